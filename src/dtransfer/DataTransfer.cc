@@ -6,8 +6,12 @@
  */
 
 #include "DataTransfer.hpp"  // class DataTransfer
+#include "PeriodicScheduler.hpp"  // class PeriodicScheduler
+#include "../util/metrics.hpp"    // class Metrics
+#include "../mygpsd/gpsshm.hpp"    // gpsShmUpdates()
 
 #include <arpa/inet.h>    // inet_pton
+#include <poll.h>         // poll()
 #include <pthread.h>      // pthread_mutex_init
 #include <sys/eventfd.h>  // eventfd()
 #include <unistd.h>       // close()
@@ -18,6 +22,7 @@
 #include <fstream>       // std::ifstream
 #include <sstream>       // std::stringstream
 #include <string>        // std::string
+#include <algorithm>     // std::transform
 #include <system_error>  // std::system_error
 #include <thread>        // std::thread
 #include <utility>
@@ -45,6 +50,10 @@ DataTransfer::DataTransfer(std::string printTag) : printTag(std::move(printTag))
         LOG_FATAL_PERROR_EXIT("DataTransfer() pthread_mutex_init()");
 }
 
+DataTransfer::~DataTransfer() {
+    if (this->metricsCollector >= 0) Metrics::getInstance()->removeCollector(this->metricsCollector);
+}
+
 std::string DataTransfer::getGpsShmPath() {
     return this->gpsShmPath;
 }
@@ -57,6 +66,162 @@ pthread_mutex_t DataTransfer::getIfaceInfoMutex() {
     return this->ifaceMapMutex;
 }
 
+IfaceCounters& DataTransfer::getIfaceCounters() {
+    return this->ifaceCounters;
+}
+
+void DataTransfer::registerIfaceCounters() {
+    for (auto & itr : this->ifaceMap) {
+        int slot = this->ifaceCounters.registerIface(itr.first);
+        if (slot < 0) {
+            std::stringstream ss;
+            ss << "Too many interfaces, at most " << IFACE_COUNTERS_MAX << " are supported";
+            LOG_FATAL_EXIT(ss.str().c_str());
+        }
+
+        (itr.second).counterSlot = slot;
+    }
+
+    if (this->metricsCollector >= 0) return;
+
+    std::string role = this->printTag;
+    std::transform(role.begin(), role.end(), role.begin(), ::tolower);
+
+    this->metricsCollector = Metrics::getInstance()->addCollector([this, role](MetricsText &text) {
+        for (int slot = 0; slot < this->ifaceCounters.size(); slot++) {
+            const std::string labels = Metrics::label("role", role) + "," +
+                                       Metrics::label("iface", this->ifaceCounters.ifname(slot));
+            text.counter("wiperf_iface_bytes_total", "UDP payload bytes sent or received", labels,
+                         this->ifaceCounters.totalBytes(slot));
+            text.counter("wiperf_iface_packets_total", "Datagrams sent or received", labels,
+                         this->ifaceCounters.totalPackets(slot));
+        }
+    });
+}
+
+void DataTransfer::reloadConfig(ConfigFile&) {}
+
+static bool samePacing(const IfacePacing& a, const IfacePacing& b) {
+    return a.rate == b.rate && a.datagramLen == b.datagramLen && a.onMs == b.onMs && a.offMs == b.offMs;
+}
+
+bool DataTransfer::reloadIfaces(IfaceInfoMap newIfaceMap) {
+    // an address that doesn't parse would end the program once its socket is opened
+    for (auto itr = newIfaceMap.begin(); itr != newIfaceMap.end();) {
+        IfaceInfo &iinfo = itr->second;
+        struct in_addr addr{};
+
+        if (inet_pton(AF_INET, iinfo.addrSrv.c_str(), &addr) != 1 ||
+            inet_pton(AF_INET, iinfo.addrCli.c_str(), &addr) != 1) {
+            LOG_STREAM(ERROR, "Reload: invalid address of interface " << itr->first << ", ignoring it")
+            itr = newIfaceMap.erase(itr);
+        } else {
+            iinfo.sockfd = UNINITIALIZED_FD;
+            ++itr;
+        }
+    }
+
+    if (newIfaceMap.empty()) {
+        LOG_ERR("Reload: no matching sender/receiver interface pairs, keeping the running ones");
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(this->reloadMutex);
+
+        // against what the workers run with, or what they're about to
+        const IfaceInfoMap &current = this->restartPending ? this->pendingIfaceMap : this->ifaceMap;
+
+        std::stringstream added, removed, changed;
+        for (auto &itr : newIfaceMap) {
+            auto old = current.find(itr.first);
+            if (old == current.end()) {
+                added << " " << itr.first;
+                continue;
+            }
+
+            const IfaceInfo &a = old->second, &b = itr.second;
+            if (a.addrSrv != b.addrSrv || a.addrCli != b.addrCli || a.ioEngineConf != b.ioEngineConf ||
+                !samePacing(a.pacing, b.pacing)) {
+                changed << " " << itr.first;
+            }
+        }
+        for (auto &itr : current) {
+            if (newIfaceMap.find(itr.first) == newIfaceMap.end()) removed << " " << itr.first;
+        }
+
+        if (added.str().empty() && removed.str().empty() && changed.str().empty()) return false;
+
+        std::stringstream ss;
+        ss << "Reload: interfaces";
+        if (!added.str().empty()) ss << ", added" << added.str();
+        if (!removed.str().empty()) ss << ", removed" << removed.str();
+        if (!changed.str().empty()) ss << ", changed" << changed.str();
+        ss << "; restarting the workers";
+        LOG_MSG(ss.str().c_str());
+
+        this->pendingIfaceMap = std::move(newIfaceMap);
+        this->restartPending = true;
+    }
+
+    this->restartWorkers();
+    return true;
+}
+
+void DataTransfer::restartWorkers() {
+    if (this->wakefd_ > 0) eventfd_write(this->wakefd_, 1);  // not running yet otherwise
+}
+
+bool DataTransfer::applyPendingIfaces() {
+    std::lock_guard<std::mutex> lock(this->reloadMutex);
+
+    // drain the wake-up of restartWorkers() first: if stopThread() came before, the
+    // check below sees it, and if it comes after, it wakes up the new workers again
+    struct pollfd pfd = {this->wakefd_, POLLIN, 0};
+    eventfd_t count;
+    if (poll(&pfd, 1, 0) > 0) eventfd_read(this->wakefd_, &count);
+
+    if (this->endProgram_ || !this->restartPending) return false;
+
+    // keep the sockets of the interfaces that didn't change, close the rest: the engines
+    // and pacers set socket options (filters, offloads, pacing caps) that they don't undo
+    for (auto &itr : this->ifaceMap) {
+        IfaceInfo &iinfo = itr.second;
+        if (iinfo.sockfd == UNINITIALIZED_FD) continue;
+
+        auto next = this->pendingIfaceMap.find(itr.first);
+        if (next != this->pendingIfaceMap.end() && next->second.addrSrv == iinfo.addrSrv &&
+            next->second.addrCli == iinfo.addrCli && next->second.ioEngineConf == iinfo.ioEngineConf &&
+            samePacing(next->second.pacing, iinfo.pacing)) {
+            next->second.sockfd = iinfo.sockfd;
+            next->second.sockaddrSrv = iinfo.sockaddrSrv;
+        } else {
+            close(iinfo.sockfd);
+        }
+    }
+
+    this->ifaceMap = std::move(this->pendingIfaceMap);
+    this->pendingIfaceMap.clear();
+    this->restartPending = false;
+
+    // the interfaces that come back keep their counters, the new ones get a slot
+    for (auto itr = this->ifaceMap.begin(); itr != this->ifaceMap.end();) {
+        int slot = this->ifaceCounters.registerIface(itr->first);
+        if (slot < 0) {
+            LOG_STREAM(ERROR, "Reload: at most " << IFACE_COUNTERS_MAX << " interfaces are supported, ignoring "
+                              << itr->first)
+            if (itr->second.sockfd != UNINITIALIZED_FD) close(itr->second.sockfd);
+            itr = this->ifaceMap.erase(itr);
+            continue;
+        }
+
+        (itr->second).counterSlot = slot;
+        ++itr;
+    }
+
+    return true;
+}
+
 void DataTransfer::createSockaddr(const std::string& addrStr, uint16_t port,
                                   struct sockaddr_in* sockaddr) {
     // prep address structure
@@ -95,58 +260,68 @@ void DataTransfer::closeIfaceSocks() {
     }
 }
 
+/**
+ * Waits for the next second to print. With the GPS clock, that's the next fix
+ * announced by mygpsd that carries a new gpstime; otherwise, the next tick of the grid.
+ * @return the second, in ms (0 on error)
+ */
+static uint64_t nextPrintSecond(PeriodicScheduler &scheduler, GpsInfo *gpsInfo, uint32_t &gpsUpdates,
+                                uint64_t last, const bool &endProgram) {
+    if (!gpsInfo) return scheduler.wait();
+
+    while (!endProgram) {
+        if (!WiperfUtility::waitGpsUpdate(gpsInfo, gpsUpdates, 2000)) continue;  // recheck endProgram
+
+        GpsInfo currentInfo = WiperfUtility::getCurrentGps(gpsInfo);
+        uint64_t second = currentInfo.gpstime * 1000;
+        if (currentInfo.fix >= 2 && second != last) return second;
+    }
+
+    return 0;
+}
+
 /**
  * Prints amount of data sent or received on each interface during each individual second.
- * Printing is triggered by a notification from mygpsd, telling us that gps information has changed.
+ * Printing is triggered by the GPS updates when the clock is disciplined by the GPS, or
+ * by the periodic scheduler, on every second of the grid.
  */
 void DataTransfer::printerThread() {
-    GpsInfo* gpsInfoShm = WiperfUtility::getGpsInfo(this->gpsShmPath);
+    PeriodicScheduler scheduler;
+    GpsInfo *gpsInfo = nullptr;
+    uint32_t gpsUpdates = 0;
+    if (this->gpsClock) {
+        gpsInfo = WiperfUtility::getGpsInfo(this->gpsShmPath);
+        gpsUpdates = gpsShmUpdates(gpsInfo);
+    } else if (!scheduler.start(1000)) {
+        return;
+    }
 
     // print header
     std::cout << "gpstime, ifaceName, nbytes" << this->printTag << std::endl;
 
     // loop variables
     uint64_t gpstime = 0, gpstimeOld = 0;
+    IfaceCounters::Cursor cursor;
     while (!endProgram_) {  // for ever, and ever, and ever
 
-        //if (pthread_mutex_lock(&gpsInfoShm->mutex))  // gain acess to gps info shm
-        //    LOG_FATAL_PERROR_EXIT("pthread pthread_mutex_lock()");
-
-        // note on behavior: call to cond_wait unlocks mutex then blocks
-        //   on condition. when condition is signaled, mutex is auto-locked.
-        //if (pthread_cond_wait(&gpsInfoShm->updateCond, &gpsInfoShm->mutex))
-        //    LOG_FATAL_PERROR_EXIT("pthread pthread_cond_wait()");
-
         // read new gpstime
         gpstimeOld = gpstime;
-        gpstime = std::chrono::duration_cast<std::chrono::milliseconds>(
-                std::chrono::system_clock::now().time_since_epoch()).count(); //gpsInfoShm->gpstime;
-
-        //if (pthread_mutex_unlock(&gpsInfoShm->mutex))  // release gps info shm
-        //    LOG_FATAL_PERROR_EXIT("pthread pthread_mutex_unlock()");
+        gpstime = nextPrintSecond(scheduler, gpsInfo, gpsUpdates, gpstimeOld, this->endProgram_);
+        if (gpstime == 0) break;
 
         if (gpstimeOld == 0) continue;  // no point in continuing
 
-        // print iface stats
-        if (pthread_mutex_lock(&this->ifaceMapMutex))  // iface map exclusive access
-            LOG_FATAL_PERROR_EXIT("pthread pthread_mutex_lock()");
+        // print iface stats, i.e., what was accounted since the last round
+        for (int slot = 0; slot < this->ifaceCounters.size(); slot++) {
+            const uint64_t ifaceNbytes = this->ifaceCounters.snapshot(slot, cursor).nbytes;
 
-        // iterate over interface map and print stats for each
-        for (auto & itr : this->ifaceMap) {
-            const std::string ifaceName = itr.first;
-            const uint64_t ifaceNbytes = (itr.second).nbytesAcc;
-
-            std::cout << gpstimeOld << ", " << ifaceName << ", " << ifaceNbytes << std::endl;
-
-            (itr.second).nbytesAcc = 0;  // reset byte count for next round
+            std::cout << gpstimeOld << ", " << this->ifaceCounters.ifname(slot) << ", "
+                      << ifaceNbytes << std::endl;
         }
 
-        if (pthread_mutex_unlock(&this->ifaceMapMutex))  // release iface map
-            LOG_FATAL_PERROR_EXIT("pthread pthread_mutex_unlock()");
-
     }  // while(!endProgram_) end
 
-    // nothing to clean up, just exit
+    if (!gpsInfo) scheduler.logStats(this->printTag);
 }
 
 /**
@@ -166,7 +341,6 @@ void DataTransfer::run() {
     // install the signal handler
     signal(SIGINT, sigHandler);
     signal(SIGTERM, sigHandler);
-    signal(SIGHUP, sigHandler);
 
     // launch worker threads
     try {
@@ -12,12 +12,17 @@
 
 #include <string>       // std::string
 #include <map>          // std::map
+#include <mutex>        // std::mutex
 #include <utility>      // std::pair
 #include <cstdint>     // uint*_t
 #include <netinet/in.h> // struct sockaddr_in
+#include <thread>       // std::thread
+#include <vector>       // std::vector
 
 #include "../util/configfile.hpp"        // class ConfigFile
+#include "../util/threadpolicy.hpp"      // class ThreadPolicy
 #include "WiperfUtility.hpp"
+#include "IfaceCounters.hpp"             // class IfaceCounters
 
 // declare globals needed to end things cleanly on exit
 // extern so they can be initialized in a single cc file
@@ -34,13 +39,24 @@ protected:
 
   std::string printTag;
   std::string gpsShmPath;
+  bool gpsClock{}; // periodic loops follow the GPS time
 
   IfaceInfoMap ifaceMap; // iface name -> iface info
   pthread_mutex_t ifaceMapMutex{}; // to ensure exclusive access
 
+  IfaceCounters ifaceCounters; // per-interface traffic counters
+  int metricsCollector{-1}; // exports ifaceCounters, see registerIfaceCounters()
+
   uint16_t portSrv{}; // server (receiver) port
   uint16_t portCli{}; // client (sender) port
 
+  ThreadPolicy threadPolicy; // placement and priority of the threads, per role
+
+  // interfaces of a reload, for commThread() to apply once its workers returned
+  std::mutex reloadMutex;
+  IfaceInfoMap pendingIfaceMap;
+  bool restartPending{};
+
   // protected constructor so only children can call it
   explicit DataTransfer(std::string printTag);
   
@@ -54,20 +70,71 @@ protected:
    * Close all of the interface sockets (which are assumed open).
    */
   void closeIfaceSocks();
+
+  /**
+   * Assigns a counter slot to every interface in the map, and exports the
+   * counters as metrics.
+   * Must be called at the end of readConfig(), before the threads start.
+   */
+  void registerIfaceCounters();
+
+  /**
+   * Compares the interfaces read on a reload with the running ones. If they differ,
+   * they're kept for applyPendingIfaces() and the workers are told to return.
+   * @return true if the interfaces changed
+   */
+  bool reloadIfaces(IfaceInfoMap newIfaceMap);
+
+  /**
+   * Tells the worker threads to return, so commThread() restarts them with the pending
+   * interfaces. Wakes them up like stopThread() does, without ending the program.
+   */
+  virtual void restartWorkers();
+
+  /**
+   * Called by commThread() once its workers returned, applies the pending interfaces.
+   * The sockets of the interfaces that were removed, or whose addresses changed, are
+   * closed and the others are kept, so only the interfaces left with an
+   * UNINITIALIZED_FD socket are to be opened.
+   * @return true if the workers are to be started again, false if it's time to end
+   */
+  bool applyPendingIfaces();
   
+  /**
+   * Starts a thread that runs the function once the policy of its role is applied.
+   * @param ifnames interfaces the thread serves, for the irq placement
+   */
+  template<typename Function>
+  std::thread launchThread(const std::string& role, const std::vector<std::string>& ifnames,
+                           Function function) {
+    return std::thread([this, role, ifnames, function]() {
+      this->threadPolicy.apply(role, ifnames);
+      function();
+    });
+  }
+
   // worker threads
   void printerThread();
   virtual void commThread() = 0; // subclasses must implement
 
 public:
+  virtual ~DataTransfer();
   virtual void readConfig(const std::string& configFname) = 0;
   void run(); // launches the threads that do actual work
   virtual void stopThread();
 
+  /**
+   * Applies a configuration read again at run time (see ConfigReloader), called from
+   * the reloader thread. By default, nothing changes until the next start.
+   */
+  virtual void reloadConfig(ConfigFile& cfile);
+
   std::string getGpsShmPath();
   // For feedback sender to safely access the iface info map
   IfaceInfoMap getIfaceInfoMap();
   pthread_mutex_t getIfaceInfoMutex();
+  // For feedback sender to read the traffic counters (without copying the map)
+  IfaceCounters& getIfaceCounters();
 
 };
 
@@ -0,0 +1,138 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "FeedbackCodec.hpp"
+
+template <typename T>
+static inline uint8_t *putBE(uint8_t *pos, T value) {
+    for (size_t i = 0; i < sizeof(T); i++) {
+        pos[i] = (uint8_t) (value >> (8 * (sizeof(T) - 1 - i)));
+    }
+    return pos + sizeof(T);
+}
+
+template <typename T>
+static inline const uint8_t *getBE(const uint8_t *pos, T &value) {
+    T bits = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+        bits = (T) ((bits << 8) | pos[i]);
+    }
+    value = bits;
+    return pos + sizeof(T);
+}
+
+size_t FeedbackCodec::encodeHeader(uint8_t *buf, size_t len, const FeedbackHeader &header) {
+    if (len < FEEDBACK_HEADER_LEN) return 0;
+
+    uint8_t *pos = buf;
+    pos = putBE<uint16_t>(pos, FEEDBACK_MAGIC);
+    pos = putBE<uint8_t>(pos, FEEDBACK_VERSION);
+    pos = putBE<uint8_t>(pos, header.nrats);
+    pos = putBE<uint32_t>(pos, header.session);
+    pos = putBE<uint32_t>(pos, header.seq);
+    pos = putBE<uint32_t>(pos, header.binUs);
+    pos = putBE<uint64_t>(pos, header.firstBin);
+    pos = putBE<uint16_t>(pos, header.nbins);
+    pos = putBE<uint16_t>(pos, 0);
+
+    return pos - buf;
+}
+
+static inline uint16_t clampU16(uint32_t value) {
+    return value > UINT16_MAX ? UINT16_MAX : (uint16_t) value;
+}
+
+size_t FeedbackCodec::encodeRat(uint8_t *buf, size_t len, uint8_t ratId, const uint64_t *nbytes,
+                                const ProbeSummary *probes, uint16_t nbins) {
+    if (len < (size_t) FEEDBACK_RAT_HEADER_LEN + nbins * FEEDBACK_BIN_LEN) return 0;
+
+    uint8_t *pos = buf;
+    pos = putBE<uint8_t>(pos, ratId);
+    pos = putBE<uint8_t>(pos, 0);
+    pos = putBE<uint16_t>(pos, 0);
+
+    const ProbeSummary none;
+    for (uint16_t i = 0; i < nbins; i++) {
+        const ProbeSummary &probe = probes ? probes[i] : none;
+
+        pos = putBE<uint32_t>(pos, nbytes[i] > UINT32_MAX ? UINT32_MAX : (uint32_t) nbytes[i]);
+        pos = putBE<uint32_t>(pos, probe.received);
+        pos = putBE<uint32_t>(pos, probe.lost);
+        pos = putBE<uint16_t>(pos, clampU16(probe.reordered));
+        pos = putBE<uint16_t>(pos, clampU16(probe.duplicates));
+        pos = putBE<uint32_t>(pos, probe.jitterUs);
+        pos = putBE<uint32_t>(pos, (uint32_t) probe.delayMinUs);
+        pos = putBE<uint32_t>(pos, (uint32_t) probe.delayMeanUs);
+        pos = putBE<uint32_t>(pos, (uint32_t) probe.delayMaxUs);
+        for (uint32_t count : probe.delayHist) {
+            pos = putBE<uint16_t>(pos, clampU16(count));
+        }
+    }
+
+    return pos - buf;
+}
+
+bool FeedbackCodec::decodeHeader(const uint8_t *buf, size_t len, FeedbackHeader &header) {
+    if (len < FEEDBACK_HEADER_LEN) return false;
+
+    uint16_t magic, reserved;
+    const uint8_t *pos = buf;
+    pos = getBE(pos, magic);
+    pos = getBE(pos, header.version);
+    pos = getBE(pos, header.nrats);
+    pos = getBE(pos, header.session);
+    pos = getBE(pos, header.seq);
+    pos = getBE(pos, header.binUs);
+    pos = getBE(pos, header.firstBin);
+    pos = getBE(pos, header.nbins);
+    getBE(pos, reserved);
+
+    return magic == FEEDBACK_MAGIC && header.version == FEEDBACK_VERSION && header.binUs > 0;
+}
+
+bool FeedbackCodec::decodeRat(const uint8_t *buf, size_t len, size_t &pos, uint16_t nbins,
+                              uint8_t &ratId, const uint8_t *&bins) {
+    if (pos + FEEDBACK_RAT_HEADER_LEN + (size_t) nbins * FEEDBACK_BIN_LEN > len) return false;
+
+    getBE(buf + pos, ratId);
+    bins = buf + pos + FEEDBACK_RAT_HEADER_LEN;
+
+    pos += FEEDBACK_RAT_HEADER_LEN + (size_t) nbins * FEEDBACK_BIN_LEN;
+    return true;
+}
+
+uint32_t FeedbackCodec::binBytes(const uint8_t *bins, uint16_t i) {
+    uint32_t nbytes;
+    getBE(bins + (size_t) i * FEEDBACK_BIN_LEN, nbytes);
+    return nbytes;
+}
+
+void FeedbackCodec::binProbes(const uint8_t *bins, uint16_t i, ProbeSummary &probes) {
+    uint16_t reordered, duplicates;
+    uint32_t delayMinUs, delayMeanUs, delayMaxUs;
+
+    const uint8_t *pos = bins + (size_t) i * FEEDBACK_BIN_LEN + sizeof(uint32_t); // past nbytes
+    pos = getBE(pos, probes.received);
+    pos = getBE(pos, probes.lost);
+    pos = getBE(pos, reordered);
+    pos = getBE(pos, duplicates);
+    pos = getBE(pos, probes.jitterUs);
+    pos = getBE(pos, delayMinUs);
+    pos = getBE(pos, delayMeanUs);
+    pos = getBE(pos, delayMaxUs);
+    for (uint32_t &count : probes.delayHist) {
+        uint16_t value;
+        pos = getBE(pos, value);
+        count = value;
+    }
+
+    probes.reordered = reordered;
+    probes.duplicates = duplicates;
+    probes.delayMinUs = (int32_t) delayMinUs;
+    probes.delayMeanUs = (int32_t) delayMeanUs;
+    probes.delayMaxUs = (int32_t) delayMaxUs;
+}
@@ -0,0 +1,116 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the wire format of the throughput feedback messages (version 4).
+ *
+ * A message carries, for every RAT, the bytes received in a range of consecutive time
+ * bins (see IfaceCounters::configureBins()), the same range for all the RATs, along
+ * with what the probe headers of the datagrams told about the bin (see ProbeStats).
+ *
+ * Layout (network byte order):
+ *   uint16_t magic       FEEDBACK_MAGIC
+ *   uint8_t  version     FEEDBACK_VERSION
+ *   uint8_t  nrats       RAT records that follow
+ *   uint32_t session     random, picked when the feedback sender starts
+ *   uint32_t seq         sequence number of the message
+ *   uint32_t binUs       bin width, in us
+ *   uint64_t firstBin    index of the first bin; bin i starts at i * binUs us of wall clock time
+ *   uint16_t nbins       bins per RAT record
+ *   uint16_t reserved    0
+ *   nrats times:
+ *     uint8_t  ratId     index of the interface pair in the data-receiver/data-sender lists
+ *     uint8_t  reserved[3]
+ *     nbins times:
+ *       uint32_t nbytes
+ *       uint32_t received, lost     probes
+ *       uint16_t reordered, duplicates
+ *       uint32_t jitterUs
+ *       int32_t  delayMinUs, delayMeanUs, delayMaxUs
+ *       uint16_t delayHist[PROBE_DELAY_BUCKETS]
+ * Counts that don't fit their field are clamped.
+ *
+ * Every message repeats the last few feedback intervals worth of bins, so a lost
+ * message doesn't lose its bins; the bin indexes tell the receiver which ones it has
+ * already stored.
+ */
+
+#ifndef WIPERF_IMPL_FEEDBACKCODEC_HPP
+#define WIPERF_IMPL_FEEDBACKCODEC_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "ProbeCodec.hpp" // ProbeSummary
+
+#define FEEDBACK_MAGIC 0x5746 // "WF"
+#define FEEDBACK_VERSION 4
+#define FEEDBACK_HEADER_LEN 28
+#define FEEDBACK_RAT_HEADER_LEN 4
+#define FEEDBACK_BIN_LEN (32 + 2 * PROBE_DELAY_BUCKETS)
+#define FEEDBACK_MSG_MAX_LEN 1400 // keeps messages within a single unfragmented datagram
+#define FEEDBACK_HISTORY_DEF 2    // previous intervals repeated in every message
+#define FEEDBACK_HISTORY_MAX 8
+
+// size of a message with nrats RATs of nbins bins each
+#define FEEDBACK_MSG_LEN(nrats, nbins) \
+    (FEEDBACK_HEADER_LEN + (nrats) * (FEEDBACK_RAT_HEADER_LEN + (nbins) * FEEDBACK_BIN_LEN))
+
+// bins per RAT that fit in a message
+#define FEEDBACK_MAX_BINS(nrats) \
+    ((FEEDBACK_MSG_MAX_LEN - FEEDBACK_HEADER_LEN - (nrats) * FEEDBACK_RAT_HEADER_LEN) \
+     / ((nrats) * FEEDBACK_BIN_LEN))
+
+struct FeedbackHeader {
+    uint8_t version;
+    uint8_t nrats;
+    uint32_t session;
+    uint32_t seq;
+    uint32_t binUs;
+    uint64_t firstBin;
+    uint16_t nbins;
+};
+
+class FeedbackCodec {
+public:
+    /**
+     * Encodes the message header. Doesn't allocate.
+     * @return number of bytes written, or 0 if buf is too small
+     */
+    static size_t encodeHeader(uint8_t *buf, size_t len, const FeedbackHeader &header);
+
+    /**
+     * Encodes the record of a RAT. Bins above 4 GiB are clamped.
+     * @param nbytes header.nbins values
+     * @param probes header.nbins values, nullptr if there are none
+     * @return number of bytes written, or 0 if buf is too small
+     */
+    static size_t encodeRat(uint8_t *buf, size_t len, uint8_t ratId, const uint64_t *nbytes,
+                            const ProbeSummary *probes, uint16_t nbins);
+
+    /**
+     * @return false if the message isn't a feedback message of this version
+     */
+    static bool decodeHeader(const uint8_t *buf, size_t len, FeedbackHeader &header);
+
+    /**
+     * Decodes the RAT record at pos, and moves pos past it. The bins are left in place.
+     * @param bins set to the first bin, to be read with binBytes() and binProbes()
+     * @return false if the record is truncated
+     */
+    static bool decodeRat(const uint8_t *buf, size_t len, size_t &pos, uint16_t nbins,
+                          uint8_t &ratId, const uint8_t *&bins);
+
+    /**
+     * @return the bytes of bin i of a record returned by decodeRat()
+     */
+    static uint32_t binBytes(const uint8_t *bins, uint16_t i);
+
+    /**
+     * Decodes the probe statistics of bin i of a record returned by decodeRat().
+     */
+    static void binProbes(const uint8_t *bins, uint16_t i, ProbeSummary &probes);
+};
+
+#endif //WIPERF_IMPL_FEEDBACKCODEC_HPP
@@ -0,0 +1,132 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "IfaceCounters.hpp"
+
+#include <time.h>  // clock_gettime()
+
+static int64_t clockMicros(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+IfaceCounters::IfaceCounters() : nslots(0), binUs(0), binOffsetUs(0), bins() {
+    for (IfaceCounter &counter : this->counters) {
+        counter.nbytes.store(0);
+        counter.npackets.store(0);
+    }
+}
+
+int IfaceCounters::registerIface(const std::string &ifname) {
+    int slot = this->find(ifname);
+    if (slot >= 0) return slot;
+
+    slot = this->nslots.load(std::memory_order_relaxed);
+    if (slot == IFACE_COUNTERS_MAX) return -1;
+
+    this->ifnames[slot] = ifname;
+    this->nslots.store(slot + 1, std::memory_order_release);
+    return slot;
+}
+
+int IfaceCounters::find(const std::string &ifname) const {
+    const int nslots = this->nslots.load(std::memory_order_acquire);
+    for (int i = 0; i < nslots; i++) {
+        if (this->ifnames[i] == ifname) return i;
+    }
+
+    return -1;
+}
+
+int IfaceCounters::size() const {
+    return this->nslots.load(std::memory_order_acquire);
+}
+
+const std::string &IfaceCounters::ifname(int slot) const {
+    return this->ifnames[slot];
+}
+
+IfaceCounters::Delta IfaceCounters::snapshot(int slot, Cursor &cursor) const {
+    const IfaceCounter &counter = this->counters[slot];
+
+    const uint64_t nbytes = counter.nbytes.load(std::memory_order_acquire);
+    const uint64_t npackets = counter.npackets.load(std::memory_order_acquire);
+
+    Delta delta{nbytes - cursor.nbytes[slot], npackets - cursor.npackets[slot]};
+    cursor.nbytes[slot] = nbytes;
+    cursor.npackets[slot] = npackets;
+
+    return delta;
+}
+
+uint64_t IfaceCounters::totalBytes(int slot) const {
+    return this->counters[slot].nbytes.load(std::memory_order_acquire);
+}
+
+uint64_t IfaceCounters::totalPackets(int slot) const {
+    return this->counters[slot].npackets.load(std::memory_order_acquire);
+}
+
+void IfaceCounters::configureBins(uint32_t binUs) {
+    this->bins.reset(new IfaceBin[IFACE_COUNTERS_MAX * IFACE_BINS_LEN]);
+    for (size_t i = 0; i < IFACE_COUNTERS_MAX * IFACE_BINS_LEN; i++) {
+        this->bins[i].key.store(IFACE_BIN_NONE, std::memory_order_relaxed);
+        this->bins[i].nbytes.store(0, std::memory_order_relaxed);
+    }
+
+    this->binOffsetUs = clockMicros(CLOCK_REALTIME) - clockMicros(CLOCK_MONOTONIC);
+    this->binUs = binUs;
+}
+
+uint32_t IfaceCounters::getBinUs() const {
+    return this->binUs;
+}
+
+uint64_t IfaceCounters::binKey(int64_t monoUs) const {
+    return (uint64_t) (monoUs + this->binOffsetUs) / this->binUs;
+}
+
+uint64_t IfaceCounters::currentBin() const {
+    return this->binKey(clockMicros(CLOCK_MONOTONIC));
+}
+
+void IfaceCounters::addToBin(int slot, uint64_t nbytes) {
+    const uint64_t key = this->binKey(clockMicros(CLOCK_MONOTONIC));
+    IfaceBin &bin = this->bins[slot * IFACE_BINS_LEN + key % IFACE_BINS_LEN];
+
+    // first bytes of a new bin: recycle the slot, invalidating it while it's zeroed
+    if (bin.key.load(std::memory_order_relaxed) != key) {
+        bin.key.store(IFACE_BIN_NONE, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bin.nbytes.store(0, std::memory_order_relaxed);
+        bin.key.store(key, std::memory_order_release);
+    }
+
+    // single writer, as for the totals
+    bin.nbytes.store(bin.nbytes.load(std::memory_order_relaxed) + nbytes, std::memory_order_release);
+}
+
+void IfaceCounters::readBins(int slot, uint64_t first, size_t nbins, uint64_t *nbytes) const {
+    for (size_t i = 0; i < nbins; i++) {
+        if (!this->bins) {
+            nbytes[i] = 0;
+            continue;
+        }
+
+        const uint64_t key = first + i;
+        const IfaceBin &bin = this->bins[slot * IFACE_BINS_LEN + key % IFACE_BINS_LEN];
+
+        // the value only counts if the slot held this very bin before and after reading it
+        const uint64_t key1 = bin.key.load(std::memory_order_acquire);
+        const uint64_t value = bin.nbytes.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint64_t key2 = bin.key.load(std::memory_order_relaxed);
+
+        nbytes[i] = (key1 == key && key2 == key) ? value : 0;
+    }
+}
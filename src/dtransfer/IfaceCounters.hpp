@@ -0,0 +1,170 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the per-interface traffic counters shared between the threads that move the
+ * data (one writer per interface) and the threads that report it (feedback, printer).
+ *
+ * Optionally, the bytes are also accounted in fixed-width time bins (down to a few ms),
+ * kept in a ring per interface; see IfaceCounters::configureBins().
+ */
+
+#ifndef IFACECOUNTERS_HPP
+#define IFACECOUNTERS_HPP
+
+#include <atomic>   // std::atomic
+#include <cstddef>  // size_t
+#include <cstdint>  // uint*_t
+#include <memory>   // std::unique_ptr
+#include <string>   // std::string
+
+#define IFACE_COUNTERS_MAX 8 // max number of interfaces with counters
+#define CACHE_LINE_LEN 64    // Cortex-A15 and x86 cache line size
+#define IFACE_BINS_LEN 2048  // time bins kept per interface, 2 s of 1 ms bins
+#define IFACE_BIN_NONE UINT64_MAX
+
+/**
+ * Counters of a single interface. Each one sits in its own cache line, so the worker
+ * threads of different interfaces don't invalidate each other's lines.
+ */
+struct alignas(CACHE_LINE_LEN) IfaceCounter {
+    std::atomic<uint64_t> nbytes;
+    std::atomic<uint64_t> npackets;
+};
+
+/**
+ * Bytes accounted during one time bin. The key tells which bin the ring slot is
+ * holding at the moment, see IfaceCounters::readBins().
+ */
+struct IfaceBin {
+    std::atomic<uint64_t> key;
+    std::atomic<uint64_t> nbytes;
+};
+
+/**
+ * Fixed set of interface counters. Slots are registered by interface name while the
+ * configuration is read (before any thread starts) and are never removed, so the
+ * slot table itself needs no locking.
+ *
+ * The counters are monotonic and only ever written by the worker thread that owns the
+ * interface. Readers keep their own IfaceCounters::Cursor and take the difference to
+ * the previous read, so several readers can consume the same counters and nothing is
+ * lost between a read and a reset.
+ */
+class IfaceCounters {
+public:
+    /**
+     * Per-reader state: the counter values at the previous snapshot.
+     */
+    struct Cursor {
+        uint64_t nbytes[IFACE_COUNTERS_MAX] = {};
+        uint64_t npackets[IFACE_COUNTERS_MAX] = {};
+    };
+
+    /**
+     * Counter values accumulated since the previous snapshot.
+     */
+    struct Delta {
+        uint64_t nbytes;
+        uint64_t npackets;
+    };
+
+    IfaceCounters();
+
+    /**
+     * Gets the slot of an interface, creating it if needed. Slots are never freed, so
+     * an interface added on a reload can be registered while the others are counted and
+     * read, as long as a single thread registers them.
+     * @param ifname interface name
+     * @return slot index, or -1 if there are no free slots
+     */
+    int registerIface(const std::string &ifname);
+
+    /**
+     * @param ifname interface name
+     * @return slot index, or -1 if the interface isn't registered
+     */
+    int find(const std::string &ifname) const;
+
+    int size() const;
+    const std::string &ifname(int slot) const;
+
+    /**
+     * Accounts received/sent data. Only the thread that owns the slot may call it.
+     * @param slot     slot index
+     * @param nbytes   number of bytes
+     * @param npackets number of datagrams
+     */
+    inline void add(int slot, uint64_t nbytes, uint64_t npackets) {
+        IfaceCounter &counter = this->counters[slot];
+
+        // single writer, so a plain load/store pair is enough (no locked read-modify-write)
+        counter.nbytes.store(counter.nbytes.load(std::memory_order_relaxed) + nbytes,
+                             std::memory_order_release);
+        counter.npackets.store(counter.npackets.load(std::memory_order_relaxed) + npackets,
+                               std::memory_order_release);
+
+        if (this->binUs) this->addToBin(slot, nbytes);
+    }
+
+    /**
+     * Reads the counters of a slot and moves the reader's cursor forward.
+     * @param slot   slot index
+     * @param cursor reader state
+     * @return amount of data accounted since the previous snapshot with this cursor
+     */
+    Delta snapshot(int slot, Cursor &cursor) const;
+
+    /**
+     * @param slot slot index
+     * @return total number of bytes accounted on the slot
+     */
+    uint64_t totalBytes(int slot) const;
+
+    /**
+     * @param slot slot index
+     * @return total number of datagrams accounted on the slot
+     */
+    uint64_t totalPackets(int slot) const;
+
+    /**
+     * Enables the time bins. Must be called before the worker threads start.
+     *
+     * Bins are keyed by CLOCK_MONOTONIC, so clock steps don't move bytes between them,
+     * but offset to the wall clock at the time of the call: bin i starts at i * binUs
+     * us of wall clock time, so the bins line up with the sampling grid.
+     * @param binUs bin width, in us
+     */
+    void configureBins(uint32_t binUs);
+
+    uint32_t getBinUs() const;
+
+    /**
+     * @return the bin that is being filled now; all the bins before it are closed
+     */
+    uint64_t currentBin() const;
+
+    /**
+     * Reads a range of bins of a slot. Bins that saw no traffic, or that are no longer
+     * in the ring, read as 0.
+     * @param first  first bin
+     * @param nbins  number of bins
+     * @param nbytes destination, with room for nbins values
+     */
+    void readBins(int slot, uint64_t first, size_t nbins, uint64_t *nbytes) const;
+
+private:
+    IfaceCounter counters[IFACE_COUNTERS_MAX];
+    std::string ifnames[IFACE_COUNTERS_MAX];
+    std::atomic<int> nslots; // published after the name of the slot
+
+    uint32_t binUs;                // 0 if the bins are disabled
+    int64_t binOffsetUs;           // wall clock minus monotonic clock at configureBins()
+    std::unique_ptr<IfaceBin[]> bins; // IFACE_BINS_LEN per slot
+
+    uint64_t binKey(int64_t monoUs) const;
+    void addToBin(int slot, uint64_t nbytes);
+};
+
+#endif //IFACECOUNTERS_HPP
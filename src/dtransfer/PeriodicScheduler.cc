@@ -0,0 +1,176 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "PeriodicScheduler.hpp"
+
+#include <sys/timerfd.h>  // timerfd_create()
+#include <unistd.h>       // read(), close()
+
+#include <cerrno>    // errno
+#include <chrono>    // std::chrono
+#include <cstdlib>   // llabs()
+#include <cstring>   // std::strerror()
+#include <sstream>   // std::stringstream
+
+#include "WiperfUtility.hpp"
+
+static void logErrno(const char *what) {
+    std::stringstream ss;
+    ss << what << ": " << std::strerror(errno);
+    LOG_ERR(ss.str().c_str());
+}
+
+static int64_t monoNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+PeriodicScheduler::PeriodicScheduler() :
+        timerfd(-1), interval(0), gpsInfo(nullptr), gpsOffset(0), nextWall(0), nextMono(0), stats(),
+        latenessMetric(nullptr), missedMetric(nullptr), resyncsMetric(nullptr) {
+}
+
+PeriodicScheduler::~PeriodicScheduler() {
+    if (this->timerfd >= 0) close(this->timerfd);
+}
+
+bool PeriodicScheduler::start(int interval, GpsInfo *gpsInfo, const std::string &name) {
+    if (this->timerfd < 0 && (this->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) {
+        logErrno("PeriodicScheduler::start() timerfd_create()");
+        return false;
+    }
+
+    this->interval = interval > 0 ? interval : 1;
+    this->gpsInfo = gpsInfo;
+    this->gpsOffset = 0;
+    this->stats = Stats();
+
+    if (!name.empty()) {
+        const std::string labels = Metrics::label("loop", name);
+        this->latenessMetric = &Metrics::getInstance()->histogram(
+                "wiperf_sched_lateness_us", "Lateness of the periodic loop ticks, in us", labels,
+                SCHED_JITTER_BASE_US, SCHED_JITTER_BUCKETS);
+        this->missedMetric = &Metrics::getInstance()->counter(
+                "wiperf_sched_missed_ticks_total", "Ticks that expired while the loop was still busy", labels);
+        this->resyncsMetric = &Metrics::getInstance()->counter(
+                "wiperf_sched_resyncs_total", "Grid realignments after wall clock steps", labels);
+    }
+
+    this->updateGpsOffset();
+    this->align();
+    return true;
+}
+
+int64_t PeriodicScheduler::wallMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count() + this->gpsOffset;
+}
+
+void PeriodicScheduler::updateGpsOffset() {
+    if (!this->gpsInfo) return;
+
+    GpsInfo currentInfo = WiperfUtility::getCurrentGps(this->gpsInfo);
+    if (currentInfo.fix < 2 || currentInfo.gpstime == 0) return;  // keep the last offset
+
+    // whole seconds only, the sub-second part is the NMEA latency rather than clock error
+    int64_t offset = (int64_t) currentInfo.gpstime * 1000 - (int64_t) currentInfo.systime;
+    this->gpsOffset = (offset >= 0 ? offset + 500 : offset - 500) / 1000 * 1000;
+}
+
+void PeriodicScheduler::align() {
+    int64_t nowWall = this->wallMillis();
+    int64_t nowMono = monoNanos();
+
+    this->nextWall = (nowWall / this->interval + 1) * this->interval;
+    this->nextMono = nowMono + (this->nextWall - nowWall) * 1000000LL;
+
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = this->nextMono / 1000000000LL;
+    spec.it_value.tv_nsec = this->nextMono % 1000000000LL;
+    spec.it_interval.tv_sec = this->interval / 1000;
+    spec.it_interval.tv_nsec = (this->interval % 1000) * 1000000L;
+
+    if (timerfd_settime(this->timerfd, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+        logErrno("PeriodicScheduler::align() timerfd_settime()");
+    }
+}
+
+uint64_t PeriodicScheduler::wait() {
+    if (this->timerfd < 0) return 0;
+
+    uint64_t expirations = 0;
+    while (read(this->timerfd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        if (errno != EINTR) {
+            logErrno("PeriodicScheduler::wait() read()");
+            return 0;
+        }
+    }
+    int64_t nowMono = monoNanos();
+
+    // more than one expiration means the loop overran; those ticks are gone
+    const int64_t intervalNs = this->interval * 1000000LL;
+    this->stats.missed += expirations - 1;
+    int64_t tickWall = this->nextWall + (int64_t) (expirations - 1) * this->interval;
+    int64_t tickMono = this->nextMono + (int64_t) (expirations - 1) * intervalNs;
+
+    this->nextWall = tickWall + this->interval;
+    this->nextMono = tickMono + intervalNs;
+    ++this->stats.ticks;
+
+    uint64_t lateness = nowMono > tickMono ? (uint64_t) (nowMono - tickMono) / 1000 : 0;  // us
+    if (lateness > this->stats.maxLateness) this->stats.maxLateness = lateness;
+
+    int bucket = 0;
+    while (bucket < SCHED_JITTER_BUCKETS - 1 && lateness >= ((uint64_t) SCHED_JITTER_BASE_US << bucket)) {
+        ++bucket;
+    }
+    ++this->stats.jitter[bucket];
+
+    if (this->latenessMetric) {
+        this->latenessMetric->observe(lateness);
+        if (expirations > 1) this->missedMetric->add(expirations - 1);
+    }
+
+    // the wall clock should have moved as much as the monotonic one; if not, it was stepped
+    this->updateGpsOffset();
+    int64_t step = this->wallMillis() - tickWall - (int64_t) (lateness / 1000);
+    if (llabs(step) >= SCHED_RESYNC_THRESHOLD) {
+        std::stringstream ss;
+        ss << "Wall clock stepped by " << step << " ms, realigning the " << this->interval << " ms grid";
+        LOG_WARN(ss.str().c_str());
+
+        ++this->stats.resyncs;
+        if (this->resyncsMetric) this->resyncsMetric->add();
+        this->align();
+        return (uint64_t) (tickWall + step - (tickWall + step) % this->interval);
+    }
+
+    return (uint64_t) tickWall;
+}
+
+int PeriodicScheduler::getInterval() const {
+    return this->interval;
+}
+
+const PeriodicScheduler::Stats &PeriodicScheduler::getStats() const {
+    return this->stats;
+}
+
+void PeriodicScheduler::logStats(const std::string &name) const {
+    std::stringstream ss;
+    ss << name << " scheduler: " << this->stats.ticks << " ticks, " << this->stats.missed << " missed, "
+       << this->stats.resyncs << " resyncs, max lateness " << this->stats.maxLateness << " us, jitter";
+
+    for (int i = 0; i < SCHED_JITTER_BUCKETS; i++) {
+        if (i < SCHED_JITTER_BUCKETS - 1) ss << " <" << (SCHED_JITTER_BASE_US << i) << "us:";
+        else ss << " >=" << (SCHED_JITTER_BASE_US << (i - 1)) << "us:";
+        ss << this->stats.jitter[i];
+    }
+
+    LOG_MSG(ss.str().c_str());
+}
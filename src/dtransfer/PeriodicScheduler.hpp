@@ -0,0 +1,99 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the periodic scheduler used by the loops that run on the sampling grid
+ * (channel monitor, feedback sender, printer).
+ *
+ * Ticks fall on the multiples of the interval in wall clock time, so that the sender
+ * and the receiver timestamps line up in the database, but they are timed by a
+ * CLOCK_MONOTONIC timerfd armed with absolute expirations, so they don't drift while
+ * the loop body runs. When the wall clock is stepped (NTP, manual, or the GPS clock
+ * below), the grid is realigned. Ticks lost to an overrunning loop are counted instead
+ * of silently skipped, and the lateness of every tick goes to a jitter histogram.
+ *
+ * Optionally, the wall clock can be disciplined by the GPS time in the shared memory,
+ * for routers without an RTC that boot with a wrong clock. gpstime only has a 1 s
+ * resolution, so only the whole-second offset to the system clock is corrected.
+ */
+
+#ifndef PERIODICSCHEDULER_HPP
+#define PERIODICSCHEDULER_HPP
+
+#include <cstdint>  // uint*_t
+#include <string>   // std::string
+
+#include "../mygpsd/gpsinfo.hpp"
+#include "../util/metrics.hpp"
+
+#define SCHED_JITTER_BUCKETS 12     // bucket i counts lateness < SCHED_JITTER_BASE_US << i
+#define SCHED_JITTER_BASE_US 100
+#define SCHED_RESYNC_THRESHOLD 5    // ms of wall clock step that realign the grid
+
+class PeriodicScheduler {
+public:
+    struct Stats {
+        uint64_t ticks;         // ticks delivered
+        uint64_t missed;        // ticks that expired while the loop was still busy
+        uint64_t resyncs;       // grid realignments after wall clock steps
+        uint64_t maxLateness;   // us
+        uint64_t jitter[SCHED_JITTER_BUCKETS]; // lateness histogram, last bucket is open
+    };
+
+private:
+    int timerfd;
+    int interval;          // ms
+    GpsInfo *gpsInfo;      // nullptr if the wall clock isn't disciplined
+    int64_t gpsOffset;     // ms added to the system clock
+
+    int64_t nextWall;      // ms, wall clock grid time of the next tick
+    int64_t nextMono;      // ns, CLOCK_MONOTONIC time of the next tick
+
+    Stats stats;
+
+    // the same, as metrics, if the loop is named
+    MetricHistogram *latenessMetric;
+    MetricCounter *missedMetric;
+    MetricCounter *resyncsMetric;
+
+    int64_t wallMillis();
+    void updateGpsOffset();
+
+    /**
+     * Places the next tick on the next grid point and arms the timer for it.
+     */
+    void align();
+
+public:
+    PeriodicScheduler();
+    ~PeriodicScheduler();
+
+    PeriodicScheduler(const PeriodicScheduler &) = delete;
+    PeriodicScheduler &operator=(const PeriodicScheduler &) = delete;
+
+    /**
+     * Creates the timer, with the first tick on the next multiple of the interval.
+     * @param interval ms between ticks
+     * @param gpsInfo GPS shared memory to discipline the wall clock, or nullptr
+     * @param name    loop name, to export the tick counters and jitter as metrics
+     * @return false if the timer can't be created
+     */
+    bool start(int interval, GpsInfo *gpsInfo = nullptr, const std::string &name = "");
+
+    /**
+     * Blocks until the next tick.
+     * @return the wall clock grid time of the tick, in ms (0 on error)
+     */
+    uint64_t wait();
+
+    int getInterval() const;
+    const Stats &getStats() const;
+
+    /**
+     * Logs the tick counters and the jitter histogram.
+     */
+    void logStats(const std::string &name) const;
+};
+
+#endif //PERIODICSCHEDULER_HPP
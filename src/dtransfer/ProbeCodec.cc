@@ -0,0 +1,60 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "ProbeCodec.hpp"
+
+#include <ctime> // clock_gettime()
+
+template <typename T>
+static inline uint8_t *putBE(uint8_t *pos, T value) {
+    for (size_t i = 0; i < sizeof(T); i++) {
+        pos[i] = (uint8_t) (value >> (8 * (sizeof(T) - 1 - i)));
+    }
+    return pos + sizeof(T);
+}
+
+template <typename T>
+static inline const uint8_t *getBE(const uint8_t *pos, T &value) {
+    T bits = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+        bits = (T) ((bits << 8) | pos[i]);
+    }
+    value = bits;
+    return pos + sizeof(T);
+}
+
+void ProbeCodec::encode(uint8_t *buf, const ProbeHeader &header) {
+    uint8_t *pos = buf;
+    pos = putBE<uint16_t>(pos, PROBE_MAGIC);
+    pos = putBE<uint8_t>(pos, PROBE_VERSION);
+    pos = putBE<uint8_t>(pos, header.ratId);
+    pos = putBE<uint32_t>(pos, header.session);
+    pos = putBE<uint64_t>(pos, header.seq);
+    putBE<uint64_t>(pos, header.sendUs);
+}
+
+bool ProbeCodec::decode(const uint8_t *buf, size_t len, ProbeHeader &header) {
+    if (len < PROBE_HEADER_LEN) return false;
+
+    uint16_t magic;
+    uint8_t version;
+    const uint8_t *pos = buf;
+    pos = getBE(pos, magic);
+    pos = getBE(pos, version);
+    pos = getBE(pos, header.ratId);
+    pos = getBE(pos, header.session);
+    pos = getBE(pos, header.seq);
+    getBE(pos, header.sendUs);
+
+    return magic == PROBE_MAGIC && version == PROBE_VERSION;
+}
+
+uint64_t ProbeCodec::nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
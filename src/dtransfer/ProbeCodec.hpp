@@ -0,0 +1,75 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the header the Data Sender writes at the start of every datagram, so the
+ * receiver can tell lost, reordered and delayed datagrams apart on top of counting bytes.
+ *
+ * Layout (network byte order):
+ *   uint16_t magic       PROBE_MAGIC
+ *   uint8_t  version     PROBE_VERSION
+ *   uint8_t  ratId       index of the interface pair in the data-receiver/data-sender lists
+ *   uint32_t session     random, picked when the data sender starts
+ *   uint64_t seq         consecutive per interface, starting at 0
+ *   uint64_t sendUs      wall clock time of the send call, in us
+ * followed by the pseudo-random filler.
+ *
+ * The datagrams of a batch (sendmmsg() or a GSO super-datagram) share the same sendUs.
+ * The one-way delay is only as good as the sync between the sender and receiver clocks,
+ * which is why both ends should follow the GPS time.
+ */
+
+#ifndef WIPERF_IMPL_PROBECODEC_HPP
+#define WIPERF_IMPL_PROBECODEC_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#define PROBE_MAGIC 0x5750 // "WP"
+#define PROBE_VERSION 1
+#define PROBE_HEADER_LEN 24
+#define PROBE_DELAY_BUCKETS 8 // bucket i holds delays below 2^(7 + 2i) us, the last one the rest
+
+struct ProbeHeader {
+    uint8_t ratId;
+    uint32_t session;
+    uint64_t seq;
+    uint64_t sendUs;
+};
+
+/**
+ * What the receiver made of the probe headers of a time bin (see ProbeStats).
+ * Every field is 0 for a bin without probes.
+ */
+struct ProbeSummary {
+    uint32_t received = 0;   // datagrams with a probe header, duplicates aside
+    uint32_t lost = 0;       // sequence numbers given up on during the bin
+    uint32_t reordered = 0;  // arrived after a later sequence number
+    uint32_t duplicates = 0;
+    uint32_t jitterUs = 0;   // RFC 3550 inter-arrival jitter at the end of the bin
+    int32_t delayMinUs = 0;  // one-way delay, negative if the receiver clock is behind
+    int32_t delayMeanUs = 0;
+    int32_t delayMaxUs = 0;
+    uint32_t delayHist[PROBE_DELAY_BUCKETS] = {};
+};
+
+class ProbeCodec {
+public:
+    /**
+     * Writes the header to buf, which must have room for PROBE_HEADER_LEN bytes.
+     */
+    static void encode(uint8_t *buf, const ProbeHeader &header);
+
+    /**
+     * @return false if the datagram doesn't start with a probe header of this version
+     */
+    static bool decode(const uint8_t *buf, size_t len, ProbeHeader &header);
+
+    /**
+     * @return the current wall clock time, in us, as written in sendUs
+     */
+    static uint64_t nowUs();
+};
+
+#endif //WIPERF_IMPL_PROBECODEC_HPP
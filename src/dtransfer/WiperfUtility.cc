@@ -12,6 +12,13 @@
 #include <cassert>     // assert
 #include <fcntl.h>     // O_RDONLY, S_IRWXU, S_IRUSR, etc
 #include <sys/mman.h>  // mmap() and shm_open()
+#include <stdexcept>   // std::exception
+#include <cstring>     // memset()
+#include <mutex>       // std::mutex
+#include <unistd.h>    // close()
+
+#include "../mygpsd/gpsshm.hpp" // gpsShmRead(), etc
+#include "ProbeCodec.hpp"        // PROBE_HEADER_LEN
 
 // ------- Configurations ------------
 
@@ -108,7 +115,12 @@ void WiperfUtility::readIfaces(ConfigFile& cfile, const std::string& secName,
                     IfaceInfo ifaceInfo;
                     // mark sockfd as non-initialized, so we don't accidently close it
                     ifaceInfo.sockfd = UNINITIALIZED_FD;
+                    ifaceInfo.name = iname;
                     ifaceInfo.ifaceId = i;
+                    ifaceInfo.counterSlot = -1;
+                    ifaceInfo.ioEngine = IoEngine::basic;
+                    ifaceInfo.ioEngineConf = IoEngine::basic;
+                    ifaceInfo.pacing = IfacePacing{};
                     ifaceMap.insert(IfaceInfoMapKvp(iname, ifaceInfo));
                 }
 
@@ -234,8 +246,165 @@ std::string WiperfUtility::readGpsShmPath(ConfigFile &cfile, const std::string&
     return gpsShmPath;
 }
 
+bool WiperfUtility::readGpsClock(ConfigFile &cfile) {
+    try {
+        return cfile.Value("gpsinfo", "clock-discipline") == "true";
+    }
+    catch (std::exception const&) {
+        return false;
+    }
+}
+
+std::string WiperfUtility::readMetricsEndpoint(ConfigFile &cfile, const std::string &secName) {
+    try {
+        return cfile.Value(secName, "metrics");
+    }
+    catch (std::exception const&) {
+        return "";
+    }
+}
+
+void WiperfUtility::readIfaceEngines(ConfigFile &cfile, const std::string& secName,
+                                     IfaceInfoMap &ifaceMap) {
+    // the engines entry is optional, interfaces without one keep the basic engine
+    std::string enginesStr;
+    try {
+        enginesStr = cfile.Value(secName, "engines");
+    } catch (std::exception const&) {
+        return;
+    }
+
+    // note: ">> std::ws" is used to remove whitespace
+    std::stringstream sstream(enginesStr);
+    for (std::string ientry; std::getline(sstream >> std::ws, ientry, ',');) {
+        std::stringstream esstream(ientry);
+        std::string iname, ename;
+
+        if (!std::getline(esstream >> std::ws, iname, ' ')
+            || !std::getline(esstream >> std::ws, ename, ' ')) {
+            std::stringstream ss;
+            ss << "Config exception: section=" << secName << ", value=engines. "
+               << "Invalid engine entry " << ientry << ". Ignoring.";
+            LOG_ERR(ss.str().c_str());
+            continue;
+        }
+
+        auto itr = ifaceMap.find(iname);
+        if (itr == ifaceMap.end()) {
+            std::stringstream ss;
+            ss << "Config exception: section=" << secName << ", value=engines. "
+               << "Unknown interface " << iname << ". Ignoring entry.";
+            LOG_ERR(ss.str().c_str());
+            continue;
+        }
+
+        itr->second.ioEngine = WiperfUtility::strToIoEngine(ename);
+        itr->second.ioEngineConf = itr->second.ioEngine;
+    }
+}
+
+/**
+ * Parses a rate in bits per second, with an optional k, M or G suffix (e.g., 20M).
+ * @return false if it isn't a number
+ */
+static bool parseRate(const std::string& str, uint64_t& rate) {
+    size_t end = 0;
+    double value;
+    try {
+        value = std::stod(str, &end);
+    } catch (std::exception const&) {
+        return false;
+    }
+
+    const std::string suffix = str.substr(end);
+    if (suffix == "k" || suffix == "K") value *= 1e3;
+    else if (suffix == "m" || suffix == "M") value *= 1e6;
+    else if (suffix == "g" || suffix == "G") value *= 1e9;
+    else if (!suffix.empty()) return false;
+
+    if (value < 0) return false;
+    rate = (uint64_t) value;
+    return true;
+}
+
+void WiperfUtility::readIfacePacing(ConfigFile &cfile, const std::string& secName,
+                                    IfaceInfoMap &ifaceMap) {
+    // the pacing entry is optional, interfaces without one send as fast as they can
+    std::string pacingStr;
+    try {
+        pacingStr = cfile.Value(secName, "pacing");
+    } catch (std::exception const&) {
+        return;
+    }
+
+    // entries are "iname rate [datagram-len [on-ms/off-ms]]"
+    std::stringstream sstream(pacingStr);
+    for (std::string ientry; std::getline(sstream >> std::ws, ientry, ',');) {
+        std::stringstream esstream(ientry);
+        std::string iname, rateStr, lenStr, patternStr;
+        IfacePacing pacing{};
+
+        bool valid = std::getline(esstream >> std::ws, iname, ' ')
+                     && std::getline(esstream >> std::ws, rateStr, ' ')
+                     && parseRate(rateStr, pacing.rate);
+
+        if (valid && std::getline(esstream >> std::ws, lenStr, ' ')) {
+            try {
+                const int len = std::stoi(lenStr);
+                valid = len >= PROBE_HEADER_LEN && len <= SND_BUF_LEN;
+                pacing.datagramLen = (uint32_t) len;
+            } catch (std::exception const&) {
+                valid = false;
+            }
+        }
+
+        if (valid && std::getline(esstream >> std::ws, patternStr, ' ')) {
+            const size_t slash = patternStr.find('/');
+            try {
+                valid = slash != std::string::npos;
+                if (valid) {
+                    const int onMs = std::stoi(patternStr.substr(0, slash));
+                    const int offMs = std::stoi(patternStr.substr(slash + 1));
+                    valid = onMs > 0 && offMs >= 0;
+                    pacing.onMs = (uint32_t) onMs;
+                    pacing.offMs = (uint32_t) offMs;
+                }
+            } catch (std::exception const&) {
+                valid = false;
+            }
+        }
+
+        if (!valid) {
+            std::stringstream ss;
+            ss << "Config exception: section=" << secName << ", value=pacing. "
+               << "Invalid pacing entry " << ientry << ". Ignoring.";
+            LOG_ERR(ss.str().c_str());
+            continue;
+        }
+
+        auto itr = ifaceMap.find(iname);
+        if (itr == ifaceMap.end()) {
+            std::stringstream ss;
+            ss << "Config exception: section=" << secName << ", value=pacing. "
+               << "Unknown interface " << iname << ". Ignoring entry.";
+            LOG_ERR(ss.str().c_str());
+            continue;
+        }
+
+        itr->second.pacing = pacing;
+    }
+}
+
 // -------------- GPS --------------
 GpsInfo* WiperfUtility::getGpsInfo(const std::string& gpsShmPath) {
+    // the mappings are never undone, threads keep reading them until the process ends
+    static std::mutex gpsShmMutex;
+    static std::map<std::string, GpsInfo*> gpsShmMap;
+
+    std::lock_guard<std::mutex> lock(gpsShmMutex);
+    auto itr = gpsShmMap.find(gpsShmPath);
+    if (itr != gpsShmMap.end()) return itr->second;
+
     int gpsShmfd = 0;
     if ((gpsShmfd = shm_open(gpsShmPath.c_str(), O_RDWR, S_IRUSR | S_IRGRP)) < 0) {
         LOG_FATAL_PERROR_EXIT("pthread gpsInfo shm_open()");
@@ -243,53 +412,84 @@ GpsInfo* WiperfUtility::getGpsInfo(const std::string& gpsShmPath) {
 
     // request memory mapping of gps shared segment
     GpsInfo *gpsInfoShm;
-    if ((gpsInfoShm = (GpsInfo *) mmap(NULL, sizeof(GpsInfo),
+    if ((gpsInfoShm = (GpsInfo *) mmap(NULL, GPS_SHM_SIZE,
                                        PROT_READ | PROT_WRITE, MAP_SHARED,
                                        gpsShmfd, 0)) == MAP_FAILED) {
         LOG_FATAL_PERROR_EXIT("pthread gpsInfo nmap()");
     }
+    close(gpsShmfd);  // the mapping stays
 
+    if (!gpsShmCompatible(gpsInfoShm)) {
+        LOG_FATAL_EXIT("gpsInfo shared memory has a different layout, restart mygpsd");
+    }
+
+    gpsShmMap[gpsShmPath] = gpsInfoShm;
     return gpsInfoShm;
 }
 
 GpsInfo WiperfUtility::getCurrentGps(GpsInfo* gpsInfo) {
-    if (pthread_mutex_lock(&(gpsInfo->mutex))) {
-        LOG_FATAL_PERROR_EXIT("pthread gpsInfo pthread_mutex_lock")
-    }
-
     GpsInfo currInfo;
-    currInfo.speed = gpsInfo->speed;
-    currInfo.systime = gpsInfo->systime;
-    currInfo.fix = gpsInfo->fix;
-    currInfo.head = gpsInfo->head;
-    currInfo.lon = gpsInfo->lon;
-    currInfo.lat = gpsInfo->lat;
-    currInfo.gpstime = gpsInfo->gpstime;
-    currInfo.alt = gpsInfo->alt;
-    currInfo.hdop = gpsInfo->hdop;
-    currInfo.nsats = gpsInfo->nsats;
-
-    if (pthread_mutex_unlock(&(gpsInfo->mutex))) {
-        LOG_FATAL_PERROR_EXIT("pthread gpsInfo pthread_mutex_unlock")
+    if (!gpsShmRead(gpsInfo, &currInfo)) {
+        // mygpsd died mid-update, report no fix rather than torn data
+        LOG_WARN("gpsInfo shared memory stuck mid-update, no GPS data");
+        memset(&currInfo, 0, sizeof(currInfo));
     }
 
     return currInfo;
 }
 
 uint64_t WiperfUtility::getCurrentMillis(GpsInfo* gpsInfo) {
-    //I commented the mutexes out because this is a read-only operation!
+    return getCurrentGps(gpsInfo).systime;
+}
 
-//    if (pthread_mutex_lock(&(gpsInfo->mutex))) {
-//        LOG_FATAL_PERROR_EXIT("pthread gpsInfo pthread_mutex_lock")
-//    }
+bool WiperfUtility::waitGpsUpdate(GpsInfo* gpsInfo, uint32_t& lastUpdates, int timeout) {
+    return gpsShmWaitUpdate(gpsInfo, &lastUpdates, timeout);
+}
 
-    uint64_t millis = gpsInfo->systime;
+bool WiperfUtility::positionAt(GpsInfo* gpsInfo, uint64_t timestamp, GpsFix& fix) {
+    const uint32_t count = gpsShmFixCount(gpsInfo);
+    // the oldest slot is left alone, mygpsd may be overwriting it right now
+    const uint32_t oldest = count >= GPS_HISTORY_LEN ? count - GPS_HISTORY_LEN + 1 : 0;
+
+    // walk back from the newest fix, the timestamps asked for are usually recent
+    GpsFix after{}, before{};
+    bool haveAfter = false;
+    for (uint32_t i = count; i-- > oldest; ) {
+        if (!gpsShmReadFix(gpsInfo, i, &before)) break; // overwritten meanwhile, as are the older ones
+
+        if (before.systime <= timestamp) {
+            if (!haveAfter || after.systime - before.systime > GPS_INTERP_MAX_GAP) {
+                fix = (!haveAfter || timestamp - before.systime <= after.systime - timestamp) ? before : after;
+                return true;
+            }
 
-//    if (pthread_mutex_unlock(&(gpsInfo->mutex))) {
-//        LOG_FATAL_PERROR_EXIT("pthread gpsInfo pthread_mutex_unlock")
-//    }
+            const float w = (float) (timestamp - before.systime) / (float) (after.systime - before.systime);
+            fix = w < 0.5f ? before : after; // the discrete fields
+            fix.systime = timestamp;
+            fix.lat = before.lat + (after.lat - before.lat) * w;
+            fix.lon = before.lon + (after.lon - before.lon) * w;
+            fix.alt = before.alt + (after.alt - before.alt) * w;
+            fix.speed = before.speed + (after.speed - before.speed) * w;
+
+            // the short way around the circle
+            float turn = after.head - before.head;
+            if (turn > 180) turn -= 360;
+            else if (turn < -180) turn += 360;
+            fix.head = before.head + turn * w;
+            if (fix.head < 0) fix.head += 360;
+            else if (fix.head >= 360) fix.head -= 360;
+
+            return true;
+        }
 
-    return millis;
+        after = before;
+        haveAfter = true;
+    }
+
+    if (!haveAfter) return false;
+
+    fix = after; // older than the whole history
+    return true;
 }
 
 // ---------- DATA TYPES ------------
@@ -330,43 +530,43 @@ uint64_t WiperfUtility::htonll(uint64_t value) {
 
 // ------------ RAT ENUM ------------
 
+// indexed by the enum value, so converting to a name is a bounds check and a load
+static constexpr const char *ratNames[] = {"lo", "802.11n", "802.11ac", "802.11ad"};
+static constexpr int numRatNames = sizeof(ratNames) / sizeof(ratNames[0]);
+
+static_assert((int) RAT::loopback == 0 && (int) RAT::n80211 == 1 && (int) RAT::ac80211 == 2 &&
+              (int) RAT::ad80211 == 3, "ratNames is indexed by RAT");
+
 RAT WiperfUtility::ifaceToRat(const std::string& ifaceName) {
-    if ( ifaceName == "lo" ) {
-        return RAT::loopback;
-    }
-    else if ( ifaceName == "802.11n" ) {
-        return RAT::n80211;
-    }
-    else if ( ifaceName == "802.11ad" ) {
-        return RAT::ad80211;
-    }
-    else if ( ifaceName == "802.11ac" ) {
-        return RAT::ac80211;
-    }
-    else {
-        return RAT::invalid;
+    for (int i = 0; i < numRatNames; i++) {
+        if (ifaceName == ratNames[i]) return static_cast<RAT>(i);
     }
+    return RAT::invalid;
 }
 
 std::string WiperfUtility::ratToIface(RAT rat) {
-    if ( rat == RAT::invalid ) {
-        return "invalid";
-    }
-    else if ( rat == RAT::loopback ) {
-        return "lo";
-    }
-    else if ( rat == RAT::n80211 ) {
-        return "802.11n";
-    }
-    else if ( rat == RAT::ac80211) {
-        return "802.11ac";
-    }
-    else if ( rat == RAT::ad80211) {
-        return "802.11ad";
-    }
-    else {
-        return "invalid";
+    const int i = static_cast<int>(rat);
+    return i >= 0 && i < numRatNames ? ratNames[i] : "invalid";
+}
+
+// ------------ IO ENGINE ENUM ------------
+
+static constexpr const char *ioEngineNames[] = {"basic", "mmsg", "gso", "gro", "ring"};
+static constexpr int numIoEngineNames = sizeof(ioEngineNames) / sizeof(ioEngineNames[0]);
+
+static_assert((int) IoEngine::basic == 0 && (int) IoEngine::mmsg == 1 && (int) IoEngine::gso == 2 &&
+              (int) IoEngine::gro == 3 && (int) IoEngine::ring == 4, "ioEngineNames is indexed by IoEngine");
+
+IoEngine WiperfUtility::strToIoEngine(const std::string& engineName) {
+    for (int i = 0; i < numIoEngineNames; i++) {
+        if (engineName == ioEngineNames[i]) return static_cast<IoEngine>(i);
     }
+    return IoEngine::basic;
+}
+
+std::string WiperfUtility::ioEngineToStr(IoEngine engine) {
+    const int i = static_cast<int>(engine);
+    return i >= 0 && i < numIoEngineNames ? ioEngineNames[i] : "basic";
 }
 
 // ----------------- IFACE INFO FUNCTIONS ------------------
@@ -374,12 +574,16 @@ std::string WiperfUtility::ratToIface(RAT rat) {
 IfaceInfo WiperfUtility::deepCloneIfaceInfo(IfaceInfo &ifaceInfo) {
     IfaceInfo newEntry{};
 
-    newEntry.nbytesAcc = ifaceInfo.nbytesAcc;
+    newEntry.name = ifaceInfo.name;
     newEntry.sockaddrSrv = ifaceInfo.sockaddrSrv;
     newEntry.sockfd = ifaceInfo.sockfd;
     newEntry.addrSrv = ifaceInfo.addrSrv;
     newEntry.addrCli = ifaceInfo.addrCli;
     newEntry.ifaceId = ifaceInfo.ifaceId;
+    newEntry.counterSlot = ifaceInfo.counterSlot;
+    newEntry.ioEngine = ifaceInfo.ioEngine;
+    newEntry.ioEngineConf = ifaceInfo.ioEngineConf;
+    newEntry.pacing = ifaceInfo.pacing;
 
     return newEntry;
 }
@@ -22,18 +22,28 @@
 
 #define UNINITIALIZED_FD -1
 #define GPS_SHM_PATH_DEF "/wiperf-gpsinfo"
+#define GPS_INTERP_MAX_GAP 2000 // ms between two fixes above which positionAt() doesn't interpolate
 #define SSIDS_STR_DEF "lo"
 #define IFACES_STR_DEF "lo 127.0.0.1"
 #define CONFIG_FNAME "/etc/wiperf.conf"
 #define PORT_CLI_DEF 44443
 #define PORT_SRV_DEF 44444
 #define SND_BUF_LEN 65506
+#define SND_BATCH_LEN 32 // datagrams handed to the kernel per sendmmsg() call
+#define SND_GSO_SEGMENT_LEN 1472 // UDP payload per GSO segment (1500 bytes MTU)
+#define SND_GSO_BATCH_LEN 8 // GSO super-datagrams per sendmmsg() call
+#define SND_RING_FRAMES 256 // frames of the PACKET_MMAP transmit ring
+#define SND_RING_BATCH_LEN 64 // frames queued per send() call
 #define RCV_BUF_LEN 524288
 #define RCV_BUF_NUM_PACKETS 64
+#define RCV_SLOT_LEN (RCV_BUF_LEN / RCV_BUF_NUM_PACKETS) // bytes copied per datagram by recvmmsg()
+#define RCV_RING_BLOCK_LEN 65536 // bytes per block of the PACKET_MMAP receive ring
+#define RCV_RING_BLOCKS 64
+#define RCV_RING_BLOCK_TIMEOUT 4 // ms before the kernel hands over a block that isn't full
 #define PORT_FEED_CLI_DEF 44445
 #define PORT_FEED_SRV_DEF 44446
 //#define FEEDBACK_SND_BUF_LEN 512 <- This is dynamic and depends on the RATs per message
-#define FEEDBACK_RCV_BUF_LEN 512
+#define FEEDBACK_RCV_BUF_LEN 2048 // above FEEDBACK_MSG_MAX_LEN
 #define FEEDBACK_IFACE_DEF "lo"
 #define FEEDBACK_INTERVAL_DEF 100
 //in milliseconds
@@ -43,16 +53,43 @@
  */
 enum class RAT { invalid = -1,  loopback = 0, n80211 = 1, ac80211 = 2, ad80211 = 3, g5nr = 4};
 
+/**
+ * Enum to define the I/O engine used to move the UDP traffic through an interface.
+ *  - basic: one sendto()/recv() per datagram
+ *  - mmsg: batches of datagrams per sendmmsg()/recvmmsg() call
+ *  - gso: UDP generic segmentation offload (transmit only)
+ *  - gro: UDP generic receive offload (receive only)
+ *  - ring: PACKET_MMAP rings shared with the kernel, past the UDP socket
+ */
+enum class IoEngine { basic = 0, mmsg = 1, gso = 2, gro = 3, ring = 4 };
+
+/**
+ * Traffic shape of an interface of the Data Sender (see [data-sender] pacing).
+ *  - rate: target rate, in bits per second, 0 for as fast as possible
+ *  - datagramLen: UDP payload of each datagram, 0 for the default of the engine
+ *  - onMs/offMs: sends for onMs then stays quiet for offMs, always on if offMs is 0
+ */
+struct IfacePacing {
+    uint64_t rate;
+    uint32_t datagramLen;
+    uint32_t onMs;
+    uint32_t offMs;
+};
+
 /**
  * Structure of information regarding an interface.
  */
 struct IfaceInfo { // interface information
+    std::string name;
     std::string addrSrv;
     std::string addrCli;
     struct sockaddr_in sockaddrSrv;
     int sockfd;
-    uint64_t nbytesAcc;  //NOTE: This is only used by the data receiver, and not by the data sender
     int ifaceId;
+    int counterSlot; // slot in DataTransfer::ifaceCounters
+    IoEngine ioEngine;
+    IoEngine ioEngineConf; // as configured, ioEngine may fall back to another one
+    IfacePacing pacing;
 };
 
 // Auxiliary structs and types
@@ -73,11 +110,26 @@ public:
     static std::vector<std::string> readIfnames(ConfigFile& cfile, const std::string& secName);
     static std::vector<std::string> readSsids(ConfigFile& cfile, const std::string& secName);
     static std::string readGpsShmPath(ConfigFile& cfile, const std::string& defGpsShmPath);
+    // optional [gpsinfo] clock-discipline, whether periodic loops follow the GPS time
+    static bool readGpsClock(ConfigFile& cfile);
+    static void readIfaceEngines(ConfigFile& cfile, const std::string& secName, IfaceInfoMap &ifaceMap);
+    static void readIfacePacing(ConfigFile& cfile, const std::string& secName, IfaceInfoMap &ifaceMap);
+    // optional metrics endpoint of the daemon ("tcp:[address:]port" or "unix:path"), empty if none
+    static std::string readMetricsEndpoint(ConfigFile& cfile, const std::string& secName);
 
     // GPS utility functions
+    // maps the segment once per process, every later call with the same path shares it
     static GpsInfo* getGpsInfo(const std::string& gpsShmPath);
     static uint64_t getCurrentMillis(GpsInfo* gpsInfo);
     static GpsInfo getCurrentGps(GpsInfo* gpsInfo);
+    // blocks until mygpsd publishes a new fix or timeout ms pass; false on timeout
+    static bool waitGpsUpdate(GpsInfo* gpsInfo, uint32_t& lastUpdates, int timeout);
+    /**
+     * Looks up the position at a past systime (ms) in the fix history, interpolating
+     * between the fixes around it. Outside the history, the closest fix is returned.
+     * @return false if there is no fix at all
+     */
+    static bool positionAt(GpsInfo* gpsInfo, uint64_t timestamp, GpsFix& fix);
 
     // Data types utility functions
     /**
@@ -93,6 +145,10 @@ public:
     static RAT ifaceToRat(const std::string& ifaceName);
     static std::string ratToIface(RAT rat);
 
+    // I/O engine enum utility functions
+    static IoEngine strToIoEngine(const std::string& engineName);
+    static std::string ioEngineToStr(IoEngine engine);
+
     //Functions associated with IfaceInfo
     static IfaceInfo deepCloneIfaceInfo(IfaceInfo &ifaceInfo);
     static IfaceInfoMapKvp deepCloneIfaceInfoMapKvp(IfaceInfoMapKvp &ifaceInfoMapKvp);
@@ -31,6 +31,9 @@
 #include <sstream>
 
 #include "ChannelMonitor.hpp"
+#include "ParallelSampler.hpp"
+#include "../PeriodicScheduler.hpp"
+#include "WifiInfoCodec.hpp"
 
 #define SAMPLING_INTERVAL_DEF 100
 #define ETH_ALEN 6
@@ -136,12 +139,6 @@ static void mac_addr_n2a(char *mac_addr, unsigned char *arg) {
     }
 }
 
-static int finish_handler(struct nl_msg *msg, void *arg) {
-    int *ret = (int *) arg;
-    *ret = 0;
-    return NL_SKIP;
-}
-
 // https://git.kernel.org/pub/scm/linux/kernel/git/jberg/iw.git/tree/interface.c#n303
 static int getInterfaceInfo_callback(struct nl_msg *msg, void *arg) {
     struct nlattr *tb[NL80211_ATTR_MAX + 1];
@@ -285,8 +282,6 @@ static int getWifiInfo_callback(struct nl_msg *msg, void *arg) {
     struct nlattr *tid_info[NL80211_TID_STATS_MAX + 1];
 //    struct nlattr *txq_info[NL80211_TXQ_STATS_MAX + 1];
 
-	std::cout << "[DEBUG] ChannelMonitor::getWifiInfo_callback 1" << std::endl; 
-
     //nl_msg_dump(msg, stdout);
     nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0), genlmsg_attrlen(gnlh, 0), NULL);
 
@@ -536,122 +531,17 @@ static int getSurvey_callback(struct nl_msg *msg, void *arg) {
     return NL_SKIP;
 }
 
-static int getWifiStatus(NetlinkInfo *nl, WifiInfo *wifi) {
-    nl->result1 = 1;
-    nl->result2 = 1;
-    nl->result3 = 1;
-
-    if (wifi->ifindex < 0) {
-        return -1;
-    }
-
-std::cout << "[DEBUG] ChannelMonitor::getWifiStatus 0" << std::endl;
-
-    struct nl_msg *msg2 = nlmsg_alloc();
-    if (!msg2) {
-        std::cerr << "[ERROR] Failed to allocate netlink message." << std::endl;
-        return -2;
-    }
-    //This will fetch the interface signal strength and transmit bitrate
-    genlmsg_put(msg2, NL_AUTO_PORT, NL_AUTO_SEQ, nl->id, 0, NLM_F_DUMP, NL80211_CMD_GET_STATION, 0);
-    nla_put_u32(msg2, NL80211_ATTR_IFINDEX, wifi->ifindex);
-    nl_send_auto(nl->socket, msg2);
-    while (nl->result2 > 0) {
-        nl_recvmsgs(nl->socket, nl->cb2);
-    }
-    nlmsg_free(msg2);
-	
-std::cout << "[DEBUG] ChannelMonitor::getWifiStatus 1" << std::endl;
-
-    //SURVEY
-    struct nl_msg *msg1 = nlmsg_alloc();
-    if (!msg1) {
-        std::cerr << "[ERROR] Failed to allocate netlink message." << std::endl;
-        return -2;
-    }
-    genlmsg_put(msg1, NL_AUTO_PORT, NL_AUTO_SEQ, nl->id, 0, NLM_F_DUMP, NL80211_CMD_GET_SURVEY, 0);
-    nla_put_u32(msg1, NL80211_ATTR_IFINDEX, wifi->ifindex);
-    nl_send_auto(nl->socket, msg1);
-    while (nl->result1 > 0) {
-        nl_recvmsgs(nl->socket, nl->cb1);
-    }
-    nlmsg_free(msg1);
-
-std::cout << "[DEBUG] ChannelMonitor::getWifiStatus 2" << std::endl;
-    //INTERFACE
-    struct nl_msg *msg3 = nlmsg_alloc();
-    if (!msg3) {
-        std::cerr << "[ERROR] Failed to allocate netlink message." << std::endl;
-        return -2;
-    }
-    genlmsg_put(msg3, NL_AUTO_PORT, NL_AUTO_SEQ, nl->id, 0, NLM_F_DUMP, NL80211_CMD_GET_INTERFACE, 0);
-    nla_put_u32(msg3, NL80211_ATTR_IFINDEX, wifi->ifindex);
-    nl_send_auto(nl->socket, msg3);
-    while (nl->result3 > 0) {
-        nl_recvmsgs(nl->socket, nl->cb3);
-    }
-    nlmsg_free(msg3);
-
-std::cout << "[DEBUG] ChannelMonitor::getWifiStatus 3" << std::endl;
-    return 0;
-}
-
-static int initNl80211(NetlinkInfo &nl, WifiInfo &wifi) {
-    nl.socket = nl_socket_alloc();
-    if (!nl.socket) {
-        std::cout << "[ERROR] Failed to allocate netlink socket." << std::endl;
-        return -ENOMEM;
-    }
-
-    //nl_socket_set_buffer_size(nl.socket, 8192, 8192);
-
-    if (genl_connect(nl.socket)) {
-        std::cout << "[ERROR] Failed to connect to netlink socket." << std::endl;
-        nl_close(nl.socket);
-        nl_socket_free(nl.socket);
-        return -ENOLINK;
-    }
-
-    nl.id = genl_ctrl_resolve(nl.socket, "nl80211");
-    if (nl.id < 0) {
-        std::cout << "[ERROR] Nl80211 interface not found." << std::endl;
-        nl_close(nl.socket);
-        nl_socket_free(nl.socket);
-        return -ENOENT;
-    }
-
-    nl.cb1 = nl_cb_alloc(NL_CB_DEFAULT);
-    nl.cb2 = nl_cb_alloc(NL_CB_DEFAULT);
-    nl.cb3 = nl_cb_alloc(NL_CB_DEFAULT);
-
-    if ((!nl.cb2) || (!nl.cb1) || (!nl.cb3)) {
-        std::cout << "[ERROR] Failed to allocate netlink callback." << std::endl;
-        nl_close(nl.socket);
-        nl_socket_free(nl.socket);
-        return -ENOMEM;
-    }
-
-    nl_cb_set(nl.cb1, NL_CB_VALID, NL_CB_CUSTOM, getSurvey_callback, &wifi);
-    nl_cb_set(nl.cb1, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &(nl.result1));
-
-    nl_cb_set(nl.cb2, NL_CB_VALID, NL_CB_CUSTOM, getWifiInfo_callback, &wifi);
-    nl_cb_set(nl.cb2, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &(nl.result2));
-
-    nl_cb_set(nl.cb3, NL_CB_VALID, NL_CB_CUSTOM, getInterfaceInfo_callback, &wifi);
-    nl_cb_set(nl.cb3, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &(nl.result3));
-
-    return nl.id;
-}
-
 ChannelMonitor::ChannelMonitor(
         std::string const &configFname)
-        : databaseManager(), endProgram_(false), samplingInterval(SAMPLING_INTERVAL_DEF), ifnames() {
+        : databaseWriter(), endProgram_(false), samplingInterval(SAMPLING_INTERVAL_DEF),
+          channelInfoCsv(false), gpsClock(false), ifnames(), reloadPending(false),
+          pendingSamplingInterval(SAMPLING_INTERVAL_DEF), pendingChannelInfoCsv(false) {
     this->configure(configFname);
 }
 
 void ChannelMonitor::configure(std::string const &configFname) {
     ConfigFile configFile(configFname);
-    this->databaseManager.configure(configFile);
+    this->databaseWriter = DatabaseWriter::get(configFile);
 
     // configure iface to receive feedback messages
     this->samplingInterval = SAMPLING_INTERVAL_DEF;
@@ -664,8 +554,57 @@ void ChannelMonitor::configure(std::string const &configFname) {
         LOG_ERR(ss.str().c_str());
     }
 
+    // optional, the binary encoding is always stored
+    try {
+        this->channelInfoCsv = configFile.Value("channel-monitor", "channel-info-csv") == "true";
+    } catch (std::exception const&) {
+        this->channelInfoCsv = false;
+    }
+
+    this->gpsShmPath = WiperfUtility::readGpsShmPath(configFile, GPS_SHM_PATH_DEF);
+    this->gpsClock = WiperfUtility::readGpsClock(configFile);
+
     std::vector<std::string> aux_ifnames = WiperfUtility::readIfnames(configFile, "channel-monitor");
     this->ifnames.insert(this->ifnames.end(), aux_ifnames.begin(), aux_ifnames.end());
+
+    // per-role thread placement and priority (optional)
+    this->threadPolicy.configure(configFile, "channel-monitor");
+}
+
+void ChannelMonitor::reloadConfig(ConfigFile &configFile) {
+    int samplingInterval = SAMPLING_INTERVAL_DEF;
+    try {
+        samplingInterval = std::stoi(configFile.Value("channel-monitor", "sampling-interval"));
+    } catch (std::exception const&) {
+        LOG_STREAM(ERROR, "Config exception: section=channel-monitor, value=sampling-interval"
+                          << " using default value " << samplingInterval)
+    }
+
+    bool channelInfoCsv;
+    try {
+        channelInfoCsv = configFile.Value("channel-monitor", "channel-info-csv") == "true";
+    } catch (std::exception const&) {
+        channelInfoCsv = false;
+    }
+
+    std::vector<std::string> ifnames = WiperfUtility::readIfnames(configFile, "channel-monitor");
+
+    if (WiperfUtility::readGpsClock(configFile) != this->gpsClock) {
+        LOG_WARN("Reload: the GPS clock discipline changes on the next start");
+    }
+
+    std::lock_guard<std::mutex> lock(this->reloadMutex);
+    if (samplingInterval != this->samplingInterval) {
+        LOG_STREAM(MSG, "Reload: sampling-interval " << samplingInterval << " ms")
+    }
+    if (ifnames != this->ifnames) {
+        LOG_STREAM(MSG, "Reload: sampling " << ifnames.size() << " radios")
+    }
+
+    this->pendingSamplingInterval = samplingInterval;
+    this->pendingChannelInfoCsv = channelInfoCsv;
+    this->pendingIfnames = ifnames;
+    this->reloadPending = true;
 }
 
 void ChannelMonitor::stopThread() {
@@ -674,118 +613,115 @@ void ChannelMonitor::stopThread() {
 }
 
 void ChannelMonitor::run() {
-    std::string gpsShmPath = dataSender->getGpsShmPath();
+    this->threadPolicy.apply("monitor");
+
     //Use GPS tp get timestamp!
-    GpsInfo *gpsInfo = WiperfUtility::getGpsInfo(gpsShmPath);
+    GpsInfo *gpsInfo = WiperfUtility::getGpsInfo(this->gpsShmPath);
 
-    std::vector<NetlinkInfo> netlinkVector;
     std::vector<WifiInfo> wifiVector;
+    wifiVector.reserve(this->ifnames.size());
 
-	for (auto & it : this->ifnames) {
-        WifiInfo wifiEntry{};
-        NetlinkInfo netlinkEntry{};
-
-        wifiEntry.ifname = it;
-        wifiEntry.ifindex = if_nametoindex(it.c_str());
-		
-        wifiVector.push_back(wifiEntry);
-        netlinkVector.push_back(netlinkEntry);
-	}
-
-	for (int i = 0; i < netlinkVector.size(); ++i) {
-		NetlinkInfo &netlinkEntry = netlinkVector.at(i);
-		WifiInfo &wifiEntry = wifiVector.at(i);
-
-        netlinkEntry.id = initNl80211(netlinkEntry, wifiEntry);
-        if (netlinkEntry.id < 0) {
-            std::cout << "[ERROR] Error initializing netlink 802.11." << std::endl;
-            return;
-        }
+    // one sampler thread per radio
+    const Nl80211Parser parsers[NL80211_REQ_COUNT] = {
+            getWifiInfo_callback, getSurvey_callback, getInterfaceInfo_callback};
+
+    ParallelSampler sampler;
+    if (!sampler.start(this->ifnames, parsers, &this->threadPolicy)) {
+        LOG_ERR("Error initializing netlink 802.11.");
+        return;
     }
 
-    //Needed to synchronize to only send on the 100 ms mark (instead of sending at 1320 ms,
-    // send at 1400 ms).
-    //uint64_t now0 = WiperfUtility::getCurrentMillis(gpsInfo);
-    std::chrono::milliseconds now0_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::system_clock::now().time_since_epoch());
-    uint64_t now0 = now0_ms.count();
+    //Ticks on the sampling grid (e.g., at 1400 ms and not at 1320 ms), so the samples
+    // line up with the feedback of the receiver
+    PeriodicScheduler scheduler;
+    if (!scheduler.start(this->samplingInterval, this->gpsClock ? gpsInfo : nullptr, "ChannelMonitor")) {
+        return;
+    }
 
-    uint64_t sleepingInterval = this->samplingInterval - (now0 % this->samplingInterval);
-    std::this_thread::sleep_for(std::chrono::milliseconds(sleepingInterval));
+    this->databaseWriter->start();
 
     while (!endProgram_) {
+        //The tick starts on the sampling grid, and all the radios get its timestamp
+        uint64_t timestamp = scheduler.wait();
+        if (timestamp == 0) break;
+
+        //A reload changes the radios and the grid from this tick on
+        if (this->reloadPending) {
+            std::lock_guard<std::mutex> lock(this->reloadMutex);
+            this->reloadPending = false;
+            this->channelInfoCsv = this->pendingChannelInfoCsv;
+
+            if (this->pendingIfnames != this->ifnames) {
+                if (sampler.start(this->pendingIfnames, parsers, &this->threadPolicy)) {
+                    this->ifnames = this->pendingIfnames;
+                } else {
+                    LOG_ERR("Reload: error initializing netlink 802.11, sampling the previous radios");
+                    sampler.start(this->ifnames, parsers, &this->threadPolicy);
+                }
+                wifiVector.reserve(this->ifnames.size());
+            }
+
+            if (this->pendingSamplingInterval != this->samplingInterval) {
+                this->samplingInterval = this->pendingSamplingInterval;
+                scheduler.start(this->samplingInterval, this->gpsClock ? gpsInfo : nullptr, "ChannelMonitor");
+            }
+        }
 
         //1. Compute the signal information
         //2. Construct database information object
         //3. Update database
 
-		//std::cout << "[DEBUG] ChannelMonitor::run while 20" << std::endl;
-        for (int i = 0; i < wifiVector.size(); ++i) {
-        	NetlinkInfo &netlinkInfo = netlinkVector.at(i);
-            WifiInfo &wifiInfo = wifiVector.at(i);
-
-            //Gather information
-            getWifiStatus(&netlinkInfo, &wifiInfo);
+        //Gather information of all the radios in parallel, within the sampling interval
+        size_t late = sampler.sample(this->samplingInterval, wifiVector);
+        if (late > 0) {
+            std::stringstream ss;
+            ss << late << " radios missed the " << this->samplingInterval << " ms sampling deadline";
+            LOG_WARN(ss.str().c_str());
         }
 
-        //Get the timestamp and the position that corresponds to the
-        // collected RAN data.
-        GpsInfo currentInfo = WiperfUtility::getCurrentGps(gpsInfo);
-        std::chrono::milliseconds currentTime_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                std::chrono::system_clock::now().time_since_epoch());
-        uint64_t timestamp = currentTime_ms.count();//currentInfo.systime;
-
-        //Round the timestamp to the nearest 10 ms
-        uint64_t timestampRound = (uint64_t) (timestamp / this->samplingInterval);
-        if ((int) timestamp % this->samplingInterval > 0)
-            timestampRound++;
-
-        timestamp = timestampRound * this->samplingInterval;
-
-        //double latitude = static_cast<double>(currentInfo.lat);
-        double latitude = 0;
-        //double longitude = static_cast<double>(currentInfo.lon);
-        double longitude = 0;
-        //double speed = static_cast<double>(currentInfo.speed);
-        double speed = 0;
-        //double orientation = static_cast<double>(currentInfo.head);
-        double orientation = 0;
-        //If vehicle is moving at less than 0.5 kmph, we consider that it stopped?
-        int moving = speed > 0.5;
+        //Get the position that corresponds to the collected RAN data, i.e., at the tick.
+        //Without fixes (e.g., a static AP without a receiver) it stays at 0
+        GpsFix fix{};
+        WiperfUtility::positionAt(gpsInfo, timestamp, fix);
 
         std::vector<DatabaseInfo> databaseInfoVector;
+        databaseInfoVector.reserve(wifiVector.size());
 
         for (auto & wifiInfo : wifiVector) {
-            std::string codedWifiInfo = codeWifiInfo(wifiInfo);
+            databaseInfoVector.push_back(toDatabaseInfo(wifiInfo, timestamp, fix, this->channelInfoCsv));
+        }
 
-            DatabaseInfo databaseInfo{};
+        // never wait on the database here, the writer thread takes care of it
+        this->databaseWriter->enqueue(databaseInfoVector);
+    }
 
-            uint64_t timestamp = timestamp - (timestamp % 10);
+    scheduler.logStats("ChannelMonitor");
+    sampler.stop();
+    this->databaseWriter->stop();
+}
 
-            databaseInfo.timestamp = timestamp;
-            databaseInfo.rat = wifiInfo.ifname;//wifiInfo.ifname;
-            databaseInfo.channelInfo = codedWifiInfo;
-            databaseInfo.latitude = latitude;
-            databaseInfo.longitude = longitude;
-            databaseInfo.speed = speed;
-            databaseInfo.orientation = orientation;
-            databaseInfo.moving = moving;
+DatabaseInfo ChannelMonitor::toDatabaseInfo(const WifiInfo& wifiInfo, uint64_t timestamp, const GpsFix& fix,
+                                            bool csv) {
+    uint8_t codedWifiInfo[WIFI_INFO_BIN_LEN];
+    size_t codedLen = WifiInfoCodec::encode(wifiInfo, codedWifiInfo, sizeof(codedWifiInfo));
 
-            databaseInfo.tx_bitrate = wifiInfo.tx_bitrate;
-            databaseInfo.signal_strength = wifiInfo.signal - 256;  //convert positive to negative
+    DatabaseInfo databaseInfo{};
 
-            databaseInfoVector.push_back(databaseInfo);
-        }
+    databaseInfo.timestamp = timestamp;
+    databaseInfo.rat = wifiInfo.ifname;//wifiInfo.ifname;
+    databaseInfo.channelInfoBin.assign((const char *) codedWifiInfo, codedLen);
+    if (csv) databaseInfo.channelInfo = codeWifiInfo(wifiInfo);
+    databaseInfo.latitude = static_cast<double>(fix.lat);
+    databaseInfo.longitude = static_cast<double>(fix.lon);
+    databaseInfo.speed = static_cast<double>(fix.speed);
+    databaseInfo.orientation = static_cast<double>(fix.head);
+    //If vehicle is moving at less than 0.5 kmph, we consider that it stopped?
+    databaseInfo.moving = databaseInfo.speed > 0.5;
 
-        this->databaseManager.createAll(databaseInfoVector);
+    databaseInfo.tx_bitrate = wifiInfo.tx_bitrate;
+    databaseInfo.signal_strength = wifiInfo.signal - 256;  //convert positive to negative
 
-        //uint64_t now1 = WiperfUtility::getCurrentMillis(gpsInfo);
-        std::chrono::milliseconds now1_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                std::chrono::system_clock::now().time_since_epoch());
-        uint64_t now1 = now1_ms.count();
-        sleepingInterval = this->samplingInterval - (now1 % this->samplingInterval);
-        std::this_thread::sleep_for(std::chrono::milliseconds(sleepingInterval));
-    }
+    return databaseInfo;
 }
 
 std::string ChannelMonitor::codeWifiInfo(const WifiInfo& wifi) {
@@ -9,22 +9,12 @@
 #ifndef WIPERF_IMPL_CHANNELMONITOR_H
 #define WIPERF_IMPL_CHANNELMONITOR_H
 
-#include "../database/DatabaseManager.hpp"
-#include "../WiperfUtility.hpp"
+#include <atomic>
+#include <mutex>
 
-/**
- * Structure containing information to send netlink messages towards
- * the nl80211 user-kernel interface.
- */
-typedef struct {
-    int id;
-    struct nl_sock *socket;
-    struct nl_cb *cb1; //survey
-    struct nl_cb *cb2; //station
-    struct nl_cb *cb3; //interface
-    struct nl_cb *cb4; //power save mode
-    int result1, result2, result3, result4;
-} NetlinkInfo;
+#include "../database/DatabaseWriter.hpp"
+#include "../WiperfUtility.hpp"
+#include "../../util/threadpolicy.hpp"
 
 /**
  * Structure containing all the information collected through the
@@ -172,10 +162,21 @@ typedef struct {
 class ChannelMonitor {
 private:
     //std::shared_ptr<DataSender> dataSender;
-    DatabaseManager databaseManager;
+    std::shared_ptr<DatabaseWriter> databaseWriter; // shared by the components of the process
     bool endProgram_;
     int samplingInterval;
+    bool channelInfoCsv; // also store the legacy CSV encoding of the channel info
+    bool gpsClock;       // discipline the sampling grid with the GPS time
     std::vector<std::string> ifnames;
+    std::string gpsShmPath;
+    ThreadPolicy threadPolicy; // placement and priority of the monitor and sampler threads
+
+    // settings of a reload, for run() to apply between two ticks
+    std::mutex reloadMutex;
+    std::atomic<bool> reloadPending;
+    int pendingSamplingInterval;
+    bool pendingChannelInfoCsv;
+    std::vector<std::string> pendingIfnames;
 
     void configure(std::string const &configFname);
 public:
@@ -183,7 +184,22 @@ public:
     void run();
     void stopThread();
 
-    //code and decode functions
+    /**
+     * Applies the sampling interval, the radios and channel-info-csv of the reloaded
+     * configuration, on the next tick. The GPS clock and the database settings are only
+     * read on start.
+     */
+    void reloadConfig(ConfigFile &configFile);
+
+    /**
+     * Builds the database entry of a sample of a radio (the encode path of run()).
+     * @param timestamp tick the sample was taken at
+     * @param fix       position at the tick
+     * @param csv       also fill in the legacy CSV encoding
+     */
+    static DatabaseInfo toDatabaseInfo(const WifiInfo& wifiInfo, uint64_t timestamp, const GpsFix& fix, bool csv);
+
+    //code and decode functions (CSV, kept for compatibility; see WifiInfoCodec)
     static std::string codeWifiInfo(const WifiInfo& wifiInfo);
     static WifiInfo decodeWifiInfo(const std::string& info);
 };
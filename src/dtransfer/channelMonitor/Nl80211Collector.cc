@@ -0,0 +1,286 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "Nl80211Collector.hpp"
+
+#include <chrono>
+#include <sstream>
+#include <poll.h>
+#include <netlink/netlink.h>
+#include <netlink/genl/genl.h>
+#include <netlink/genl/ctrl.h>
+#include <linux/nl80211.h>
+
+#include "../../util/logfile.hpp"
+
+static uint64_t steadyMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @return true if the socket has data to be read within the timeout (ms)
+ */
+static bool waitReadable(struct nl_sock *socket, int timeout) {
+    struct pollfd pfd = {nl_socket_get_fd(socket), POLLIN, 0};
+    return poll(&pfd, 1, timeout) > 0;
+}
+
+// the multicast groups with channel switches, (dis)connections and interface changes
+static const char *const eventGroups[] = {"config", "mlme"};
+
+Nl80211Collector::Nl80211Collector() :
+        familyId(-1), socket(nullptr), cb(nullptr), eventSocket(nullptr), parsers(),
+        ifaces(), pending(), outstanding(0) {
+}
+
+Nl80211Collector::~Nl80211Collector() {
+    this->close();
+}
+
+void Nl80211Collector::close() {
+    if (this->cb) nl_cb_put(this->cb);
+    if (this->socket) nl_socket_free(this->socket);  // also closes it
+    if (this->eventSocket) nl_socket_free(this->eventSocket);
+
+    this->cb = nullptr;
+    this->socket = nullptr;
+    this->eventSocket = nullptr;
+}
+
+bool Nl80211Collector::init() {
+    this->close();
+
+    this->socket = nl_socket_alloc();
+    if (!this->socket) {
+        LOG_ERR("Failed to allocate netlink socket.");
+        return false;
+    }
+
+    if (genl_connect(this->socket)) {
+        LOG_ERR("Failed to connect to netlink socket.");
+        this->close();
+        return false;
+    }
+
+    this->familyId = genl_ctrl_resolve(this->socket, "nl80211");
+    if (this->familyId < 0) {
+        LOG_ERR("Nl80211 interface not found.");
+        this->close();
+        return false;
+    }
+
+    // the replies of a whole tick are queued in the socket until they're read
+    nl_socket_set_buffer_size(this->socket, NL80211_RX_BUFFER_LEN, 0);
+    nl_socket_disable_auto_ack(this->socket);
+    nl_socket_set_nonblocking(this->socket);
+
+    this->cb = nl_cb_alloc(NL_CB_DEFAULT);
+    if (!this->cb) {
+        LOG_ERR("Failed to allocate netlink callback.");
+        this->close();
+        return false;
+    }
+
+    // several requests are in flight, so the replies don't come in sequence order
+    nl_cb_set(this->cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, noSeqCheck, nullptr);
+    nl_cb_set(this->cb, NL_CB_VALID, NL_CB_CUSTOM, validHandler, this);
+    nl_cb_set(this->cb, NL_CB_FINISH, NL_CB_CUSTOM, finishHandler, this);
+    nl_cb_err(this->cb, NL_CB_CUSTOM, errorHandler, this);
+
+    // events are optional, without them the interface information is dumped every tick
+    this->eventSocket = nl_socket_alloc();
+    if (!this->eventSocket || genl_connect(this->eventSocket)) {
+        LOG_WARN("Can't open the nl80211 event socket, interface info will be polled");
+        if (this->eventSocket) nl_socket_free(this->eventSocket);
+        this->eventSocket = nullptr;
+        return true;
+    }
+
+    for (const char *group : eventGroups) {
+        int groupId = genl_ctrl_resolve_grp(this->socket, "nl80211", group);
+        if (groupId < 0 || nl_socket_add_membership(this->eventSocket, groupId)) {
+            std::stringstream ss;
+            ss << "Can't subscribe to the nl80211 " << group << " events, interface info will be polled";
+            LOG_WARN(ss.str().c_str());
+
+            nl_socket_free(this->eventSocket);
+            this->eventSocket = nullptr;
+            return true;
+        }
+    }
+
+    nl_socket_disable_seq_check(this->eventSocket);
+    nl_socket_modify_cb(this->eventSocket, NL_CB_VALID, NL_CB_CUSTOM, eventHandler, this);
+    nl_socket_set_nonblocking(this->eventSocket);
+
+    return true;
+}
+
+void Nl80211Collector::setParser(Nl80211Request request, Nl80211Parser parser) {
+    this->parsers[request] = parser;
+}
+
+void Nl80211Collector::addInterface(WifiInfo *wifi) {
+    this->ifaces.push_back(Iface{wifi, true, 0});
+    this->pending.reserve(this->ifaces.size() * NL80211_REQ_COUNT);
+}
+
+bool Nl80211Collector::send(size_t iface, Nl80211Request request) {
+    static const uint8_t commands[NL80211_REQ_COUNT] = {
+            NL80211_CMD_GET_STATION, NL80211_CMD_GET_SURVEY, NL80211_CMD_GET_INTERFACE};
+
+    if (!this->parsers[request]) return false;
+
+    struct nl_msg *msg = nlmsg_alloc();
+    if (!msg) {
+        LOG_ERR("Failed to allocate netlink message.");
+        return false;
+    }
+
+    genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, this->familyId, 0, NLM_F_DUMP, commands[request], 0);
+    nla_put_u32(msg, NL80211_ATTR_IFINDEX, this->ifaces[iface].wifi->ifindex);
+
+    bool ok = nl_send_auto(this->socket, msg) >= 0;
+    if (ok) {
+        // the sequence number is assigned when sending
+        this->pending.push_back(Pending{nlmsg_hdr(msg)->nlmsg_seq, iface, request, false});
+        ++this->outstanding;
+    }
+
+    nlmsg_free(msg);
+    return ok;
+}
+
+size_t Nl80211Collector::collect(int timeout) {
+    if (!this->socket) return 0;
+
+    uint64_t now = steadyMillis();
+    uint64_t deadline = now + (timeout > 0 ? timeout : 0);
+
+    this->drainEvents();
+
+    // replies to the previous tick that arrive now don't match any of these
+    this->pending.clear();
+    this->outstanding = 0;
+
+    for (size_t i = 0; i < this->ifaces.size(); i++) {
+        Iface &iface = this->ifaces[i];
+        if (iface.wifi->ifindex <= 0) continue;
+
+        this->send(i, NL80211_REQ_STATION);
+        this->send(i, NL80211_REQ_SURVEY);
+
+        if (!this->eventSocket || iface.dirty || now - iface.refreshedAt >= NL80211_IFACE_REFRESH_DEF) {
+            if (this->send(i, NL80211_REQ_INTERFACE)) {
+                iface.dirty = false;
+                iface.refreshedAt = now;
+            }
+        }
+    }
+
+    // a single wait for all of them
+    while (this->outstanding > 0) {
+        int err = nl_recvmsgs(this->socket, this->cb);
+        if (err < 0 && err != -NLE_AGAIN) {
+            std::stringstream ss;
+            ss << "nl80211 receive failed: " << nl_geterror(err);
+            LOG_ERR(ss.str().c_str());
+            break;
+        }
+        if (this->outstanding == 0) break;
+
+        now = steadyMillis();
+        if (now >= deadline || !waitReadable(this->socket, (int) (deadline - now))) break;
+    }
+
+    // an interface dump that didn't make it is retried on the next tick
+    for (const Pending &p : this->pending) {
+        if (!p.done && p.request == NL80211_REQ_INTERFACE) this->ifaces[p.iface].dirty = true;
+    }
+
+    return this->outstanding;
+}
+
+Nl80211Collector::Pending *Nl80211Collector::findPending(uint32_t seq) {
+    for (Pending &p : this->pending) {
+        if (p.seq == seq) return p.done ? nullptr : &p;
+    }
+    return nullptr;
+}
+
+void Nl80211Collector::drainEvents() {
+    if (!this->eventSocket) return;
+
+    while (waitReadable(this->eventSocket, 0)) {
+        int err = nl_recvmsgs_default(this->eventSocket);
+        if (err == -NLE_NOMEM) {
+            this->markDirty(-1);  // the socket overflowed, some events were lost
+        }
+        else if (err < 0 && err != -NLE_AGAIN) {
+            break;
+        }
+    }
+}
+
+void Nl80211Collector::markDirty(int ifindex) {
+    for (Iface &iface : this->ifaces) {
+        if (ifindex < 0 || iface.wifi->ifindex == ifindex) iface.dirty = true;
+    }
+}
+
+int Nl80211Collector::validHandler(struct nl_msg *msg, void *arg) {
+    Nl80211Collector *collector = (Nl80211Collector *) arg;
+
+    Pending *p = collector->findPending(nlmsg_hdr(msg)->nlmsg_seq);
+    if (!p) return NL_SKIP;
+
+    return collector->parsers[p->request](msg, collector->ifaces[p->iface].wifi);
+}
+
+int Nl80211Collector::finishHandler(struct nl_msg *msg, void *arg) {
+    Nl80211Collector *collector = (Nl80211Collector *) arg;
+
+    Pending *p = collector->findPending(nlmsg_hdr(msg)->nlmsg_seq);
+    if (p) {
+        p->done = true;
+        --collector->outstanding;
+    }
+
+    // keep going, the rest of the buffer may hold other replies
+    return NL_SKIP;
+}
+
+int Nl80211Collector::errorHandler(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg) {
+    Nl80211Collector *collector = (Nl80211Collector *) arg;
+
+    // e.g., the interface went down; the fields keep their last values
+    Pending *p = collector->findPending(err->msg.nlmsg_seq);
+    if (p) {
+        p->done = true;
+        --collector->outstanding;
+    }
+
+    return NL_SKIP;
+}
+
+int Nl80211Collector::eventHandler(struct nl_msg *msg, void *arg) {
+    Nl80211Collector *collector = (Nl80211Collector *) arg;
+
+    struct nlattr *tb[NL80211_ATTR_MAX + 1];
+    struct genlmsghdr *gnlh = (genlmsghdr *) nlmsg_data(nlmsg_hdr(msg));
+    nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0), genlmsg_attrlen(gnlh, 0), NULL);
+
+    // events of the whole wiphy don't carry an interface index
+    collector->markDirty(tb[NL80211_ATTR_IFINDEX] ? (int) nla_get_u32(tb[NL80211_ATTR_IFINDEX]) : -1);
+
+    return NL_SKIP;
+}
+
+int Nl80211Collector::noSeqCheck(struct nl_msg *msg, void *arg) {
+    return NL_OK;
+}
@@ -0,0 +1,113 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the nl80211 collector, which gathers the channel state of all the monitored
+ * interfaces with a single netlink socket.
+ *
+ * On every tick the station and survey dumps of every interface are sent back to back,
+ * and the replies are then read in one pass, routed to their interface by sequence
+ * number. The interface information (channel, width, tx power) rarely changes, so it
+ * is only dumped again when an nl80211 "config" or "mlme" multicast event is received
+ * for the interface, or every NL80211_IFACE_REFRESH_DEF ms as a fallback.
+ */
+
+#ifndef WIPERF_IMPL_NL80211COLLECTOR_HPP
+#define WIPERF_IMPL_NL80211COLLECTOR_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "ChannelMonitor.hpp"
+
+#define NL80211_IFACE_REFRESH_DEF 10000     // ms between interface dumps without events
+#define NL80211_RX_BUFFER_LEN (256 * 1024)  // the pipelined replies are read in one go
+
+struct nl_msg;
+struct nl_sock;
+struct nl_cb;
+struct sockaddr_nl;
+struct nlmsgerr;
+
+/**
+ * Parses one reply message into the WifiInfo given as argument.
+ */
+typedef int (*Nl80211Parser)(struct nl_msg *msg, void *arg);
+
+enum Nl80211Request {
+    NL80211_REQ_STATION = 0,
+    NL80211_REQ_SURVEY = 1,
+    NL80211_REQ_INTERFACE = 2,
+    NL80211_REQ_COUNT = 3
+};
+
+class Nl80211Collector {
+private:
+    struct Iface {
+        WifiInfo *wifi;
+        bool dirty;            // interface information must be dumped again
+        uint64_t refreshedAt;  // ms, last interface dump
+    };
+
+    struct Pending {
+        uint32_t seq;
+        size_t iface;
+        Nl80211Request request;
+        bool done;
+    };
+
+    int familyId;
+    struct nl_sock *socket;
+    struct nl_cb *cb;
+    struct nl_sock *eventSocket; // nullptr if the events can't be subscribed
+    Nl80211Parser parsers[NL80211_REQ_COUNT];
+
+    std::vector<Iface> ifaces;
+    std::vector<Pending> pending;
+    size_t outstanding;
+
+    void close();
+
+    bool send(size_t iface, Nl80211Request request);
+    Pending *findPending(uint32_t seq);
+    void drainEvents();
+    void markDirty(int ifindex);
+
+    static int validHandler(struct nl_msg *msg, void *arg);
+    static int finishHandler(struct nl_msg *msg, void *arg);
+    static int errorHandler(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg);
+    static int eventHandler(struct nl_msg *msg, void *arg);
+    static int noSeqCheck(struct nl_msg *msg, void *arg);
+
+public:
+    Nl80211Collector();
+    ~Nl80211Collector();
+
+    Nl80211Collector(const Nl80211Collector &) = delete;
+    Nl80211Collector &operator=(const Nl80211Collector &) = delete;
+
+    /**
+     * Opens the request socket, resolves nl80211 and subscribes to its multicast
+     * events. Without events, the interface information is dumped on every tick.
+     * @return false if nl80211 can't be reached
+     */
+    bool init();
+
+    void setParser(Nl80211Request request, Nl80211Parser parser);
+
+    /**
+     * Adds an interface to be collected. The WifiInfo must outlive the collector,
+     * and keeps the last values of the fields that weren't refreshed.
+     */
+    void addInterface(WifiInfo *wifi);
+
+    /**
+     * Sends the requests of every interface and waits for all the replies.
+     * @param timeout ms to wait for the replies, the late ones are ignored
+     * @return number of requests left unanswered (0 if all of them completed)
+     */
+    size_t collect(int timeout);
+};
+
+#endif //WIPERF_IMPL_NL80211COLLECTOR_HPP
@@ -0,0 +1,147 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "ParallelSampler.hpp"
+
+#include <chrono>
+#include <sstream>
+#include <net/if.h>
+
+#include "../../util/logfile.hpp"
+
+ParallelSampler::ParallelSampler() :
+        radios(), mutex(), tickCond(), doneCond(), tick(0), timeout(0), stopping(false),
+        threadPolicy(nullptr) {
+}
+
+ParallelSampler::~ParallelSampler() {
+    this->stop();
+}
+
+bool ParallelSampler::start(const std::vector<std::string> &ifnames,
+                            const Nl80211Parser parsers[NL80211_REQ_COUNT],
+                            const ThreadPolicy *threadPolicy) {
+    this->stop();
+    this->radios.clear();
+    this->threadPolicy = threadPolicy;
+
+    for (const std::string &ifname : ifnames) {
+        std::unique_ptr<Radio> radio(new Radio{});
+
+        radio->wifi.ifname = ifname;
+        radio->wifi.ifindex = if_nametoindex(ifname.c_str());
+        if (radio->wifi.ifindex == 0) {
+            std::stringstream ss;
+            ss << "Interface " << ifname << " not found, it won't be sampled";
+            LOG_WARN(ss.str().c_str());
+        }
+
+        // a socket per radio, so a slow driver only holds its own replies
+        if (!radio->collector.init()) {
+            this->radios.clear();
+            return false;
+        }
+        for (int r = 0; r < NL80211_REQ_COUNT; r++) {
+            radio->collector.setParser((Nl80211Request) r, parsers[r]);
+        }
+        radio->collector.addInterface(&radio->wifi);
+
+        radio->latency = &Metrics::getInstance()->histogram("wiperf_nl80211_sample_latency_us",
+                                                             "Time to collect the nl80211 sample of a radio, in us",
+                                                             Metrics::label("iface", ifname), 128, 16);
+        radio->unanswered = &Metrics::getInstance()->counter("wiperf_nl80211_unanswered_total",
+                                                             "nl80211 requests unanswered by the sample deadline",
+                                                             Metrics::label("iface", ifname));
+
+        this->radios.push_back(std::move(radio));
+    }
+
+    this->stopping = false;
+    for (auto &radio : this->radios) {
+        radio->thread = std::thread(&ParallelSampler::samplerLoop, this, radio.get());
+    }
+
+    return true;
+}
+
+void ParallelSampler::stop() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->tickCond.notify_all();
+
+    for (auto &radio : this->radios) {
+        if (radio->thread.joinable()) radio->thread.join();
+    }
+}
+
+void ParallelSampler::samplerLoop(Radio *radio) {
+    if (this->threadPolicy) this->threadPolicy->apply("sample", {radio->wifi.ifname});
+
+    uint64_t seen = 0;
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true) {
+        this->tickCond.wait(lock, [this, seen] { return this->stopping || this->tick != seen; });
+        if (this->stopping) break;
+
+        // a sampler that overran its tick goes straight to the latest one
+        seen = this->tick;
+        int timeout = this->timeout;
+        lock.unlock();
+
+        const auto start = std::chrono::steady_clock::now();
+        size_t unanswered = radio->collector.collect(timeout);
+        radio->latency->observe(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count());
+
+        if (unanswered > 0) {
+            radio->unanswered->add(unanswered);
+
+            std::stringstream ss;
+            ss << radio->wifi.ifname << ": " << unanswered << " nl80211 requests unanswered within "
+               << timeout << " ms";
+            LOG_WARN(ss.str().c_str());
+        }
+
+        lock.lock();
+        radio->sample = radio->wifi;
+        radio->sampledTick = seen;
+        this->doneCond.notify_one();
+    }
+}
+
+size_t ParallelSampler::sample(int timeout, std::vector<WifiInfo> &samples) {
+    // the collectors give up a bit earlier, so their partial replies still make the tick
+    int collectTimeout = timeout - timeout / 4;
+    if (collectTimeout < 1) collectTimeout = 1;
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    ++this->tick;
+    this->timeout = collectTimeout;
+    this->tickCond.notify_all();
+
+    this->doneCond.wait_until(lock, deadline, [this] {
+        for (auto &radio : this->radios) {
+            if (radio->sampledTick != this->tick) return false;
+        }
+        return true;
+    });
+
+    samples.clear();
+    size_t late = 0;
+    for (auto &radio : this->radios) {
+        if (radio->sampledTick == this->tick) samples.push_back(radio->sample);
+        else ++late;
+    }
+
+    return late;
+}
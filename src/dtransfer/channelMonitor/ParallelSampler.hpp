@@ -0,0 +1,81 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the parallel sampler, which samples every radio from its own thread.
+ *
+ * Each radio has a sampler thread with its own nl80211 collector. On every tick the
+ * samplers are released together and the caller waits for them up to a deadline, so
+ * the tick takes as long as the slowest radio instead of the sum of all of them, and
+ * a radio whose driver stalls only misses its own samples. All the samples of a tick
+ * get the same grid timestamp from the caller.
+ */
+
+#ifndef WIPERF_IMPL_PARALLELSAMPLER_HPP
+#define WIPERF_IMPL_PARALLELSAMPLER_HPP
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../util/metrics.hpp"
+#include "../../util/threadpolicy.hpp"
+#include "ChannelMonitor.hpp"
+#include "Nl80211Collector.hpp"
+
+class ParallelSampler {
+private:
+    struct Radio {
+        WifiInfo wifi;        // only touched by the sampler thread
+        WifiInfo sample;      // last published sample
+        uint64_t sampledTick; // tick of the published sample
+        Nl80211Collector collector;
+        std::thread thread;
+        MetricHistogram *latency;  // us to collect a sample
+        MetricCounter *unanswered; // nl80211 requests without a reply by the deadline
+    };
+
+    std::vector<std::unique_ptr<Radio>> radios;
+
+    std::mutex mutex;
+    std::condition_variable tickCond; // a new tick was released
+    std::condition_variable doneCond; // a radio published its sample
+    uint64_t tick;
+    int timeout;                      // ms, collection deadline of the current tick
+    bool stopping;
+    const ThreadPolicy *threadPolicy; // for the sampler threads, may be null
+
+    void samplerLoop(Radio *radio);
+
+public:
+    ParallelSampler();
+    ~ParallelSampler();
+
+    /**
+     * Opens the collectors and starts one sampler thread per interface.
+     * @param parsers      reply parsers, indexed by Nl80211Request
+     * @param threadPolicy applied to the sampler threads (role sample), outliving the sampler
+     * @return false if nl80211 can't be reached
+     */
+    bool start(const std::vector<std::string> &ifnames, const Nl80211Parser parsers[NL80211_REQ_COUNT],
+               const ThreadPolicy *threadPolicy = nullptr);
+
+    /**
+     * Stops and joins the sampler threads.
+     */
+    void stop();
+
+    /**
+     * Releases all the samplers for a new tick and waits for their samples.
+     * @param timeout ms to wait; the radios that don't make it are left out of this tick
+     * @param samples the samples of this tick, in the order of the interfaces
+     * @return number of radios left out
+     */
+    size_t sample(int timeout, std::vector<WifiInfo> &samples);
+};
+
+#endif //WIPERF_IMPL_PARALLELSAMPLER_HPP
@@ -0,0 +1,80 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "WifiInfoCodec.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+template <typename T>
+static inline uint8_t *putLE(uint8_t *pos, T value) {
+    typedef typename std::make_unsigned<T>::type U;
+    U bits = (U) value;
+    for (size_t i = 0; i < sizeof(T); i++) {
+        pos[i] = (uint8_t) (bits >> (8 * i));
+    }
+    return pos + sizeof(T);
+}
+
+template <typename T>
+static inline const uint8_t *getLE(const uint8_t *pos, T &value) {
+    typedef typename std::make_unsigned<T>::type U;
+    U bits = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+        bits |= (U) ((U) pos[i] << (8 * i));
+    }
+    value = (T) bits;
+    return pos + sizeof(T);
+}
+
+size_t WifiInfoCodec::encode(const WifiInfo &wifiInfo, uint8_t *buf, size_t len) {
+    if (len < WIFI_INFO_BIN_LEN) return 0;
+
+    uint8_t *pos = buf;
+    pos = putLE<uint8_t>(pos, WIFI_INFO_CODEC_VERSION);
+    pos = putLE<uint8_t>(pos, 0);
+    pos = putLE<uint16_t>(pos, WIFI_INFO_BIN_LEN - WIFI_INFO_HEADER_LEN);
+
+    std::memset(pos, 0, WIFI_INFO_IFNAME_LEN);
+    std::memcpy(pos, wifiInfo.ifname.data(), std::min(wifiInfo.ifname.size(), (size_t) WIFI_INFO_IFNAME_LEN));
+    pos += WIFI_INFO_IFNAME_LEN;
+
+#define WIFI_INFO_PUT(type, name) pos = putLE<type>(pos, (type) wifiInfo.name);
+    WIFI_INFO_FIELDS(WIFI_INFO_PUT)
+#undef WIFI_INFO_PUT
+
+    return pos - buf;
+}
+
+bool WifiInfoCodec::decode(const uint8_t *buf, size_t len, WifiInfo &wifiInfo) {
+    if (len < WIFI_INFO_HEADER_LEN + WIFI_INFO_IFNAME_LEN) return false;
+
+    uint8_t version, flags;
+    uint16_t length;
+    const uint8_t *pos = buf;
+    pos = getLE(pos, version);
+    pos = getLE(pos, flags);
+    pos = getLE(pos, length);
+
+    if (version == 0 || version > WIFI_INFO_CODEC_VERSION) return false;
+    if (length < WIFI_INFO_IFNAME_LEN || (size_t) length + WIFI_INFO_HEADER_LEN > len) return false;
+
+    const uint8_t *end = pos + length;
+    wifiInfo = WifiInfo{};
+
+    wifiInfo.ifname.assign((const char *) pos, strnlen((const char *) pos, WIFI_INFO_IFNAME_LEN));
+    pos += WIFI_INFO_IFNAME_LEN;
+
+    // fields past the end of an older record are left at zero
+#define WIFI_INFO_GET(type, name) \
+    if (pos + sizeof(type) <= end) { type value; pos = getLE(pos, value); wifiInfo.name = value; }
+    WIFI_INFO_FIELDS(WIFI_INFO_GET)
+#undef WIFI_INFO_GET
+
+    return true;
+}
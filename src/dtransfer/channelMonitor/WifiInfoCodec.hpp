@@ -0,0 +1,150 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the binary encoding of WifiInfo, stored in the channel_info_bin column.
+ *
+ * Layout (little endian):
+ *   uint8_t  version     WIFI_INFO_CODEC_VERSION
+ *   uint8_t  flags       0
+ *   uint16_t length      bytes after this header
+ *   char     ifname[16]  zero padded
+ *   fields of WIFI_INFO_FIELDS, in order, each with its listed width
+ *
+ * New fields are only ever appended to WIFI_INFO_FIELDS (with a new version), so
+ * older records decode with the missing fields set to zero.
+ */
+
+#ifndef WIPERF_IMPL_WIFIINFOCODEC_HPP
+#define WIPERF_IMPL_WIFIINFOCODEC_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "ChannelMonitor.hpp"
+
+#define WIFI_INFO_CODEC_VERSION 1
+#define WIFI_INFO_HEADER_LEN 4
+#define WIFI_INFO_IFNAME_LEN 16
+
+// X(wire type, WifiInfo field)
+#define WIFI_INFO_FIELDS(X) \
+    X(int32_t, ifindex) \
+    X(uint32_t, inactive_time) \
+    X(uint32_t, rx_bytes) \
+    X(uint32_t, tx_bytes) \
+    X(uint64_t, rx_bytes_64) \
+    X(uint64_t, tx_bytes_64) \
+    X(uint8_t, signal) \
+    X(uint32_t, rx_packets) \
+    X(uint32_t, tx_packets) \
+    X(uint32_t, tx_retries) \
+    X(uint32_t, tx_failed) \
+    X(uint8_t, signal_avg) \
+    X(uint16_t, llid) \
+    X(uint16_t, plid) \
+    X(uint8_t, plink_state) \
+    X(uint32_t, connected_time) \
+    X(uint32_t, beacon_loss) \
+    X(int64_t, t_offset) \
+    X(uint32_t, local_pm) \
+    X(uint32_t, peer_pm) \
+    X(uint32_t, non_peer_pm) \
+    X(uint8_t, chain_signal) \
+    X(uint8_t, chain_signal_avg) \
+    X(uint32_t, expected_throughput) \
+    X(uint64_t, rx_drop_misc) \
+    X(uint64_t, beacon_rx) \
+    X(uint8_t, beacon_signal_avg) \
+    X(uint64_t, rx_duration) \
+    X(uint64_t, sta_pad) \
+    X(uint8_t, ack_signal) \
+    X(int8_t, ack_signal_avg) \
+    X(uint32_t, rx_mpdus) \
+    X(uint32_t, fcs_error_count) \
+    X(uint8_t, connected_to_gate) \
+    X(uint64_t, tx_duration) \
+    X(uint16_t, airtime_weight) \
+    X(uint32_t, airtime_link_metric) \
+    X(uint32_t, assoc_at_boottime) \
+    X(uint16_t, tx_bitrate) \
+    X(uint32_t, tx_bitrate32) \
+    X(uint8_t, msc) \
+    X(int32_t, short_gi) \
+    X(int32_t, f5_mhz_width) \
+    X(int32_t, f10_mhz_width) \
+    X(int32_t, f40_mhz_width) \
+    X(int32_t, f80_mhz_width) \
+    X(int32_t, f80p80_mhz_width) \
+    X(int32_t, f160_mhz_width) \
+    X(uint8_t, vht_mcs) \
+    X(uint8_t, vht_nss) \
+    X(uint8_t, he_mcs) \
+    X(uint8_t, he_nss) \
+    X(uint8_t, he_gi) \
+    X(uint8_t, he_dcm) \
+    X(uint8_t, he_ru_alloc) \
+    X(uint64_t, tid_rx_msdu) \
+    X(uint64_t, tid_tx_msdu) \
+    X(uint64_t, tid_tx_msdu_retries) \
+    X(uint64_t, tid_tx_msdu_failed) \
+    X(int32_t, tid_pad) \
+    X(uint64_t, txq_backlog_bytes) \
+    X(uint64_t, txq_backlog_packets) \
+    X(uint64_t, txq_flows) \
+    X(uint64_t, txq_drops) \
+    X(uint64_t, txq_ecn_marks) \
+    X(uint64_t, txq_overlimit) \
+    X(uint64_t, txq_overmemory) \
+    X(uint64_t, txq_collisions) \
+    X(uint64_t, txq_tx_bytes) \
+    X(uint64_t, txq_tx_packets) \
+    X(int32_t, cts_protection) \
+    X(int32_t, short_preamble) \
+    X(int32_t, short_slot_time) \
+    X(uint8_t, dtim_period) \
+    X(uint16_t, beacon_interval) \
+    X(uint64_t, surv_frequency) \
+    X(uint8_t, surv_noise) \
+    X(uint64_t, surv_in_use) \
+    X(uint64_t, surv_time) \
+    X(uint64_t, surv_time_busy) \
+    X(uint64_t, surv_time_ext_busy) \
+    X(uint64_t, surv_time_rx) \
+    X(uint64_t, surv_time_tx) \
+    X(uint64_t, surv_time_scan) \
+    X(uint64_t, surv_time_bss_rx) \
+    X(uint32_t, iface_wiphy) \
+    X(uint32_t, iface_frequency) \
+    X(uint32_t, iface_channel) \
+    X(uint32_t, iface_channel_width) \
+    X(uint32_t, iface_center_freq1) \
+    X(uint32_t, iface_center_freq2) \
+    X(uint32_t, iface_channel_type) \
+    X(uint32_t, iface_tx_power)
+
+#define WIFI_INFO_FIELD_LEN(type, name) + sizeof(type)
+
+// size of an encoded WifiInfo of the current version
+#define WIFI_INFO_BIN_LEN (WIFI_INFO_HEADER_LEN + WIFI_INFO_IFNAME_LEN WIFI_INFO_FIELDS(WIFI_INFO_FIELD_LEN))
+
+class WifiInfoCodec {
+public:
+    /**
+     * Encodes a WifiInfo. Doesn't allocate.
+     * @param buf destination, with at least WIFI_INFO_BIN_LEN bytes
+     * @param len size of buf
+     * @return number of bytes written, or 0 if buf is too small
+     */
+    static size_t encode(const WifiInfo &wifiInfo, uint8_t *buf, size_t len);
+
+    /**
+     * Decodes a WifiInfo of this or an older version. Fields the record doesn't have
+     * are set to zero. Doesn't allocate (interface names fit std::string's inline buffer).
+     * @return false if the record is malformed or of a newer version
+     */
+    static bool decode(const uint8_t *buf, size_t len, WifiInfo &wifiInfo);
+};
+
+#endif //WIPERF_IMPL_WIFIINFOCODEC_HPP
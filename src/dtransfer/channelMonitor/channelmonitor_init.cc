@@ -12,6 +12,9 @@
 
 #include "../../util/logfile.hpp"
 #include "../../util/configfile.hpp"
+#include "../../util/configreloader.hpp"
+#include "../../util/metrics.hpp"
+#include "../WiperfUtility.hpp"
 #include "ChannelMonitor.hpp"
 
 #define CONFIG_FNAME "/etc/wiperf.conf"
@@ -37,12 +40,21 @@ int main(int argc, char* argv[]) {
     
     ChannelMonitor channelMonitor(CONFIG_FNAME);
 
+    ConfigFile cfile(CONFIG_FNAME);
+    MetricsExporter metricsExporter;
+    metricsExporter.start(WiperfUtility::readMetricsEndpoint(cfile, "channel-monitor"));
+
     //To handle signals
     array[0] = &channelMonitor;
 
     signal(SIGINT, sigHandler);
     signal(SIGTERM, sigHandler);
-    signal(SIGHUP, sigHandler);
+
+    //SIGHUP reloads the configuration
+    ConfigReloader *reloader = ConfigReloader::getInstance();
+    reloader->addListener([&channelMonitor](ConfigFile &cfile) { channelMonitor.reloadConfig(cfile); });
+    reloader->start(CONFIG_FNAME);
+    signal(SIGHUP, ConfigReloader::signalHandler);
 
     std::cout << "[INFO] Set up the resources" << std::endl;
     
@@ -52,6 +64,9 @@ int main(int argc, char* argv[]) {
 
     channelMonitorThread.join();
 
+    reloader->stop();
+    metricsExporter.stop();
+
     std::cout << "[INFO] Threads finish running" << std::endl;
 
     LOG_CLOSE()
@@ -0,0 +1,207 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "ConnectionPool.hpp"
+
+#include <sstream>
+#include <utility>
+
+#include "../../util/logfile.hpp"
+
+std::mutex ConnectionPool::registryMutex;
+std::map<std::string, std::weak_ptr<ConnectionPool>> ConnectionPool::registry;
+
+// ------------- CONNECTION -------------
+
+ConnectionPool::Connection::Connection(PGconn *conn) : conn(conn), prepared(), setup() {}
+
+ConnectionPool::Connection::~Connection() {
+    PQfinish(this->conn);
+}
+
+PGconn *ConnectionPool::Connection::get() {
+    return this->conn;
+}
+
+bool ConnectionPool::Connection::isOk() const {
+    return PQstatus(this->conn) == CONNECTION_OK;
+}
+
+bool ConnectionPool::Connection::reset() {
+    // the server side of the connection is gone, and so are the prepared statements
+    // and the temporary tables
+    this->prepared.clear();
+    this->setup.clear();
+    PQreset(this->conn);
+
+    if (!this->isOk()) {
+        std::stringstream ss;
+        ss << "Connection to database failed: " << PQerrorMessage(this->conn);
+        LOG_ERR(ss.str().c_str());
+        return false;
+    }
+
+    LOG_MSG("Reconnected to the database");
+    return true;
+}
+
+bool ConnectionPool::Connection::prepare(const PreparedStatement &statement) {
+    if (this->prepared.count(statement.name)) return true;
+
+    PGresult *res = PQprepare(this->conn, statement.name, statement.sql, statement.nParams, nullptr);
+    if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
+        std::stringstream ss;
+        ss << "PQprepare " << statement.name << " failed: " << PQresultErrorMessage(res);
+        LOG_ERR(ss.str().c_str());
+
+        PQclear(res);
+        return false;
+    }
+
+    PQclear(res);
+    this->prepared.insert(statement.name);
+    return true;
+}
+
+bool ConnectionPool::Connection::setupOnce(const char *name, const char *sql) {
+    if (this->setup.count(name)) return true;
+
+    PGresult *res = PQexec(this->conn, sql);
+    if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
+        std::stringstream ss;
+        ss << "Session setup " << name << " failed: " << PQresultErrorMessage(res);
+        LOG_ERR(ss.str().c_str());
+
+        PQclear(res);
+        return false;
+    }
+
+    PQclear(res);
+    this->setup.insert(name);
+    return true;
+}
+
+PGresult *ConnectionPool::Connection::execPrepared(const PreparedStatement &statement,
+                                                   const char *const *paramValues) {
+    return this->execPrepared(statement, paramValues, nullptr, nullptr);
+}
+
+PGresult *ConnectionPool::Connection::execPrepared(const PreparedStatement &statement,
+                                                   const char *const *paramValues,
+                                                   const int *paramLengths, const int *paramFormats) {
+    if (!this->prepare(statement)) return nullptr;
+
+    /*
+     * ParamValues -> array with the values for the parameters
+     * ParamLengths -> length of binay-format values (ignored for text values)
+     * ParamFormat -> specify if the params are text (0) or binary (1) (if null, all are text)
+     */
+    return PQexecPrepared(this->conn, statement.name, statement.nParams, paramValues,
+                          paramLengths, paramFormats, 0 /*text results*/);
+}
+
+// ------------- LEASE -------------
+
+ConnectionPool::Lease::Lease(ConnectionPool *pool, Connection *conn) : pool(pool), conn(conn) {}
+
+ConnectionPool::Lease::Lease(Lease &&other) noexcept : pool(other.pool), conn(other.conn) {
+    other.conn = nullptr;
+}
+
+ConnectionPool::Lease::~Lease() {
+    if (this->conn) this->pool->checkin(this->conn);
+}
+
+ConnectionPool::Connection *ConnectionPool::Lease::operator->() {
+    return this->conn;
+}
+
+ConnectionPool::Connection &ConnectionPool::Lease::operator*() {
+    return *this->conn;
+}
+
+ConnectionPool::Lease::operator bool() const {
+    return this->conn != nullptr;
+}
+
+// ------------- POOL -------------
+
+std::shared_ptr<ConnectionPool> ConnectionPool::get(const std::string &connString, int size) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+
+    std::shared_ptr<ConnectionPool> pool = registry[connString].lock();
+    if (!pool) {
+        pool = std::shared_ptr<ConnectionPool>(new ConnectionPool(connString, size));
+        registry[connString] = pool;
+    }
+
+    return pool;
+}
+
+ConnectionPool::ConnectionPool(std::string connString, int size) :
+        connString(std::move(connString)), size(size < 1 ? 1 : size), nopening(0) {}
+
+ConnectionPool::~ConnectionPool() {
+    // every lease holds a pointer to the pool, so by now all connections are idle
+    this->idle.clear();
+    this->connections.clear();
+}
+
+ConnectionPool::Lease ConnectionPool::checkout() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    // wait for an idle connection, unless we can still open a new one
+    this->freeCond.wait(lock, [this] {
+        return !this->idle.empty() || this->connections.size() + this->nopening < this->size;
+    });
+
+    Connection *conn = nullptr;
+    if (!this->idle.empty()) {
+        conn = this->idle.back();
+        this->idle.pop_back();
+        lock.unlock();
+
+        if (!conn->isOk() && !conn->reset()) {
+            this->checkin(conn);  // we'll try to reset it again next time
+            return Lease(this, nullptr);
+        }
+
+        return Lease(this, conn);
+    }
+
+    // open a new connection, without blocking the other threads during the handshake
+    ++this->nopening;
+    lock.unlock();
+
+    PGconn *pgconn = PQconnectdb(this->connString.c_str());
+
+    lock.lock();
+    --this->nopening;
+    this->connections.emplace_back(new Connection(pgconn));
+    conn = this->connections.back().get();
+    lock.unlock();
+
+    if (!conn->isOk()) {
+        std::stringstream ss;
+        ss << "Connection to database failed: " << PQerrorMessage(pgconn);
+        LOG_ERR(ss.str().c_str());
+
+        this->checkin(conn);  // kept, to be reset on a later checkout
+        return Lease(this, nullptr);
+    }
+
+    return Lease(this, conn);
+}
+
+void ConnectionPool::checkin(Connection *conn) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->idle.push_back(conn);
+    }
+
+    this->freeCond.notify_one();
+}
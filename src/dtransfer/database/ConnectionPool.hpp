@@ -0,0 +1,150 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines a small pool of long-lived PostgreSQL connections. Connections are opened on
+ * demand, keep their prepared statements for their whole life, and are reset (and the
+ * statements prepared again) when the server goes away.
+ */
+
+#ifndef WIPERF_IMPL_CONNECTIONPOOL_HPP
+#define WIPERF_IMPL_CONNECTIONPOOL_HPP
+
+#include <libpq-fe.h>
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+/**
+ * SQL statement that is prepared once per connection.
+ */
+struct PreparedStatement {
+    const char *name;
+    const char *sql;
+    int nParams;
+};
+
+class ConnectionPool {
+public:
+    /**
+     * A pooled connection. Only the thread holding its Lease may use it.
+     */
+    class Connection {
+    private:
+        friend class ConnectionPool;
+
+        PGconn *conn;
+        std::set<std::string> prepared; // names of the statements prepared on conn
+        std::set<std::string> setup;    // names of the session setup commands run on conn
+
+        explicit Connection(PGconn *conn);
+
+    public:
+        ~Connection();
+
+        PGconn *get();
+
+        /**
+         * @return true if the connection to the server is up
+         */
+        bool isOk() const;
+
+        /**
+         * Re-establishes the connection to the server. Prepared statements and
+     * session setup are lost.
+         * @return true if the connection is up again
+         */
+        bool reset();
+
+        /**
+         * Prepares the statement, unless it was already prepared on this connection.
+         * @return true if the statement is ready to be executed
+         */
+        bool prepare(const PreparedStatement &statement);
+
+        /**
+         * Runs a session setup command (e.g., creating a temporary table), unless it
+         * already ran on this connection. Must not be called inside a transaction,
+         * as a rollback would undo the command.
+         * @return true if the command ran (now or before)
+         */
+        bool setupOnce(const char *name, const char *sql);
+
+        /**
+         * Executes a prepared statement (preparing it first if needed), with text
+         * parameters and text results.
+         * @return result, to be freed with PQclear(), or nullptr
+         */
+        PGresult *execPrepared(const PreparedStatement &statement, const char *const *paramValues);
+
+        /**
+         * Same as above, but with the given parameter lengths and formats (0 text, 1 binary),
+         * as in PQexecPrepared().
+         */
+        PGresult *execPrepared(const PreparedStatement &statement, const char *const *paramValues,
+                               const int *paramLengths, const int *paramFormats);
+    };
+
+    /**
+     * RAII checkout of a connection: the connection goes back to the pool when the
+     * lease is destroyed. An empty lease means no connection could be established.
+     */
+    class Lease {
+    private:
+        ConnectionPool *pool;
+        Connection *conn;
+
+    public:
+        Lease(ConnectionPool *pool, Connection *conn);
+        Lease(Lease &&other) noexcept;
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+        ~Lease();
+
+        Connection *operator->();
+        Connection &operator*();
+        explicit operator bool() const;
+    };
+
+    /**
+     * Gets the pool of the given database, creating it if needed. Every DatabaseManager
+     * pointing to the same database shares the same pool.
+     * @param connString libpq connection string
+     * @param size       max number of connections (only used when the pool is created)
+     * @return the pool
+     */
+    static std::shared_ptr<ConnectionPool> get(const std::string &connString, int size);
+
+    ~ConnectionPool();
+
+    /**
+     * Checks out a connection, waiting for one to be free if all of them are in use.
+     * Broken connections are reset before being handed out.
+     * @return lease of the connection (empty if the database can't be reached)
+     */
+    Lease checkout();
+
+private:
+    std::string connString;
+    size_t size;
+
+    std::mutex mutex;
+    std::condition_variable freeCond;
+    std::vector<std::unique_ptr<Connection>> connections; // every open connection
+    std::vector<Connection *> idle;                       // connections not checked out
+    size_t nopening; // connections being opened (outside the lock)
+
+    ConnectionPool(std::string connString, int size);
+    void checkin(Connection *conn);
+
+    static std::mutex registryMutex;
+    static std::map<std::string, std::weak_ptr<ConnectionPool>> registry;
+};
+
+#endif //WIPERF_IMPL_CONNECTIONPOOL_HPP
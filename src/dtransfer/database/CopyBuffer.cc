@@ -0,0 +1,106 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "CopyBuffer.hpp"
+
+#include <cstring>
+
+// "PGCOPY\n\377\r\n\0", followed by the flags and the header extension length
+static const char COPY_SIGNATURE[] = {'P', 'G', 'C', 'O', 'P', 'Y', '\n', '\377', '\r', '\n', '\0'};
+
+CopyBuffer::CopyBuffer() : buf(), nrows(0) {
+    this->clear();
+}
+
+void CopyBuffer::clear() {
+    this->buf.clear();
+    this->nrows = 0;
+
+    this->putRaw(COPY_SIGNATURE, sizeof(COPY_SIGNATURE));
+    this->putBE(0, 4); // flags
+    this->putBE(0, 4); // header extension length
+}
+
+void CopyBuffer::putRaw(const void *value, size_t len) {
+    const char *bytes = static_cast<const char *>(value);
+    this->buf.insert(this->buf.end(), bytes, bytes + len);
+}
+
+void CopyBuffer::putBE(uint64_t value, size_t len) {
+    for (size_t i = len; i > 0; i--) {
+        this->buf.push_back((char) ((value >> (8 * (i - 1))) & 0xff));
+    }
+}
+
+void CopyBuffer::beginRow(int16_t nfields) {
+    this->putBE((uint16_t) nfields, 2);
+    ++this->nrows;
+}
+
+void CopyBuffer::addInt2(int16_t value) {
+    this->putBE(2, 4);
+    this->putBE((uint16_t) value, 2);
+}
+
+void CopyBuffer::addInt4(int32_t value) {
+    this->putBE(4, 4);
+    this->putBE((uint32_t) value, 4);
+}
+
+void CopyBuffer::addInt8(int64_t value) {
+    this->putBE(8, 4);
+    this->putBE((uint64_t) value, 8);
+}
+
+void CopyBuffer::addFloat8(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+
+    this->putBE(8, 4);
+    this->putBE(bits, 8);
+}
+
+void CopyBuffer::addText(const std::string &value) {
+    this->addBytes(value.data(), value.size());
+}
+
+void CopyBuffer::addBytes(const void *value, size_t len) {
+    this->putBE((uint32_t) len, 4);
+    this->putRaw(value, len);
+}
+
+void CopyBuffer::addInt4Array(const int32_t *values, size_t n) {
+    this->putBE((uint32_t) (20 + 8 * n), 4);
+    this->putBE(1, 4);  // dimensions
+    this->putBE(0, 4);  // no NULLs
+    this->putBE(23, 4); // int4 type oid
+    this->putBE((uint32_t) n, 4);
+    this->putBE(1, 4);  // lower bound
+    for (size_t i = 0; i < n; i++) {
+        this->addInt4(values[i]);
+    }
+}
+
+void CopyBuffer::addNull() {
+    this->putBE((uint32_t) -1, 4);
+}
+
+void CopyBuffer::finish() {
+    this->putBE((uint16_t) -1, 2);
+}
+
+const char *CopyBuffer::data() const {
+    return this->buf.data();
+}
+
+size_t CopyBuffer::size() const {
+    return this->buf.size();
+}
+
+size_t CopyBuffer::rows() const {
+    return this->nrows;
+}
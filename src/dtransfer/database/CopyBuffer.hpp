@@ -0,0 +1,54 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines a buffer that encodes rows in the PostgreSQL binary COPY format, to be
+ * streamed with COPY ... FROM STDIN (FORMAT binary). Values are written in network
+ * byte order, and each row must add exactly the fields announced in beginRow().
+ */
+
+#ifndef WIPERF_IMPL_COPYBUFFER_HPP
+#define WIPERF_IMPL_COPYBUFFER_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class CopyBuffer {
+private:
+    std::vector<char> buf;
+    size_t nrows;
+
+    void putRaw(const void *value, size_t len);
+    void putBE(uint64_t value, size_t len);
+
+public:
+    CopyBuffer();
+
+    /**
+     * Discards every row and writes the file header again.
+     */
+    void clear();
+
+    void beginRow(int16_t nfields);
+    void addInt2(int16_t value);
+    void addInt4(int32_t value);
+    void addInt8(int64_t value);
+    void addFloat8(double value);
+    void addText(const std::string &value);
+    void addBytes(const void *value, size_t len);
+    void addInt4Array(const int32_t *values, size_t n); // one dimension, no NULLs
+    void addNull();
+
+    /**
+     * Writes the file trailer. No rows can be added afterwards.
+     */
+    void finish();
+
+    const char *data() const;
+    size_t size() const;
+    size_t rows() const;
+};
+
+#endif //WIPERF_IMPL_COPYBUFFER_HPP
@@ -11,6 +11,8 @@
 
 #include <string>
 
+#include "../ProbeCodec.hpp" // ProbeSummary
+
 struct DatabaseInfo {
     double latitude;
     double longitude;
@@ -20,7 +22,9 @@ struct DatabaseInfo {
 
     uint32_t throughput;
     uint32_t numBits;
-    std::string channelInfo;
+    bool feedback = false;      // throughput and numBits come from the feedback, even when 0
+    std::string channelInfo;    // CSV, only filled for compatibility (see ChannelMonitor::codeWifiInfo)
+    std::string channelInfoBin; // binary WifiInfo (see WifiInfoCodec), stored as bytea
     std::string scanInfo;
     std::string rat;
 
@@ -29,6 +33,34 @@ struct DatabaseInfo {
     // from channel info, to calculate statistics
     uint32_t tx_bitrate;
     int32_t signal_strength;
+
+    // from the probe headers, only filled by the feedback (see ProbeStats)
+    ProbeSummary probes;
+};
+
+/**
+ * History statistics of a RAT, aggregated by the database.
+ */
+struct RatStats {
+    std::string rat;
+    uint64_t nsamples;    // history entries
+    uint64_t nthroughput; // entries with throughput feedback
+
+    double meanThroughput;
+    double p50Throughput;
+    double p90Throughput;
+
+    // from channel info
+    double meanSignalStrength;
+    double meanTxBitrate;
+};
+
+/**
+ * RAT statistics of a grid cell.
+ */
+struct CellStats {
+    int64_t cellId;
+    RatStats stats;
 };
 
 #endif //WIPERF_IMPL_DATABASEINFO_HPP
@@ -9,455 +9,927 @@
 
 #include "DatabaseManager.hpp"
 #include "DatabaseInfo.hpp"
+#include "CopyBuffer.hpp"
 
+#include <algorithm>
+#include <cmath>
 #include <utility>
 #include "../../util/logfile.hpp"
 
-DatabaseManager::DatabaseManager() : dbName(), host(), dbUser(), password() {}
-
-DatabaseManager::DatabaseManager(
-        std::string dbName, std::string host, std::string dbUser, std::string password) :
-        dbName(std::move(dbName)), host(std::move(host)), dbUser(std::move(dbUser)), password(std::move(password)) {
+// ------------- STATEMENTS -------------
+// Prepared once per pooled connection, so each one needs a distinct name
+
+// This adds another entry to Location
+// Since location has UNIQUE(lat, lon), there won't be two equal locations
+// $1 -> latitude
+// $2 -> longitude
+static const PreparedStatement insertLocationStatement = {
+        "insert_location",
+        "INSERT INTO location (latitude, longitude) "
+        "VALUES ($1, $2) ON CONFLICT DO NOTHING;",
+        2};
+
+// Adds entry to history
+// The locationId is obtained by querying the Location table based on lat and lon
+// The throughput is computed based on the time and number of bits compared with the
+// last History entry for the same RAT
+// $1 -> timestamp (in seconds)
+// $2 -> throughput
+// $3 -> num_bits
+// $4 -> channel_info
+// $5 -> scan_info
+// $6 -> rat
+// $7 -> speed
+// $8 -> orientation
+// $9 -> moving
+// $10 -> tx_bitrate
+// $11 -> signal_strength
+// $12 -> latitude
+// $13 -> longitude
+// $14 -> channel_info_bin (binary parameter, NULL if empty)
+// $15..$23 -> probe statistics (see PROBE_COLUMNS_SQL), NULL if the entry has none
+// feedback -> true if the entry holds throughput feedback (even of 0 bits), NULL otherwise
+#define PROBE_COLUMNS_SQL \
+        "probes_received, probes_lost, probes_reordered, probes_duplicated, jitter_us, " \
+        "delay_min_us, delay_mean_us, delay_max_us, delay_hist"
+#define PROBE_NPARAMS 9
+#define INSERT_HISTORY_SQL(feedback) \
+        "INSERT INTO history " \
+        "(timestamp, throughput, num_bits, channel_info, scan_info, rat, speed, " \
+        "orientation, moving, tx_bitrate, signal_strength, location_id, channel_info_bin, " \
+        PROBE_COLUMNS_SQL ", feedback) " \
+        "VALUES (to_timestamp($1), $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, " \
+        "        (SELECT location_id " \
+        "         FROM location " \
+        "         WHERE latitude = $12 " \
+        "           AND longitude = $13), $14, " \
+        "        $15, $16, $17, $18, $19, $20, $21, $22, $23, " feedback ") " \
+        "ON CONFLICT (timestamp, rat) DO UPDATE "
+
+// Columns updated on conflict, depending on which module produced the entry
+#define UPDATE_HISTORY_CHANNEL_SQL \
+        "       SET channel_info = excluded.channel_info," \
+        "           channel_info_bin = excluded.channel_info_bin," \
+        "           tx_bitrate = excluded.tx_bitrate," \
+        "           signal_strength = excluded.signal_strength; "
+#define UPDATE_HISTORY_SCAN_SQL \
+        "       SET scan_info = excluded.scan_info; "
+#define UPDATE_HISTORY_FEEDBACK_SQL \
+        "       SET feedback = true, " \
+        "           throughput = excluded.throughput, " \
+        "           num_bits = excluded.num_bits, " \
+        "           speed = excluded.speed, " \
+        "           orientation = excluded.orientation, " \
+        "           moving = excluded.moving, " \
+        "           location_id = excluded.location_id, " \
+        "           probes_received = excluded.probes_received, " \
+        "           probes_lost = excluded.probes_lost, " \
+        "           probes_reordered = excluded.probes_reordered, " \
+        "           probes_duplicated = excluded.probes_duplicated, " \
+        "           jitter_us = excluded.jitter_us, " \
+        "           delay_min_us = excluded.delay_min_us, " \
+        "           delay_mean_us = excluded.delay_mean_us, " \
+        "           delay_max_us = excluded.delay_max_us, " \
+        "           delay_hist = excluded.delay_hist; "
+
+// CHANNEL MONITOR: the throughput is empty and it has channel info
+static const PreparedStatement insertHistoryChannelStatement = {
+        "insert_history_channel",
+        INSERT_HISTORY_SQL("NULL") UPDATE_HISTORY_CHANNEL_SQL,
+        14 + PROBE_NPARAMS};
+
+// CHANNEL MONITOR SCAN: the throughput is empty and it has scan info
+static const PreparedStatement insertHistoryScanStatement = {
+        "insert_history_scan",
+        INSERT_HISTORY_SQL("NULL") UPDATE_HISTORY_SCAN_SQL,
+        14 + PROBE_NPARAMS};
+
+// FEEDBACK RECEIVER
+static const PreparedStatement insertHistoryFeedbackStatement = {
+        "insert_history_feedback",
+        INSERT_HISTORY_SQL("true") UPDATE_HISTORY_FEEDBACK_SQL,
+        14 + PROBE_NPARAMS};
+
+// SAMPLE MERGER: channel info and feedback of the same (timestamp, rat) in one entry
+#define UPDATE_HISTORY_MERGED_SQL \
+        "       SET channel_info = excluded.channel_info," \
+        "           channel_info_bin = excluded.channel_info_bin," \
+        "           tx_bitrate = excluded.tx_bitrate," \
+        "           signal_strength = excluded.signal_strength," \
+        "           feedback = true, " \
+        "           throughput = excluded.throughput, " \
+        "           num_bits = excluded.num_bits, " \
+        "           speed = excluded.speed, " \
+        "           orientation = excluded.orientation, " \
+        "           moving = excluded.moving, " \
+        "           location_id = excluded.location_id, " \
+        "           probes_received = excluded.probes_received, " \
+        "           probes_lost = excluded.probes_lost, " \
+        "           probes_reordered = excluded.probes_reordered, " \
+        "           probes_duplicated = excluded.probes_duplicated, " \
+        "           jitter_us = excluded.jitter_us, " \
+        "           delay_min_us = excluded.delay_min_us, " \
+        "           delay_mean_us = excluded.delay_mean_us, " \
+        "           delay_max_us = excluded.delay_max_us, " \
+        "           delay_hist = excluded.delay_hist; "
+
+static const PreparedStatement insertHistoryMergedStatement = {
+        "insert_history_merged",
+        INSERT_HISTORY_SQL("true") UPDATE_HISTORY_MERGED_SQL,
+        14 + PROBE_NPARAMS};
+
+// ------------- BULK (COPY) STATEMENTS -------------
+// Batches are streamed with COPY into a per-session staging table, and then moved
+// into location and history with one statement per history kind, so a batch costs
+// a handful of round trips instead of two per entry
+
+// Temporary table, emptied at the end of every transaction
+#define STAGING_NFIELDS (16 + PROBE_NPARAMS)
+static const char *const createStagingSql =
+        "CREATE TEMP TABLE IF NOT EXISTS history_staging ("
+        "    seq int8, kind int2, timestamp_ms int8, throughput int8, num_bits int8,"
+        "    channel_info text, scan_info text, rat text, speed float8, orientation float8,"
+        "    moving int4, tx_bitrate int8, signal_strength int4, latitude float8, longitude float8,"
+        "    channel_info_bin bytea,"
+        "    probes_received int4, probes_lost int4, probes_reordered int4, probes_duplicated int4,"
+        "    jitter_us int4, delay_min_us int4, delay_mean_us int4, delay_max_us int4, delay_hist int4[]"
+        ") ON COMMIT DELETE ROWS;";
+
+static const char *const copyStagingSql =
+        "COPY history_staging FROM STDIN (FORMAT binary);";
+
+// Every staged position that isn't yet in location
+static const PreparedStatement insertStagedLocationStatement = {
+        "insert_staged_location",
+        "INSERT INTO location (latitude, longitude) "
+        "SELECT DISTINCT latitude, longitude FROM history_staging "
+        "ON CONFLICT DO NOTHING;",
+        0};
+
+// Same as INSERT_HISTORY_SQL(), with the location_id resolved by a join. An upsert
+// can't touch the same row twice, so only the last staged entry of each
+// (timestamp, rat) is kept, as it would have been by the row by row inserts
+#define UPSERT_STAGED_HISTORY_SQL(kind) \
+        "INSERT INTO history " \
+        "(timestamp, throughput, num_bits, channel_info, scan_info, rat, speed, " \
+        "orientation, moving, tx_bitrate, signal_strength, location_id, channel_info_bin, " \
+        PROBE_COLUMNS_SQL ", feedback) " \
+        "SELECT DISTINCT ON (s.timestamp_ms, s.rat) " \
+        "       to_timestamp(s.timestamp_ms / 1000.0), s.throughput, s.num_bits, s.channel_info, " \
+        "       s.scan_info, s.rat, s.speed, s.orientation, s.moving, s.tx_bitrate, " \
+        "       s.signal_strength, l.location_id, s.channel_info_bin, " \
+        "       s.probes_received, s.probes_lost, s.probes_reordered, s.probes_duplicated, " \
+        "       s.jitter_us, s.delay_min_us, s.delay_mean_us, s.delay_max_us, s.delay_hist, " \
+        "       CASE WHEN s.kind IN (2, 3) THEN true END " \
+        "FROM history_staging s " \
+        "         LEFT JOIN location l ON l.latitude = s.latitude AND l.longitude = s.longitude " \
+        "WHERE s.kind = " kind " " \
+        "ORDER BY s.timestamp_ms, s.rat, s.seq DESC " \
+        "ON CONFLICT (timestamp, rat) DO UPDATE "
+
+static const PreparedStatement upsertStagedHistoryStatements[] = {
+        {"upsert_staged_history_channel", UPSERT_STAGED_HISTORY_SQL("0") UPDATE_HISTORY_CHANNEL_SQL, 0},
+        {"upsert_staged_history_scan", UPSERT_STAGED_HISTORY_SQL("1") UPDATE_HISTORY_SCAN_SQL, 0},
+        {"upsert_staged_history_feedback", UPSERT_STAGED_HISTORY_SQL("2") UPDATE_HISTORY_FEEDBACK_SQL, 0},
+        {"upsert_staged_history_merged", UPSERT_STAGED_HISTORY_SQL("3") UPDATE_HISTORY_MERGED_SQL, 0}};
+
+// Update a history entry
+// The entries corresponding to the given RAT and between the begin and end
+// timestamps are updated with the scan information
+// $1 -> scan_info
+// $2 -> rat
+// $3 -> timestamp begin
+// $4 -> timestamp end
+static const PreparedStatement updateScanInfoStatement = {
+        "update_history_scan_info",
+        "UPDATE history "
+        "SET scan_info = $1 "
+        "WHERE rat = $2 "
+        "  AND timestamp > $3 "
+        "  AND timestamp <= $4; ",
+        4};
+
+// ------------- SPATIAL STATEMENTS -------------
+// Locations are indexed by grid cell (DB_GRID_CELL_DEG x DB_GRID_CELL_DEG degrees), with an
+// expression index computed at insert time. Position queries enumerate the cells that
+// cover the search square ($lat_lo..$lat_hi x $lon_lo..$lon_hi cell indexes, see
+// cellRangeAround()), look them up in the index, and only then apply the exact filter,
+// so their cost depends on the rows around the position and not on the table size
+
+#define DB_STR(x) #x
+#define DB_XSTR(x) DB_STR(x)
+
+// Binary channel info (see WifiInfoCodec), added to existing databases on first use;
+// the catalog check avoids taking the table lock when the column is already there
+#define ADD_CHANNEL_INFO_BIN_SQL \
+        "  IF NOT EXISTS (SELECT 1 FROM pg_attribute " \
+        "                 WHERE attrelid = 'history'::regclass " \
+        "                   AND attname = 'channel_info_bin' AND NOT attisdropped) THEN " \
+        "    ALTER TABLE history ADD COLUMN channel_info_bin bytea; " \
+        "  END IF; "
+
+static const char *const createChannelInfoBinSql =
+        "DO $do$ BEGIN " ADD_CHANNEL_INFO_BIN_SQL "END $do$;";
+
+// Probe statistics of the feedback entries (see ProbeStats), added the same way
+#define ADD_PROBE_COLUMNS_SQL \
+        "  IF NOT EXISTS (SELECT 1 FROM pg_attribute " \
+        "                 WHERE attrelid = 'history'::regclass " \
+        "                   AND attname = 'probes_received' AND NOT attisdropped) THEN " \
+        "    ALTER TABLE history ADD COLUMN probes_received int4, ADD COLUMN probes_lost int4, " \
+        "                        ADD COLUMN probes_reordered int4, ADD COLUMN probes_duplicated int4, " \
+        "                        ADD COLUMN jitter_us int4, ADD COLUMN delay_min_us int4, " \
+        "                        ADD COLUMN delay_mean_us int4, ADD COLUMN delay_max_us int4, " \
+        "                        ADD COLUMN delay_hist int4[]; " \
+        "  END IF; "
+
+static const char *const createProbeColumnsSql =
+        "DO $do$ BEGIN " ADD_PROBE_COLUMNS_SQL "END $do$;";
+
+// Marks the entries with throughput feedback, so a bin of 0 bits (an outage) still counts
+// as one; the entries of before can only be told apart by their bits, so the ones with
+// none are taken as channel or scan entries
+#define ADD_FEEDBACK_COLUMN_SQL \
+        "  IF NOT EXISTS (SELECT 1 FROM pg_attribute " \
+        "                 WHERE attrelid = 'history'::regclass " \
+        "                   AND attname = 'feedback' AND NOT attisdropped) THEN " \
+        "    ALTER TABLE history ADD COLUMN feedback boolean; " \
+        "    UPDATE history SET feedback = true WHERE num_bits > 0; " \
+        "  END IF; "
+
+static const char *const createFeedbackColumnSql =
+        "DO $do$ BEGIN " ADD_FEEDBACK_COLUMN_SQL "END $do$;";
+
+// Created once per database, in a single transaction
+// wiperf_cell_id(lat, lon) -> (lat cell index << 32) | lon cell index
+static const char *const createSpatialSchemaSql =
+        "DO $do$ BEGIN "
+        ADD_CHANNEL_INFO_BIN_SQL
+        ADD_PROBE_COLUMNS_SQL
+        ADD_FEEDBACK_COLUMN_SQL
+        "  IF to_regprocedure('wiperf_cell_id(float8, float8)') IS NULL THEN "
+        "    CREATE FUNCTION wiperf_cell_id(lat float8, lon float8) RETURNS int8 "
+        "    LANGUAGE sql IMMUTABLE STRICT AS $fn$ "
+        "      SELECT (floor((lat + 90) / " DB_XSTR(DB_GRID_CELL_DEG) ")::int8 << 32) "
+        "           | floor((lon + 180) / " DB_XSTR(DB_GRID_CELL_DEG) ")::int8 "
+        "    $fn$; "
+        "  END IF; "
+        "  IF to_regclass('location_cell_idx') IS NULL THEN "
+        "    CREATE INDEX location_cell_idx ON location (wiperf_cell_id(latitude, longitude)); "
+        "  END IF; "
+        "  IF to_regclass('history_location_rat_idx') IS NULL THEN "
+        "    CREATE INDEX history_location_rat_idx ON history (location_id, rat); "
+        "  END IF; "
+        "  IF to_regclass('history_rat_timestamp_idx') IS NULL THEN "
+        "    CREATE INDEX history_rat_timestamp_idx ON history (rat, timestamp); "
+        "  END IF; "
+        "END $do$;";
+
+// Locations in the cells covering the search square, aliased as l
+#define CELLS_AROUND_SQL(latLo, latHi, lonLo, lonHi) \
+        "generate_series(" latLo "::int8, " latHi "::int8) AS cell_lat " \
+        "         CROSS JOIN generate_series(" lonLo "::int8, " lonHi "::int8) AS cell_lon " \
+        "         JOIN location l ON wiperf_cell_id(l.latitude, l.longitude) = ((cell_lat << 32) | cell_lon) "
+
+// Per-RAT statistics of the history entries aliased as h. Throughput only counts for
+// entries with feedback, and the channel statistics for entries with channel info
+#define RAT_STATS_SQL \
+        "SELECT h.rat, " RAT_AGGREGATES_SQL
+#define RAT_AGGREGATES_SQL \
+        "       count(*), " \
+        "       count(*) FILTER (WHERE h.feedback), " \
+        "       avg(h.throughput) FILTER (WHERE h.feedback), " \
+        "       percentile_cont(0.5) WITHIN GROUP (ORDER BY h.throughput) FILTER (WHERE h.feedback), " \
+        "       percentile_cont(0.9) WITHIN GROUP (ORDER BY h.throughput) FILTER (WHERE h.feedback), " \
+        "       avg(h.signal_strength) FILTER (WHERE h.channel_info <> '' OR h.channel_info_bin IS NOT NULL), " \
+        "       avg(h.tx_bitrate) FILTER (WHERE h.channel_info <> '' OR h.channel_info_bin IS NOT NULL) "
+
+// Per-cell and per-RAT statistics of the entries in a block of cells
+// $1..$4 -> cell indexes (lat_lo, lat_hi, lon_lo, lon_hi)
+static const PreparedStatement queryCellStatsStatement = {
+        "query_stats_cells",
+        "SELECT (cell_lat << 32) | cell_lon, h.rat, " RAT_AGGREGATES_SQL
+        "FROM " CELLS_AROUND_SQL("$1", "$2", "$3", "$4")
+        "         JOIN history h ON h.location_id = l.location_id "
+        "GROUP BY cell_lat, cell_lon, h.rat;",
+        4};
+
+// Queries for all entries in the given coordinates and for the given RAT
+// $1 -> latitude
+// $2 -> longitude
+// $3 -> RAT
+// $4 -> radius
+// $5..$8 -> cell indexes (lat_lo, lat_hi, lon_lo, lon_hi)
+static const PreparedStatement queryAllStatement = {
+        "query_all_location_cell",
+        "SELECT EXTRACT(EPOCH FROM h.timestamp) * 1000, h.throughput, h.num_bits, h.channel_info, h.scan_info, h.rat,"
+        " h.speed, h.orientation, h.moving, h.tx_bitrate, h.signal_strength, l.latitude, l.longitude,"
+        " h.channel_info_bin, h.feedback "
+        "FROM " CELLS_AROUND_SQL("$5", "$6", "$7", "$8")
+        "         JOIN history h ON h.location_id = l.location_id "
+        " WHERE abs(l.latitude - $1) <= $4::float8 "
+        "   AND abs(l.longitude - $2) <= $4::float8 "
+        "   AND h.rat = $3;",
+        8};
+
+// Per-RAT statistics of the entries in the given coordinates
+// $1 -> latitude
+// $2 -> longitude
+// $3 -> radius
+// $4..$7 -> cell indexes (lat_lo, lat_hi, lon_lo, lon_hi)
+static const PreparedStatement queryStatsStatement = {
+        "query_stats_location_cell",
+        RAT_STATS_SQL
+        "FROM " CELLS_AROUND_SQL("$4", "$5", "$6", "$7")
+        "         JOIN history h ON h.location_id = l.location_id "
+        " WHERE abs(l.latitude - $1) <= $3::float8 "
+        "   AND abs(l.longitude - $2) <= $3::float8 "
+        "GROUP BY h.rat;",
+        7};
+
+// Entries of the same RAT taken forecast +/- interval seconds after an entry in the
+// given coordinates, as a range join on history (rat, timestamp)
+#define FORECAST_JOIN_SQL \
+        "FROM " CELLS_AROUND_SQL("$6", "$7", "$8", "$9") \
+        "         JOIN history h2 ON h2.location_id = l.location_id " \
+        "         JOIN history h ON h.rat = h2.rat " \
+        "                       AND h.timestamp BETWEEN h2.timestamp + ($3::float8 - $4::float8) * interval '1 second' " \
+        "                                           AND h2.timestamp + ($3::float8 + $4::float8) * interval '1 second' " \
+        "WHERE abs(l.latitude - $1) <= ($5::float8 / 2) " \
+        "  AND abs(l.longitude - $2) <= ($5::float8 / 2) "
+
+// Queries for every entry where the position corresponds to lat and lon coordinates
+// and adds the history_id index with the forecast
+// $1 -> latitude
+// $2 -> longitude
+// $3 -> forecast (in seconds)
+// $4 -> time interval between samples (in seconds)
+// $5 -> radius
+// $6..$9 -> cell indexes (lat_lo, lat_hi, lon_lo, lon_hi)
+static const PreparedStatement queryForecastStatement = {
+        "query_forecast_position_cell",
+        "SELECT EXTRACT(EPOCH FROM h.timestamp) * 1000 as millis, "
+        "       h.throughput, "
+        "       h.num_bits, "
+        "       h.channel_info, "
+        "       h.scan_info, "
+        "       h.rat, "
+        "       h.speed, "
+        "       h.orientation, "
+        "       h.moving, "
+        "       h.tx_bitrate, "
+        "       h.signal_strength, "
+        "       l1.latitude, "
+        "       l1.longitude, "
+        "       h.channel_info_bin, "
+        "       h.feedback "
+        "FROM (SELECT h.* " FORECAST_JOIN_SQL ") h "
+        "         JOIN location l1 on l1.location_id = h.location_id;",
+        9};
+
+// Per-RAT statistics of the entries used in forecasting
+// $1..$9 -> same as query_forecast_position_cell
+static const PreparedStatement queryForecastStatsStatement = {
+        "query_forecast_stats_cell",
+        RAT_STATS_SQL
+        FORECAST_JOIN_SQL
+        "GROUP BY h.rat;",
+        9};
+
+// Which module produced a history entry (also the kind column of the staging table)
+enum HistoryKind {
+    HISTORY_CHANNEL = 0,
+    HISTORY_SCAN = 1,
+    HISTORY_FEEDBACK = 2,
+    HISTORY_MERGED = 3,
+    HISTORY_NKINDS = 4
+};
+
+static HistoryKind historyKindFor(const DatabaseInfo &databaseInfo) {
+    bool hasChannelInfo = !databaseInfo.channelInfo.empty() || !databaseInfo.channelInfoBin.empty();
+
+    if (hasChannelInfo) {
+        return databaseInfo.feedback ? HISTORY_MERGED : HISTORY_CHANNEL;  // merged, see SampleMerger
+    }
+    else if (!databaseInfo.feedback && !databaseInfo.scanInfo.empty()) {
+        return HISTORY_SCAN;
+    }
+    else {
+        return HISTORY_FEEDBACK;
+    }
 }
 
-void DatabaseManager::configure(ConfigFile &configFile) {
-    dbName = configFile.Value("database", "db-name");
-    host = configFile.Value("database", "host");
-    dbUser = configFile.Value("database", "user");
-    password = configFile.Value("database", "password");
+/**
+ * Picks the history insert statement based on which module produced the entry.
+ */
+static const PreparedStatement &historyStatementFor(const DatabaseInfo &databaseInfo) {
+    switch (historyKindFor(databaseInfo)) {
+        case HISTORY_CHANNEL:
+            return insertHistoryChannelStatement;
+        case HISTORY_SCAN:
+            return insertHistoryScanStatement;
+        case HISTORY_MERGED:
+            return insertHistoryMergedStatement;
+        default:
+            return insertHistoryFeedbackStatement;
+    }
 }
 
-void DatabaseManager::createAll(std::vector<DatabaseInfo> &databaseInfoList) {
-    // The creation order doesn't matter unless entry t data depends on entry t-1
-    // ot t-2
+static bool hasProbes(const ProbeSummary &probes) {
+    return probes.received > 0 || probes.lost > 0 || probes.duplicates > 0;
+}
 
-    for (DatabaseInfo &databaseInfo : databaseInfoList) {
-        this->create(databaseInfo);
+/**
+ * Probe statistics as text parameters, in PROBE_COLUMNS_SQL order.
+ */
+static void probeParams(const ProbeSummary &probes, std::string params[PROBE_NPARAMS]) {
+    params[0] = std::to_string(probes.received);
+    params[1] = std::to_string(probes.lost);
+    params[2] = std::to_string(probes.reordered);
+    params[3] = std::to_string(probes.duplicates);
+    params[4] = std::to_string(probes.jitterUs);
+    params[5] = std::to_string(probes.delayMinUs);
+    params[6] = std::to_string(probes.delayMeanUs);
+    params[7] = std::to_string(probes.delayMaxUs);
+
+    params[8] = "{";
+    for (int i = 0; i < PROBE_DELAY_BUCKETS; i++) {
+        if (i > 0) params[8] += ",";
+        params[8] += std::to_string(probes.delayHist[i]);
     }
+    params[8] += "}";
 }
 
-void DatabaseManager::create(DatabaseInfo &databaseInfo) {
-
-    // This adds another entry to Location
-    // Since location has UNIQUE(lat, lon), there won't be two equal locations
-    // $1 -> latitude
-    // $2 -> longitude
-    const std::string insertLocationPrepStatement =
-            "INSERT INTO location (latitude, longitude) "
-            "VALUES ($1, $2) ON CONFLICT DO NOTHING;";
-    const int insertLocationNumParams = 2;
-
-    // Adds entry to history
-    // The locationId is obtained by querying the Location table based on lat and lon
-    // The throughput is computed based on the time and number of bits compared with the
-    // last History entry for the same RAT
-    // $1 -> timestamp (in seconds)
-    // $2 -> throughput
-    // $3 -> num_bits
-    // $4 -> channel_info
-    // $5 -> scan_info
-    // $6 -> rat
-    // $7 -> speed
-    // $8 -> orientation
-    // $9 -> moving
-    // $10 -> tx_bitrate
-    // $11 -> signal_strength
-    // $12 -> latitude
-    // $13 -> longitude
-
-    std::string insertHistoryPrepStatement;
-    const int insertHistoryNumParams = 13;
-
-    if (databaseInfo.numBits == 0 && databaseInfo.throughput == 0 && !databaseInfo.channelInfo.empty()) {
-        //If the throughput is empty and it has channel info => CHANNEL MONITOR
-        insertHistoryPrepStatement =
-                "INSERT INTO history "
-                "(timestamp, throughput, num_bits, channel_info, scan_info, rat, speed, "
-                "orientation, moving, tx_bitrate, signal_strength, location_id) "
-                "VALUES (to_timestamp($1), $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, "
-                "        (SELECT location_id "
-                "         FROM location "
-                "         WHERE latitude = $12 "
-                "           AND longitude = $13)) "
-                "ON CONFLICT (timestamp, rat) DO UPDATE "
-                "       SET channel_info = excluded.channel_info,"
-                "           tx_bitrate = excluded.tx_bitrate,"
-                "           signal_strength = excluded.signal_strength; ";
-    }
-    else if (databaseInfo.numBits == 0 && databaseInfo.throughput == 0 && !databaseInfo.scanInfo.empty()) {
-        //If the throughput is empty and it has scan info => CHANNEL MONITOR SCAN
-        insertHistoryPrepStatement =
-                "INSERT INTO history "
-                "(timestamp, throughput, num_bits, channel_info, scan_info, rat, speed, "
-                "orientation, moving, tx_bitrate, signal_strength, location_id) "
-                "VALUES (to_timestamp($1), $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, "
-                "        (SELECT location_id "
-                "         FROM location "
-                "         WHERE latitude = $12 "
-                "           AND longitude = $13)) "
-                "ON CONFLICT (timestamp, rat) DO UPDATE "
-                "       SET scan_info = excluded.scan_info; ";
-    }
-    else {
-        //else => FEEDBACK RECEIVER
-        insertHistoryPrepStatement =
-                "INSERT INTO history "
-                "(timestamp, throughput, num_bits, channel_info, scan_info, rat, speed, "
-                "orientation, moving, tx_bitrate, signal_strength, location_id) "
-                "VALUES (to_timestamp($1), $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, "
-                "        (SELECT location_id "
-                "         FROM location "
-                "         WHERE latitude = $12 "
-                "           AND longitude = $13)) "
-                "ON CONFLICT (timestamp, rat) DO UPDATE "
-                "       SET throughput = excluded.throughput, "
-                "           num_bits = excluded.num_bits, "
-                "           speed = excluded.speed, "
-                "           orientation = excluded.orientation, "
-                "           moving = excluded.moving, "
-                "           location_id = excluded.location_id; ";
+/**
+ * Probe statistics as COPY fields, in PROBE_COLUMNS_SQL order.
+ */
+static void addProbeFields(CopyBuffer &buffer, const ProbeSummary &probes) {
+    if (!hasProbes(probes)) {
+        for (int i = 0; i < PROBE_NPARAMS; i++) buffer.addNull();
+        return;
     }
 
-    try {
-        std::string connectionString = this->getConnectionString();
-        PGconn *conn = PQconnectdb(connectionString.c_str());
-
-        /* Check to see that the backend conn was successfully made */
-        if (PQstatus(conn) != CONNECTION_OK) {
-            std::stringstream ss;
-            ss << "Connection to database failed: " << PQerrorMessage(conn);
-            LOG_ERR(ss.str().c_str());
+    buffer.addInt4((int32_t) probes.received);
+    buffer.addInt4((int32_t) probes.lost);
+    buffer.addInt4((int32_t) probes.reordered);
+    buffer.addInt4((int32_t) probes.duplicates);
+    buffer.addInt4((int32_t) probes.jitterUs);
+    buffer.addInt4(probes.delayMinUs);
+    buffer.addInt4(probes.delayMeanUs);
+    buffer.addInt4(probes.delayMaxUs);
+
+    int32_t hist[PROBE_DELAY_BUCKETS];
+    for (int i = 0; i < PROBE_DELAY_BUCKETS; i++) hist[i] = (int32_t) probes.delayHist[i];
+    buffer.addInt4Array(hist, PROBE_DELAY_BUCKETS);
+}
 
-            std::cout << ss << std::endl;
-            PQfinish(conn);
-            return;
-        }
+/**
+ * The row by row inserts send the coordinates as text with 6 decimals, so the staged
+ * coordinates are rounded the same way to match the same location rows.
+ */
+static double roundCoordinate(double coordinate) {
+    return std::stod(std::to_string(coordinate));
+}
 
-        PGresult *res = NULL;
+/**
+ * Executes a statement outside of a transaction, retrying once (after reconnecting)
+ * if the connection was lost.
+ * @return result with the expected status, or nullptr on error
+ */
+static PGresult *execWithRetry(ConnectionPool::Connection &conn, const PreparedStatement &statement,
+                               const char *const *paramValues, ExecStatusType expected) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        PGresult *res = conn.execPrepared(statement, paramValues);
+        if (res && PQresultStatus(res) == expected) return res;
 
-        // Start a Transaction block
-        res = PQexec(conn, "BEGIN");
-        if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
+        if (conn.isOk() || attempt > 0 || !conn.reset()) {
             std::stringstream ss;
-            ss << "PQexec failed:" << PQresultErrorMessage(res);
+            ss << "PQexecPrepared " << statement.name << " failed: "
+               << (res ? PQresultErrorMessage(res) : PQerrorMessage(conn.get()));
             LOG_ERR(ss.str().c_str());
 
-            std::cout << ss << std::endl;
-
             PQclear(res);
-            PQfinish(conn);
-            return;
+            return nullptr;
         }
 
-        // Prepare statements
-        res = PQprepare(conn, "insert_location", insertLocationPrepStatement.c_str(), insertLocationNumParams, NULL);
-        if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
-            std::stringstream ss;
-            ss << "PQprepare failed:" << PQresultErrorMessage(res);
-            LOG_ERR(ss.str().c_str());
+        PQclear(res);  // connection was reset, try again
+    }
 
-            std::cout << ss << std::endl;
+    return nullptr;
+}
 
-            PQclear(res);
-            PQfinish(conn);
-            return;
-        }
+/**
+ * Runs a simple command (BEGIN, COMMIT, ROLLBACK).
+ */
+static bool execCommand(ConnectionPool::Connection &conn, const char *command) {
+    PGresult *res = PQexec(conn.get(), command);
+    if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
+        std::stringstream ss;
+        ss << "PQexec " << command << " failed: " << PQresultErrorMessage(res);
+        LOG_ERR(ss.str().c_str());
 
         PQclear(res);
+        return false;
+    }
 
-        res = PQprepare(conn, "insert_history", insertHistoryPrepStatement.c_str(), insertHistoryNumParams, NULL);
-        if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
-            std::stringstream ss;
-            ss << "PQprepare failed:" << PQresultErrorMessage(res);
-            LOG_ERR(ss.str().c_str());
+    PQclear(res);
+    return true;
+}
 
-            std::cout << ss << std::endl;
+/**
+ * Streams an encoded COPY buffer to the server.
+ * @return true if the server accepted every row
+ */
+static bool execCopyIn(ConnectionPool::Connection &conn, const char *sql, const CopyBuffer &buffer) {
+    PGresult *res = PQexec(conn.get(), sql);
+    if (!res || PQresultStatus(res) != PGRES_COPY_IN) {
+        std::stringstream ss;
+        ss << "PQexec COPY failed: " << PQresultErrorMessage(res);
+        LOG_ERR(ss.str().c_str());
 
-            PQclear(res);
-            PQfinish(conn);
-            return;
-        }
         PQclear(res);
+        return false;
+    }
+    PQclear(res);
 
-        // EXECUTE STATEMENT TO INSERT LOCATION and HISTORY
-
-        int resultFormat = 0;
-
-        std::string param_latitude = std::to_string(databaseInfo.latitude);
-        std::string param_longitude = std::to_string(databaseInfo.longitude);
-        std::string param_timestamp = std::to_string(databaseInfo.timestamp / (double) 1000);
-        std::string param_throughput = std::to_string(databaseInfo.throughput);
-        std::string param_numbits = std::to_string(databaseInfo.numBits);
-        std::string param_channelinfo = databaseInfo.channelInfo;
-        std::string param_scaninfo = databaseInfo.scanInfo;
-        std::string param_rat = databaseInfo.rat;
-        std::string param_speed = std::to_string(databaseInfo.speed);
-        std::string param_orientation = std::to_string(databaseInfo.orientation);
-        std::string param_moving = std::to_string(databaseInfo.moving);
-        std::string param_txbitrate = std::to_string(databaseInfo.tx_bitrate);
-        std::string param_signalstrength = std::to_string(databaseInfo.signal_strength);
-
-        const char *const insertLocationParamValues[] = { param_latitude.c_str(), param_longitude.c_str() };
+    bool ok = true;
+    for (size_t off = 0; ok && off < buffer.size(); off += DB_COPY_CHUNK_LEN) {
+        size_t len = std::min((size_t) DB_COPY_CHUNK_LEN, buffer.size() - off);
+        ok = PQputCopyData(conn.get(), buffer.data() + off, (int) len) == 1;
+    }
 
-        res = PQexecPrepared(conn, "insert_location", insertLocationNumParams, insertLocationParamValues,
-                             nullptr, nullptr, resultFormat);
+    // ending with an error message aborts the COPY on the server side
+    if (PQputCopyEnd(conn.get(), ok ? nullptr : "client failed to send the data") != 1) ok = false;
 
-        if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
+    while ((res = PQgetResult(conn.get())) != nullptr) {
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
             std::stringstream ss;
-            ss << "PQexecPrepared failed: " << PQresultErrorMessage(res);
+            ss << "COPY failed: " << PQresultErrorMessage(res);
             LOG_ERR(ss.str().c_str());
+            ok = false;
+        }
+        PQclear(res);
+    }
 
-            std::cout << ss << std::endl;
+    return ok;
+}
 
-            PQclear(res);
-            PQfinish(conn);
-            return;
+/**
+ * Cell indexes of the square of the given radius (in decimal degrees) around a position,
+ * as text parameters (lat_lo, lat_hi, lon_lo, lon_hi). Same arithmetic as wiperf_cell_id().
+ */
+static std::vector<std::string> cellRangeAround(double latitude, double longitude, double radius) {
+    return {std::to_string(DatabaseManager::latCellIndex(latitude - radius)),
+            std::to_string(DatabaseManager::latCellIndex(latitude + radius)),
+            std::to_string(DatabaseManager::lonCellIndex(longitude - radius)),
+            std::to_string(DatabaseManager::lonCellIndex(longitude + radius))};
+}
+
+/**
+ * Converts a row of the statistics queries into a RatStats.
+ * @param col column of the RAT, followed by the aggregates
+ */
+static RatStats rowToRatStats(PGresult *res, int i, int col = 0) {
+    auto value = [res, i](int col) {
+        return PQgetisnull(res, i, col) ? 0.0 : std::stod(PQgetvalue(res, i, col));
+    };
+
+    RatStats ratStats;
+    ratStats.rat = PQgetvalue(res, i, col);
+    ratStats.nsamples = std::stoull(PQgetvalue(res, i, col + 1));
+    ratStats.nthroughput = std::stoull(PQgetvalue(res, i, col + 2));
+    ratStats.meanThroughput = value(col + 3);
+    ratStats.p50Throughput = value(col + 4);
+    ratStats.p90Throughput = value(col + 5);
+    ratStats.meanSignalStrength = value(col + 6);
+    ratStats.meanTxBitrate = value(col + 7);
+
+    return ratStats;
+}
+
+/**
+ * Converts a row of the history queries into a DatabaseInfo.
+ */
+static DatabaseInfo rowToDatabaseInfo(PGresult *res, int i) {
+    DatabaseInfo databaseInfo;
+    databaseInfo.timestamp = std::stoll(PQgetvalue(res, i, 0));
+    databaseInfo.throughput = std::stoi(PQgetvalue(res, i, 1));
+    databaseInfo.numBits = std::stoi(PQgetvalue(res, i, 2));
+    databaseInfo.channelInfo = PQgetvalue(res, i, 3);
+    databaseInfo.scanInfo = PQgetvalue(res, i, 4);
+    databaseInfo.rat = PQgetvalue(res, i, 5);
+    databaseInfo.speed = std::stod(PQgetvalue(res, i, 6));
+    databaseInfo.orientation = std::stod(PQgetvalue(res, i, 7));
+    databaseInfo.moving = std::stoi(PQgetvalue(res, i, 8));
+    databaseInfo.tx_bitrate = std::stoi(PQgetvalue(res, i, 9));
+    databaseInfo.signal_strength = std::stoi(PQgetvalue(res, i, 10));
+
+    // bytea comes back hex-escaped in text results
+    if (PQnfields(res) > 13 && !PQgetisnull(res, i, 13)) {
+        size_t len = 0;
+        unsigned char *bin = PQunescapeBytea((const unsigned char *) PQgetvalue(res, i, 13), &len);
+        if (bin) {
+            databaseInfo.channelInfoBin.assign((const char *) bin, len);
+            PQfreemem(bin);
         }
+    }
 
-        PQclear(res);
+    databaseInfo.feedback = PQnfields(res) > 14 && !PQgetisnull(res, i, 14) && PQgetvalue(res, i, 14)[0] == 't';
 
-        const char *const insertHistoryParamValues[] = {
-                param_timestamp.c_str(), param_throughput.c_str(), param_numbits.c_str(),
-                param_channelinfo.c_str(), param_scaninfo.c_str(), param_rat.c_str(),
-                param_speed.c_str(), param_orientation.c_str(), param_moving.c_str(),
-                param_txbitrate.c_str(), param_signalstrength.c_str(), param_latitude.c_str(),
-                param_longitude.c_str()};
+    return databaseInfo;
+}
 
-        res = PQexecPrepared(conn, "insert_history", insertHistoryNumParams,
-                             insertHistoryParamValues, nullptr, nullptr, resultFormat);
+// ------------- DATABASE MANAGER -------------
 
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            std::stringstream ss;
-            ss << "PQexecPrepared failed: " << PQresultErrorMessage(res);
-            LOG_ERR(ss.str().c_str());
+DatabaseManager::DatabaseManager() : dbName(), host(), dbUser(), password(),
+                                     poolSize(DB_POOL_SIZE_DEF), copyMinRows(DB_COPY_MIN_ROWS_DEF), pool() {}
 
-            std::cout << ss << std::endl;
+DatabaseManager::DatabaseManager(
+        std::string dbName, std::string host, std::string dbUser, std::string password) :
+        dbName(std::move(dbName)), host(std::move(host)), dbUser(std::move(dbUser)), password(std::move(password)),
+        poolSize(DB_POOL_SIZE_DEF), copyMinRows(DB_COPY_MIN_ROWS_DEF), pool() {
+}
 
-            PQclear(res);
-            PQfinish(conn);
-            return;
-        }
-        PQclear(res);
+void DatabaseManager::configure(ConfigFile &configFile) {
+    dbName = configFile.Value("database", "db-name");
+    host = configFile.Value("database", "host");
+    dbUser = configFile.Value("database", "user");
+    password = configFile.Value("database", "password");
 
-        /* commit the transaction */
-        res = PQexec(conn, "COMMIT");
-        PQclear(res);
+    // optional, number of connections shared by the modules of this process
+    try {
+        poolSize = std::stoi(configFile.Value("database", "pool-size"));
+    } catch (std::exception const&) {
+        poolSize = DB_POOL_SIZE_DEF;
+    }
 
-        /* close the connection to the database and cleanup */
-        PQfinish(conn);
+    // optional, smallest batch written with COPY instead of row by row (0 disables it)
+    try {
+        copyMinRows = std::stoi(configFile.Value("database", "copy-min-rows"));
+    } catch (std::exception const&) {
+        copyMinRows = DB_COPY_MIN_ROWS_DEF;
     }
-    catch (std::exception const &exception) {
-        std::cout << "[DEBUG] exception :: " << exception.what() << std::endl;
-        LOG_ERR(exception.what())
+
+    this->pool.reset();  // connection parameters may have changed
+}
+
+std::shared_ptr<ConnectionPool> DatabaseManager::getPool() {
+    if (!this->pool) {
+        this->pool = ConnectionPool::get(this->getConnectionString(), this->poolSize);
     }
+
+    return this->pool;
 }
 
-void DatabaseManager::updateScanInfo(DatabaseInfo &databaseInfo, uint64_t begin, uint64_t end) {
-    // Update a history entry
-    // The entries corresponding to the given RAT and between the begin and end
-    // timestamps are updated with the scan information
-
-    // $1 -> scan_info
-    // $2 -> rat
-    // $3 -> timestamp begin
-    // $4 -> timestamp end
-    std::string updateScanInfoPrepStatement =
-            "UPDATE history "
-            "SET scan_info = $1 "
-            "WHERE rat = $2 "
-            "  AND timestamp > $3 "
-            "  AND timestamp <= $4; ";
-    const int updateScanIfoNumParams = 4;
+bool DatabaseManager::createAll(std::vector<DatabaseInfo> &databaseInfoList) {
+    // The creation order doesn't matter unless entry t data depends on entry t-1
+    // ot t-2
+    bool copy = this->copyMinRows > 0 && databaseInfoList.size() >= (size_t) this->copyMinRows;
+    return this->insert(databaseInfoList.data(), databaseInfoList.size(), copy);
+}
 
-    try {
-        std::string connectionString = this->getConnectionString();
-        PGconn *conn = PQconnectdb(connectionString.c_str());
+bool DatabaseManager::copyAll(std::vector<DatabaseInfo> &databaseInfoList) {
+    return this->insert(databaseInfoList.data(), databaseInfoList.size(), true);
+}
 
-        /* Check to see that the backend conn was successfully made */
-        if (PQstatus(conn) != CONNECTION_OK) {
-            std::stringstream ss;
-            ss << "Connection to database failed: " << PQerrorMessage(conn);
-            LOG_ERR(ss.str().c_str());
+bool DatabaseManager::create(DatabaseInfo &databaseInfo) {
+    return this->insert(&databaseInfo, 1, false);
+}
 
-            std::cout << ss << std::endl;
-            PQfinish(conn);
+bool DatabaseManager::insert(DatabaseInfo *databaseInfos, size_t count, bool copy) {
+    if (count == 0) return true;
 
-            return;
-        }
+    ConnectionPool::Lease conn = this->getPool()->checkout();
+    if (!conn) return false;  // already logged
 
-        PGresult *res = NULL;
+    if (!conn->setupOnce("channel_info_bin", createChannelInfoBinSql)) return false;
+    if (!conn->setupOnce("probe_columns", createProbeColumnsSql)) return false;
+    if (!conn->setupOnce("feedback_column", createFeedbackColumnSql)) return false;
 
-        // Prepare statements
-        res = PQprepare(conn, "update_history_scan_info", updateScanInfoPrepStatement.c_str(), updateScanIfoNumParams,
-                        NULL);
+    // the whole batch goes in a single transaction; if the connection drops midway,
+    // reconnect and replay the batch once
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool ok = copy ? this->copyBatch(*conn, databaseInfos, count)
+                       : this->insertBatch(*conn, databaseInfos, count);
+        if (ok) return true;
 
-        int resultFormat = 0;
+        if (conn->isOk()) {
+            execCommand(*conn, "ROLLBACK");  // SQL error, retrying won't help
+            return false;
+        }
 
-        std::string param_scaninfo = databaseInfo.scanInfo;
-        std::string param_rat = databaseInfo.rat;
-        std::string param_begin = std::to_string(begin);
-        std::string param_end = std::to_string(end);
+        if (attempt > 0 || !conn->reset()) return false;
+    }
 
-        const char *const updateScaninfoParamValues[] = {param_scaninfo.c_str(), param_rat.c_str(),
-                                                         param_begin.c_str(), param_end.c_str()};
+    return false;
+}
 
-        // EXECUTE STATEMENT TO UPDATE HISTORY
-        if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
-            std::stringstream ss;
-            ss << "PQprepare failed:" << PQresultErrorMessage(res);
-            LOG_ERR(ss.str().c_str());
+bool DatabaseManager::insertBatch(ConnectionPool::Connection &conn, DatabaseInfo *databaseInfos, size_t count) {
+    try {
+        // Start a Transaction block
+        if (!execCommand(conn, "BEGIN")) return false;
+
+        for (size_t n = 0; n < count; n++) {
+            const DatabaseInfo &databaseInfo = databaseInfos[n];
+
+            // EXECUTE STATEMENT TO INSERT LOCATION and HISTORY
+            std::string param_latitude = std::to_string(databaseInfo.latitude);
+            std::string param_longitude = std::to_string(databaseInfo.longitude);
+            std::string param_timestamp = std::to_string(databaseInfo.timestamp / (double) 1000);
+            std::string param_throughput = std::to_string(databaseInfo.throughput);
+            std::string param_numbits = std::to_string(databaseInfo.numBits);
+            std::string param_speed = std::to_string(databaseInfo.speed);
+            std::string param_orientation = std::to_string(databaseInfo.orientation);
+            std::string param_moving = std::to_string(databaseInfo.moving);
+            std::string param_txbitrate = std::to_string(databaseInfo.tx_bitrate);
+            std::string param_signalstrength = std::to_string(databaseInfo.signal_strength);
+
+            const char *const insertLocationParamValues[] = { param_latitude.c_str(), param_longitude.c_str() };
+
+            PGresult *res = conn.execPrepared(insertLocationStatement, insertLocationParamValues);
+            if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
+                std::stringstream ss;
+                ss << "PQexecPrepared failed: " << PQresultErrorMessage(res);
+                LOG_ERR(ss.str().c_str());
 
-            std::cout << ss << std::endl;
-            PQclear(res);
-            PQfinish(conn);
-            return;
-        } else {
-            /*
-             * ParamValues -> array with the values for the parameters
-             * ParamLengths -> length of binay-format values (ignored for text values)
-             * ParamFormat -> specify if the params are text (0) or binary (1) (if null, all are text)
-             */
+                PQclear(res);
+                return false;
+            }
             PQclear(res);
 
-            res = PQexecPrepared(conn, "update_history_scan_info", updateScanIfoNumParams,
-                                 updateScaninfoParamValues, nullptr, nullptr, resultFormat);
+            std::string param_probes[PROBE_NPARAMS];
+            const bool probes = hasProbes(databaseInfo.probes);
+            if (probes) probeParams(databaseInfo.probes, param_probes);
+
+            const char *insertHistoryParamValues[14 + PROBE_NPARAMS] = {
+                    param_timestamp.c_str(), param_throughput.c_str(), param_numbits.c_str(),
+                    databaseInfo.channelInfo.c_str(), databaseInfo.scanInfo.c_str(), databaseInfo.rat.c_str(),
+                    param_speed.c_str(), param_orientation.c_str(), param_moving.c_str(),
+                    param_txbitrate.c_str(), param_signalstrength.c_str(), param_latitude.c_str(),
+                    param_longitude.c_str(),
+                    databaseInfo.channelInfoBin.empty() ? nullptr : databaseInfo.channelInfoBin.data()};
+            for (int i = 0; i < PROBE_NPARAMS; i++) {
+                insertHistoryParamValues[14 + i] = probes ? param_probes[i].c_str() : nullptr;
+            }
+
+            // only the encoded channel info goes in binary, no escaping needed
+            int insertHistoryParamLengths[14 + PROBE_NPARAMS] = {0};
+            int insertHistoryParamFormats[14 + PROBE_NPARAMS] = {0};
+            insertHistoryParamLengths[13] = (int) databaseInfo.channelInfoBin.size();
+            insertHistoryParamFormats[13] = 1;
 
+            res = conn.execPrepared(historyStatementFor(databaseInfo), insertHistoryParamValues,
+                                    insertHistoryParamLengths, insertHistoryParamFormats);
             if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
                 std::stringstream ss;
                 ss << "PQexecPrepared failed: " << PQresultErrorMessage(res);
                 LOG_ERR(ss.str().c_str());
 
-                std::cout << ss << std::endl;
-
                 PQclear(res);
-                PQfinish(conn);
-                return;
+                return false;
             }
-
             PQclear(res);
         }
 
-        PQfinish(conn);
+        /* commit the transaction */
+        return execCommand(conn, "COMMIT");
     }
     catch (std::exception const &exception) {
         LOG_ERR(exception.what())
+        return false;
     }
 }
 
-std::list<DatabaseInfo> DatabaseManager::retrieveAllByPosition(
-        const double latitude, const double longitude, const std::string &rat, const double radius) {
+bool DatabaseManager::copyBatch(ConnectionPool::Connection &conn, DatabaseInfo *databaseInfos, size_t count) {
+    // outside the transaction, a rollback would drop the table
+    if (!conn.setupOnce("create_history_staging", createStagingSql)) return false;
+
+    CopyBuffer buffer;
+    size_t nkind[HISTORY_NKINDS] = {0};
+
+    for (size_t n = 0; n < count; n++) {
+        const DatabaseInfo &databaseInfo = databaseInfos[n];
+        HistoryKind kind = historyKindFor(databaseInfo);
+        ++nkind[kind];
+
+        buffer.beginRow(STAGING_NFIELDS);
+        buffer.addInt8((int64_t) n);
+        buffer.addInt2((int16_t) kind);
+        buffer.addInt8((int64_t) databaseInfo.timestamp);
+        buffer.addInt8(databaseInfo.throughput);
+        buffer.addInt8(databaseInfo.numBits);
+        buffer.addText(databaseInfo.channelInfo);
+        buffer.addText(databaseInfo.scanInfo);
+        buffer.addText(databaseInfo.rat);
+        buffer.addFloat8(databaseInfo.speed);
+        buffer.addFloat8(databaseInfo.orientation);
+        buffer.addInt4(databaseInfo.moving);
+        buffer.addInt8(databaseInfo.tx_bitrate);
+        buffer.addInt4(databaseInfo.signal_strength);
+        buffer.addFloat8(roundCoordinate(databaseInfo.latitude));
+        buffer.addFloat8(roundCoordinate(databaseInfo.longitude));
+        if (databaseInfo.channelInfoBin.empty()) buffer.addNull();
+        else buffer.addBytes(databaseInfo.channelInfoBin.data(), databaseInfo.channelInfoBin.size());
+        addProbeFields(buffer, databaseInfo.probes);
+    }
+    buffer.finish();
 
-    double radius_decimal_degrees = DatabaseManager::metersToDecimalDegrees(radius);
-    //If radius is in meters => decimal degrees = meters * .00001 (convert meters to decimal degrees)
+    if (!execCommand(conn, "BEGIN")) return false;
+    if (!execCopyIn(conn, copyStagingSql, buffer)) return false;
 
-    //Queries for all entries in the given coordinates and for the given RAT
-    // $1 -> latitude
-    // $2 -> longitude
-    // $3 -> RAT
-    // $4 -> radius
-    const std::string queryAllPrepStatement =
-            "SELECT EXTRACT(EPOCH FROM timestamp) * 1000, throughput, num_bits, channel_info, scan_info, rat,"
-            " speed, orientation, moving, tx_bitrate, signal_strength, latitude, longitude "
-            "FROM history INNER JOIN location "
-            " USING(location_id) "
-            " WHERE abs(latitude - $1) <= $4 "
-            "   AND abs(longitude - $2) <= $4 "
-            "   AND rat = $3;";
-    const int queryAllNumParams = 4;
+    PGresult *res = conn.execPrepared(insertStagedLocationStatement, nullptr);
+    if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
+        std::stringstream ss;
+        ss << "PQexecPrepared failed: " << PQresultErrorMessage(res);
+        LOG_ERR(ss.str().c_str());
 
-    std::list<DatabaseInfo> databaseInfoList;
+        PQclear(res);
+        return false;
+    }
+    PQclear(res);
 
-    try {
-        std::string connectionString = this->getConnectionString();
-        PGconn *conn = PQconnectdb(connectionString.c_str());
+    for (int kind = 0; kind < HISTORY_NKINDS; kind++) {
+        if (nkind[kind] == 0) continue;
 
-        /* Check to see that the backend conn was successfully made */
-        if (PQstatus(conn) != CONNECTION_OK) {
+        res = conn.execPrepared(upsertStagedHistoryStatements[kind], nullptr);
+        if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
             std::stringstream ss;
-            ss << "Connection to database failed: " << PQerrorMessage(conn);
+            ss << "PQexecPrepared failed: " << PQresultErrorMessage(res);
             LOG_ERR(ss.str().c_str());
 
-            std::cout << ss << std::endl;
-            PQfinish(conn);
-            return databaseInfoList;
+            PQclear(res);
+            return false;
         }
+        PQclear(res);
+    }
+
+    /* commit the transaction, which also empties the staging table */
+    return execCommand(conn, "COMMIT");
+}
+
+void DatabaseManager::updateScanInfo(DatabaseInfo &databaseInfo, uint64_t begin, uint64_t end) {
+    ConnectionPool::Lease conn = this->getPool()->checkout();
+    if (!conn) return;
+
+    try {
+        std::string param_begin = std::to_string(begin);
+        std::string param_end = std::to_string(end);
+
+        const char *const updateScaninfoParamValues[] = {databaseInfo.scanInfo.c_str(), databaseInfo.rat.c_str(),
+                                                         param_begin.c_str(), param_end.c_str()};
+
+        // EXECUTE STATEMENT TO UPDATE HISTORY
+        PGresult *res = execWithRetry(*conn, updateScanInfoStatement, updateScaninfoParamValues, PGRES_COMMAND_OK);
+        PQclear(res);
+    }
+    catch (std::exception const &exception) {
+        LOG_ERR(exception.what())
+    }
+}
 
-        PGresult *res = NULL;
-        res = PQprepare(conn, "query_all_location", queryAllPrepStatement.c_str(), queryAllNumParams, NULL);
+bool DatabaseManager::setupSpatialIndex() {
+    ConnectionPool::Lease conn = this->getPool()->checkout();
+    if (!conn) return false;
 
-        int resultFormat = 0;
+    // the first call on a large history table builds the indexes, which takes a while
+    return conn->setupOnce("spatial_schema", createSpatialSchemaSql);
+}
 
+std::list<DatabaseInfo> DatabaseManager::retrieveAllByPosition(
+        const double latitude, const double longitude, const std::string &rat, const double radius) {
+
+    double radius_decimal_degrees = DatabaseManager::metersToDecimalDegrees(radius);
+    //If radius is in meters => decimal degrees = meters * .00001 (convert meters to decimal degrees)
+
+    std::list<DatabaseInfo> databaseInfoList;
+
+    ConnectionPool::Lease conn = this->getPool()->checkout();
+    if (!conn) return databaseInfoList;
+    if (!conn->setupOnce("spatial_schema", createSpatialSchemaSql)) return databaseInfoList;
+
+    try {
         std::string param_latitude = std::to_string(latitude);
         std::string param_longitude = std::to_string(longitude);
         std::string param_radius = std::to_string(radius_decimal_degrees);
+        std::vector<std::string> cells = cellRangeAround(latitude, longitude, radius_decimal_degrees);
 
         const char *const queryAllParamValues[] = { param_latitude.c_str(), param_longitude.c_str(),
-                                                    rat.c_str(), param_radius.c_str() };
+                                                    rat.c_str(), param_radius.c_str(),
+                                                    cells[0].c_str(), cells[1].c_str(),
+                                                    cells[2].c_str(), cells[3].c_str() };
 
-        // EXECUTE STATEMENT TO UPDATE HISTORY
-        if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
-            std::stringstream ss;
-            ss << "PQprepare failed:" << PQresultErrorMessage(res);
-            LOG_ERR(ss.str().c_str());
+        PGresult *res = execWithRetry(*conn, queryAllStatement, queryAllParamValues, PGRES_TUPLES_OK);
+        if (!res) return databaseInfoList;
 
-            std::cout << ss << std::endl;
+        for (int i = 0; i < PQntuples(res); i++) {
+            DatabaseInfo databaseInfo = rowToDatabaseInfo(res, i);
+            databaseInfo.longitude = longitude;
+            databaseInfo.latitude = latitude;
 
-            PQclear(res);
-            PQfinish(conn);
-            return databaseInfoList;
+            databaseInfoList.push_back(databaseInfo);
         }
-        else
-        {
-            PQclear(res);
-            res = PQexecPrepared(conn, "query_all_location", queryAllNumParams, queryAllParamValues,
-                                 nullptr, nullptr, resultFormat);
-
-            if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-                std::stringstream ss;
-                ss << "PQexecPrepared failed:" << PQresultErrorMessage(res);
-                LOG_ERR(ss.str().c_str());
-
-                std::cout << ss << std::endl;
-                PQclear(res);
-                PQfinish(conn);
 
-                return databaseInfoList;
-            }
-            else {
-
-                for (int i = 0; i < PQntuples(res); i++) {
-                    const std::string timestamp(PQgetvalue(res, i, 0));
-                    const std::string throughput(PQgetvalue(res, i, 1));
-                    const std::string numBits(PQgetvalue(res, i, 2));
-                    const std::string channelInfo(PQgetvalue(res, i, 3));
-                    const std::string scanInfo(PQgetvalue(res, i, 4));
-                    const std::string speed(PQgetvalue(res, i, 6));
-                    const std::string orientation(PQgetvalue(res, i, 7));
-                    const std::string moving(PQgetvalue(res, i, 8));
-                    const std::string tx_bitrate(PQgetvalue(res, i, 9));
-                    const std::string signal_strength(PQgetvalue(res, i, 10));
-
-                    DatabaseInfo databaseInfo;
-                    databaseInfo.longitude = longitude;
-                    databaseInfo.latitude = latitude;
-                    databaseInfo.timestamp = std::stoll(timestamp.c_str());
-                    databaseInfo.throughput = std::stoi(throughput.c_str());
-                    databaseInfo.numBits = std::stoi(numBits.c_str());
-                    databaseInfo.channelInfo = channelInfo;
-                    databaseInfo.scanInfo = scanInfo;
-                    databaseInfo.rat = rat;
-                    databaseInfo.speed = std::stod(speed.c_str());
-                    databaseInfo.orientation = std::stod(orientation.c_str());
-                    databaseInfo.moving = std::stoi(moving.c_str());
-                    databaseInfo.tx_bitrate = std::stoi(tx_bitrate.c_str());
-                    databaseInfo.signal_strength = std::stoi(signal_strength.c_str());
-
-                    databaseInfoList.push_back(databaseInfo);
-                }
-            }
-            PQclear(res);
-        }
-        PQfinish(conn);
+        PQclear(res);
     }
     catch (std::exception const &exception) {
         LOG_ERR(exception.what())
@@ -466,154 +938,154 @@ std::list<DatabaseInfo> DatabaseManager::retrieveAllByPosition(
     return databaseInfoList;
 }
 
-std::list<DatabaseInfo> DatabaseManager::retrieveForecastAllByPosition(
-        const double latitude, const double longitude,
-        const double forecast, const double interval, double radius) {
+std::vector<RatStats> DatabaseManager::retrieveStatsByPosition(
+        const double latitude, const double longitude, const double radius) {
 
     double radius_decimal_degrees = DatabaseManager::metersToDecimalDegrees(radius);
 
-    // Queries for every entry where the position corresponds to lat and lon coordinates
-    // and adds the history_id index with the forecast
-    // $1 -> latitude
-    // $2 -> longitude
-    // $3 -> forecast (in seconds)
-    // $4 -> time interval between samples (in seconds)
-    // $5 -> radius
-    const std::string queryAllForecastPrepStatement =
-            "WITH subquery (timestamp, rat) "
-            "         AS ( "
-            "        SELECT h2.timestamp, h2.rat "
-            "        FROM history h2 "
-            "                 INNER JOIN location l2 on l2.location_id = h2.location_id "
-            "        WHERE abs(l2.latitude - $1) <= ($5 / 2) "
-            "          AND abs(l2.longitude - $2) <= ($5 / 2) "
-            "    ) "
-            "SELECT EXTRACT(EPOCH FROM h1.timestamp) * 1000 as millis, "
-            "       h1.throughput, "
-            "       h1.num_bits, "
-            "       h1.channel_info, "
-            "       h1.scan_info, "
-            "       h1.rat, "
-            "       h1.speed, "
-            "       h1.orientation, "
-            "       h1.moving, "
-            "       h1.tx_bitrate, "
-            "       h1.signal_strength, "
-            "       l1.latitude, "
-            "       l1.longitude "
-            "FROM history h1 "
-            "         JOIN location l1 on l1.location_id = h1.location_id, "
-            "     subquery h2 "
-            "WHERE h1.rat = h2.rat "
-            "  AND ABS(extract(epoch from h1.timestamp) - (extract(epoch from h2.timestamp) + $3)) <= $4;";
-    const int queryAllForecastNumParams = 5;
+    std::string param_latitude = std::to_string(latitude);
+    std::string param_longitude = std::to_string(longitude);
+    std::string param_radius = std::to_string(radius_decimal_degrees);
+    std::vector<std::string> cells = cellRangeAround(latitude, longitude, radius_decimal_degrees);
 
-    std::list<DatabaseInfo> databaseInfoList;
+    const char *const queryStatsParamValues[] = { param_latitude.c_str(), param_longitude.c_str(),
+                                                  param_radius.c_str(),
+                                                  cells[0].c_str(), cells[1].c_str(),
+                                                  cells[2].c_str(), cells[3].c_str() };
 
-    try {
-        std::string connectionString = this->getConnectionString();
-        PGconn *conn = PQconnectdb(connectionString.c_str());
+    return this->retrieveStats(queryStatsStatement, queryStatsParamValues);
+}
 
-        /* Check to see that the backend conn was successfully made */
-        if (PQstatus(conn) != CONNECTION_OK) {
-            std::stringstream ss;
-            ss << "Connection to database failed: " << PQerrorMessage(conn);
-            LOG_ERR(ss.str().c_str());
+std::list<DatabaseInfo> DatabaseManager::retrieveForecastAllByPosition(
+        const double latitude, const double longitude,
+        const double forecast, const double interval, double radius) {
 
-            std::cout << ss << std::endl;
-            PQfinish(conn);
-            return databaseInfoList;
-        }
+    double radius_decimal_degrees = DatabaseManager::metersToDecimalDegrees(radius);
 
-        PGresult *res = NULL;
-        res = PQprepare(conn, "query_forecast_position", queryAllForecastPrepStatement.c_str(),
-                        queryAllForecastNumParams, NULL);
+    std::list<DatabaseInfo> databaseInfoList;
 
-        int resultFormat = 0;
+    ConnectionPool::Lease conn = this->getPool()->checkout();
+    if (!conn) return databaseInfoList;
+    if (!conn->setupOnce("spatial_schema", createSpatialSchemaSql)) return databaseInfoList;
 
+    try {
         std::string param_latitude = std::to_string(latitude);
         std::string param_longitude = std::to_string(longitude);
         std::string param_radius = std::to_string(radius_decimal_degrees);
         std::string param_forecast = std::to_string(forecast);
         std::string param_interval = std::to_string(interval);
+        std::vector<std::string> cells = cellRangeAround(latitude, longitude, radius_decimal_degrees / 2);
 
+        // same order as the statement parameters: $3 forecast, $4 interval, $5 radius
         const char *const queryAllForecastParamValues[] = {
                 param_latitude.c_str(), param_longitude.c_str(),
+                param_forecast.c_str(), param_interval.c_str(),
                 param_radius.c_str(),
-                param_forecast.c_str(), param_interval.c_str()};
+                cells[0].c_str(), cells[1].c_str(), cells[2].c_str(), cells[3].c_str()};
 
-        // EXECUTE STATEMENT TO UPDATE HISTORY
-        if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
-            std::stringstream ss;
-            ss << "PQprepare failed:" << PQresultErrorMessage(res);
-            LOG_ERR(ss.str().c_str());
+        PGresult *res = execWithRetry(*conn, queryForecastStatement, queryAllForecastParamValues, PGRES_TUPLES_OK);
+        if (!res) return databaseInfoList;
 
-            std::cout << ss << std::endl;
-            PQclear(res);
-            PQfinish(conn);
+        for (int i = 0; i < PQntuples(res); i++) {
+            DatabaseInfo databaseInfo = rowToDatabaseInfo(res, i);
+            databaseInfo.longitude = longitude;
+            databaseInfo.latitude = latitude;
 
-            return databaseInfoList;
+            databaseInfoList.push_back(databaseInfo);
         }
-        else
-        {
-            PQclear(res);
 
-            res = PQexecPrepared(conn, "query_forecast_position", queryAllForecastNumParams,
-                                 queryAllForecastParamValues, nullptr, nullptr, resultFormat);
+        PQclear(res);
+    }
+    catch (std::exception const &exception) {
+        LOG_ERR(exception.what())
+    }
 
-            if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-                std::stringstream ss;
-                ss << "PQexecPrepared failed: " << PQresultErrorMessage(res);
-                LOG_ERR(ss.str().c_str());
+    return databaseInfoList;
+}
 
-                std::cout << ss << std::endl;
-                PQclear(res);
-                PQfinish(conn);
-
-                return databaseInfoList;
-            } else {
-                for (int i = 0; i < PQntuples(res); i++) {
-                    const std::string timestamp(PQgetvalue(res, i, 0));
-                    const std::string throughput(PQgetvalue(res, i, 1));
-                    const std::string numBits(PQgetvalue(res, i, 2));
-                    const std::string channelInfo(PQgetvalue(res, i, 3));
-                    const std::string scanInfo(PQgetvalue(res, i, 4));
-                    const std::string rat(PQgetvalue(res, i, 5));
-                    const std::string speed(PQgetvalue(res, i, 6));
-                    const std::string orientation(PQgetvalue(res, i, 7));
-                    const std::string moving(PQgetvalue(res, i, 8));
-                    const std::string tx_bitrate(PQgetvalue(res, i, 9));
-                    const std::string signal_strength(PQgetvalue(res, i, 10));
-
-                    DatabaseInfo databaseInfo;
-                    databaseInfo.longitude = longitude;
-                    databaseInfo.latitude = latitude;
-                    databaseInfo.timestamp = std::stoi(timestamp.c_str());
-                    databaseInfo.throughput = std::stoi(throughput.c_str());
-                    databaseInfo.numBits = std::stoi(numBits.c_str());
-                    databaseInfo.channelInfo = channelInfo;
-                    databaseInfo.scanInfo = scanInfo;
-                    databaseInfo.rat = rat;
-                    databaseInfo.speed = std::stod(speed.c_str());
-                    databaseInfo.orientation = std::stod(orientation.c_str());
-                    databaseInfo.moving = std::stoi(moving.c_str());
-                    databaseInfo.tx_bitrate = std::stoi(tx_bitrate.c_str());
-                    databaseInfo.signal_strength = std::stoi(signal_strength.c_str());
-
-                    databaseInfoList.push_back(databaseInfo);
-                }
-            }
+std::vector<RatStats> DatabaseManager::retrieveForecastStatsByPosition(
+        const double latitude, const double longitude,
+        const double forecast, const double interval, double radius) {
 
-            PQclear(res);
+    double radius_decimal_degrees = DatabaseManager::metersToDecimalDegrees(radius);
+
+    std::string param_latitude = std::to_string(latitude);
+    std::string param_longitude = std::to_string(longitude);
+    std::string param_radius = std::to_string(radius_decimal_degrees);
+    std::string param_forecast = std::to_string(forecast);
+    std::string param_interval = std::to_string(interval);
+    std::vector<std::string> cells = cellRangeAround(latitude, longitude, radius_decimal_degrees / 2);
+
+    const char *const queryForecastStatsParamValues[] = {
+            param_latitude.c_str(), param_longitude.c_str(),
+            param_forecast.c_str(), param_interval.c_str(),
+            param_radius.c_str(),
+            cells[0].c_str(), cells[1].c_str(), cells[2].c_str(), cells[3].c_str()};
+
+    return this->retrieveStats(queryForecastStatsStatement, queryForecastStatsParamValues);
+}
+
+bool DatabaseManager::retrieveStatsByCells(int64_t latLo, int64_t latHi, int64_t lonLo, int64_t lonHi,
+                                           std::vector<CellStats> &cellStatsList) {
+    cellStatsList.clear();
+
+    ConnectionPool::Lease conn = this->getPool()->checkout();
+    if (!conn) return false;
+    if (!conn->setupOnce("spatial_schema", createSpatialSchemaSql)) return false;
+
+    try {
+        std::string param_latlo = std::to_string(latLo);
+        std::string param_lathi = std::to_string(latHi);
+        std::string param_lonlo = std::to_string(lonLo);
+        std::string param_lonhi = std::to_string(lonHi);
+
+        const char *const queryCellStatsParamValues[] = { param_latlo.c_str(), param_lathi.c_str(),
+                                                          param_lonlo.c_str(), param_lonhi.c_str() };
+
+        PGresult *res = execWithRetry(*conn, queryCellStatsStatement, queryCellStatsParamValues, PGRES_TUPLES_OK);
+        if (!res) return false;
+
+        for (int i = 0; i < PQntuples(res); i++) {
+            CellStats cellStats;
+            cellStats.cellId = std::stoll(PQgetvalue(res, i, 0));
+            cellStats.stats = rowToRatStats(res, i, 1);
+
+            cellStatsList.push_back(cellStats);
         }
 
-        PQfinish(conn);
+        PQclear(res);
     }
     catch (std::exception const &exception) {
         LOG_ERR(exception.what())
+        return false;
     }
 
-    return databaseInfoList;
+    return true;
+}
+
+std::vector<RatStats> DatabaseManager::retrieveStats(const PreparedStatement &statement,
+                                                     const char *const *paramValues) {
+    std::vector<RatStats> ratStatsList;
+
+    ConnectionPool::Lease conn = this->getPool()->checkout();
+    if (!conn) return ratStatsList;
+    if (!conn->setupOnce("spatial_schema", createSpatialSchemaSql)) return ratStatsList;
+
+    try {
+        PGresult *res = execWithRetry(*conn, statement, paramValues, PGRES_TUPLES_OK);
+        if (!res) return ratStatsList;
+
+        for (int i = 0; i < PQntuples(res); i++) {
+            ratStatsList.push_back(rowToRatStats(res, i));
+        }
+
+        PQclear(res);
+    }
+    catch (std::exception const &exception) {
+        LOG_ERR(exception.what())
+    }
+
+    return ratStatsList;
 }
 
 std::string DatabaseManager::getConnectionString() {
@@ -622,6 +1094,18 @@ std::string DatabaseManager::getConnectionString() {
     return connectionString;
 }
 
+int64_t DatabaseManager::latCellIndex(double latitude) {
+    return (int64_t) std::floor((latitude + 90) / DB_GRID_CELL_DEG);
+}
+
+int64_t DatabaseManager::lonCellIndex(double longitude) {
+    return (int64_t) std::floor((longitude + 180) / DB_GRID_CELL_DEG);
+}
+
+int64_t DatabaseManager::cellId(int64_t latIndex, int64_t lonIndex) {
+    return (latIndex << 32) | lonIndex;
+}
+
 double DatabaseManager::metersToDecimalDegrees(double meters) {
     double decimalDegrees = meters * 0.000009009;
     return decimalDegrees;
@@ -15,9 +15,17 @@
 #include <sstream>
 #include <queue>
 #include <list>
+#include <memory>
+#include <vector>
 
 #include "../../util/configfile.hpp"
 #include "DatabaseInfo.hpp"
+#include "ConnectionPool.hpp"
+
+#define DB_POOL_SIZE_DEF 2 // connections shared by the modules of a process
+#define DB_COPY_MIN_ROWS_DEF 32 // smallest batch written with COPY
+#define DB_COPY_CHUNK_LEN (256 * 1024) // bytes per PQputCopyData() call
+#define DB_GRID_CELL_DEG 0.0005 // side of the location index grid cells (about 55 m)
 
 /**
  * This class represents an interface through which to access the database
@@ -25,6 +33,10 @@
  *
  * This interface is specific to PostgreSQL databases, as that is the one
  * that is used to store the historic records.
+ *
+ * Every DatabaseManager configured for the same database shares one
+ * ConnectionPool, so the connections (and their prepared statements) survive
+ * between calls and can be used from several threads.
  */
 class DatabaseManager {
 private:
@@ -32,6 +44,10 @@ private:
     std::string host;
     std::string dbUser;
     std::string password;
+    int poolSize;
+    int copyMinRows;
+
+    std::shared_ptr<ConnectionPool> pool;
 
     /**
      * Get the connection string to connect to the database.
@@ -39,6 +55,24 @@ private:
      */
     std::string getConnectionString();
 
+    /**
+     * Get the connection pool of the configured database (created on first use).
+     * @return connection pool
+     */
+    std::shared_ptr<ConnectionPool> getPool();
+
+    /**
+     * Inserts the entries in a single transaction, replaying it once on a
+     * new connection if the current one is lost.
+     * @param copy true to stream the entries with COPY, false to insert them row by row
+     * @return true if the transaction was committed
+     */
+    bool insert(DatabaseInfo *databaseInfos, size_t count, bool copy);
+    bool insertBatch(ConnectionPool::Connection &conn, DatabaseInfo *databaseInfos, size_t count);
+    bool copyBatch(ConnectionPool::Connection &conn, DatabaseInfo *databaseInfos, size_t count);
+
+    std::vector<RatStats> retrieveStats(const PreparedStatement &statement, const char *const *paramValues);
+
 public:
 
     DatabaseManager(std::string  dbName, std::string  host,
@@ -46,23 +80,36 @@ public:
     DatabaseManager();
 
     /**
-     * Configure the database parameters (i.e., dbName, host, dbUser and password)
-     * based on the information from the given configuration file.
+     * Configure the database parameters (i.e., dbName, host, dbUser, password and
+     * the optional pool-size and copy-min-rows) based on the information from the
+     * given configuration file.
      * @param configFile configuration file
      */
     void configure(ConfigFile &configFile);
 
     /**
-     * Adds multiple entries to the database.
+     * Adds multiple entries to the database, in a single transaction. Batches of at
+     * least copy-min-rows entries are streamed with COPY.
+     * @param databaseInfoList
+     * @return true if the entries were committed
+     */
+    bool createAll(std::vector<DatabaseInfo>& databaseInfoList);
+
+    /**
+     * Adds multiple entries to the database with COPY, whatever the batch size.
+     * Entries are staged in a temporary table and then moved into location and
+     * history set-wise.
      * @param databaseInfoList
+     * @return true if the entries were committed
      */
-    void createAll(std::vector<DatabaseInfo>& databaseInfoList);
+    bool copyAll(std::vector<DatabaseInfo>& databaseInfoList);
 
     /**
      * Adds a new entry to the database.
      * @param databaseInfo
+     * @return true if the entry was committed
      */
-    void create(DatabaseInfo& databaseInfo);
+    bool create(DatabaseInfo& databaseInfo);
 
     /**
      * Updates entries between begin and end with new scan_info
@@ -72,6 +119,14 @@ public:
      */
     void updateScanInfo(DatabaseInfo& databaseInfo, uint64_t begin, uint64_t end);
 
+    /**
+     * Creates the grid cell index of location and the history indexes used by the
+     * position queries, if they don't exist yet. The queries call it on their own,
+     * but on a large database the first build takes a while.
+     * @return true if the indexes are ready
+     */
+    bool setupSpatialIndex();
+
     /**
      * Retrieves every entry that corresponds to the given coordinates and to
      * the specified RAT.
@@ -84,6 +139,16 @@ public:
     std::list<DatabaseInfo> retrieveAllByPosition(
             double latitude, double longitude, const std::string& rat, double radius);
 
+    /**
+     * Same entries as retrieveAllByPosition, for every RAT, aggregated per RAT by
+     * the database.
+     * @param latitude  latitude coordinates
+     * @param longitude longitude coordinates
+     * @param radius    radius to consider similar samples (in meters)
+     * @return statistics of each RAT with samples in the area
+     */
+    std::vector<RatStats> retrieveStatsByPosition(double latitude, double longitude, double radius);
+
     /**
      * Gets the samples that correspond to the given coordinates, and
      * then shifts forward by {@code forecast} seconds.
@@ -106,6 +171,30 @@ public:
     std::list<DatabaseInfo> retrieveForecastAllByPosition(
             double latitude, double longitude, double forecast, double interval, double radius);
 
+    /**
+     * Same entries as retrieveForecastAllByPosition, aggregated per RAT by the database.
+     * @return statistics of each RAT with forecast samples
+     */
+    std::vector<RatStats> retrieveForecastStatsByPosition(
+            double latitude, double longitude, double forecast, double interval, double radius);
+
+    /**
+     * Per-RAT statistics of every grid cell with samples in a block of cells.
+     * @param latLo first latitude cell index
+     * @param latHi last latitude cell index
+     * @param lonLo first longitude cell index
+     * @param lonHi last longitude cell index
+     * @param cellStatsList one entry per cell and RAT
+     * @return false if the database couldn't be queried
+     */
+    bool retrieveStatsByCells(int64_t latLo, int64_t latHi, int64_t lonLo, int64_t lonHi,
+                              std::vector<CellStats> &cellStatsList);
+
+    // Grid cells of the location index (same as the wiperf_cell_id() SQL function)
+    static int64_t latCellIndex(double latitude);
+    static int64_t lonCellIndex(double longitude);
+    static int64_t cellId(int64_t latIndex, int64_t lonIndex);
+
     //Convert from meters to decimal degrees and vice versa, to compare with lat and long
     static double metersToDecimalDegrees(double meters);
     static double decimalDegreesToMeters(double decimalDegrees);
@@ -0,0 +1,395 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "DatabaseWriter.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <sstream>
+
+#include "../../util/logfile.hpp"
+
+std::mutex DatabaseWriter::instanceMutex;
+std::weak_ptr<DatabaseWriter> DatabaseWriter::instance;
+
+std::shared_ptr<DatabaseWriter> DatabaseWriter::get(ConfigFile &configFile) {
+    std::lock_guard<std::mutex> lock(instanceMutex);
+
+    std::shared_ptr<DatabaseWriter> writer = instance.lock();
+    if (!writer) {
+        writer = std::make_shared<DatabaseWriter>();
+        writer->configure(configFile);
+        instance = writer;
+    }
+
+    return writer;
+}
+
+DatabaseWriter::DatabaseWriter() :
+        databaseManager(), queueLen(DB_WRITER_QUEUE_LEN_DEF), batchLen(DB_WRITER_BATCH_LEN_DEF),
+        flushInterval(DB_WRITER_FLUSH_INTERVAL_DEF), overflowPolicy(OverflowPolicy::dropOldest),
+        spillFile(), spoolFile(), retryInterval(DB_WRITER_RETRY_INTERVAL_DEF), offline(false), offlineUntil(),
+        mutex(), cond(), queue(), merger(), mergedRows(), stopping(false), writerThread(), stats(),
+        insertLatency(Metrics::getInstance()->histogram("wiperf_db_insert_latency_us",
+                                                        "Time to write a batch to the database, in us", "",
+                                                        1024, 16)),
+        metricsCollector(-1), lifeMutex(), users(0) {
+}
+
+DatabaseWriter::~DatabaseWriter() {
+    std::lock_guard<std::mutex> lock(this->lifeMutex);
+    this->users = 0;
+    this->stopWriter();
+}
+
+void DatabaseWriter::configure(ConfigFile &configFile) {
+    this->databaseManager.configure(configFile);
+
+    // optional writer parameters
+    try {
+        this->queueLen = std::stoul(configFile.Value("database", "writer-queue-len"));
+    } catch (std::exception const&) {
+        this->queueLen = DB_WRITER_QUEUE_LEN_DEF;
+    }
+
+    try {
+        this->batchLen = std::stoul(configFile.Value("database", "writer-batch-len"));
+    } catch (std::exception const&) {
+        this->batchLen = DB_WRITER_BATCH_LEN_DEF;
+    }
+
+    try {
+        this->flushInterval = std::stoi(configFile.Value("database", "writer-flush-interval"));
+    } catch (std::exception const&) {
+        this->flushInterval = DB_WRITER_FLUSH_INTERVAL_DEF;
+    }
+
+    try {
+        this->overflowPolicy = strToOverflowPolicy(configFile.Value("database", "writer-overflow"));
+    } catch (std::exception const&) {
+        this->overflowPolicy = OverflowPolicy::dropOldest;
+    }
+
+    std::string spillPath;
+    try {
+        spillPath = configFile.Value("database", "writer-spill-path");
+    } catch (std::exception const&) {
+        spillPath = DB_WRITER_SPILL_PATH_DEF;
+    }
+
+    std::string spoolPath;
+    try {
+        spoolPath = configFile.Value("database", "writer-spool-path");
+    } catch (std::exception const&) {
+        spoolPath = DB_WRITER_SPOOL_PATH_DEF;
+    }
+
+    try {
+        this->retryInterval = std::stoi(configFile.Value("database", "writer-retry-interval"));
+    } catch (std::exception const&) {
+        this->retryInterval = DB_WRITER_RETRY_INTERVAL_DEF;
+    }
+
+    uint64_t mergeResolution;
+    try {
+        mergeResolution = std::stoull(configFile.Value("database", "writer-merge-resolution"));
+    } catch (std::exception const&) {
+        mergeResolution = DB_WRITER_MERGE_RESOLUTION_DEF;
+    }
+
+    int mergeWindow;
+    try {
+        mergeWindow = std::stoi(configFile.Value("database", "writer-merge-window"));
+    } catch (std::exception const&) {
+        mergeWindow = DB_WRITER_MERGE_WINDOW_DEF;
+    }
+
+    this->merger.configure(mergeResolution, mergeWindow);
+
+    if (this->queueLen < 1) this->queueLen = 1;
+    if (this->batchLen < 1 || this->batchLen > this->queueLen) this->batchLen = this->queueLen;
+    if (this->flushInterval < 1) this->flushInterval = 1;
+    if (this->retryInterval < 0) this->retryInterval = 0;
+
+    this->spillFile.reset();
+    if (this->overflowPolicy == OverflowPolicy::spill) {
+        this->spillFile.reset(new SpillFile(spillPath));
+    }
+
+    this->spoolFile.reset();
+    if (this->overflowPolicy == OverflowPolicy::spool) {
+        this->spoolFile.reset(new SpoolFile(spoolPath));
+    }
+
+    std::stringstream ss;
+    ss << "Database writer: queue " << this->queueLen << ", batch " << this->batchLen
+       << ", flush interval " << this->flushInterval << " ms, overflow "
+       << overflowPolicyToStr(this->overflowPolicy);
+    if (this->spillFile) ss << " (" << this->spillFile->getPath() << ")";
+    if (this->spoolFile) ss << " (" << this->spoolFile->getPath() << ", retry interval " << this->retryInterval << " ms)";
+    if (this->merger.enabled()) ss << ", merging on a " << mergeResolution << " ms grid within " << mergeWindow << " ms";
+    LOG_MSG(ss.str().c_str());
+}
+
+void DatabaseWriter::start() {
+    std::lock_guard<std::mutex> lock(this->lifeMutex);
+    if (this->users++ > 0 || this->writerThread.joinable()) return;
+
+    this->stopping = false;
+    this->writerThread = std::thread(&DatabaseWriter::writerLoop, this);
+
+    this->metricsCollector = Metrics::getInstance()->addCollector([this](MetricsText &text) {
+        text.gauge("wiperf_db_queue_depth", "Entries queued to be written", "", this->stats.backlog.load());
+        text.counter("wiperf_db_enqueued_total", "Entries accepted by the writer", "", this->stats.enqueued.load());
+        text.counter("wiperf_db_written_total", "Entries committed to the database", "", this->stats.written.load());
+        text.counter("wiperf_db_dropped_total", "Entries discarded", "", this->stats.dropped.load());
+        text.counter("wiperf_db_spilled_total", "Entries written to the spill file", "", this->stats.spilled.load());
+        text.counter("wiperf_db_spooled_total", "Entries written to the spool file", "", this->stats.spooled.load());
+        text.counter("wiperf_db_merged_total", "Entries merged into the row of another", "", this->stats.merged.load());
+        text.counter("wiperf_db_failed_flushes_total", "Batches the database refused", "",
+                     this->stats.failedFlushes.load());
+    });
+}
+
+void DatabaseWriter::stop() {
+    std::lock_guard<std::mutex> lock(this->lifeMutex);
+    if (this->users == 0 || --this->users > 0) return;
+
+    this->stopWriter();
+}
+
+void DatabaseWriter::stopWriter() {
+    if (!this->writerThread.joinable()) return;
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->cond.notify_one();
+    this->writerThread.join();
+
+    Metrics::getInstance()->removeCollector(this->metricsCollector);
+    this->metricsCollector = -1;
+
+    std::stringstream ss;
+    ss << "Database writer stopped: " << this->stats.written << " written, "
+       << this->stats.dropped << " dropped, " << this->stats.spilled << " spilled, "
+       << this->stats.spooled << " spooled, " << this->stats.merged << " merged, "
+       << this->stats.failedFlushes << " failed flushes";
+    LOG_MSG(ss.str().c_str());
+}
+
+void DatabaseWriter::enqueue(std::vector<DatabaseInfo> &databaseInfoList) {
+    if (databaseInfoList.empty()) return;
+
+    const size_t count = databaseInfoList.size();
+    std::vector<DatabaseInfo> overflow;
+    std::vector<DatabaseInfo> merged;
+    bool flushNow;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+
+        // only the rows the merger completes are queued, the rest wait in it
+        std::vector<DatabaseInfo> &ready = this->merger.enabled() ? merged : databaseInfoList;
+        if (this->merger.enabled()) this->stats.merged += this->merger.add(databaseInfoList, merged);
+
+        this->push(ready, overflow);
+        flushNow = this->queue.size() >= this->batchLen;
+    }
+
+    this->stats.enqueued += count;
+    databaseInfoList.clear();
+
+    // wake the writer only when a batch is ready, the timeout takes care of the rest
+    if (flushNow) this->cond.notify_one();
+
+    // outside the lock, so the writer thread never waits on the spill file
+    if (!overflow.empty()) this->discard(overflow.data(), overflow.size());
+}
+
+void DatabaseWriter::push(std::vector<DatabaseInfo> &databaseInfoList, std::vector<DatabaseInfo> &overflow) {
+    for (DatabaseInfo &databaseInfo : databaseInfoList) {
+        if (this->queue.size() >= this->queueLen) {
+            overflow.push_back(std::move(this->queue.front()));
+            this->queue.pop_front();
+        }
+        this->queue.push_back(std::move(databaseInfo));
+    }
+
+    this->stats.backlog = this->queue.size();
+}
+
+void DatabaseWriter::writerLoop() {
+    std::vector<DatabaseInfo> overflow;
+    std::vector<DatabaseInfo> batch;
+    int attempt = 0;
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true) {
+        if (attempt > 0) {
+            // back off after a failure, the database is probably down
+            this->cond.wait_for(lock, std::chrono::milliseconds(this->flushInterval),
+                                [this] { return this->stopping; });
+        }
+        else {
+            this->cond.wait_for(lock, std::chrono::milliseconds(this->flushInterval),
+                                [this] { return this->stopping || this->queue.size() >= this->batchLen; });
+        }
+
+        // the slots that waited long enough, or all of them when stopping, go out as they are
+        if (this->merger.enabled() && this->merger.size() > 0) {
+            this->merger.expire(std::chrono::steady_clock::now(), this->stopping, this->mergedRows);
+            this->push(this->mergedRows, overflow);
+            this->mergedRows.clear();
+
+            // bounded by the queue as the entries enqueued, and handled the same way
+            if (!overflow.empty()) {
+                lock.unlock();
+                this->discard(overflow.data(), overflow.size());
+                overflow.clear();
+                lock.lock();
+            }
+        }
+
+        // a batch that failed is retried before anything else
+        if (batch.empty()) {
+            size_t n = std::min(this->queue.size(), this->batchLen);
+            batch.assign(std::make_move_iterator(this->queue.begin()),
+                         std::make_move_iterator(this->queue.begin() + n));
+            this->queue.erase(this->queue.begin(), this->queue.begin() + n);
+            this->stats.backlog = this->queue.size();
+        }
+
+        if (batch.empty()) {
+            if (this->stopping) break;
+            continue;
+        }
+
+        // when stopping, the waits above return right away and the queue is drained
+        bool stopping = this->stopping;
+        lock.unlock();
+
+        bool done = this->flush(batch, attempt);
+        if (!done && stopping) {
+            this->discard(batch.data(), batch.size());  // no more retries
+            done = true;
+        }
+
+        if (done) {
+            batch.clear();
+            attempt = 0;
+        }
+        else {
+            ++attempt;
+        }
+
+        lock.lock();
+    }
+    lock.unlock();
+
+    if (this->spillFile) this->spillFile->flush();
+    if (this->spoolFile) this->spoolFile->flush();
+}
+
+bool DatabaseWriter::flush(std::vector<DatabaseInfo> &batch, int attempt) {
+    const auto start = std::chrono::steady_clock::now();
+
+    if (this->offline && start < this->offlineUntil) {
+        this->discard(batch.data(), batch.size());  // to the spool, without waiting on the database
+        return true;
+    }
+
+    const bool written = this->databaseManager.createAll(batch);
+    const auto end = std::chrono::steady_clock::now();
+    this->insertLatency.observe(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+
+    if (written) {
+        this->stats.written += batch.size();
+
+        if (this->offline) {
+            this->offline = false;
+            this->spoolFile->seal();  // so the uploader can take all of it
+
+            std::stringstream ss;
+            ss << "Database writer: database reachable again, spooled entries are in "
+               << this->spoolFile->getPath();
+            LOG_MSG(ss.str().c_str());
+        }
+        return true;
+    }
+
+    ++this->stats.failedFlushes;
+
+    if (this->spoolFile) {
+        if (!this->offline) {
+            std::stringstream ss;
+            ss << "Database writer: database unreachable, spooling for at least " << this->retryInterval << " ms";
+            LOG_WARN(ss.str().c_str());
+        }
+
+        this->offline = true;
+        this->offlineUntil = end + std::chrono::milliseconds(this->retryInterval);
+        this->discard(batch.data(), batch.size());
+        return true;
+    }
+
+    // with spill there's no point in holding the batch in memory
+    if (this->overflowPolicy == OverflowPolicy::spill || attempt + 1 >= DB_WRITER_MAX_RETRIES) {
+        std::stringstream ss;
+        ss << "Database writer: giving up a batch of " << batch.size() << " entries";
+        LOG_WARN(ss.str().c_str());
+
+        this->discard(batch.data(), batch.size());
+        return true;
+    }
+
+    return false;
+}
+
+void DatabaseWriter::discard(const DatabaseInfo *databaseInfos, size_t count) {
+    if (this->spoolFile) {
+        size_t spooled = this->spoolFile->append(databaseInfos, count);
+        this->stats.spooled += spooled;
+        this->stats.dropped += count - spooled;
+        return;
+    }
+
+    if (this->spillFile && this->spillFile->append(databaseInfos, count)) {
+        this->stats.spilled += count;
+        return;
+    }
+
+    this->stats.dropped += count;
+}
+
+const DatabaseWriter::Stats &DatabaseWriter::getStats() const {
+    return this->stats;
+}
+
+OverflowPolicy DatabaseWriter::strToOverflowPolicy(const std::string &str) {
+    if (str == "spill") {
+        return OverflowPolicy::spill;
+    }
+    else if (str == "spool") {
+        return OverflowPolicy::spool;
+    }
+    else {
+        return OverflowPolicy::dropOldest;
+    }
+}
+
+std::string DatabaseWriter::overflowPolicyToStr(OverflowPolicy policy) {
+    switch (policy) {
+        case OverflowPolicy::spill:
+            return "spill";
+        case OverflowPolicy::spool:
+            return "spool";
+        default:
+            return "drop-oldest";
+    }
+}
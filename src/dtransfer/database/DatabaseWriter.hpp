@@ -0,0 +1,168 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the Database Writer, a write-behind queue in front of the Database Manager.
+ * Producers enqueue entries without ever waiting for the database; a dedicated thread
+ * groups them into batches and writes them once enough entries are queued or enough
+ * time has passed.
+ */
+
+#ifndef WIPERF_IMPL_DATABASEWRITER_HPP
+#define WIPERF_IMPL_DATABASEWRITER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../util/configfile.hpp"
+#include "../../util/metrics.hpp"
+#include "DatabaseInfo.hpp"
+#include "DatabaseManager.hpp"
+#include "SampleMerger.hpp"
+#include "SpillFile.hpp"
+#include "SpoolFile.hpp"
+
+#define DB_WRITER_QUEUE_LEN_DEF 4096      // entries held in memory
+#define DB_WRITER_BATCH_LEN_DEF 256       // entries that trigger a flush
+#define DB_WRITER_FLUSH_INTERVAL_DEF 1000 // ms, max time an entry waits to be flushed
+#define DB_WRITER_SPILL_PATH_DEF "/tmp/wiperf-spill.bin"
+#define DB_WRITER_SPOOL_PATH_DEF "/tmp/wiperf-spool.bin"
+#define DB_WRITER_RETRY_INTERVAL_DEF 30000 // ms without trying the database after a failure, when spooling
+#define DB_WRITER_MERGE_RESOLUTION_DEF 0   // ms, grid of the sample merger, 0 to write the entries as they come
+#define DB_WRITER_MERGE_WINDOW_DEF 3000    // ms an entry waits for the others of its slot
+#define DB_WRITER_MAX_RETRIES 3           // failed flushes before a batch is given up
+
+/**
+ * What to do with new entries when the queue is full.
+ */
+enum class OverflowPolicy {
+    dropOldest = 0, // discard the oldest queued entries
+    spill = 1,      // move the oldest queued entries to the spill file
+    spool = 2       // move them to the spool file, and every batch the database doesn't take
+};
+
+class DatabaseWriter {
+public:
+    /**
+     * Backlog counters, updated as entries flow through the writer.
+     */
+    struct Stats {
+        std::atomic<uint64_t> backlog;  // entries currently queued
+        std::atomic<uint64_t> enqueued; // entries accepted
+        std::atomic<uint64_t> written;  // entries committed to the database
+        std::atomic<uint64_t> dropped;  // entries discarded
+        std::atomic<uint64_t> spilled;  // entries written to the spill file
+        std::atomic<uint64_t> spooled;  // entries written to the spool file
+        std::atomic<uint64_t> merged;   // entries merged into the row of another
+        std::atomic<uint64_t> failedFlushes;
+    };
+
+private:
+    DatabaseManager databaseManager;
+
+    size_t queueLen;
+    size_t batchLen;
+    int flushInterval; // ms
+    OverflowPolicy overflowPolicy;
+    std::unique_ptr<SpillFile> spillFile;
+    std::unique_ptr<SpoolFile> spoolFile;
+    int retryInterval; // ms
+
+    // with the spool, after a failure the batches go straight to it for a while, so the
+    // collection doesn't wait on connection attempts (only touched by the writer thread)
+    bool offline;
+    std::chrono::steady_clock::time_point offlineUntil;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<DatabaseInfo> queue;
+    SampleMerger merger;                 // in front of the queue, under the same mutex
+    std::vector<DatabaseInfo> mergedRows; // reused by the writer thread
+    bool stopping;
+    std::thread writerThread;
+
+    Stats stats;
+    MetricHistogram &insertLatency; // us per batch written to the database
+    int metricsCollector;           // exports the stats while the writer runs
+
+    std::mutex lifeMutex; // serializes start() and stop()
+    int users;            // start() calls not yet matched by stop()
+
+    static std::mutex instanceMutex;
+    static std::weak_ptr<DatabaseWriter> instance;
+
+    void writerLoop();
+    void stopWriter();
+
+    /**
+     * Writes a batch to the database, retrying failed batches a few times.
+     * @return true if the batch was handled (written or given up), false if it should be retried
+     */
+    bool flush(std::vector<DatabaseInfo> &batch, int attempt);
+
+    /**
+     * Queues the entries (moved from), moving the oldest queued ones to overflow when
+     * the queue is full. Must be called with the mutex held.
+     */
+    void push(std::vector<DatabaseInfo> &databaseInfoList, std::vector<DatabaseInfo> &overflow);
+
+    /**
+     * Discards, spills or spools the entries, as per the overflow policy.
+     */
+    void discard(const DatabaseInfo *databaseInfos, size_t count);
+
+public:
+    DatabaseWriter();
+    ~DatabaseWriter();
+
+    /**
+     * Gets the writer of the process, creating and configuring it on first use. The
+     * components that run in the same process share it, and so its queue, its database
+     * connections and its spill or spool file.
+     * @param configFile configuration file, only read by the first call
+     */
+    static std::shared_ptr<DatabaseWriter> get(ConfigFile &configFile);
+
+    /**
+     * Configures the database and the optional writer parameters (writer-queue-len,
+     * writer-batch-len, writer-flush-interval, writer-overflow, writer-spill-path,
+     * writer-spool-path, writer-retry-interval, writer-merge-resolution and
+     * writer-merge-window).
+     * @param configFile configuration file
+     */
+    void configure(ConfigFile &configFile);
+
+    /**
+     * Starts the writer thread, unless it's already running. Every call must be matched
+     * by a call to stop().
+     */
+    void start();
+
+    /**
+     * Stops the writer thread, after flushing the entries still queued, once every
+     * start() has been matched.
+     */
+    void stop();
+
+    /**
+     * Queues entries to be written, through the sample merger if enabled. Never blocks
+     * on the database.
+     * @param databaseInfoList entries (moved from)
+     */
+    void enqueue(std::vector<DatabaseInfo> &databaseInfoList);
+
+    const Stats &getStats() const;
+
+    static OverflowPolicy strToOverflowPolicy(const std::string &str);
+    static std::string overflowPolicyToStr(OverflowPolicy policy);
+};
+
+#endif //WIPERF_IMPL_DATABASEWRITER_HPP
@@ -0,0 +1,200 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "SampleMerger.hpp"
+
+#include <algorithm>
+
+#define SAMPLE_CHANNEL 0x1
+#define SAMPLE_SCAN 0x2
+#define SAMPLE_FEEDBACK 0x4
+
+// scan info only comes once in a while, it's merged but never waited for
+#define SAMPLE_AWAITED (SAMPLE_CHANNEL | SAMPLE_FEEDBACK)
+
+SampleMerger::SampleMerger() : resolution(0), window(0), slots(), emitted(), kindsSeen() {}
+
+void SampleMerger::configure(uint64_t resolution, int window) {
+    this->resolution = resolution;
+    this->window = std::chrono::milliseconds(std::max(window, 0));
+}
+
+bool SampleMerger::enabled() const {
+    return this->resolution > 0;
+}
+
+unsigned SampleMerger::kindOf(const DatabaseInfo &databaseInfo) {
+    // the same as the history kinds of the Database Manager
+    if (databaseInfo.feedback) {
+        return SAMPLE_FEEDBACK;
+    }
+    else if (!databaseInfo.channelInfo.empty() || !databaseInfo.channelInfoBin.empty()) {
+        return SAMPLE_CHANNEL;
+    }
+    else if (!databaseInfo.scanInfo.empty()) {
+        return SAMPLE_SCAN;
+    }
+    else {
+        return SAMPLE_FEEDBACK;
+    }
+}
+
+void SampleMerger::mergeProbes(ProbeSummary &into, const ProbeSummary &from) {
+    if (from.received > 0) {
+        if (into.received == 0) {
+            into.delayMinUs = from.delayMinUs;
+            into.delayMaxUs = from.delayMaxUs;
+        }
+        else {
+            into.delayMinUs = std::min(into.delayMinUs, from.delayMinUs);
+            into.delayMaxUs = std::max(into.delayMaxUs, from.delayMaxUs);
+        }
+
+        const uint64_t received = (uint64_t) into.received + from.received;
+        into.delayMeanUs = (int32_t) (((int64_t) into.delayMeanUs * into.received +
+                                       (int64_t) from.delayMeanUs * from.received) / (int64_t) received);
+        into.jitterUs = from.jitterUs;  // at the end of the later bin
+    }
+
+    into.received += from.received;
+    into.lost += from.lost;
+    into.reordered += from.reordered;
+    into.duplicates += from.duplicates;
+    for (int i = 0; i < PROBE_DELAY_BUCKETS; i++) into.delayHist[i] += from.delayHist[i];
+}
+
+void SampleMerger::merge(Slot &slot, unsigned kind, DatabaseInfo &databaseInfo) {
+    DatabaseInfo &row = slot.row;
+    const uint64_t slotTimestamp = row.timestamp;
+
+    // the position of the entry taken closest to the slot, if it has one
+    const uint64_t distance = slotTimestamp - std::min(databaseInfo.timestamp, slotTimestamp);
+    const bool hasFix = databaseInfo.latitude != 0 || databaseInfo.longitude != 0;
+    if (hasFix && distance < slot.fixDistance) {
+        row.latitude = databaseInfo.latitude;
+        row.longitude = databaseInfo.longitude;
+        row.speed = databaseInfo.speed;
+        row.orientation = databaseInfo.orientation;
+        row.moving = databaseInfo.moving;
+        slot.fixDistance = distance;
+    }
+
+    switch (kind) {
+        case SAMPLE_CHANNEL:
+            // the last sample of the slot, as the database would keep
+            row.channelInfo = std::move(databaseInfo.channelInfo);
+            row.channelInfoBin = std::move(databaseInfo.channelInfoBin);
+            row.tx_bitrate = databaseInfo.tx_bitrate;
+            row.signal_strength = databaseInfo.signal_strength;
+            break;
+        case SAMPLE_SCAN:
+            row.scanInfo = std::move(databaseInfo.scanInfo);
+            break;
+        default:
+            row.feedback = true;
+            slot.bins++;
+            slot.throughputSum += databaseInfo.throughput;
+            row.throughput = (uint32_t) (slot.throughputSum / slot.bins);
+            row.numBits = (uint32_t) std::min<uint64_t>((uint64_t) row.numBits + databaseInfo.numBits, UINT32_MAX);
+            mergeProbes(row.probes, databaseInfo.probes);
+            if (databaseInfo.timestamp == slotTimestamp) slot.lastBin = true;
+            break;
+    }
+
+    slot.kinds |= kind;
+}
+
+bool SampleMerger::complete(const std::string &rat, const Slot &slot) const {
+    auto itr = this->kindsSeen.find(rat);
+    const unsigned awaited = itr == this->kindsSeen.end() ? 0 : itr->second & SAMPLE_AWAITED;
+
+    if ((slot.kinds & awaited) != awaited) return false;
+    return !(awaited & SAMPLE_FEEDBACK) || slot.lastBin;
+}
+
+size_t SampleMerger::add(std::vector<DatabaseInfo> &databaseInfoList, std::vector<DatabaseInfo> &ready) {
+    const auto now = std::chrono::steady_clock::now();
+    size_t merged = 0;
+
+    for (DatabaseInfo &databaseInfo : databaseInfoList) {
+        const unsigned kind = kindOf(databaseInfo);
+        this->kindsSeen[databaseInfo.rat] |= kind;
+
+        const uint64_t slotTimestamp = (databaseInfo.timestamp + this->resolution - 1) / this->resolution *
+                                       this->resolution;
+        auto key = std::make_pair(databaseInfo.rat, slotTimestamp);
+
+        auto itr = this->slots.find(key);
+        if (itr == this->slots.end()) {
+            Slot slot{};
+            slot.row.rat = databaseInfo.rat;
+            slot.row.timestamp = slotTimestamp;
+            slot.fixDistance = UINT64_MAX;
+            slot.deadline = now + this->window;
+
+            // the bins already written for this slot, so the row that replaces theirs has them too
+            auto before = this->emitted.find(key);
+            if (before != this->emitted.end()) {
+                slot.bins = before->second.bins;
+                slot.throughputSum = before->second.throughputSum;
+                slot.row.throughput = (uint32_t) (slot.throughputSum / slot.bins);
+                slot.row.numBits = before->second.numBits;
+                slot.row.probes = before->second.probes;
+                slot.row.feedback = true;
+                slot.kinds = SAMPLE_FEEDBACK;
+                this->emitted.erase(before);
+            }
+
+            itr = this->slots.emplace(std::move(key), std::move(slot)).first;
+        }
+        else {
+            ++merged;
+        }
+
+        this->merge(itr->second, kind, databaseInfo);
+
+        if (this->complete(itr->first.first, itr->second)) {
+            ready.push_back(std::move(itr->second.row));
+            this->slots.erase(itr);
+        }
+    }
+
+    databaseInfoList.clear();
+    return merged;
+}
+
+size_t SampleMerger::expire(std::chrono::steady_clock::time_point now, bool all, std::vector<DatabaseInfo> &ready) {
+    size_t expired = 0;
+
+    for (auto itr = this->emitted.begin(); itr != this->emitted.end();) {
+        if (all || itr->second.deadline <= now) itr = this->emitted.erase(itr);
+        else ++itr;
+    }
+
+    for (auto itr = this->slots.begin(); itr != this->slots.end();) {
+        if (all || itr->second.deadline <= now) {
+            const Slot &slot = itr->second;
+            if (!all && (slot.kinds & SAMPLE_FEEDBACK) && !slot.lastBin) {
+                this->emitted[itr->first] = Emitted{slot.bins, slot.throughputSum, slot.row.numBits,
+                                                    slot.row.probes, now + this->window};
+            }
+
+            ready.push_back(std::move(itr->second.row));
+            itr = this->slots.erase(itr);
+            ++expired;
+        }
+        else {
+            ++itr;
+        }
+    }
+
+    return expired;
+}
+
+size_t SampleMerger::size() const {
+    return this->slots.size();
+}
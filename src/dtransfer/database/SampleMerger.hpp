@@ -0,0 +1,97 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the sample merger, the stage of the Database Writer that joins the entries of
+ * the channel monitor (channel info) and of the feedback receiver (throughput and probe
+ * statistics) for the same RAT and time, so they're written as one history row instead
+ * of two that the database merges.
+ *
+ * Timestamps are rounded up to a grid (the resolution, usually the sampling interval),
+ * as a feedback bin is stored on its end and a channel sample on its tick. Feedback bins
+ * shorter than the resolution are summed into its slot. A slot is emitted once it holds
+ * every kind of entry seen for its RAT (with the feedback up to the end of the slot), or
+ * once it has waited for the window. Nothing is dropped: an entry that comes after its
+ * slot was emitted starts another one, which the database merges with the first. As the
+ * database overwrites the feedback columns of a row, a slot emitted with only part of
+ * its bins is remembered for another window, and the slot of the bins that come later
+ * starts from its sums, so the second row holds all of them.
+ */
+
+#ifndef WIPERF_IMPL_SAMPLEMERGER_HPP
+#define WIPERF_IMPL_SAMPLEMERGER_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "DatabaseInfo.hpp"
+
+class SampleMerger {
+private:
+    struct Slot {
+        DatabaseInfo row;
+        unsigned kinds;          // SAMPLE_* of the entries merged
+        bool lastBin;            // the feedback bin that ends on the slot came
+        uint32_t bins;           // feedback bins summed
+        uint64_t throughputSum;  // of those bins, for their mean
+        uint64_t fixDistance;    // ms from the entry the position was taken from to the slot
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    struct Emitted { // feedback sums of a slot emitted before its last bin came
+        uint32_t bins;
+        uint64_t throughputSum;
+        uint32_t numBits;
+        ProbeSummary probes;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    uint64_t resolution; // ms, 0 if disabled
+    std::chrono::milliseconds window;
+
+    std::map<std::pair<std::string, uint64_t>, Slot> slots; // by (rat, rounded timestamp)
+    std::map<std::pair<std::string, uint64_t>, Emitted> emitted; // the same
+    std::map<std::string, unsigned> kindsSeen;              // SAMPLE_* ever seen by RAT
+
+    static unsigned kindOf(const DatabaseInfo &databaseInfo);
+    static void mergeProbes(ProbeSummary &into, const ProbeSummary &from);
+    void merge(Slot &slot, unsigned kind, DatabaseInfo &databaseInfo);
+    bool complete(const std::string &rat, const Slot &slot) const;
+
+public:
+    SampleMerger();
+
+    /**
+     * @param resolution grid the timestamps are rounded up to, in ms (0 disables merging)
+     * @param window     max time an entry waits for the others of its slot, in ms
+     */
+    void configure(uint64_t resolution, int window);
+
+    bool enabled() const;
+
+    /**
+     * Merges the entries. The slots they complete are appended to ready.
+     * @param databaseInfoList entries (moved from)
+     * @return number of entries merged into a slot that already had one (the rows saved)
+     */
+    size_t add(std::vector<DatabaseInfo> &databaseInfoList, std::vector<DatabaseInfo> &ready);
+
+    /**
+     * Appends the slots that waited for the window (or all of them, e.g., when stopping)
+     * to ready, by RAT and time.
+     * @return number of slots appended
+     */
+    size_t expire(std::chrono::steady_clock::time_point now, bool all, std::vector<DatabaseInfo> &ready);
+
+    /**
+     * @return slots waiting to be complete
+     */
+    size_t size() const;
+};
+
+#endif //WIPERF_IMPL_SAMPLEMERGER_HPP
@@ -0,0 +1,159 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "SpillFile.hpp"
+
+#include <cstring>
+#include <sstream>
+#include <utility>
+
+#include "../../util/logfile.hpp"
+
+#define SPILL_RECORD_MAX_LEN (16 * 1024 * 1024) // sanity check when reading
+
+template <typename T>
+static void put(std::vector<char> &buf, const T &value) {
+    const char *bytes = reinterpret_cast<const char *>(&value);
+    buf.insert(buf.end(), bytes, bytes + sizeof(T));
+}
+
+static void putString(std::vector<char> &buf, const std::string &str) {
+    put(buf, (uint32_t) str.size());
+    buf.insert(buf.end(), str.begin(), str.end());
+}
+
+template <typename T>
+static bool get(const char *&pos, const char *end, T &value) {
+    if ((size_t) (end - pos) < sizeof(T)) return false;
+    std::memcpy(&value, pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+
+static bool getString(const char *&pos, const char *end, std::string &str) {
+    uint32_t len;
+    if (!get(pos, end, len) || (size_t) (end - pos) < len) return false;
+    str.assign(pos, len);
+    pos += len;
+    return true;
+}
+
+SpillFile::SpillFile(std::string path) : path(std::move(path)), file(nullptr), mutex(), record() {}
+
+SpillFile::~SpillFile() {
+    if (this->file) fclose(this->file);
+}
+
+bool SpillFile::append(const DatabaseInfo *databaseInfos, size_t count) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    if (!this->file && !(this->file = fopen(this->path.c_str(), "ab"))) {
+        std::stringstream ss;
+        ss << "Can't open spill file " << this->path << ": " << std::strerror(errno);
+        LOG_ERR(ss.str().c_str());
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        this->record.clear();
+        put(this->record, (uint32_t) 0);  // length, filled below
+        SpillFile::encode(databaseInfos[i], this->record);
+
+        uint32_t len = (uint32_t) (this->record.size() - sizeof(uint32_t));
+        std::memcpy(this->record.data(), &len, sizeof(len));
+
+        if (fwrite(this->record.data(), 1, this->record.size(), this->file) != this->record.size()) {
+            LOG_ERR("Can't write to the spill file");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void SpillFile::flush() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->file) fflush(this->file);
+}
+
+const std::string &SpillFile::getPath() const {
+    return this->path;
+}
+
+void SpillFile::encode(const DatabaseInfo &databaseInfo, std::vector<char> &record) {
+    put(record, databaseInfo.latitude);
+    put(record, databaseInfo.longitude);
+    put(record, databaseInfo.speed);
+    put(record, databaseInfo.orientation);
+    put(record, (int32_t) databaseInfo.moving);
+    put(record, databaseInfo.throughput);
+    put(record, databaseInfo.numBits);
+    putString(record, databaseInfo.channelInfo);
+    putString(record, databaseInfo.scanInfo);
+    putString(record, databaseInfo.rat);
+    put(record, databaseInfo.timestamp);
+    put(record, databaseInfo.tx_bitrate);
+    put(record, databaseInfo.signal_strength);
+    putString(record, databaseInfo.channelInfoBin);
+    put(record, databaseInfo.probes);
+    put(record, (uint8_t) databaseInfo.feedback);
+}
+
+bool SpillFile::decode(const char *record, size_t len, DatabaseInfo &databaseInfo) {
+    const char *pos = record, *end = record + len;
+    int32_t moving = 0;
+    uint8_t feedback = 0;
+
+    bool ok = get(pos, end, databaseInfo.latitude)
+              && get(pos, end, databaseInfo.longitude)
+              && get(pos, end, databaseInfo.speed)
+              && get(pos, end, databaseInfo.orientation)
+              && get(pos, end, moving)
+              && get(pos, end, databaseInfo.throughput)
+              && get(pos, end, databaseInfo.numBits)
+              && getString(pos, end, databaseInfo.channelInfo)
+              && getString(pos, end, databaseInfo.scanInfo)
+              && getString(pos, end, databaseInfo.rat)
+              && get(pos, end, databaseInfo.timestamp)
+              && get(pos, end, databaseInfo.tx_bitrate)
+              && get(pos, end, databaseInfo.signal_strength);
+
+    // added after the first version of the format, so they may be missing
+    if (ok && pos < end) ok = getString(pos, end, databaseInfo.channelInfoBin);
+    if (ok && pos < end) ok = get(pos, end, databaseInfo.probes);
+    if (ok && pos < end) ok = get(pos, end, feedback);
+
+    databaseInfo.moving = moving;
+    // records of before only had the bits to tell the feedback apart
+    databaseInfo.feedback = feedback != 0 || databaseInfo.numBits > 0 || databaseInfo.throughput > 0;
+    return ok;
+}
+
+long SpillFile::readAll(const std::string &path, const std::function<void(DatabaseInfo &)> &callback) {
+    FILE *in = fopen(path.c_str(), "rb");
+    if (!in) return -1;
+
+    std::vector<char> record;
+    long count = 0;
+    uint32_t len;
+
+    while (fread(&len, sizeof(len), 1, in) == 1) {
+        if (len > SPILL_RECORD_MAX_LEN) break;  // corrupted
+
+        record.resize(len);
+        if (fread(record.data(), 1, len, in) != len) break;  // truncated (e.g., crash while writing)
+
+        DatabaseInfo databaseInfo{};
+        if (!SpillFile::decode(record.data(), len, databaseInfo)) break;
+
+        callback(databaseInfo);
+        ++count;
+    }
+
+    fclose(in);
+    return count;
+}
@@ -0,0 +1,64 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the spill file, where database entries that couldn't be written to the
+ * database are kept so they can be replayed later.
+ *
+ * The file is a sequence of length-prefixed records: a uint32_t with the record length
+ * followed by the record, with the DatabaseInfo fields (numbers in host byte order, strings
+ * as a uint32_t length followed by the characters). Fields added later are appended to the
+ * record, so older records are still readable. Files are meant to be replayed on the
+ * machine (or architecture) that wrote them.
+ */
+
+#ifndef WIPERF_IMPL_SPILLFILE_HPP
+#define WIPERF_IMPL_SPILLFILE_HPP
+
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "DatabaseInfo.hpp"
+
+class SpillFile {
+private:
+    std::string path;
+    FILE *file;
+    std::mutex mutex;
+    std::vector<char> record; // reused encoding buffer
+
+public:
+    explicit SpillFile(std::string path);
+    ~SpillFile();
+
+    /**
+     * Appends entries to the file (opened in append mode on first use).
+     * Thread-safe.
+     * @return false if the entries couldn't be written
+     */
+    bool append(const DatabaseInfo *databaseInfos, size_t count);
+
+    /**
+     * Flushes the buffered records to the kernel.
+     */
+    void flush();
+
+    const std::string &getPath() const;
+
+    static void encode(const DatabaseInfo &databaseInfo, std::vector<char> &record);
+    static bool decode(const char *record, size_t len, DatabaseInfo &databaseInfo);
+
+    /**
+     * Reads every record in a spill file.
+     * @param path     spill file path
+     * @param callback called for each entry
+     * @return number of entries read, or -1 if the file can't be opened
+     */
+    static long readAll(const std::string &path, const std::function<void(DatabaseInfo &)> &callback);
+};
+
+#endif //WIPERF_IMPL_SPILLFILE_HPP
@@ -0,0 +1,496 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "SpoolFile.hpp"
+
+#include <fcntl.h>     // open(), posix_fallocate()
+#include <sys/file.h>  // flock()
+#include <sys/mman.h>  // mmap()
+#include <sys/stat.h>  // fstat()
+#include <unistd.h>    // close(), ftruncate()
+#include <cerrno>      // errno
+#include <cstring>     // strerror(), strncmp()
+#include <limits>      // std::numeric_limits
+#include <sstream>     // std::stringstream
+#include <utility>     // std::move
+
+#include "../../util/logfile.hpp"
+
+#define SPOOL_MAGIC 0x50535057 // "WPSP"
+#define SPOOL_VERSION 1
+
+#define SPOOL_FLAG_SEALED 0x1
+#define SPOOL_FLAG_UPLOADED 0x2
+
+#define SPOOL_ROW_FEEDBACK 0x80 // in the RAT index of a row, the entry has throughput feedback
+
+static_assert(SPOOL_BLOCK_MAX_RATS <= SPOOL_ROW_FEEDBACK, "RAT indexes leave the feedback bit free");
+
+struct SpoolBlockHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;   // SPOOL_FLAG_*, the sealed one set by the writer, the other by the uploader
+    uint32_t rows;    // rows written, published last
+    uint32_t heapLen; // heap bytes used
+
+    uint64_t minTimestamp;
+    uint64_t maxTimestamp;
+    double minLatitude;
+    double maxLatitude;
+    double minLongitude;
+    double maxLongitude;
+
+    uint32_t nrats;
+    char rats[SPOOL_BLOCK_MAX_RATS][SPOOL_RAT_LEN];
+};
+
+struct SpoolVarRef {
+    uint32_t offset; // in the heap
+    uint32_t len;
+};
+
+struct SpoolBlockColumns {
+    SpoolBlockHeader header;
+
+    uint64_t timestamp[SPOOL_BLOCK_ROWS];
+    double latitude[SPOOL_BLOCK_ROWS];
+    double longitude[SPOOL_BLOCK_ROWS];
+    double speed[SPOOL_BLOCK_ROWS];
+    double orientation[SPOOL_BLOCK_ROWS];
+    uint32_t throughput[SPOOL_BLOCK_ROWS];
+    uint32_t numBits[SPOOL_BLOCK_ROWS];
+    uint32_t txBitrate[SPOOL_BLOCK_ROWS];
+    int32_t signalStrength[SPOOL_BLOCK_ROWS];
+    int32_t moving[SPOOL_BLOCK_ROWS];
+    ProbeSummary probes[SPOOL_BLOCK_ROWS];
+    SpoolVarRef channelInfoBin[SPOOL_BLOCK_ROWS];
+    SpoolVarRef channelInfo[SPOOL_BLOCK_ROWS];
+    SpoolVarRef scanInfo[SPOOL_BLOCK_ROWS];
+    uint8_t rat[SPOOL_BLOCK_ROWS]; // in the dictionary of the header, | SPOOL_ROW_FEEDBACK
+};
+
+#define SPOOL_HEAP_LEN (SPOOL_BLOCK_LEN - sizeof(SpoolBlockColumns))
+
+struct SpoolBlock : SpoolBlockColumns {
+    char heap[SPOOL_HEAP_LEN];
+};
+
+static_assert(sizeof(SpoolBlock) == SPOOL_BLOCK_LEN, "spool block layout");
+static_assert(SPOOL_BLOCK_LEN % 4096 == 0, "spool blocks are mapped one by one");
+
+static bool isHeader(const SpoolBlockHeader &header) {
+    return header.magic == SPOOL_MAGIC && header.version == SPOOL_VERSION;
+}
+
+static bool isBlock(const SpoolBlock &block) {
+    return isHeader(block.header);
+}
+
+static uint16_t flagsOf(const SpoolBlock &block) {
+    return __atomic_load_n(&block.header.flags, __ATOMIC_ACQUIRE);
+}
+
+static uint32_t rowsOf(const SpoolBlock &block) {
+    uint32_t rows = __atomic_load_n(&block.header.rows, __ATOMIC_ACQUIRE);
+    return rows < SPOOL_BLOCK_ROWS ? rows : SPOOL_BLOCK_ROWS;
+}
+
+/*
+ * SpoolFile
+ */
+
+SpoolFile::SpoolFile(std::string path) :
+        basePath(std::move(path)), path(), fd(-1), block(nullptr), blockOffset(0), mutex() {
+    this->path = this->basePath;
+}
+
+SpoolFile::~SpoolFile() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    if (this->block) {
+        if (this->block->header.rows > 0) this->sealBlock();
+        msync(this->block, SPOOL_BLOCK_LEN, MS_SYNC);
+        munmap(this->block, SPOOL_BLOCK_LEN);
+    }
+    if (this->fd >= 0) close(this->fd);  // releases the lock
+}
+
+bool SpoolFile::open() {
+    for (int n = 0; n < SPOOL_MAX_WRITERS; n++) {
+        std::string candidate = n == 0 ? this->basePath : this->basePath + "." + std::to_string(n);
+
+        int candidatefd = ::open(candidate.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (candidatefd < 0) {
+            std::stringstream ss;
+            ss << "Can't open spool file " << candidate << ": " << std::strerror(errno);
+            LOG_ERR(ss.str().c_str());
+            return false;
+        }
+
+        if (flock(candidatefd, LOCK_EX | LOCK_NB) != 0) {
+            close(candidatefd);  // another writer, or the uploader, has it
+            continue;
+        }
+
+        struct stat st;
+        SpoolBlockHeader first;
+        if (fstat(candidatefd, &st) != 0 ||
+            (st.st_size > 0 && pread(candidatefd, &first, sizeof(first), 0) == sizeof(first) &&
+             first.magic != 0 && !isHeader(first))) {
+            std::stringstream ss;
+            ss << candidate << " isn't a spool file, not writing to it";
+            LOG_ERR(ss.str().c_str());
+            close(candidatefd);
+            return false;
+        }
+
+        this->fd = candidatefd;
+        this->path = candidate;
+
+        // a partial block (the disk filled up while growing the file) is dropped
+        off_t size = st.st_size - st.st_size % SPOOL_BLOCK_LEN;
+        if (size != st.st_size && ftruncate(this->fd, size) != 0) size = st.st_size;
+
+        // carry on with the last block if it was left open
+        if (size >= SPOOL_BLOCK_LEN) {
+            void *addr = mmap(nullptr, SPOOL_BLOCK_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd,
+                              size - SPOOL_BLOCK_LEN);
+            if (addr != MAP_FAILED) {
+                SpoolBlock *last = static_cast<SpoolBlock *>(addr);
+                const bool started = isBlock(*last);
+                if (started && flagsOf(*last) == 0) {
+                    this->block = last;
+                    this->blockOffset = size - SPOOL_BLOCK_LEN;
+                }
+                else {
+                    munmap(addr, SPOOL_BLOCK_LEN);
+                    // allocated but never started, nextBlock() takes its place
+                    if (!started && ftruncate(this->fd, size - SPOOL_BLOCK_LEN) != 0) {
+                        LOG_WARN("Can't drop an empty spool block");
+                    }
+                }
+            }
+        }
+
+        if (!this->block && !this->nextBlock()) return false;
+
+        std::stringstream ss;
+        ss << "Spooling to " << this->path << ", " << this->blockOffset / SPOOL_BLOCK_LEN + 1 << " blocks";
+        LOG_MSG(ss.str().c_str());
+        return true;
+    }
+
+    std::stringstream ss;
+    ss << "No free spool file at " << this->basePath << " (" << SPOOL_MAX_WRITERS << " writers)";
+    LOG_ERR(ss.str().c_str());
+    return false;
+}
+
+bool SpoolFile::nextBlock() {
+    off_t offset = 0;
+    if (this->block) {
+        this->sealBlock();
+        munmap(this->block, SPOOL_BLOCK_LEN);
+        this->block = nullptr;
+        offset = this->blockOffset + SPOOL_BLOCK_LEN;
+    }
+    else {
+        struct stat st;
+        if (fstat(this->fd, &st) == 0) offset = st.st_size - st.st_size % SPOOL_BLOCK_LEN;
+    }
+
+    // the space is reserved up front, so a full disk fails here instead of raising
+    // SIGBUS on a store to the mapping
+    int err = posix_fallocate(this->fd, offset, SPOOL_BLOCK_LEN);
+    if (err == EOPNOTSUPP || err == EINVAL) err = ftruncate(this->fd, offset + SPOOL_BLOCK_LEN) == 0 ? 0 : errno;
+    if (err != 0) {
+        std::stringstream ss;
+        ss << "Can't grow spool file " << this->path << ": " << std::strerror(err);
+        LOG_ERR(ss.str().c_str());
+        return false;
+    }
+
+    void *addr = mmap(nullptr, SPOOL_BLOCK_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, offset);
+    if (addr == MAP_FAILED) {
+        std::stringstream ss;
+        ss << "Can't map spool file " << this->path << ": " << std::strerror(errno);
+        LOG_ERR(ss.str().c_str());
+        return false;
+    }
+
+    this->block = static_cast<SpoolBlock *>(addr);
+    this->blockOffset = offset;
+
+    SpoolBlockHeader &header = this->block->header;
+    header.version = SPOOL_VERSION;
+    header.flags = 0;
+    header.rows = 0;
+    header.heapLen = 0;
+    header.minTimestamp = std::numeric_limits<uint64_t>::max();
+    header.maxTimestamp = 0;
+    header.minLatitude = header.minLongitude = std::numeric_limits<double>::max();
+    header.maxLatitude = header.maxLongitude = std::numeric_limits<double>::lowest();
+    header.nrats = 0;
+    __atomic_store_n(&header.magic, SPOOL_MAGIC, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+void SpoolFile::sealBlock() {
+    __atomic_fetch_or(&this->block->header.flags, SPOOL_FLAG_SEALED, __ATOMIC_RELEASE);
+    msync(this->block, SPOOL_BLOCK_LEN, MS_ASYNC);
+}
+
+bool SpoolFile::appendRow(const DatabaseInfo &databaseInfo) {
+    SpoolBlock &block = *this->block;
+    SpoolBlockHeader &header = block.header;
+    const uint32_t row = header.rows;
+    if (row >= SPOOL_BLOCK_ROWS) return false;
+
+    const size_t varLen = databaseInfo.channelInfoBin.size() + databaseInfo.channelInfo.size() +
+                          databaseInfo.scanInfo.size();
+    if (varLen > SPOOL_HEAP_LEN - header.heapLen) return false;
+
+    uint32_t rat = 0;
+    while (rat < header.nrats && strncmp(header.rats[rat], databaseInfo.rat.c_str(), SPOOL_RAT_LEN) != 0) rat++;
+    if (rat == header.nrats) {
+        if (header.nrats >= SPOOL_BLOCK_MAX_RATS) return false;
+        std::strncpy(header.rats[rat], databaseInfo.rat.c_str(), SPOOL_RAT_LEN - 1);
+        header.nrats++;
+    }
+
+    block.timestamp[row] = databaseInfo.timestamp;
+    block.latitude[row] = databaseInfo.latitude;
+    block.longitude[row] = databaseInfo.longitude;
+    block.speed[row] = databaseInfo.speed;
+    block.orientation[row] = databaseInfo.orientation;
+    block.throughput[row] = databaseInfo.throughput;
+    block.numBits[row] = databaseInfo.numBits;
+    block.txBitrate[row] = databaseInfo.tx_bitrate;
+    block.signalStrength[row] = databaseInfo.signal_strength;
+    block.moving[row] = databaseInfo.moving;
+    block.probes[row] = databaseInfo.probes;
+    block.rat[row] = (uint8_t) (rat | (databaseInfo.feedback ? SPOOL_ROW_FEEDBACK : 0));
+
+    auto putVar = [&](SpoolVarRef &ref, const std::string &str) {
+        ref.offset = header.heapLen;
+        ref.len = (uint32_t) str.size();
+        std::memcpy(block.heap + header.heapLen, str.data(), str.size());
+        header.heapLen += ref.len;
+    };
+    putVar(block.channelInfoBin[row], databaseInfo.channelInfoBin);
+    putVar(block.channelInfo[row], databaseInfo.channelInfo);
+    putVar(block.scanInfo[row], databaseInfo.scanInfo);
+
+    if (databaseInfo.timestamp < header.minTimestamp) header.minTimestamp = databaseInfo.timestamp;
+    if (databaseInfo.timestamp > header.maxTimestamp) header.maxTimestamp = databaseInfo.timestamp;
+    if (databaseInfo.latitude < header.minLatitude) header.minLatitude = databaseInfo.latitude;
+    if (databaseInfo.latitude > header.maxLatitude) header.maxLatitude = databaseInfo.latitude;
+    if (databaseInfo.longitude < header.minLongitude) header.minLongitude = databaseInfo.longitude;
+    if (databaseInfo.longitude > header.maxLongitude) header.maxLongitude = databaseInfo.longitude;
+
+    // the row exists for readers only once counted
+    __atomic_store_n(&header.rows, row + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+size_t SpoolFile::append(const DatabaseInfo *databaseInfos, size_t count) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    if (this->fd < 0 && !this->open()) return 0;
+    if (!this->block && !this->nextBlock()) return 0;
+
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        const DatabaseInfo &databaseInfo = databaseInfos[i];
+
+        // stored truncated, it would never match itself in the dictionary again
+        if (databaseInfo.rat.size() >= SPOOL_RAT_LEN) {
+            std::stringstream ss;
+            ss << "Entry of " << databaseInfo.rat << " at " << databaseInfo.timestamp
+               << " not spooled, RAT names are at most " << SPOOL_RAT_LEN - 1 << " characters";
+            LOG_ERR(ss.str().c_str());
+            continue;
+        }
+
+        if (this->appendRow(databaseInfo)) {
+            n++;
+            continue;
+        }
+
+        // the block is full, unless the entry is too large for any (and then a new block won't do)
+        const size_t varLen = databaseInfo.channelInfoBin.size() + databaseInfo.channelInfo.size() +
+                              databaseInfo.scanInfo.size();
+        if (this->block->header.rows > 0 && varLen <= SPOOL_HEAP_LEN) {
+            if (!this->nextBlock()) break;  // the file can't grow, neither can the next entries
+            if (this->appendRow(databaseInfo)) {
+                n++;
+                continue;
+            }
+        }
+
+        std::stringstream ss;
+        ss << "Entry of " << databaseInfo.rat << " at " << databaseInfo.timestamp
+           << " not spooled, it doesn't fit in a spool block";
+        LOG_ERR(ss.str().c_str());
+    }
+
+    return n;
+}
+
+void SpoolFile::seal() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (!this->block || this->block->header.rows == 0) return;
+
+    this->sealBlock();
+    munmap(this->block, SPOOL_BLOCK_LEN);
+    this->block = nullptr;  // the next append allocates another one
+}
+
+void SpoolFile::flush() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->block) msync(this->block, SPOOL_BLOCK_LEN, MS_SYNC);
+}
+
+const std::string &SpoolFile::getPath() const {
+    return this->path;
+}
+
+/*
+ * SpoolReader
+ */
+
+SpoolReader::SpoolReader(std::string path) : path(std::move(path)), fd(-1), data(nullptr), nblocks(0), live(false) {}
+
+SpoolReader::~SpoolReader() {
+    if (this->data) {
+        msync(this->data, this->nblocks * SPOOL_BLOCK_LEN, MS_SYNC);
+        munmap(this->data, this->nblocks * SPOOL_BLOCK_LEN);
+    }
+    if (this->fd >= 0) close(this->fd);
+}
+
+bool SpoolReader::open() {
+    if ((this->fd = ::open(this->path.c_str(), O_RDWR | O_CLOEXEC)) < 0) return false;
+
+    struct stat st;
+    if (fstat(this->fd, &st) != 0 || st.st_size < SPOOL_BLOCK_LEN) return false;
+
+    // while the lock is held, no writer can start on the file
+    this->live = flock(this->fd, LOCK_EX | LOCK_NB) != 0;
+
+    this->nblocks = st.st_size / SPOOL_BLOCK_LEN;
+    void *addr = mmap(nullptr, this->nblocks * SPOOL_BLOCK_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+    if (addr == MAP_FAILED) {
+        this->nblocks = 0;
+        return false;
+    }
+
+    this->data = static_cast<char *>(addr);
+    return isBlock(this->blockAt(0));
+}
+
+const SpoolBlock &SpoolReader::blockAt(size_t n) const {
+    return *reinterpret_cast<const SpoolBlock *>(this->data + n * SPOOL_BLOCK_LEN);
+}
+
+bool SpoolReader::isLive() const {
+    return this->live;
+}
+
+size_t SpoolReader::size() const {
+    return this->nblocks;
+}
+
+SpoolBlockIndex SpoolReader::index(size_t n) const {
+    SpoolBlockIndex index{};
+
+    const SpoolBlock &block = this->blockAt(n);
+    if (!isBlock(block)) return index;  // allocated, never started
+
+    const uint16_t flags = flagsOf(block);
+    index.rows = rowsOf(block);
+    index.sealed = flags & SPOOL_FLAG_SEALED;
+    index.uploaded = flags & SPOOL_FLAG_UPLOADED;
+    index.minTimestamp = block.header.minTimestamp;
+    index.maxTimestamp = block.header.maxTimestamp;
+    index.minLatitude = block.header.minLatitude;
+    index.maxLatitude = block.header.maxLatitude;
+    index.minLongitude = block.header.minLongitude;
+    index.maxLongitude = block.header.maxLongitude;
+    return index;
+}
+
+bool SpoolReader::pending(size_t n) const {
+    const SpoolBlock &block = this->blockAt(n);
+    if (!isBlock(block)) return false;
+
+    const uint16_t flags = flagsOf(block);
+    return !(flags & SPOOL_FLAG_UPLOADED) && ((flags & SPOOL_FLAG_SEALED) || !this->live);
+}
+
+size_t SpoolReader::read(size_t n, std::vector<DatabaseInfo> &databaseInfoList) const {
+    const SpoolBlock &block = this->blockAt(n);
+    if (!isBlock(block)) return 0;
+
+    const SpoolBlockHeader &header = block.header;
+    const uint32_t rows = rowsOf(block);
+
+    auto getVar = [&](const SpoolVarRef &ref, std::string &str) {
+        if (ref.offset <= SPOOL_HEAP_LEN && ref.len <= SPOOL_HEAP_LEN - ref.offset) {
+            str.assign(block.heap + ref.offset, ref.len);
+        }
+    };
+
+    for (uint32_t row = 0; row < rows; row++) {
+        DatabaseInfo databaseInfo{};
+        databaseInfo.timestamp = block.timestamp[row];
+        databaseInfo.latitude = block.latitude[row];
+        databaseInfo.longitude = block.longitude[row];
+        databaseInfo.speed = block.speed[row];
+        databaseInfo.orientation = block.orientation[row];
+        databaseInfo.throughput = block.throughput[row];
+        databaseInfo.numBits = block.numBits[row];
+        databaseInfo.tx_bitrate = block.txBitrate[row];
+        databaseInfo.signal_strength = block.signalStrength[row];
+        databaseInfo.moving = block.moving[row];
+        databaseInfo.probes = block.probes[row];
+
+        // blocks written before the flag only had the bits to tell the feedback apart
+        const uint8_t rat = block.rat[row] & ~SPOOL_ROW_FEEDBACK;
+        databaseInfo.feedback = (block.rat[row] & SPOOL_ROW_FEEDBACK) || databaseInfo.numBits > 0 ||
+                                databaseInfo.throughput > 0;
+
+        if (rat < header.nrats && header.nrats <= SPOOL_BLOCK_MAX_RATS) {
+            databaseInfo.rat.assign(header.rats[rat], strnlen(header.rats[rat], SPOOL_RAT_LEN));
+        }
+
+        getVar(block.channelInfoBin[row], databaseInfo.channelInfoBin);
+        getVar(block.channelInfo[row], databaseInfo.channelInfo);
+        getVar(block.scanInfo[row], databaseInfo.scanInfo);
+
+        databaseInfoList.push_back(std::move(databaseInfo));
+    }
+
+    return rows;
+}
+
+void SpoolReader::markUploaded(size_t n) {
+    SpoolBlock &block = *reinterpret_cast<SpoolBlock *>(this->data + n * SPOOL_BLOCK_LEN);
+    __atomic_fetch_or(&block.header.flags, SPOOL_FLAG_UPLOADED, __ATOMIC_RELEASE);
+    msync(&block, SPOOL_BLOCK_LEN, MS_SYNC);
+}
+
+bool SpoolReader::isSpool(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    SpoolBlockHeader header;
+    bool spool = pread(fd, &header, sizeof(header), 0) == sizeof(header) && isHeader(header);
+    close(fd);
+    return spool;
+}
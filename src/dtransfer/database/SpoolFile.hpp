@@ -0,0 +1,160 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the spool file, where the Database Writer keeps the entries collected while
+ * the database is unreachable, for an uploader (dbreplay) to load them later.
+ *
+ * The file is a sequence of fixed-size blocks (SPOOL_BLOCK_LEN bytes) and is only ever
+ * appended to. Each block holds up to SPOOL_BLOCK_ROWS entries, column by column: a
+ * header with the number of rows, the min/max timestamp, latitude and longitude of the
+ * rows (the block index), and the dictionary of the RAT names, then one array per
+ * DatabaseInfo field, and a heap where the variable-length fields (channel info, scan
+ * info) are stored. The block being filled is memory-mapped, so appending an entry is a
+ * few stores. A block is sealed when it's full, and only sealed blocks are uploaded
+ * while the file is still being written. Numbers are in host byte order, so files are
+ * meant to be uploaded on the machine (or architecture) that wrote them.
+ *
+ * The writer holds an exclusive lock (flock) on the file while it appends to it. A
+ * second writer on the same path (e.g., channel_monitor and dreceiver) moves to the
+ * first free of path.1, path.2, ...
+ */
+
+#ifndef WIPERF_IMPL_SPOOLFILE_HPP
+#define WIPERF_IMPL_SPOOLFILE_HPP
+
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "DatabaseInfo.hpp"
+
+#define SPOOL_BLOCK_LEN (64 * 1024) // bytes
+#define SPOOL_BLOCK_ROWS 128        // max entries per block
+#define SPOOL_BLOCK_MAX_RATS 8      // distinct RAT names per block
+#define SPOOL_RAT_LEN 16            // max RAT name length, with the terminating '\0'
+#define SPOOL_MAX_WRITERS 8         // paths tried before giving up on the lock
+
+struct SpoolBlock;
+
+/**
+ * Index entry of a block: what it holds, so readers can pick blocks without decoding them.
+ */
+struct SpoolBlockIndex {
+    uint32_t rows;
+    bool sealed;   // full, or closed by its writer
+    bool uploaded; // written to the database by the uploader
+
+    uint64_t minTimestamp;
+    uint64_t maxTimestamp;
+    double minLatitude;
+    double maxLatitude;
+    double minLongitude;
+    double maxLongitude;
+};
+
+class SpoolFile {
+private:
+    std::string basePath;
+    std::string path; // the one actually locked, once opened
+    int fd;
+    SpoolBlock *block; // the block being filled, mapped
+    off_t blockOffset;
+    std::mutex mutex;
+
+    bool open();
+    bool nextBlock();
+    void sealBlock();
+    bool appendRow(const DatabaseInfo &databaseInfo);
+
+public:
+    explicit SpoolFile(std::string path);
+    ~SpoolFile();
+
+    SpoolFile(const SpoolFile &) = delete;
+    SpoolFile &operator=(const SpoolFile &) = delete;
+
+    /**
+     * Appends entries to the file (opened, or created, on first use). Thread-safe.
+     * @return number of entries appended, less than count if the file can't grow (e.g.,
+     * the disk is full, and then the rest of the entries aren't appended), or an entry
+     * doesn't fit in a block or its RAT name is longer than SPOOL_RAT_LEN - 1 characters
+     * (those entries are skipped, the next ones are still appended)
+     */
+    size_t append(const DatabaseInfo *databaseInfos, size_t count);
+
+    /**
+     * Seals the block being filled, so the uploader can take it even though the file is
+     * still open. The next entry starts a new block.
+     */
+    void seal();
+
+    /**
+     * Writes the mapped block back to the file.
+     */
+    void flush();
+
+    /**
+     * @return path of the file being written, or the configured one if not opened yet
+     */
+    const std::string &getPath() const;
+};
+
+/**
+ * Reads a spool file for the upload, marking the blocks that were uploaded in the file
+ * itself, so an upload that stops midway resumes at the first block left.
+ */
+class SpoolReader {
+private:
+    std::string path;
+    int fd;
+    char *data; // the whole file, mapped
+    size_t nblocks;
+    bool live;  // locked by a writer
+
+    const SpoolBlock &blockAt(size_t n) const;
+
+public:
+    explicit SpoolReader(std::string path);
+    ~SpoolReader();
+
+    SpoolReader(const SpoolReader &) = delete;
+    SpoolReader &operator=(const SpoolReader &) = delete;
+
+    /**
+     * Maps the file. A file a writer still appends to can be read, but only its sealed
+     * blocks are pending.
+     * @return false if the file can't be opened or isn't a spool file
+     */
+    bool open();
+
+    bool isLive() const;
+    size_t size() const;
+
+    SpoolBlockIndex index(size_t n) const;
+
+    /**
+     * @return true if the block is to be uploaded: not uploaded yet, and sealed or no
+     * longer written
+     */
+    bool pending(size_t n) const;
+
+    /**
+     * Appends the entries of the block to the list.
+     * @return number of entries appended
+     */
+    size_t read(size_t n, std::vector<DatabaseInfo> &databaseInfoList) const;
+
+    void markUploaded(size_t n);
+
+    /**
+     * @return true if the file starts with a spool block
+     */
+    static bool isSpool(const std::string &path);
+};
+
+#endif //WIPERF_IMPL_SPOOLFILE_HPP
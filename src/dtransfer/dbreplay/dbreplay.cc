@@ -0,0 +1,208 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Database replay main file/function. Writes the entries kept in spill and spool files
+ * (see DatabaseWriter) to the database, in COPY batches. Files that are fully replayed
+ * are renamed with a ".replayed" suffix, so running it again doesn't duplicate work.
+ * Spool files also record which blocks were uploaded, and can be uploaded while they're
+ * still being written, along with the ones of the other writers on the same path. With
+ * -w, it keeps uploading them every few seconds, as the database becomes reachable.
+ */
+
+#include <unistd.h>  // access(), sleep()
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../../util/logfile.hpp"
+#include "../../util/configfile.hpp"
+#include "../database/DatabaseManager.hpp"
+#include "../database/SpillFile.hpp"
+#include "../database/SpoolFile.hpp"
+
+#define CONFIG_FNAME "/etc/wiperf.conf"
+#define LOG_FNAME "/var/log/dbreplay.log"
+#define DB_REPLAY_BATCH_LEN 4096 // entries per COPY transaction
+
+/**
+ * Replays one spill file.
+ * @return true if every entry was written
+ */
+static bool replayFile(DatabaseManager &databaseManager, const std::string &path) {
+    std::vector<DatabaseInfo> batch;
+    batch.reserve(DB_REPLAY_BATCH_LEN);
+
+    bool ok = true;
+    long written = 0;
+
+    long nread = SpillFile::readAll(path, [&](DatabaseInfo &databaseInfo) {
+        if (!ok) return;  // keep the rest of the file for a later run
+
+        batch.push_back(std::move(databaseInfo));
+        if (batch.size() < DB_REPLAY_BATCH_LEN) return;
+
+        ok = databaseManager.copyAll(batch);
+        if (ok) written += (long) batch.size();
+        batch.clear();
+    });
+
+    if (nread < 0) {
+        std::cerr << "Can't open " << path << std::endl;
+        return false;
+    }
+
+    if (ok && !batch.empty()) {
+        ok = databaseManager.copyAll(batch);
+        if (ok) written += (long) batch.size();
+    }
+
+    std::stringstream ss;
+    ss << path << ": " << written << " of " << nread << " entries replayed";
+    LOG_MSG(ss.str().c_str());
+    std::cout << ss.str() << std::endl;
+
+    if (!ok) return false;
+
+    // entries are upserted, so a partial replay can safely be run again
+    std::string donePath = path + ".replayed";
+    if (std::rename(path.c_str(), donePath.c_str()) != 0) {
+        std::cerr << "Can't rename " << path << " to " << donePath << std::endl;
+    }
+
+    return true;
+}
+
+/**
+ * Uploads the pending blocks of one spool file, several blocks per COPY batch.
+ * @return true if every pending block was written
+ */
+static bool replaySpool(DatabaseManager &databaseManager, const std::string &path) {
+    SpoolReader reader(path);
+    if (!reader.open()) {
+        std::cerr << "Can't open " << path << std::endl;
+        return false;
+    }
+
+    std::vector<DatabaseInfo> batch;
+    std::vector<size_t> blocks; // in the batch
+    batch.reserve(DB_REPLAY_BATCH_LEN + SPOOL_BLOCK_ROWS);
+
+    bool ok = true;
+    long written = 0, npending = 0;
+    uint64_t minTimestamp = UINT64_MAX, maxTimestamp = 0;
+
+    auto upload = [&]() {
+        if (batch.empty()) return;
+
+        ok = databaseManager.copyAll(batch);
+        if (ok) {
+            for (size_t n : blocks) reader.markUploaded(n);
+            written += (long) batch.size();
+        }
+        batch.clear();
+        blocks.clear();
+    };
+
+    for (size_t n = 0; n < reader.size() && ok; n++) {
+        if (!reader.pending(n)) continue;
+
+        const SpoolBlockIndex index = reader.index(n);
+        if (index.rows > 0) {
+            if (index.minTimestamp < minTimestamp) minTimestamp = index.minTimestamp;
+            if (index.maxTimestamp > maxTimestamp) maxTimestamp = index.maxTimestamp;
+        }
+
+        npending += (long) reader.read(n, batch);
+        blocks.push_back(n);
+        if (batch.size() >= DB_REPLAY_BATCH_LEN) upload();
+    }
+    if (ok) upload();
+
+    if (npending == 0 && reader.isLive()) return true;  // nothing sealed yet, not worth a line
+
+    std::stringstream ss;
+    ss << path << ": " << written << " of " << npending << " entries uploaded";
+    if (npending > 0) ss << ", timestamps " << minTimestamp << " to " << maxTimestamp;
+    if (reader.isLive()) ss << " (still being written)";
+    LOG_MSG(ss.str().c_str());
+    std::cout << ss.str() << std::endl;
+
+    if (!ok || reader.isLive()) return ok;
+
+    // renamed while locked, so a writer that starts now creates a new file
+    std::string donePath = path + ".replayed";
+    if (std::rename(path.c_str(), donePath.c_str()) != 0) {
+        std::cerr << "Can't rename " << path << " to " << donePath << std::endl;
+    }
+
+    return true;
+}
+
+static volatile sig_atomic_t stopReplay = 0;
+
+static void sigHandler(int) {
+    stopReplay = 1;
+}
+
+/**
+ * Replays every spill or spool file given as an argument, once or, with -w, every
+ * given number of seconds until stopped.
+ */
+int main(int argc, char *argv[]) {
+    int watchInterval = 0;  // s, 0 to replay once
+
+    std::vector<std::string> paths(argv + 1, argv + argc);
+    if (paths.size() >= 2 && paths[0] == "-w") {
+        watchInterval = std::stoi(paths[1]);
+        paths.erase(paths.begin(), paths.begin() + 2);
+    }
+
+    if (paths.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [-w <seconds>] <spill-or-spool-file> [<spill-or-spool-file> ...]"
+                  << std::endl;
+        return 1;
+    }
+
+    LOG_INIT(LOG_FNAME)
+
+    ConfigFile configFile(CONFIG_FNAME);
+    DatabaseManager databaseManager;
+    databaseManager.configure(configFile);
+
+    signal(SIGINT, sigHandler);
+    signal(SIGTERM, sigHandler);
+
+    int nfailed = 0;
+    do {
+        nfailed = 0;
+        for (const std::string &path : paths) {
+            // while watching, the files come and go with the writers
+            if (watchInterval > 0 && access(path.c_str(), F_OK) != 0) continue;
+
+            if (!SpoolReader::isSpool(path)) {
+                if (!replayFile(databaseManager, path)) ++nfailed;
+                continue;
+            }
+
+            if (!replaySpool(databaseManager, path)) ++nfailed;
+
+            // the files of the other writers on the same path (see SpoolFile)
+            for (int n = 1; n < SPOOL_MAX_WRITERS; n++) {
+                std::string other = path + "." + std::to_string(n);
+                if (SpoolReader::isSpool(other) && !replaySpool(databaseManager, other)) ++nfailed;
+            }
+        }
+
+        for (int s = 0; s < watchInterval && !stopReplay; s++) sleep(1);
+    } while (watchInterval > 0 && !stopReplay);
+
+    LOG_CLOSE()
+
+    return nfailed == 0 ? 0 : 2;
+}
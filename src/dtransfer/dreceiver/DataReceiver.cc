@@ -15,6 +15,8 @@
 #include <sys/mman.h>
 #include <sys/stat.h>        /* For mode constants */
 #include <fcntl.h>       // O_RDONLY, S_IRWXU, S_IRUSR, etc
+#include <poll.h>        // poll()
+#include <cerrno>        // errno
 #include <cstdint>      // uint*_t
 #include <cstring>       // memset()
 #include <unistd.h>      // close()
@@ -23,18 +25,16 @@
 #include <string>        // std::string
 #include <map>           // std::map
 #include <algorithm>
+#include <memory>        // std::unique_ptr
+#include <mutex>         // std::lock_guard
 
 #include "../../util/logfile.hpp"    // class LogFile and LOG_* macros
+#include "RxEngine.hpp"
 
-DataReceiver::DataReceiver() : DataTransfer("Rx"), stopFlag(false), nbytes_reset_value() {
-    // create a mutex to protect the access to nbytes_reset_value
-    pthread_mutexattr_t mattr;
-    if (pthread_mutexattr_init(&mattr))
-        LOG_FATAL_PERROR_EXIT("DataReceiver() pthread_mutexattr_init()");
-
-    if (pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED))
-        LOG_FATAL_PERROR_EXIT("DataReceiver() pthread_condattr_setpshared()");
+DataReceiver::DataReceiver() : DataTransfer("Rx"), stopFlag(false), probeStats() {}
 
+ProbeStats& DataReceiver::getProbeStats() {
+    return this->probeStats;
 }
 
 void DataReceiver::stopThread() {
@@ -49,27 +49,34 @@ void DataReceiver::readAndSetLogLevel(ConfigFile &cfile) {
     WiperfUtility::readAndSetLogLevel(cfile, std::string("data-receiver"));
 }
 
-void DataReceiver::readConfig(const std::string &configFname) {
-    ConfigFile cfile(configFname);
-
-    this->readAndSetLogLevel(cfile);
-
-    this->portSrv = WiperfUtility::readPort(cfile, "data-receiver", PORT_SRV_DEF);
+void DataReceiver::readIfaceMap(ConfigFile &cfile, IfaceInfoMap &ifaceMap) {
     WiperfUtility::readIfaces(cfile, "data-receiver", SERVER, ifaceMap);
-    this->portCli = WiperfUtility::readPort(cfile, "data-sender", PORT_CLI_DEF);
     WiperfUtility::readIfaces(cfile, "data-sender", CLIENT, ifaceMap);
 
     // check that we have both cli and srv addresses for all ifaces
     // remove interfaces for which we don't have both addresses
-    for (auto itr = this->ifaceMap.begin(); itr != this->ifaceMap.end();) {
+    for (auto itr = ifaceMap.begin(); itr != ifaceMap.end();) {
         IfaceInfo &iinfo = itr->second;
 
         if (!iinfo.addrSrv.length() || !iinfo.addrCli.length())  // bad boy
-            itr = this->ifaceMap.erase(itr);
+            itr = ifaceMap.erase(itr);
         else
             ++itr;  // all good in the neighborhood
     }
 
+    // per-interface receive engine (optional)
+    WiperfUtility::readIfaceEngines(cfile, "data-receiver", ifaceMap);
+}
+
+void DataReceiver::readConfig(const std::string &configFname) {
+    ConfigFile cfile(configFname);
+
+    this->readAndSetLogLevel(cfile);
+
+    this->portSrv = WiperfUtility::readPort(cfile, "data-receiver", PORT_SRV_DEF);
+    this->portCli = WiperfUtility::readPort(cfile, "data-sender", PORT_CLI_DEF);
+    readIfaceMap(cfile, this->ifaceMap);
+
     // do we have at least one interface pair?
     if (this->ifaceMap.empty()) {
         std::stringstream ss;
@@ -78,9 +85,28 @@ void DataReceiver::readConfig(const std::string &configFname) {
         LOG_FATAL_EXIT(ss.str().c_str());
     }
 
-    for (auto &itr: this->ifaceMap) {
-        this->nbytes_reset_value.insert({itr.first, 0});
+    // per-role thread placement and priority (optional)
+    this->threadPolicy.configure(cfile, "data-receiver");
+
+    this->registerIfaceCounters();
+}
+
+void DataReceiver::reloadConfig(ConfigFile &cfile) {
+    this->readAndSetLogLevel(cfile);
+
+    if (WiperfUtility::readPort(cfile, "data-receiver", PORT_SRV_DEF) != this->portSrv ||
+        WiperfUtility::readPort(cfile, "data-sender", PORT_CLI_DEF) != this->portCli) {
+        LOG_WARN("Reload: the data ports change on the next start");
     }
+
+    IfaceInfoMap newIfaceMap;
+    readIfaceMap(cfile, newIfaceMap);
+    this->reloadIfaces(newIfaceMap);
+}
+
+void DataReceiver::restartWorkers() {
+    this->stopFlag = true;
+    DataTransfer::restartWorkers();
 }
 
 void DataReceiver::addIfaceSocksToFdSet(fd_set *fdset) {
@@ -91,103 +117,106 @@ void DataReceiver::addIfaceSocksToFdSet(fd_set *fdset) {
     }
 }
 
-void DataReceiver::commThread() {
-    //Go over all interface addresses and create a socket for each of them
-
-    for (auto &itr: this->ifaceMap) {
-        std::string iname = itr.first;
-        IfaceInfo &ifaceInfo = itr.second;
-        std::string iaddrStr = ifaceInfo.addrSrv;
-
-        // tell the world about what we're doing
-        std::stringstream ss;
-        ss << "Attaching interface " << iname << " @ " << iaddrStr << ":"
-           << this->portSrv;
-        LOG_MSG(ss.str().c_str());
-
-        // create udp socket
-        int sockfd;
-        if ((sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
-            LOG_FATAL_PERROR_EXIT("rthread socket()");
-        }
-
-        // make socket non blocking
-        if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK) < 0) {
-            this->closeIfaceSocks();
-            LOG_FATAL_PERROR_EXIT("rthread fcntl()");
-        }
+bool DataReceiver::openIfaceSock(const std::string &iname, IfaceInfo &ifaceInfo, bool fatal) {
+    std::string iaddrStr = ifaceInfo.addrSrv;
 
-        // construct local address structure
-        struct sockaddr_in sockaddr{}; // local address
-        this->createSockaddr(iaddrStr, this->portSrv, &sockaddr);
+    // tell the world about what we're doing
+    std::stringstream ss;
+    ss << "Attaching interface " << iname << " @ " << iaddrStr << ":"
+       << this->portSrv << " (engine " << WiperfUtility::ioEngineToStr(ifaceInfo.ioEngine) << ")";
+    LOG_MSG(ss.str().c_str());
 
-        // bind to local address
-        if (bind(sockfd, (struct sockaddr *) &sockaddr, sizeof(sockaddr)) < 0) {
+    // on start, any failure ends the program; on a reload, only the interface is left out
+    auto fail = [&](int sockfd, const std::string &what) {
+        if (fatal) {
             this->closeIfaceSocks();
-            std::stringstream ss0;
-            ss0 << "rthread bind() addr " << iaddrStr;
-            LOG_FATAL_PERROR_EXIT(ss0.str().c_str());
+            LOG_FATAL_PERROR_EXIT(what.c_str());
         }
+        LOG_STREAM(ERROR, what << ": " << strerror(errno) << ", leaving " << iname << " out")
+        if (sockfd >= 0) close(sockfd);
+        return false;
+    };
+
+    // create udp socket
+    int sockfd;
+    if ((sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        return fail(-1, "rthread socket()");
+    }
 
-        // update interface details
-        ifaceInfo.sockfd = sockfd;
-        ifaceInfo.nbytesAcc = 0;
-
-    } // iface sock creation loop end
+    // make socket non blocking
+    if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        return fail(sockfd, "rthread fcntl()");
+    }
 
-    LOG_MSG("program up and running");
+    // construct local address structure
+    struct sockaddr_in sockaddr{}; // local address
+    this->createSockaddr(iaddrStr, this->portSrv, &sockaddr);
 
-    for (auto &itr: this->ifaceMap) {
-        IfaceInfo &iinfo = itr.second;
-        std::string ifname = itr.first;
+    // bind to local address
+    if (bind(sockfd, (struct sockaddr *) &sockaddr, sizeof(sockaddr)) < 0) {
+        return fail(sockfd, "rthread bind() addr " + iaddrStr);
+    }
 
-        this->workers.push_back(std::thread([&iinfo, ifname, this]() {
-            char *rcvBuf = new char[RCV_BUF_LEN];
-            ssize_t nbytes;
+    // update interface details
+    ifaceInfo.sockfd = sockfd;
+    return true;
+}
 
-            fd_set fdset;
-            int sockfd = iinfo.sockfd;
-            int wakedf_ = this->wakefd_;
+void DataReceiver::commThread() {
+    for (bool start = true;; start = false) {
+        // create a socket for each interface that doesn't have one yet, i.e., all of
+        // them on start, and the ones added or changed on a reload
+        for (auto itr = this->ifaceMap.begin(); itr != this->ifaceMap.end();) {
+            if (itr->second.sockfd != UNINITIALIZED_FD || this->openIfaceSock(itr->first, itr->second, start)) {
+                ++itr;
+                continue;
+            }
 
-            int maxfd = std::max(sockfd, wakedf_) + 1;
+            std::lock_guard<std::mutex> lock(this->reloadMutex);
+            itr = this->ifaceMap.erase(itr);
+        }
 
-            struct timeval timeout{};
+        LOG_MSG(start ? "program up and running" : "running with the reloaded interfaces");
 
-            while(!this->stopFlag.load()) {
-                FD_SET(sockfd, &fdset);
-                FD_SET(wakedf_, &fdset);
+        for (auto &itr: this->ifaceMap) {
+            IfaceInfo &iinfo = itr.second;
+            std::string ifname = itr.first;
 
-                timeout.tv_sec = 0;
-                timeout.tv_usec = 10;
+            this->workers.push_back(this->launchThread("receive", {ifname}, [&iinfo, ifname, this]() {
+                ProbeStats *probes = this->probeStats.enabled() ? &this->probeStats : nullptr;
+                std::unique_ptr<RxEngine> engine(RxEngine::create(iinfo, this->wakefd_, probes));
 
-                if (select(maxfd, &fdset, NULL, NULL, &timeout) == -1) {
-                    this->closeIfaceSocks();
-                    LOG_FATAL_PERROR_EXIT("rthread select()");
-                }
+                std::stringstream ss;
+                ss << "Receiving from " << ifname << " with the "
+                   << WiperfUtility::ioEngineToStr(iinfo.ioEngine) << " engine";
+                LOG_MSG(ss.str().c_str());
 
-                auto itr_nbytes = this->nbytes_reset_value.find(ifname);
+                uint64_t npackets;
+                while(!this->stopFlag.load()) {
+                    // sleeps until there is data or it's time to end (or to restart)
+                    int64_t nbytes = engine->receive(npackets);
+                    if (nbytes < 0) break;
 
-                if (itr_nbytes->second > 0) {
-                    iinfo.nbytesAcc = iinfo.nbytesAcc - itr_nbytes->second;
-                    itr_nbytes->second = 0;
+                    this->ifaceCounters.add(iinfo.counterSlot, nbytes, npackets); // add read bytes to stats
                 }
+            }));
+        }
 
-                if (FD_ISSET(sockfd, &fdset)) {
-                    while ((nbytes = recv(sockfd, rcvBuf, RCV_BUF_LEN, MSG_DONTWAIT)) > 0 && !this->stopFlag.load()) {
-                        iinfo.nbytesAcc += nbytes; // add read bytes to stats
-                    }
-                }
-            }
+        if (this->workers.empty()) {
+            LOG_ERR("No interface to receive from, waiting for a reload");
+            struct pollfd pfd = {this->wakefd_, POLLIN, 0};
+            while (poll(&pfd, 1, -1) < 0 && errno == EINTR);
+        }
 
-            delete [] rcvBuf;
-        }));
-    }
+        for (auto & itr : workers) {
+            itr.join();
+        }
+        this->workers.clear();
 
-    for (auto & itr : workers) {
-        itr.join();
+        if (!this->applyPendingIfaces()) break;
+        this->stopFlag = false;
     }
 
     // clean up and be done
     this->closeIfaceSocks();
 }
-
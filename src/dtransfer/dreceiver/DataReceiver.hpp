@@ -18,6 +18,7 @@
 #include "../DataTransfer.hpp"
 #include "../../util/configfile.hpp"
 #include "../../mygpsd/gpsinfo.hpp"
+#include "ProbeStats.hpp"
 
 class DataReceiver : public DataTransfer {
 private:
@@ -31,8 +32,26 @@ private:
      */
     std::atomic<bool> stopFlag;
 
+    /**
+     * Loss, reordering and delay of the probes received, enabled along with the bins.
+     */
+    ProbeStats probeStats;
+
+    /**
+     * Creates and binds the socket of an interface.
+     * @param fatal end the program if it can't be done, as on start
+     * @return false if it can't be done
+     */
+    bool openIfaceSock(const std::string &iname, IfaceInfo &ifaceInfo, bool fatal);
+
+    /**
+     * Reads the interface pairs, along with their engines.
+     */
+    static void readIfaceMap(ConfigFile &cfile, IfaceInfoMap &ifaceMap);
+
 protected:
     void readAndSetLogLevel(ConfigFile &cfile) override;
+    void restartWorkers() override;
 
     /**
      * Adds all the interface sockets on the map to the fd set.
@@ -48,20 +67,23 @@ protected:
 
 public:
 
-    /**
-     * Used to reset the byte counters based on the last read value.
-     */
-    std::map<std::string, uint32_t> nbytes_reset_value;
-
     DataReceiver();
 
     void readConfig(const std::string &configFname) override;
 
+    /**
+     * Applies the interfaces of the reloaded configuration, by restarting the workers.
+     * The ports are only read on start.
+     */
+    void reloadConfig(ConfigFile &cfile) override;
+
     /**
      * Calls DataTransfer::stopThread(), but also runs code specific
      * to the DataReceiver.
      */
     void stopThread() override;
+
+    ProbeStats& getProbeStats();
 };
 
 #endif //DATARECEIVER_HPP
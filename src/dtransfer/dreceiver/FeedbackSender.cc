@@ -17,15 +17,25 @@
 #include <cstring>  // std::memcpy
 #include <arpa/inet.h>
 #include <iomanip>
+#include <algorithm> // std::min, std::fill
+#include <random>   // std::random_device
+#include <vector>   // std::vector
 
 #include "FeedbackSender.hpp"
+#include "../FeedbackCodec.hpp"
+#include "../PeriodicScheduler.hpp"
 
 FeedbackSender::FeedbackSender(DataReceiver *dataReceiver) :
     DataTransfer("FeedTx"), dreceiver(),
-    feedbackInterval(FEEDBACK_INTERVAL_DEF), dataReceiverIfaces() {
+    feedbackInterval(FEEDBACK_INTERVAL_DEF), feedbackHistory(FEEDBACK_HISTORY_DEF),
+    binInterval(FEEDBACK_INTERVAL_DEF), dataReceiverIfaces(), ratsPending(false) {
     dreceiver = dataReceiver;
 }
 
+uint64_t FeedbackSender::binsPerInterval() const {
+    return ((uint64_t) this->feedbackInterval + this->binInterval - 1) / this->binInterval;
+}
+
 void FeedbackSender::readAndSetLogLevel(ConfigFile &cfile) {
     WiperfUtility::readAndSetLogLevel(cfile, std::string("feedback-sender"));
 }
@@ -34,6 +44,7 @@ void FeedbackSender::readConfig(const std::string& configFname) {
     ConfigFile cfile(configFname);
 
     this->gpsShmPath = WiperfUtility::readGpsShmPath(cfile, GPS_SHM_PATH_DEF);
+    this->gpsClock = WiperfUtility::readGpsClock(cfile);
 
     this->portSrv = WiperfUtility::readPort(cfile, "feedback-receiver", PORT_FEED_SRV_DEF);
     WiperfUtility::readIfaces(cfile, "feedback-receiver", SERVER, this->ifaceMap);
@@ -56,6 +67,59 @@ void FeedbackSender::readConfig(const std::string& configFname) {
         LOG_ERR(ss.str().c_str());
     }
 
+    // configure how many previous samples every message repeats
+    this->feedbackHistory = FEEDBACK_HISTORY_DEF;
+    try {
+        this->feedbackHistory = std::stoi(cfile.Value("feedback-sender", "history"));
+    } catch (std::exception const&) {
+        // optional, keep the default
+    }
+    if (this->feedbackHistory < 0 || this->feedbackHistory > FEEDBACK_HISTORY_MAX) {
+        std::stringstream ss;
+        ss << "Config exception: section=feedback-sender, value=history, invalid value "
+           << this->feedbackHistory << ". Acceptable range is [0, " << FEEDBACK_HISTORY_MAX
+           << "]. Reverting to default: " << FEEDBACK_HISTORY_DEF;
+        LOG_ERR(ss.str().c_str());
+        this->feedbackHistory = FEEDBACK_HISTORY_DEF;
+    }
+
+    // configure the width of the time bins, by default one per feedback message
+    this->binInterval = this->feedbackInterval;
+    try {
+        this->binInterval = std::stoi(cfile.Value("feedback-sender", "bin-interval"));
+    } catch (std::exception const&) {
+        // optional, keep the default
+    }
+    if (this->binInterval < 1 || this->binInterval > this->feedbackInterval) {
+        std::stringstream ss;
+        ss << "Config exception: section=feedback-sender, value=bin-interval, invalid value "
+           << this->binInterval << ". Acceptable range is [1, feedback-interval]. Reverting to default: "
+           << this->feedbackInterval;
+        LOG_ERR(ss.str().c_str());
+        this->binInterval = this->feedbackInterval;
+    }
+
+    // the bins of an interval and of those repeated must still be in the ring when sent
+    if (this->binsPerInterval() * 2 > IFACE_BINS_LEN) {
+        std::stringstream ss;
+        ss << "Config exception: section=feedback-sender, value=bin-interval. At most "
+           << IFACE_BINS_LEN / 2 << " bins per feedback-interval";
+        LOG_FATAL_EXIT(ss.str().c_str());
+    }
+    while (this->feedbackHistory > 0
+           && (this->feedbackHistory + 2) * this->binsPerInterval() > IFACE_BINS_LEN) {
+        --this->feedbackHistory;
+    }
+
+    // a message must fit at least a bin of every RAT
+    if (this->dataReceiverIfnames.size() > UINT8_MAX || FEEDBACK_MAX_BINS(this->dataReceiverIfnames.size()) < 1) {
+        LOG_FATAL_EXIT("Config exception: section=data-receiver, value=ifaces. Too many for a feedback message");
+    }
+
+    // the data receiver accounts the bytes and probes in the bins from its first datagram on
+    this->dreceiver->getIfaceCounters().configureBins((uint32_t) this->binInterval * 1000);
+    this->dreceiver->getProbeStats().configure(&this->dreceiver->getIfaceCounters());
+
     // check that we have both cli and srv addresses for all ifaces
     // remove interfaces for which we don't have both addresses
     for (auto itr = this->ifaceMap.begin(); itr != this->ifaceMap.end();) {
@@ -78,6 +142,28 @@ void FeedbackSender::readConfig(const std::string& configFname) {
     }
 }
 
+void FeedbackSender::reloadConfig(ConfigFile& cfile) {
+    try {
+        if (std::stoi(cfile.Value("feedback-sender", "feedback-interval")) != this->feedbackInterval) {
+            LOG_WARN("Reload: the feedback interval changes on the next start");
+        }
+    } catch (std::exception const&) {}
+
+    std::vector<std::string> ifnames = WiperfUtility::readIfnames(cfile, "data-receiver");
+    if (ifnames.size() > UINT8_MAX || FEEDBACK_MAX_BINS(ifnames.size()) < 1) {
+        LOG_ERR("Reload: too many data-receiver interfaces for a feedback message, keeping the RAT ids");
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(this->reloadRatsMutex);
+    const std::vector<std::string> &current = this->ratsPending ? this->pendingIfnames : this->dataReceiverIfnames;
+    if (ifnames == current) return;
+
+    LOG_STREAM(MSG, "Reload: feedback for " << ifnames.size() << " RATs")
+    this->pendingIfnames = ifnames;
+    this->ratsPending = true;
+}
+
 /**
  * Create and bind sockets for each interface in the IfaceInfoMap field.
  * Socket file descriptors are stored in IfaceInfoMap.
@@ -115,7 +201,6 @@ void FeedbackSender::initializeInterfaceSockets() {
 
         // save new interface details
         iinfo.sockfd = sockfdCli;
-        iinfo.nbytesAcc = 0; // Since we will send feedback, this is not needed
 
         // build server (receiver) address structure
         this->createSockaddr(iinfo.addrSrv, this->portSrv, &iinfo.sockaddrSrv);
@@ -129,143 +214,116 @@ void FeedbackSender::commThread() {
     LOG_MSG("program up and running");
 
     /*
-     * t-2, t-1 and t information.
-     * These maps holds feedback message sent through each interface at
-     * time t, t-1 and t-2.
-     * The idea is that at time t, we always send the two previous readings also
-     * to add some reliability to the feedback.
+     * At time t, we always send the bins of the previous intervals also to add some
+     * reliability to the feedback; the receiver drops the ones it already has.
      */
-    std::map<std::string, FeedbackMessageStruct> tm2Info;
-    std::map<std::string, FeedbackMessageStruct> tm1Info;
-    std::map<std::string, FeedbackMessageStruct> tInfo;
+    const uint64_t binsPerInterval = this->binsPerInterval();
+    uint8_t numRats;
+    uint16_t maxBins;
+
+    // every message has at most the same size, so the buffers are allocated once per
+    // set of RATs, i.e., on start and on reloads that change them
+    std::vector<uint8_t> buffer;
+    std::vector<uint64_t> nbytes;
+    std::vector<ProbeSummary> probes;
+
+    // the counter slot of every RAT, -1 while the interface doesn't receive data
+    IfaceCounters &counters = this->dreceiver->getIfaceCounters();
+    const ProbeStats &probeStats = this->dreceiver->getProbeStats();
+    std::vector<int> slots;
+
+    FeedbackHeader header{};
+    header.binUs = counters.getBinUs();
+
+    auto setRats = [&]() {
+        numRats = static_cast<uint8_t>(this->dataReceiverIfnames.size());
+        maxBins = (uint16_t) std::min<uint64_t>(FEEDBACK_MAX_BINS(numRats), UINT16_MAX);
+        buffer.assign(FEEDBACK_MSG_LEN(numRats, maxBins), 0);
+        nbytes.assign(maxBins, 0);
+        probes.assign(maxBins, ProbeSummary());
+        slots.assign(numRats, -1);
+        header.nrats = numRats;
+    };
+    setRats();
+    // tells the receiver that a restarted sender counts anew
+    header.session = std::random_device()();
+
+    // feedback goes through the first interface pair
+    const IfaceInfo &ifaceInfo = this->ifaceMap.begin()->second;
 
     //Needed to synchronize to only send on the 100 ms mark (instead of sending at 1320 ms,
     //send at 1400 ms).
-    //GpsInfo currentInfo = WiperfUtility::getCurrentGps(gpsInfo);
-    //uint64_t currentMillis = WiperfUtility::getCurrentMillis(gpsInfo);
-
-    std::chrono::milliseconds currentMillis_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::system_clock::now().time_since_epoch());
-    uint64_t currentMillis = currentMillis_ms.count();
-
-    uint64_t sleepingInterval = this->feedbackInterval - (currentMillis % this->feedbackInterval);
-    std::this_thread::sleep_for(std::chrono::milliseconds(sleepingInterval));
+    PeriodicScheduler scheduler;
+    if (!scheduler.start(this->feedbackInterval,
+                         this->gpsClock ? WiperfUtility::getGpsInfo(this->gpsShmPath) : nullptr,
+                         "FeedbackSender")) {
+        LOG_FATAL_EXIT("FeedbackSender::commThread() can't create the scheduler");
+    }
 
+    // the bins before we started, which were never filled, aren't reported
+    const uint64_t startBin = counters.currentBin();
+    uint64_t nextBin = startBin;
     while (!endProgram_) {
-        //Get the GPS timestamp that corresponds to the throughput information
-        uint64_t timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
-                std::chrono::system_clock::now().time_since_epoch()).count();
-        //uint64_t timestamp = WiperfUtility::getCurrentMillis(gpsInfo);
-        timestamp = timestamp - (timestamp % this->feedbackInterval); // Do a little rounding to sync with receiver
-        // receiver will add this to the same database entry as the mobility and channel information
-
-        std::map<std::string, uint32_t> nbytesMap;
-
-        // Read the throughput from the dreceiver pointer and add them to the nbytesMap
-        for (auto & itr : dreceiver->getIfaceInfoMap()) {
-            uint32_t nbytes = itr.second.nbytesAcc;
-            nbytesMap.insert({itr.first, nbytes});
+        //The tick is on the same grid as the receiver's, the bins closed up to it are
+        // ready; each goes to the database entry of its own time
+        if (scheduler.wait() == 0) break;
+
+        const uint64_t endBin = counters.currentBin(); // the one still being filled
+        if (endBin <= nextBin) continue;
+
+        {
+            std::lock_guard<std::mutex> lock(this->reloadRatsMutex);
+            if (this->ratsPending) {
+                this->dataReceiverIfnames.swap(this->pendingIfnames);
+                this->ratsPending = false;
+                setRats();
+            }
         }
 
-        // Tell the dreceiver that we read the throughput when tput = x,
-        // for them to reset their counters by decrementing by x
-        for (auto & itr : dreceiver->nbytes_reset_value) {
-            auto itr_tput = nbytesMap.find(itr.first);
-            itr.second = itr_tput->second;
+        // an interface the data receiver added on a reload may have a slot by now
+        for (uint8_t ratId = 0; ratId < numRats; ratId++) {
+            if (slots[ratId] < 0) slots[ratId] = counters.find(this->dataReceiverIfnames[ratId]);
         }
 
-        uint64_t netTimestamp = WiperfUtility::htonll(timestamp);
-
-        // Update the maps for another iteration
-        tm2Info = tm1Info;
-        tm1Info = tInfo;
-        tInfo.clear();
-
-        // 4 Bytes - # of RATs
-        // 4 Bytes - RAT ID
-        // 12 Bytes - entry t
-        // 12 Bytes - entry t-1
-        // 12 Bytes - entry t-2
-        // 40 Bytes per RAT + 4 bytes for # of RATs
-
-        uint32_t numRats = static_cast<uint32_t>(this->dataReceiverIfnames.size());
-        uint32_t netNumRats = htonl(numRats);
-        uint32_t sizePerRat = 40;
-        const int bufferSize = 4 + numRats * sizePerRat;
-
-        // Buffer is a variable-length array, the "new" operator has to be used
-        // to allocate dynamic memory
-        uint8_t* buffer = new uint8_t[bufferSize];
-        std::memset(buffer, 0, bufferSize);
-        std::memcpy(&buffer[0], &netNumRats, sizeof(uint32_t));
-
-        uint32_t i = 0;
-
-        for (auto & ifname : this->dataReceiverIfnames) {
-            uint32_t offset = 4 + sizePerRat * i;
-            std::string ifaceName = ifname;
-
-            uint32_t nbytes = nbytesMap.find(ifaceName)->second;
-
-            uint32_t throughput = (nbytes * 8) / sleepingInterval;
-            uint32_t netThroughput = htonl(throughput);
-
-            uint8_t currInfo[12] = { 0 };
-            std::memcpy(&(currInfo[0]), &netTimestamp, sizeof(uint64_t));
-            std::memcpy(&(currInfo[8]), &netThroughput, sizeof(uint32_t));
-
-            std::memcpy(&buffer[offset], &(i), 4);
-
-            //Add entry t
-            std::memcpy(&buffer[offset + 4], &currInfo[0], 12);
-
-            if (!tm1Info.empty() && tm1Info.count(ifaceName)) {
-                //Add entry t-1
-                uint8_t *message1 = tm1Info[ifaceName].message;
-                std::memcpy(&buffer[offset + 4 + 12], &message1[0],12);
-
-                if (!tm2Info.empty() && tm2Info.count(ifaceName)) {
-                    //Add entry t-2
-                    uint8_t *message2 = tm2Info[ifaceName].message;
-                    std::memcpy(&buffer[offset + 4 + 24], &message2[0], 12);
+        // the new bins, plus as many bins of the previous intervals as fit in the same message
+        uint64_t bin = nextBin;
+        const uint64_t repeat = std::min<uint64_t>(this->feedbackHistory * binsPerInterval, bin - startBin);
+        bin -= std::min<uint64_t>(repeat, maxBins > endBin - bin ? maxBins - (endBin - bin) : 0);
+        if (endBin - bin > IFACE_BINS_LEN - binsPerInterval) bin = endBin - (IFACE_BINS_LEN - binsPerInterval);
+
+        // as many messages as it takes, normally one
+        while (bin < endBin) {
+            header.nbins = (uint16_t) std::min<uint64_t>(endBin - bin, maxBins);
+            header.firstBin = bin;
+            ++header.seq;
+
+            size_t len = FeedbackCodec::encodeHeader(buffer.data(), buffer.size(), header);
+            for (uint8_t ratId = 0; ratId < numRats; ratId++) {
+                // bytes and probes received through the interface in each bin
+                if (slots[ratId] >= 0) {
+                    counters.readBins(slots[ratId], bin, header.nbins, nbytes.data());
+                    probeStats.readBins(slots[ratId], bin, header.nbins, probes.data());
+                } else {
+                    std::fill(nbytes.begin(), nbytes.begin() + header.nbins, 0);
+                    std::fill(probes.begin(), probes.begin() + header.nbins, ProbeSummary());
                 }
-            }
-
-            //Add the current info (time t) to the tInfo map for future use.
-            FeedbackMessageStruct feedbackMsg;
-            feedbackMsg.ifaceName = ifaceName;
-            feedbackMsg.throughput = throughput;
-            feedbackMsg.timestamp = timestamp;
-
-            std::memcpy(&(feedbackMsg.message[0]), &currInfo[0], 12);
-            tInfo.insert(std::pair<std::string, FeedbackMessageStruct>(ifaceName, feedbackMsg));
-
-            ++i;
-        } // for() end
 
+                len += FeedbackCodec::encodeRat(buffer.data() + len, buffer.size() - len, ratId,
+                                                nbytes.data(), probes.data(), header.nbins);
+            }
 
-        auto itr = this->ifaceMap.begin();
-        IfaceInfo ifaceInfo = itr->second;
+            if (sendto(ifaceInfo.sockfd, buffer.data(), len, 0,  /*flags*/
+                       (const struct sockaddr*) &(ifaceInfo.sockaddrSrv), sizeof(ifaceInfo.sockaddrSrv)) == -1) {
+                this->closeIfaceSocks();
+                LOG_FATAL_PERROR_EXIT("rthread sendto()");
+            }
 
-        if (sendto(ifaceInfo.sockfd, buffer, bufferSize, 0,  /*flags*/
-                   (const struct sockaddr*) &(ifaceInfo.sockaddrSrv), sizeof(ifaceInfo.sockaddrSrv)) == -1) {
-            this->closeIfaceSocks();
-            LOG_FATAL_PERROR_EXIT("rthread sendto()");
+            bin += header.nbins;
         }
 
-
-        delete[] buffer; // delete dynamic memory allocation
-
-        //Calculate the sleeping time and sleep
-        //uint64_t endTimestamp = WiperfUtility::getCurrentMillis(gpsInfo);
-
-        std::chrono::milliseconds endTimestamp_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                std::chrono::system_clock::now().time_since_epoch());
-        uint64_t endTimestamp = endTimestamp_ms.count();
-
-        sleepingInterval = this->feedbackInterval - (endTimestamp % this->feedbackInterval);
-        std::this_thread::sleep_for(std::chrono::milliseconds(sleepingInterval));
+        nextBin = endBin;
     } // while() end
 
+    scheduler.logStats("FeedbackSender");
     this->closeIfaceSocks();
 }
@@ -12,20 +12,11 @@
 #ifndef FEEDBACKSENDER_HPP
 #define FEEDBACKSENDER_HPP
 
+#include <mutex>    // std::mutex
 #include <string>   // std::string
 #include "../DataTransfer.hpp"
 #include "DataReceiver.hpp"
 
-/**
- * Structure useful for the throughput feedback messages.
- */
-struct FeedbackMessageStruct {
-    uint64_t timestamp;
-    uint32_t throughput;
-    std::string ifaceName;
-    uint8_t message[12];
-};
-
 /**
  * This class defines a thread that must read the number of bytes that were transmitted
  * to each interface and send it through each interface, accompanied by a timestamp from
@@ -43,9 +34,26 @@ private:
      */
     int feedbackInterval;
 
+    /**
+     * Previous intervals repeated in every message (see FeedbackCodec.hpp).
+     */
+    int feedbackHistory;
+
+    /**
+     * Milliseconds per time bin of the throughput counters, at most feedbackInterval.
+     */
+    int binInterval;
+
+    uint64_t binsPerInterval() const;
+
     IfaceInfoMap dataReceiverIfaces;
     std::vector<std::string> dataReceiverIfnames;
 
+    // RAT ids of a reload, for commThread() to apply before its next message
+    std::mutex reloadRatsMutex;
+    std::vector<std::string> pendingIfnames;
+    bool ratsPending;
+
     void initializeInterfaceSockets();
 
 protected:
@@ -55,6 +63,13 @@ protected:
 public:
     explicit FeedbackSender(DataReceiver *dataReceiver);
     void readConfig(const std::string& configFname) override;
+
+    /**
+     * Applies the RAT ids (data-receiver interfaces) of the reloaded configuration, which
+     * the feedback receiver must reload as well. The feedback interval, bins and
+     * interfaces are only read on start.
+     */
+    void reloadConfig(ConfigFile& cfile) override;
 };
 
 #endif //FEEDBACKSENDER_HPP
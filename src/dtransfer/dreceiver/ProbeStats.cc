@@ -0,0 +1,198 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "ProbeStats.hpp"
+
+#include <climits>  // INT32_MAX
+#include <cstring>  // memset()
+
+#define PROBE_JITTER_MAX_US 100000000 // larger steps are clock jumps, not jitter
+
+// single writer, so a plain load/store pair is enough (no locked read-modify-write)
+template <typename T>
+static inline void bump(std::atomic<T> &value, T n) {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static inline uint32_t clampU32(uint64_t value) {
+    return value > UINT32_MAX ? UINT32_MAX : (uint32_t) value;
+}
+
+static inline int32_t clampI32(int64_t value) {
+    return value > INT32_MAX ? INT32_MAX : value < INT32_MIN ? INT32_MIN : (int32_t) value;
+}
+
+static inline int delayBucket(int64_t delayUs) {
+    if (delayUs < 128) return 0;
+
+    const int log2 = 63 - __builtin_clzll((uint64_t) delayUs);
+    const int bucket = (log2 - 5) / 2;
+    return bucket < PROBE_DELAY_BUCKETS ? bucket : PROBE_DELAY_BUCKETS - 1;
+}
+
+ProbeStats::ProbeStats() : counters(nullptr), nslots(0), trackers(), bins() {}
+
+void ProbeStats::configure(const IfaceCounters *counters) {
+    this->nslots = IFACE_COUNTERS_MAX;
+
+    this->trackers.reset(new Tracker[this->nslots]);
+    for (int i = 0; i < this->nslots; i++) {
+        this->trackers[i].started = false;
+    }
+
+    this->bins.reset(new ProbeBin[(size_t) this->nslots * IFACE_BINS_LEN]);
+    for (size_t i = 0; i < (size_t) this->nslots * IFACE_BINS_LEN; i++) {
+        this->bins[i].key.store(IFACE_BIN_NONE, std::memory_order_relaxed);
+    }
+
+    this->counters = counters;
+}
+
+bool ProbeStats::enabled() const {
+    return this->counters != nullptr;
+}
+
+uint64_t ProbeStats::currentBin() const {
+    return this->counters->currentBin();
+}
+
+ProbeBin &ProbeStats::binFor(int slot, uint64_t key) {
+    ProbeBin &bin = this->bins[(size_t) slot * IFACE_BINS_LEN + key % IFACE_BINS_LEN];
+
+    // first probe of a new bin: recycle the slot, invalidating it while it's reset
+    if (bin.key.load(std::memory_order_relaxed) != key) {
+        bin.key.store(IFACE_BIN_NONE, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bin.received.store(0, std::memory_order_relaxed);
+        bin.lost.store(0, std::memory_order_relaxed);
+        bin.reordered.store(0, std::memory_order_relaxed);
+        bin.duplicates.store(0, std::memory_order_relaxed);
+        bin.jitterUs.store(0, std::memory_order_relaxed);
+        bin.delayMinUs.store(INT32_MAX, std::memory_order_relaxed);
+        bin.delayMaxUs.store(INT32_MIN, std::memory_order_relaxed);
+        bin.delaySumUs.store(0, std::memory_order_relaxed);
+        for (auto &count : bin.delayHist) count.store(0, std::memory_order_relaxed);
+        bin.key.store(key, std::memory_order_release);
+    }
+
+    return bin;
+}
+
+void ProbeStats::advance(Tracker &tracker, uint64_t seq, ProbeBin &bin) {
+    const uint64_t jump = seq - tracker.highest;
+    uint64_t lost = 0;
+
+    if (jump >= PROBE_WINDOW) {
+        // the whole window moves out, along with the skipped numbers that don't make it in
+        for (uint64_t &word : tracker.window) {
+            lost += 64 - __builtin_popcountll(word);
+            word = 0;
+        }
+        lost += jump - PROBE_WINDOW;
+    } else {
+        // each new number takes the bit of the one PROBE_WINDOW before it
+        for (uint64_t s = tracker.highest + 1; s <= seq; s++) {
+            uint64_t &word = tracker.window[(s % PROBE_WINDOW) / 64];
+            const uint64_t mask = 1ULL << (s % 64);
+            if (!(word & mask)) ++lost;
+            word &= ~mask;
+        }
+    }
+
+    tracker.highest = seq;
+    if (lost) bump(bin.lost, clampU32(lost));
+}
+
+void ProbeStats::add(int slot, const uint8_t *datagram, size_t len, uint64_t nowUs, uint64_t key) {
+    ProbeHeader header;
+    if (!ProbeCodec::decode(datagram, len, header)) return;
+
+    if (slot < 0 || slot >= this->nslots) return;
+
+    Tracker &tracker = this->trackers[slot];
+    ProbeBin &bin = this->binFor(slot, key);
+    const int64_t transitUs = (int64_t) (nowUs - header.sendUs);
+
+    if (!tracker.started || header.session != tracker.session) {
+        // a new sender, nothing before its first datagram is missing
+        tracker.started = true;
+        tracker.session = header.session;
+        tracker.highest = header.seq;
+        memset(tracker.window, 0xff, sizeof(tracker.window));
+        tracker.lastTransitUs = transitUs;
+        tracker.jitter16 = 0;
+    } else if (header.seq > tracker.highest) {
+        this->advance(tracker, header.seq, bin);
+        tracker.window[(header.seq % PROBE_WINDOW) / 64] |= 1ULL << (header.seq % 64);
+    } else if (tracker.highest - header.seq >= PROBE_WINDOW) {
+        bump(bin.reordered, 1u); // too late to tell, already counted lost
+    } else {
+        uint64_t &word = tracker.window[(header.seq % PROBE_WINDOW) / 64];
+        const uint64_t mask = 1ULL << (header.seq % 64);
+        if (word & mask) {
+            bump(bin.duplicates, 1u);
+            return;
+        }
+        word |= mask;
+        bump(bin.reordered, 1u);
+    }
+
+    bump(bin.received, 1u);
+
+    // RFC 3550: J += (|D| - J) / 16, with J scaled by 16
+    int64_t d = transitUs - tracker.lastTransitUs;
+    if (d < 0) d = -d;
+    if (d > PROBE_JITTER_MAX_US) d = 0;
+    tracker.lastTransitUs = transitUs;
+    tracker.jitter16 += (uint32_t) d - ((tracker.jitter16 + 8) >> 4);
+    bin.jitterUs.store(tracker.jitter16 >> 4, std::memory_order_relaxed);
+
+    const int32_t delayUs = clampI32(transitUs);
+    if (delayUs < bin.delayMinUs.load(std::memory_order_relaxed))
+        bin.delayMinUs.store(delayUs, std::memory_order_relaxed);
+    if (delayUs > bin.delayMaxUs.load(std::memory_order_relaxed))
+        bin.delayMaxUs.store(delayUs, std::memory_order_relaxed);
+    bump(bin.delaySumUs, (int64_t) delayUs);
+    bump(bin.delayHist[delayBucket(delayUs)], 1u);
+}
+
+void ProbeStats::readBins(int slot, uint64_t first, size_t nbins, ProbeSummary *summaries) const {
+    for (size_t i = 0; i < nbins; i++) {
+        summaries[i] = ProbeSummary();
+        if (!this->bins || slot < 0 || slot >= this->nslots) continue;
+
+        const uint64_t key = first + i;
+        const ProbeBin &bin = this->bins[(size_t) slot * IFACE_BINS_LEN + key % IFACE_BINS_LEN];
+
+        // as in IfaceCounters::readBins(), the slot must hold this bin before and after
+        ProbeSummary summary;
+        const uint64_t key1 = bin.key.load(std::memory_order_acquire);
+        summary.received = bin.received.load(std::memory_order_relaxed);
+        summary.lost = bin.lost.load(std::memory_order_relaxed);
+        summary.reordered = bin.reordered.load(std::memory_order_relaxed);
+        summary.duplicates = bin.duplicates.load(std::memory_order_relaxed);
+        summary.jitterUs = bin.jitterUs.load(std::memory_order_relaxed);
+        summary.delayMinUs = bin.delayMinUs.load(std::memory_order_relaxed);
+        summary.delayMaxUs = bin.delayMaxUs.load(std::memory_order_relaxed);
+        const int64_t delaySumUs = bin.delaySumUs.load(std::memory_order_relaxed);
+        for (int b = 0; b < PROBE_DELAY_BUCKETS; b++) {
+            summary.delayHist[b] = bin.delayHist[b].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint64_t key2 = bin.key.load(std::memory_order_relaxed);
+
+        if (key1 != key || key2 != key) continue;
+
+        if (summary.received > 0) {
+            summary.delayMeanUs = clampI32(delaySumUs / summary.received);
+        } else {
+            summary.delayMinUs = summary.delayMaxUs = 0;
+        }
+
+        summaries[i] = summary;
+    }
+}
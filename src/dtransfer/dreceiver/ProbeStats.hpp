@@ -0,0 +1,112 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the receiver side accounting of the probe headers written by the Data Sender
+ * (see ProbeCodec.hpp): loss, reordering, duplicates, jitter and one-way delay, in the
+ * same time bins as the byte counters, so every feedback bin carries both.
+ */
+
+#ifndef PROBESTATS_HPP
+#define PROBESTATS_HPP
+
+#include <atomic>   // std::atomic
+#include <cstddef>  // size_t
+#include <cstdint>  // uint*_t
+#include <memory>   // std::unique_ptr
+
+#include "../IfaceCounters.hpp"
+#include "../ProbeCodec.hpp"
+
+#define PROBE_WINDOW 256 // sequence numbers tracked for reordering and duplicates
+
+/**
+ * Probe statistics of one time bin, keyed like IfaceBin.
+ */
+struct ProbeBin {
+    std::atomic<uint64_t> key;
+    std::atomic<uint32_t> received;
+    std::atomic<uint32_t> lost;
+    std::atomic<uint32_t> reordered;
+    std::atomic<uint32_t> duplicates;
+    std::atomic<uint32_t> jitterUs;
+    std::atomic<int32_t> delayMinUs;
+    std::atomic<int32_t> delayMaxUs;
+    std::atomic<int64_t> delaySumUs;
+    std::atomic<uint32_t> delayHist[PROBE_DELAY_BUCKETS];
+};
+
+/**
+ * Per-interface probe statistics, indexed by the IfaceCounters slot of the interface.
+ * As for the byte counters, each slot has a single writer (its receive worker) and
+ * the bins are read once closed, so the hot path has no locks, read-modify-writes
+ * nor allocations.
+ *
+ * A sequence number is only declared lost once PROBE_WINDOW later ones have arrived,
+ * so a reordered datagram isn't counted as lost, and the loss shows up in the bin
+ * where that happens. Datagrams later than that are counted as reordered, on top of
+ * having been counted lost. Datagrams without a probe header only count as bytes.
+ */
+class ProbeStats {
+private:
+    /**
+     * Receive state of an interface, only touched by its worker.
+     */
+    struct alignas(CACHE_LINE_LEN) Tracker {
+        bool started;
+        uint32_t session;
+        uint64_t highest;                   // highest sequence number received
+        uint64_t window[PROBE_WINDOW / 64]; // bit seq % PROBE_WINDOW set if received
+        int64_t lastTransitUs;
+        uint32_t jitter16;                  // jitter, in 1/16 us
+    };
+
+    const IfaceCounters *counters;
+    int nslots;
+    std::unique_ptr<Tracker[]> trackers;
+    std::unique_ptr<ProbeBin[]> bins; // IFACE_BINS_LEN per slot
+
+    ProbeBin &binFor(int slot, uint64_t key);
+
+    /**
+     * Moves the window up to seq, declaring lost the sequence numbers that leave it
+     * without having been received.
+     */
+    static void advance(Tracker &tracker, uint64_t seq, ProbeBin &bin);
+
+public:
+    ProbeStats();
+
+    /**
+     * Enables the statistics, in the bins of the counters, which must already be
+     * configured with IfaceCounters::configureBins(). Every slot the counters can have
+     * is allocated, as a reload may register new ones while the workers run.
+     * Must be called before the worker threads start.
+     */
+    void configure(const IfaceCounters *counters);
+
+    bool enabled() const;
+
+    /**
+     * @return the bin being filled now, to be passed to add() for a batch of datagrams
+     */
+    uint64_t currentBin() const;
+
+    /**
+     * Accounts a received datagram. Only the thread that owns the slot may call it.
+     * @param datagram the start of the datagram, at least as much as was read of it
+     * @param nowUs    wall clock time it was received at, in us
+     * @param bin      from currentBin()
+     */
+    void add(int slot, const uint8_t *datagram, size_t len, uint64_t nowUs, uint64_t bin);
+
+    /**
+     * Reads a range of bins of a slot. Bins that saw no probes, or that are no longer
+     * in the ring, read as an empty summary.
+     * @param summaries destination, with room for nbins values
+     */
+    void readBins(int slot, uint64_t first, size_t nbins, ProbeSummary *summaries) const;
+};
+
+#endif //PROBESTATS_HPP
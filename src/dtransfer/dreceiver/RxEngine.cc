@@ -0,0 +1,372 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "RxEngine.hpp"
+
+#include <linux/filter.h>    // struct sock_filter
+#include <linux/if_ether.h>  // ETH_P_IP
+#include <linux/if_packet.h> // struct tpacket3_hdr
+#include <net/if.h>      // if_nametoindex()
+#include <netinet/in.h>  // IPPROTO_UDP
+#include <sys/epoll.h>   // epoll_create1(), epoll_wait()
+#include <sys/mman.h>    // mmap()
+#include <unistd.h>      // close()
+#include <cerrno>        // errno
+#include <cstring>       // std::strerror, memset()
+#include <algorithm>     // std::min, std::max
+#include <sstream>       // std::stringstream
+
+#include "../../util/logfile.hpp"    // class LogFile and LOG_* macros
+
+// older libc headers don't know about UDP GRO (kernel >= 5.0)
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+RxEngine::RxEngine(IfaceInfo &iinfo, int wakefd, ProbeStats *probes, size_t bufferLen) :
+        iinfo(iinfo), wakefd(wakefd), epollfd(-1), probes(probes),
+        batchSizes(Metrics::getInstance()->histogram("wiperf_rx_batch_datagrams", "Datagrams read per wake up",
+                                                     Metrics::label("iface", iinfo.name), 1, 8)),
+        emptyReads(Metrics::getInstance()->counter("wiperf_rx_empty_reads_total",
+                                                   "Wake ups that found nothing to read (EAGAIN)",
+                                                   Metrics::label("iface", iinfo.name))),
+        recvErrors(Metrics::getInstance()->counter("wiperf_rx_recv_errors_total", "Failed receive calls",
+                                                   Metrics::label("iface", iinfo.name))),
+        buffer(bufferLen) {
+    if ((this->epollfd = epoll_create1(0)) < 0) {
+        LOG_FATAL_PERROR_EXIT("rthread epoll_create1()");
+    }
+
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = iinfo.sockfd;
+    if (epoll_ctl(this->epollfd, EPOLL_CTL_ADD, iinfo.sockfd, &ev) < 0) {
+        LOG_FATAL_PERROR_EXIT("rthread epoll_ctl() socket");
+    }
+
+    ev.data.fd = wakefd;
+    if (epoll_ctl(this->epollfd, EPOLL_CTL_ADD, wakefd, &ev) < 0) {
+        LOG_FATAL_PERROR_EXIT("rthread epoll_ctl() wakefd");
+    }
+}
+
+RxEngine::~RxEngine() {
+    close(this->epollfd);
+}
+
+bool RxEngine::setup() {
+    return true;
+}
+
+bool RxEngine::waitReadable() {
+    struct epoll_event events[2];
+
+    while (true) {
+        int nready = epoll_wait(this->epollfd, events, 2, -1 /*no timeout*/);
+        if (nready < 0) {
+            if (errno == EINTR) continue;
+            LOG_FATAL_PERROR_EXIT("rthread epoll_wait()");
+        }
+
+        bool readable = false;
+        for (int i = 0; i < nready; i++) {
+            if (events[i].data.fd == this->wakefd) return false;  // time to end
+            readable = true;
+        }
+
+        if (readable) return true;
+    }
+}
+
+int64_t RxEngine::receive(uint64_t &npackets) {
+    npackets = 0;
+    if (!this->waitReadable()) return -1;
+
+    const uint64_t nbytes = this->drain(npackets);
+    if (npackets > 0) this->batchSizes.observe(npackets);
+    else this->emptyReads.add();
+
+    return (int64_t) nbytes;
+}
+
+RxEngine* RxEngine::create(IfaceInfo &iinfo, int wakefd, ProbeStats *probes) {
+    RxEngine *engine = nullptr;
+
+    if (iinfo.ioEngine == IoEngine::ring) {
+        engine = new RingRxEngine(iinfo, wakefd, probes);
+        if (engine->setup()) return engine;
+
+        LOG_WARN("PACKET_MMAP receive ring not available, falling back to the mmsg engine");
+        delete engine;
+        iinfo.ioEngine = IoEngine::mmsg;
+    }
+
+    if (iinfo.ioEngine == IoEngine::gro) {
+        engine = new GroRxEngine(iinfo, wakefd, probes);
+        if (engine->setup()) return engine;
+
+        LOG_WARN("UDP GRO not supported, falling back to the mmsg engine");
+        delete engine;
+        iinfo.ioEngine = IoEngine::mmsg;
+    }
+
+    if (iinfo.ioEngine == IoEngine::mmsg) {
+        engine = new MmsgRxEngine(iinfo, wakefd, probes);
+    } else {
+        iinfo.ioEngine = IoEngine::basic;  // gso and other transmit-only engines
+        engine = new BasicRxEngine(iinfo, wakefd, probes);
+    }
+
+    engine->setup();
+    return engine;
+}
+
+// ------------- BASIC -------------
+
+BasicRxEngine::BasicRxEngine(IfaceInfo &iinfo, int wakefd, ProbeStats *probes) :
+        RxEngine(iinfo, wakefd, probes, RCV_BUF_LEN) {}
+
+uint64_t BasicRxEngine::drain(uint64_t &npackets) {
+    uint64_t nbytesTotal = 0;
+    uint64_t nowUs = 0, bin = 0;
+
+    for (int i = 0; i < RCV_BUF_NUM_PACKETS; i++) {
+        ssize_t nbytes = recv(this->iinfo.sockfd, this->buffer.data(), this->buffer.size(), MSG_DONTWAIT);
+        if (nbytes <= 0) break;  // EAGAIN, socket drained
+
+        if (this->probes) {
+            if (i == 0) {
+                nowUs = ProbeCodec::nowUs();
+                bin = this->probes->currentBin();
+            }
+            this->inspect(this->buffer.data(), nbytes, nbytes, nbytes, nowUs, bin);
+        }
+
+        nbytesTotal += nbytes;
+        ++npackets;
+    }
+
+    return nbytesTotal;
+}
+
+// ------------- MMSG -------------
+
+MmsgRxEngine::MmsgRxEngine(IfaceInfo &iinfo, int wakefd, ProbeStats *probes) :
+        MmsgRxEngine(iinfo, wakefd, probes, RCV_SLOT_LEN, 0) {}
+
+MmsgRxEngine::MmsgRxEngine(IfaceInfo &iinfo, int wakefd, ProbeStats *probes, size_t slotLen, size_t controlLen) :
+        RxEngine(iinfo, wakefd, probes, 0), nmsgs(0), slotLen(slotLen), control(), controlLen(controlLen) {
+    // the buffer stays RCV_BUF_LEN long, with fewer messages if they are larger
+    this->nmsgs = (int) std::min<size_t>(RCV_BUF_NUM_PACKETS, RCV_BUF_LEN / slotLen);
+    this->buffer.resize(this->nmsgs * slotLen);
+    this->control.resize(this->nmsgs * controlLen);
+
+    memset(this->msgs, 0, sizeof(this->msgs));
+
+    for (int i = 0; i < this->nmsgs; i++) {
+        this->iovs[i].iov_base = this->buffer.data() + i * slotLen;
+        this->iovs[i].iov_len = slotLen;
+
+        this->msgs[i].msg_hdr.msg_iov = &this->iovs[i];
+        this->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+size_t MmsgRxEngine::segmentLen(const struct mmsghdr &msg) const {
+    return msg.msg_len;
+}
+
+uint64_t MmsgRxEngine::drain(uint64_t &npackets) {
+    // the kernel shrinks msg_controllen to what it wrote, so it's set again every time
+    for (int i = 0; this->controlLen && i < this->nmsgs; i++) {
+        this->msgs[i].msg_hdr.msg_control = this->control.data() + i * this->controlLen;
+        this->msgs[i].msg_hdr.msg_controllen = this->controlLen;
+    }
+
+    int nread = recvmmsg(this->iinfo.sockfd, this->msgs, this->nmsgs,
+                         MSG_DONTWAIT | MSG_TRUNC, nullptr);
+
+    if (nread < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            this->recvErrors.add();
+            LOG_STREAM(ERROR, "rthread recvmmsg() error: " << errno << " :: " << std::strerror(errno))
+        }
+        return 0;
+    }
+
+    uint64_t nowUs = 0, bin = 0;
+    if (this->probes && nread > 0) {
+        nowUs = ProbeCodec::nowUs();
+        bin = this->probes->currentBin();
+    }
+
+    // with MSG_TRUNC, msg_len is the real datagram length, even if it didn't fit the slot
+    uint64_t nbytesTotal = 0;
+    for (int i = 0; i < nread; i++) {
+        const size_t length = this->msgs[i].msg_len;
+        const size_t segmentLen = std::max<size_t>(this->segmentLen(this->msgs[i]), 1);
+
+        if (this->probes) {
+            this->inspect((const char *) this->iovs[i].iov_base, std::min(length, this->slotLen),
+                          length, segmentLen, nowUs, bin);
+        }
+
+        nbytesTotal += length;
+        npackets += length > segmentLen ? (length + segmentLen - 1) / segmentLen : 1;
+    }
+
+    return nbytesTotal;
+}
+
+// ------------- GRO -------------
+
+GroRxEngine::GroRxEngine(IfaceInfo &iinfo, int wakefd, ProbeStats *probes) :
+        MmsgRxEngine(iinfo, wakefd, probes, GRO_SLOT_LEN, CMSG_SPACE(sizeof(int))) {}
+
+bool GroRxEngine::setup() {
+    int enable = 1;
+    return setsockopt(this->iinfo.sockfd, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == 0;
+}
+
+size_t GroRxEngine::segmentLen(const struct mmsghdr &msg) const {
+    // the kernel tells the datagram length of coalesced messages only
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg.msg_hdr); cmsg;
+         cmsg = CMSG_NXTHDR((struct msghdr *) &msg.msg_hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int gsoSize;
+            memcpy(&gsoSize, CMSG_DATA(cmsg), sizeof(gsoSize));
+            if (gsoSize > 0) return (size_t) gsoSize;
+        }
+    }
+
+    return msg.msg_len;
+}
+
+// ------------- RING -------------
+
+#define RING_SNAP_LEN (60 + 8 + PROBE_HEADER_LEN) // longest IPv4 header, UDP, probe header
+
+RingRxEngine::RingRxEngine(IfaceInfo &iinfo, int wakefd, ProbeStats *probes) :
+        RxEngine(iinfo, wakefd, probes, 0), ringfd(-1), ring(nullptr), ringLen(0), block(0) {}
+
+RingRxEngine::~RingRxEngine() {
+    if (this->ring) munmap(this->ring, this->ringLen);
+    if (this->ringfd >= 0) close(this->ringfd);
+}
+
+bool RingRxEngine::setup() {
+    const int ifindex = (int) if_nametoindex(this->iinfo.name.c_str());
+    if (ifindex == 0) return false;
+
+    struct sockaddr_in local{};
+    socklen_t localLen = sizeof(local);
+    if (getsockname(this->iinfo.sockfd, (struct sockaddr *) &local, &localLen) < 0) return false;
+
+    // protocol 0, so nothing comes in before the filter and the ring are in place
+    if ((this->ringfd = socket(AF_PACKET, SOCK_DGRAM, 0)) < 0) return false;
+
+    // from the IP header on: UDP, not a fragment, to the port; cut after the probe header
+    struct sock_filter code[] = {
+            BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),
+            BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),
+            BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, 4, 0),
+            BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+            BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohs(local.sin_port), 0, 1),
+            BPF_STMT(BPF_RET | BPF_K, RING_SNAP_LEN),
+            BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog filter = {(unsigned short) (sizeof(code) / sizeof(code[0])), code};
+    if (setsockopt(this->ringfd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) < 0) return false;
+
+    int version = TPACKET_V3;
+    if (setsockopt(this->ringfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) return false;
+
+    struct tpacket_req3 req{};
+    req.tp_block_size = RCV_RING_BLOCK_LEN;
+    req.tp_block_nr = RCV_RING_BLOCKS;
+    req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+    req.tp_frame_nr = (RCV_RING_BLOCK_LEN / req.tp_frame_size) * RCV_RING_BLOCKS;
+    req.tp_retire_blk_tov = RCV_RING_BLOCK_TIMEOUT;
+    if (setsockopt(this->ringfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) return false;
+
+    this->ringLen = (size_t) RCV_RING_BLOCK_LEN * RCV_RING_BLOCKS;
+    void *ring = mmap(nullptr, this->ringLen, PROT_READ | PROT_WRITE, MAP_SHARED, this->ringfd, 0);
+    if (ring == MAP_FAILED) return false;
+    this->ring = (uint8_t *) ring;
+
+    struct sockaddr_ll sll{};
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_IP);
+    sll.sll_ifindex = ifindex;
+    if (bind(this->ringfd, (struct sockaddr *) &sll, sizeof(sll)) < 0) return false;
+
+    // wait on the ring instead of the UDP socket, which keeps the port and drops it all
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = this->ringfd;
+    if (epoll_ctl(this->epollfd, EPOLL_CTL_DEL, this->iinfo.sockfd, nullptr) < 0 ||
+        epoll_ctl(this->epollfd, EPOLL_CTL_ADD, this->ringfd, &ev) < 0) {
+        LOG_FATAL_PERROR_EXIT("rthread epoll_ctl() ring");
+    }
+
+    struct sock_filter dropAll[] = {BPF_STMT(BPF_RET | BPF_K, 0)};
+    struct sock_fprog drop = {1, dropAll};
+    if (setsockopt(this->iinfo.sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &drop, sizeof(drop)) < 0) {
+        LOG_STREAM(WARN, "UDP socket of " << this->iinfo.name << " not muted: " << std::strerror(errno))
+    }
+
+    return true;
+}
+
+uint64_t RingRxEngine::drain(uint64_t &npackets) {
+    uint64_t nbytesTotal = 0;
+    const size_t sllOffset = TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+
+    while (true) {
+        auto *desc = (struct tpacket_block_desc *) (this->ring + (size_t) this->block * RCV_RING_BLOCK_LEN);
+        if (!(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) break;
+
+        const uint64_t bin = this->probes ? this->probes->currentBin() : 0;
+
+        auto *pkt = (struct tpacket3_hdr *) ((uint8_t *) desc + desc->hdr.bh1.offset_to_first_pkt);
+        for (uint32_t i = 0; i < desc->hdr.bh1.num_pkts; i++) {
+            const auto *sll = (const struct sockaddr_ll *) ((uint8_t *) pkt + sllOffset);
+            const uint8_t *ip = (uint8_t *) pkt + pkt->tp_net;
+            const size_t ipHeaderLen = (size_t) (ip[0] & 0x0f) * 4;
+
+            // looped back datagrams show up on their way out too
+            if (sll->sll_pkttype != PACKET_OUTGOING && pkt->tp_snaplen >= ipHeaderLen + 8) {
+                const uint8_t *udp = ip + ipHeaderLen;
+                const size_t udpLen = (size_t) (udp[4] << 8 | udp[5]);
+
+                if (udpLen >= 8) {
+                    const size_t length = udpLen - 8;
+                    if (this->probes) {
+                        const uint64_t rxUs = (uint64_t) pkt->tp_sec * 1000000 + pkt->tp_nsec / 1000;
+                        this->inspect((const char *) udp + 8, pkt->tp_snaplen - ipHeaderLen - 8, length, length,
+                                      rxUs, bin);
+                    }
+
+                    nbytesTotal += length;
+                    ++npackets;
+                }
+            }
+
+            pkt = (struct tpacket3_hdr *) ((uint8_t *) pkt + pkt->tp_next_offset);
+        }
+
+        __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        this->block = (this->block + 1) % RCV_RING_BLOCKS;
+    }
+
+    return nbytesTotal;
+}
@@ -0,0 +1,184 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the receive engines used by the Data Receiver to drain the UDP data sent
+ * by the Data Sender. The engines sleep on epoll until there is data (or it is time
+ * to end), and then drain the socket in batches.
+ */
+
+#ifndef RXENGINE_HPP
+#define RXENGINE_HPP
+
+#include <sys/socket.h>  // struct mmsghdr
+#include <sys/uio.h>     // struct iovec
+#include <vector>        // std::vector
+
+#include "../../util/metrics.hpp"
+#include "../WiperfUtility.hpp"
+#include "ProbeStats.hpp"
+
+#define GRO_SLOT_LEN 65536 // a coalesced message is at most a 64 KiB super-datagram
+
+/**
+ * Base class of the receive engines. Each call to receive() blocks until the
+ * interface socket is readable and then reads up to RCV_BUF_NUM_PACKETS datagrams.
+ * Besides the amount of data, only the probe header at the start of each datagram
+ * matters, which is handed to the probe statistics; the rest is discarded.
+ */
+class RxEngine {
+protected:
+    IfaceInfo &iinfo;
+    int wakefd;
+    int epollfd;
+    ProbeStats *probes; // nullptr if disabled
+
+    MetricHistogram &batchSizes; // datagrams per wake up
+    MetricCounter &emptyReads;   // wake ups that found nothing to read
+    MetricCounter &recvErrors;
+
+    std::vector<char> buffer;
+
+    RxEngine(IfaceInfo &iinfo, int wakefd, ProbeStats *probes, size_t bufferLen);
+
+    /**
+     * Hands the probe headers of a received message to the probe statistics. The
+     * datagrams of a batch share the receive time, taken once per batch.
+     * @param copied     bytes of the message in the buffer
+     * @param length     real length of the message
+     * @param segmentLen length of each datagram, if the message coalesces several
+     */
+    inline void inspect(const char *data, size_t copied, size_t length, size_t segmentLen,
+                        uint64_t nowUs, uint64_t bin) {
+        for (size_t off = 0; off < length && off < copied; off += segmentLen) {
+            this->probes->add(this->iinfo.counterSlot, (const uint8_t *) data + off,
+                              copied - off, nowUs, bin);
+        }
+    }
+
+    /**
+     * Blocks until the interface socket has data to read.
+     * @return false if the wake up file descriptor was signaled (time to stop)
+     */
+    bool waitReadable();
+
+    /**
+     * Reads one batch of datagrams from the socket.
+     * @param npackets set to the number of datagrams read
+     * @return number of bytes read (0 if the socket had nothing after all)
+     */
+    virtual uint64_t drain(uint64_t &npackets) = 0;
+
+public:
+    virtual ~RxEngine();
+
+    /**
+     * Engine specific socket configuration.
+     * @return false if the engine is not supported by the socket/kernel
+     */
+    virtual bool setup();
+
+    /**
+     * Waits for data and reads one batch of datagrams.
+     * @param npackets set to the number of datagrams read
+     * @return number of bytes read, or -1 if it is time to end
+     */
+    int64_t receive(uint64_t &npackets);
+
+    /**
+     * Creates the engine configured for the interface, falling back to simpler
+     * engines when the preferred one isn't supported.
+     * @param iinfo  interface information (with an open, non-blocking socket)
+     * @param wakefd file descriptor that is signaled when it's time to end
+     * @param probes probe statistics to feed, nullptr if disabled
+     * @return engine, owned by the caller
+     */
+    static RxEngine* create(IfaceInfo &iinfo, int wakefd, ProbeStats *probes);
+};
+
+/**
+ * One recv() per datagram, up to RCV_BUF_NUM_PACKETS per batch.
+ */
+class BasicRxEngine : public RxEngine {
+protected:
+    uint64_t drain(uint64_t &npackets) override;
+
+public:
+    BasicRxEngine(IfaceInfo &iinfo, int wakefd, ProbeStats *probes);
+};
+
+/**
+ * RCV_BUF_NUM_PACKETS datagrams per recvmmsg() call. MSG_TRUNC is used so the kernel
+ * reports the real datagram length without copying more than RCV_SLOT_LEN bytes.
+ */
+class MmsgRxEngine : public RxEngine {
+private:
+    struct mmsghdr msgs[RCV_BUF_NUM_PACKETS];
+    struct iovec iovs[RCV_BUF_NUM_PACKETS];
+    int nmsgs;
+    size_t slotLen;
+
+protected:
+    std::vector<char> control; // ancillary data of every message, if any
+    size_t controlLen;         // per message
+
+    /**
+     * @param slotLen    bytes copied per message
+     * @param controlLen ancillary data bytes per message
+     */
+    MmsgRxEngine(IfaceInfo &iinfo, int wakefd, ProbeStats *probes, size_t slotLen, size_t controlLen);
+    uint64_t drain(uint64_t &npackets) override;
+
+    /**
+     * @return length of each datagram of message i, which is one datagram
+     */
+    virtual size_t segmentLen(const struct mmsghdr &msg) const;
+
+public:
+    MmsgRxEngine(IfaceInfo &iinfo, int wakefd, ProbeStats *probes);
+};
+
+/**
+ * recvmmsg() over a UDP GRO socket: the kernel coalesces consecutive datagrams of the
+ * same flow, so each message may carry several datagrams. The datagram length comes
+ * with each message, and every datagram is counted (and inspected) on its own. The
+ * messages are copied whole, GRO_SLOT_LEN bytes each, so the probe header of every
+ * datagram can be read.
+ */
+class GroRxEngine : public MmsgRxEngine {
+protected:
+    size_t segmentLen(const struct mmsghdr &msg) const override;
+
+public:
+    GroRxEngine(IfaceInfo &iinfo, int wakefd, ProbeStats *probes);
+    bool setup() override;
+};
+
+/**
+ * PACKET_MMAP receive ring (TPACKET_V3) on a packet socket of the interface. A socket
+ * filter only passes the unfragmented UDP datagrams to the port of the interface
+ * socket, cut right after the probe header, so the payload is never copied to user
+ * space. The kernel fills blocks of RCV_RING_BLOCK_LEN bytes with the length and
+ * receive time of every datagram and wakes the engine once per block (or after
+ * RCV_RING_BLOCK_TIMEOUT ms). The interface socket stays bound, so the port is open,
+ * and drops everything it gets. The datagrams must fit the MTU (as sent by the gso or
+ * ring engines), fragments are not counted.
+ */
+class RingRxEngine : public RxEngine {
+private:
+    int ringfd;
+    uint8_t *ring;
+    size_t ringLen;
+    int block; // next block to read
+
+protected:
+    uint64_t drain(uint64_t &npackets) override;
+
+public:
+    RingRxEngine(IfaceInfo &iinfo, int wakefd, ProbeStats *probes);
+    ~RingRxEngine() override;
+    bool setup() override;
+};
+
+#endif //RXENGINE_HPP
@@ -8,11 +8,14 @@
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <csignal>       // SIGHUP
 #include <thread>
 #include <chrono>
 
 #include "DataReceiver.hpp"
 #include "FeedbackSender.hpp"
+#include "../../util/configreloader.hpp"
+#include "../../util/metrics.hpp"
 
 #define LOG_FNAME "/var/log/dreceiver.log"
 
@@ -39,9 +42,20 @@ int main(int argc, char *argv[]) {
     FeedbackSender feedbackSender(&dreceiver);
     feedbackSender.readConfig(CONFIG_FNAME);
 
+    ConfigFile cfile(CONFIG_FNAME);
+    MetricsExporter metricsExporter;
+    metricsExporter.start(WiperfUtility::readMetricsEndpoint(cfile, "data-receiver"));
+
     array[0] = &dreceiver;
     array[1] = &feedbackSender;
 
+    //SIGHUP reloads the configuration, in the order it was read on start
+    ConfigReloader *reloader = ConfigReloader::getInstance();
+    reloader->addListener([&dreceiver](ConfigFile &cfile) { dreceiver.reloadConfig(cfile); });
+    reloader->addListener([&feedbackSender](ConfigFile &cfile) { feedbackSender.reloadConfig(cfile); });
+    reloader->start(CONFIG_FNAME);
+    signal(SIGHUP, ConfigReloader::signalHandler);
+
     //This is needed because dreceiver and feedback sender both
     // initiate two children threads and would block the other from running.
     std::thread dreceiverThread(&DataReceiver::run, &dreceiver);
@@ -50,6 +64,9 @@ int main(int argc, char *argv[]) {
     feedbackSenderThread.join();
     dreceiverThread.join();
 
+    reloader->stop();
+    metricsExporter.stop();
+
     LOG_CLOSE()
 
     return 0;
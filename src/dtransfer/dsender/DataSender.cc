@@ -7,8 +7,11 @@
 
 #include <arpa/inet.h>   // socklen_t, inet_pton
 #include <fcntl.h>       // O_RDONLY, S_IRWXU, S_IRUSR, etc
+#include <poll.h>        // ppoll()
 #include <pthread.h>     // pthread_mutex_lock()
 #include <sys/mman.h>    // mmap()
+#include <unistd.h>      // close()
+#include <cerrno>   // errno
 #include <cstdlib>  // std::rand()
 #include <map>      // std::map
 #include <sstream>  // std::stringstream
@@ -18,13 +21,18 @@
 #include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <mutex>    // std::lock_guard
+#include <memory>   // std::unique_ptr
 
 #include "../../util/configfile.hpp"         // class ConfigFile
 #include "../../util/logfile.hpp"    // class LogFile and LOG_* macros
 #include "DataSender.hpp"
+#include "TxEngine.hpp"
+#include "TxPacer.hpp"
 
-DataSender::DataSender() : DataTransfer("Tx"), decisionLevel(0),
-                           decision(), decisionExpiresAt(0), /*decisionMaker(),*/ stopFlag(false) {}
+DataSender::DataSender() : DataTransfer("Tx"), decisionLevel(0), decisionInterval(DECISION_INTERVAL_DEF),
+                           randomEngine(std::random_device()()), /*decisionMaker(),*/ throughputCache(),
+                           gpsInfo(nullptr), probeSession(std::random_device()()), stopFlag(false) {}
 
 void DataSender::stopThread() {
     DataTransfer::stopThread();
@@ -32,36 +40,70 @@ void DataSender::stopThread() {
     this->stopFlag = true;
 }
 
+void DataSender::readIfaceMap(ConfigFile &cfile, IfaceInfoMap &ifaceMap) {
+    // server (receiver) and client (sender) interfaces
+    WiperfUtility::readIfaces(cfile, "data-receiver", SERVER, ifaceMap);
+    WiperfUtility::readIfaces(cfile, "data-sender", CLIENT, ifaceMap);
+
+    // check that we have both cli and srv addresses for all ifaces
+    // remove interfaces for which we don't have both addresses
+    for (auto itr = ifaceMap.begin(); itr != ifaceMap.end();) {
+        IfaceInfo &iinfo = itr->second;
+
+        if (!iinfo.addrSrv.length() || !iinfo.addrCli.length())  // bad boy
+            itr = ifaceMap.erase(itr);
+        else
+            ++itr;  // all good in the neighborhood
+    }
+
+    // per-interface transmit engine and traffic shape (optional)
+    WiperfUtility::readIfaceEngines(cfile, "data-sender", ifaceMap);
+    WiperfUtility::readIfacePacing(cfile, "data-sender", ifaceMap);
+}
+
+int DataSender::readDecisionInterval(ConfigFile &cfile) {
+    // how often the interface is picked again (optional)
+    int decisionInterval = DECISION_INTERVAL_DEF;
+    try {
+        decisionInterval = std::stoi(cfile.Value("data-sender", "decision-interval"));
+    } catch (std::exception const &) {}
+    if (decisionInterval <= 0) {
+        std::stringstream ss;
+        ss << "Config exception: section=data-sender, value=decision-interval"
+           << " must be positive, using " << DECISION_INTERVAL_DEF << " ms";
+        LOG_WARN(ss.str().c_str());
+        decisionInterval = DECISION_INTERVAL_DEF;
+    }
+
+    return decisionInterval;
+}
+
 void DataSender::readConfig(const std::string &configFname) {
     ConfigFile cfile(configFname);
 
     this->readAndSetLogLevel(cfile);
 
-    // read server port and interfaces
+    // read server and client ports, and the interfaces
     this->portSrv = WiperfUtility::readPort(cfile, "data-receiver", PORT_SRV_DEF);
-    WiperfUtility::readIfaces(cfile, "data-receiver", SERVER, ifaceMap);
-
-    // read client port and interfaces
     this->portCli = WiperfUtility::readPort(cfile, "data-sender", PORT_CLI_DEF);
-    WiperfUtility::readIfaces(cfile, "data-sender", CLIENT, ifaceMap);
+    readIfaceMap(cfile, this->ifaceMap);
 
     this->gpsShmPath = WiperfUtility::readGpsShmPath(cfile, GPS_SHM_PATH_DEF);
-    // configure the decision maker and its database
-
     // set the decision level
     this->decisionLevel = std::stoi(cfile.Value("data-sender", "decision-level"));
+    this->decisionInterval = readDecisionInterval(cfile);
 
-    // check that we have both cli and srv addresses for all ifaces
-    // remove interfaces for which we don't have both addresses
-    for (auto itr = this->ifaceMap.begin(); itr != this->ifaceMap.end();) {
-        IfaceInfo &iinfo = itr->second;
-
-        if (!iinfo.addrSrv.length() || !iinfo.addrCli.length())  // bad boy
-            itr = this->ifaceMap.erase(itr);
-        else
-            ++itr;  // all good in the neighborhood
+    // configure the decision maker and its database
+    if (this->decisionLevel >= DECISION_LEVEL_CACHE) {
+        this->throughputCache.reset(new ThroughputCache());
+        this->throughputCache->configure(cfile, "data-sender");
     }
 
+    // per-role thread placement and priority (optional)
+    this->threadPolicy.configure(cfile, "data-sender");
+
+    this->registerIfaceCounters();
+
     // do we have at least one interface pair?
     if (this->ifaceMap.empty()) {
         std::stringstream ss;
@@ -76,15 +118,49 @@ void DataSender::readAndSetLogLevel(ConfigFile &cfile) {
     WiperfUtility::readAndSetLogLevel(cfile, "data-sender");
 }
 
-std::string DataSender::pickRandomIface() {
-    std::default_random_engine defEngine{123123123};
-    std::uniform_int_distribution<int> intDistro(0, (int) this->ifaceMap.size());
-    int idx = intDistro(defEngine);
+void DataSender::reloadConfig(ConfigFile &cfile) {
+    this->readAndSetLogLevel(cfile);
+
+    if (WiperfUtility::readPort(cfile, "data-receiver", PORT_SRV_DEF) != this->portSrv ||
+        WiperfUtility::readPort(cfile, "data-sender", PORT_CLI_DEF) != this->portCli) {
+        LOG_WARN("Reload: the data ports change on the next start");
+    }
+    if (std::stoi(cfile.Value("data-sender", "decision-level")) != this->decisionLevel) {
+        LOG_WARN("Reload: the decision level changes on the next start");
+    }
+
+    // the decision thread reads it before every wait
+    const int decisionInterval = readDecisionInterval(cfile);
+    if (this->decisionInterval.exchange(decisionInterval) != decisionInterval) {
+        LOG_STREAM(MSG, "Reload: decision-interval " << decisionInterval << " ms")
+    }
+
+    IfaceInfoMap newIfaceMap;
+    readIfaceMap(cfile, newIfaceMap);
+    this->reloadIfaces(newIfaceMap);
+}
+
+void DataSender::restartWorkers() {
+    this->stopFlag = true;
+    DataTransfer::restartWorkers();
+}
 
-    auto itr = this->ifaceMap.begin();
-    for (int i = 0; i < idx; ++itr, i++);  // advance iterator as needed
+int DataSender::pickRandomIface(int count) {
+    if (count <= 0) return -1;
 
-    return itr->first;
+    std::uniform_int_distribution<int> intDistro(0, count - 1);
+    return intDistro(this->randomEngine);
+}
+
+int DataSender::pickBestIface(const std::vector<std::string> &ifnames) {
+    if (this->throughputCache && this->gpsInfo) {
+        GpsInfo currentInfo = WiperfUtility::getCurrentGps(this->gpsInfo);
+
+        int best = this->throughputCache->bestRat(currentInfo.lat, currentInfo.lon, ifnames);
+        if (best >= 0) return best;
+    }
+
+    return this->pickRandomIface((int) ifnames.size());
 }
 
 void DataSender::sendEveryInterface() {
@@ -92,22 +168,28 @@ void DataSender::sendEveryInterface() {
         std::string ifname = entry.first;
         IfaceInfo &iinfo = entry.second;
 
-        this->workers.push_back(std::thread([&iinfo, ifname, this]() {
-            char sndBuf[SND_BUF_LEN];
-            int sndBufSize = sizeof(sndBuf);
+        this->workers.push_back(this->launchThread("send", {ifname}, [&iinfo, ifname, this]() {
+            std::unique_ptr<TxEngine> engine(TxEngine::create(iinfo, this->wakefd_, this->probeSession));
+            TxPacer pacer(iinfo.pacing, iinfo.sockfd, engine->datagramLen(), this->wakefd_);
+
+            std::stringstream ss;
+            ss << "Sending through " << ifname << " with the "
+               << WiperfUtility::ioEngineToStr(iinfo.ioEngine) << " engine, "
+               << engine->datagramLen() << " byte datagrams";
+            if (iinfo.pacing.rate > 0) ss << ", at " << iinfo.pacing.rate << " bit/s";
+            if (iinfo.pacing.offMs > 0) ss << ", " << iinfo.pacing.onMs << "/" << iinfo.pacing.offMs << " ms on/off";
+            LOG_MSG(ss.str().c_str());
 
-            while(!this->stopFlag.load()) {
-                //If the decision has expired, make a new one
-                int ret = sendto(iinfo.sockfd, sndBuf, sndBufSize, MSG_DONTWAIT | MSG_DONTROUTE, /*MSG_DONTROUTE,*/
-                       (const struct sockaddr *) &iinfo.sockaddrSrv, sizeof(iinfo.sockaddrSrv));
+            const uint64_t datagramLen = engine->datagramLen();
+            while (!this->stopFlag.load()) {
+                int budget = pacer.acquire(engine->batchLen());
+                if (budget < 0) break;  // woken up, time to end
 
-                if (ret < 0 && errno != 11) {
-                    std::stringstream ss;
-                    ss << "Error: " << errno << " :: " << std::strerror(errno);
-                    std::cout << ss << std::endl;
+                int ndatagrams = engine->transmit(budget);
+                if (ndatagrams < 0) break;  // woken up, time to end
 
-                    LOG_ERR(ss.str().c_str());
-                }
+                pacer.consume(ndatagrams);
+                this->ifaceCounters.add(iinfo.counterSlot, ndatagrams * datagramLen, ndatagrams);
             }
         }));
     }
@@ -116,108 +198,147 @@ void DataSender::sendEveryInterface() {
         itr.join();
     }
 
-    this->closeIfaceSocks();
+    this->workers.clear();
 }
 
 void DataSender::sendOneInterface() {
-    uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::system_clock::now().time_since_epoch()).count();
+    RatScheduler scheduler(this->ifaceMap, this->probeSession);
 
-    char sndBuf[SND_BUF_LEN];
-    int sndBufSize = sizeof(sndBuf);
+    // the decisions are indexes of the scheduler, so make the names the same table once
+    std::vector<std::string> ifnames;
+    for (int i = 0; i < scheduler.size(); i++) ifnames.push_back(scheduler.nameOf(i));
 
-    this->decision = this->pickRandomIface();
-    this->decisionExpiresAt = 0;
-    IfaceInfo &iinfo = this->ifaceMap[this->decision];
+    // start on the first decision, not on whatever interface comes first
+    scheduler.activate(this->pickBestIface(ifnames));
 
-    while (!endProgram_) {
-        //If the decision has expired, make a new one
-        if (now > this->decisionExpiresAt) {
-            this->decision = this->pickRandomIface();
+    std::thread decisionThread = this->launchThread("decision", {}, [&scheduler, &ifnames, this]() {
+        this->decide(scheduler, ifnames);
+    });
 
-            iinfo = this->ifaceMap[this->decision];
-            this->decisionExpiresAt = now + 333; //TODO: pass this to the configuration or to the header
-        }
+    // this thread sends, through any of the interfaces
+    this->threadPolicy.apply("send", ifnames);
 
-        if (sendto(iinfo.sockfd, sndBuf, sndBufSize, MSG_DONTWAIT | MSG_DONTROUTE, /*MSG_DONTROUTE,*/
-                   (const struct sockaddr *) &iinfo.sockaddrSrv, sizeof(iinfo.sockaddrSrv)) == -1) {
-            //this->closeIfaceSocks();
-            //LOG_FATAL_PERROR_EXIT("rthread sendto()");
-            //break;
-        }
-    }
+    scheduler.run(this->ifaceCounters);
+
+    decisionThread.join();
 }
 
-/**
-* Receives data, and keeps track of how much it receives.<???>
-*/
-void DataSender::commThread() {
-    // go over all interface addresses and create a socket for each of them
-    IfaceInfoMap &ifaceMap = this->ifaceMap;
-    for (auto &itr: ifaceMap) {
-        std::string iname = itr.first;
-        IfaceInfo &iinfo = itr.second;
+void DataSender::decide(RatScheduler &scheduler, const std::vector<std::string> &ifnames) {
+    struct pollfd pfd = {this->wakefd_, POLLIN, 0};
 
-        // tell the world about what we're doing
-        std::stringstream ss;
-        ss << "Attaching interface " << iname << " @ " << iinfo.addrCli << ":"
-           << this->portCli;
-        LOG_MSG(ss.str().c_str());
-
-        // create udp socket
-        int sockfdCli;
-        if ((sockfdCli = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
-            LOG_FATAL_PERROR_EXIT("sthread socket()");
-        }
+    while (!endProgram_ && !this->stopFlag.load()) {
+        const int decisionInterval = this->decisionInterval.load();
+        const struct timespec interval = {decisionInterval / 1000, (long) (decisionInterval % 1000) * 1000000};
 
-        int enable = 1;
-        if (setsockopt(sockfdCli, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
-            LOG_FATAL_PERROR_EXIT("sthread setsockopt()");
-        }
+        int ret = ppoll(&pfd, 1, &interval, nullptr);
+        if (ret < 0 && errno != EINTR) LOG_FATAL_PERROR_EXIT("sthread ppoll()");
+        if (ret > 0 && (pfd.revents & POLLIN)) break;  // woken up, time to end (or to restart)
 
-        if (setsockopt(sockfdCli, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
-            LOG_FATAL_PERROR_EXIT("sthread setsockopt()");
-        }
+        scheduler.activate(this->pickBestIface(ifnames));
+    }
+
+    scheduler.stop();
+}
 
-        // build client (sender) address structure
-        struct sockaddr_in sockaddrCli{};
-        this->createSockaddr(iinfo.addrCli, this->portCli, &sockaddrCli);
+bool DataSender::openIfaceSock(const std::string &iname, IfaceInfo &iinfo, bool fatal) {
+    // tell the world about what we're doing
+    std::stringstream ss;
+    ss << "Attaching interface " << iname << " @ " << iinfo.addrCli << ":"
+       << this->portCli << " (engine " << WiperfUtility::ioEngineToStr(iinfo.ioEngine) << ")";
+    LOG_MSG(ss.str().c_str());
 
-        // bind to local address
-        if (bind(sockfdCli, (struct sockaddr *) &sockaddrCli, sizeof(sockaddrCli)) < 0) {
+    // on start, any failure ends the program; on a reload, only the interface is left out
+    auto fail = [&](int sockfd, const std::string &what) {
+        if (fatal) {
             this->closeIfaceSocks();
-            std::stringstream ss0;
-            ss0 << "sthread bind() addr " << iinfo.addrCli;
-            LOG_FATAL_PERROR_EXIT(ss0.str().c_str());
+            LOG_FATAL_PERROR_EXIT(what.c_str());
         }
+        LOG_STREAM(ERROR, what << ": " << strerror(errno) << ", leaving " << iname << " out")
+        if (sockfd >= 0) close(sockfd);
+        return false;
+    };
+
+    // create udp socket
+    int sockfdCli;
+    if ((sockfdCli = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        return fail(-1, "sthread socket()");
+    }
 
-        if (connect(sockfdCli, (struct sockaddr *) &sockaddrCli, sizeof(sockaddrCli)) < 0) {
-            /* is non-blocking, so we don't get error at that point yet */
-            if (EINPROGRESS != errno) {
-                this->closeIfaceSocks();
-                LOG_FATAL_PERROR_EXIT("sthread connect()");
-            }
+    int enable = 1;
+    if (setsockopt(sockfdCli, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
+        return fail(sockfdCli, "sthread setsockopt()");
+    }
+
+    if (setsockopt(sockfdCli, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+        return fail(sockfdCli, "sthread setsockopt()");
+    }
+
+    // build client (sender) address structure
+    struct sockaddr_in sockaddrCli{};
+    this->createSockaddr(iinfo.addrCli, this->portCli, &sockaddrCli);
+
+    // bind to local address
+    if (bind(sockfdCli, (struct sockaddr *) &sockaddrCli, sizeof(sockaddrCli)) < 0) {
+        return fail(sockfdCli, "sthread bind() addr " + iinfo.addrCli);
+    }
+
+    if (connect(sockfdCli, (struct sockaddr *) &sockaddrCli, sizeof(sockaddrCli)) < 0) {
+        /* is non-blocking, so we don't get error at that point yet */
+        if (EINPROGRESS != errno) {
+            return fail(sockfdCli, "sthread connect()");
         }
+    }
 
-        // save new interface details
-        iinfo.sockfd = sockfdCli;
-        iinfo.nbytesAcc = 0;
+    // save new interface details
+    iinfo.sockfd = sockfdCli;
 
-        // build server (receiver) address structure
-        this->createSockaddr(iinfo.addrSrv, this->portSrv, &iinfo.sockaddrSrv);
+    // build server (receiver) address structure
+    this->createSockaddr(iinfo.addrSrv, this->portSrv, &iinfo.sockaddrSrv);
+    return true;
+}
 
-    }  // iface sock creation loop end
+/**
+* Sends data, through the interfaces of the configuration until a reload changes them,
+* then through the new ones.
+*/
+void DataSender::commThread() {
+    if (this->decisionLevel != 0 && this->throughputCache) {
+        this->gpsInfo = WiperfUtility::getGpsInfo(this->gpsShmPath);
+        this->throughputCache->start(this->gpsInfo);
+    }
 
-    LOG_MSG("program up and running");
+    for (bool start = true;; start = false) {
+        // create a socket for each interface that doesn't have one yet, i.e., all of
+        // them on start, and the ones added or changed on a reload
+        for (auto itr = this->ifaceMap.begin(); itr != this->ifaceMap.end();) {
+            if (itr->second.sockfd != UNINITIALIZED_FD || this->openIfaceSock(itr->first, itr->second, start)) {
+                ++itr;
+                continue;
+            }
 
-    // main server loop
+            std::lock_guard<std::mutex> lock(this->reloadMutex);
+            itr = this->ifaceMap.erase(itr);
+        }
 
-    if (this->decisionLevel == 0) {
-        sendEveryInterface();
-    } else {
-        sendOneInterface();
+        LOG_MSG(start ? "program up and running" : "running with the reloaded interfaces");
+
+        // main server loop, until it's time to end or to restart
+        if (this->ifaceMap.empty()) {
+            LOG_ERR("No interface to send through, waiting for a reload");
+            struct pollfd pfd = {this->wakefd_, POLLIN, 0};
+            while (ppoll(&pfd, 1, nullptr, nullptr) < 0 && errno == EINTR);
+        } else if (this->decisionLevel == 0) {
+            sendEveryInterface();
+        } else {
+            sendOneInterface();
+        }
+
+        if (!this->applyPendingIfaces()) break;
+        this->stopFlag = false;
     }
 
+    if (this->throughputCache && this->gpsInfo) this->throughputCache->stop();
+
     // clean up and be done
     this->closeIfaceSocks();
 }
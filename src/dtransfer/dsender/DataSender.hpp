@@ -11,15 +11,27 @@
 #define DATASENDER_H
 
 #include <atomic>
+#include <memory>
+#include <random>
 #include <thread>
 #include "../DataTransfer.hpp"
 #include "../../mygpsd/gpsinfo.hpp"
+#include "RatScheduler.hpp"
+#include "ThroughputCache.hpp"
+
+#define DECISION_LEVEL_CACHE 2 // decisions based on the throughput history of the position
+#define DECISION_INTERVAL_DEF 333 // ms between decisions
 
 class DataSender : public DataTransfer {
 private:
     int decisionLevel;
-    std::string decision;
-    uint64_t decisionExpiresAt;
+    std::atomic<int> decisionInterval; // ms, changed on reloads
+    std::default_random_engine randomEngine; // only used by the decision thread
+
+    std::unique_ptr<ThroughputCache> throughputCache; // decision level >= DECISION_LEVEL_CACHE
+    GpsInfo *gpsInfo;
+
+    uint32_t probeSession; // written in the probe header of every datagram
 
     std::vector<std::thread> workers;
     std::atomic<bool> stopFlag;
@@ -27,20 +39,51 @@ private:
     /**
      * Send data only through one interface, chosen at random, or by
      * the decision making module, or in another fashion.
+     * The data goes out through a RatScheduler, which this thread runs,
+     * while a decision thread picks the interface every decisionInterval
+     * milliseconds and switches to it.
      */
     void sendOneInterface();
 
+    /**
+     * Decision loop of sendOneInterface(), stops the scheduler when it's
+     * time to end.
+     * @param ifnames interfaces of the scheduler, by index
+     */
+    void decide(RatScheduler &scheduler, const std::vector<std::string> &ifnames);
+
     /**
      * Send data through every interface to measure throughput.
      * It creates one thread for each interface, which sends traffic
-     * inside a while loop.
+     * inside a while loop, paced to the rate and on/off pattern of the
+     * interface, if any.
      */
     void sendEveryInterface();
 
+    /**
+     * Creates, binds and connects the socket of an interface.
+     * @param fatal end the program if it can't be done, as on start
+     * @return false if it can't be done
+     */
+    bool openIfaceSock(const std::string& iname, IfaceInfo& iinfo, bool fatal);
+
+    /**
+     * Reads the interface pairs, along with their engines and pacing.
+     */
+    static void readIfaceMap(ConfigFile& cfile, IfaceInfoMap& ifaceMap);
+    static int readDecisionInterval(ConfigFile& cfile);
+
 public:
     DataSender();
     void readConfig(const std::string& configFname) override;
 
+    /**
+     * Applies the decision interval and the interfaces of the reloaded configuration,
+     * the interfaces by restarting the workers. The ports and the decision level are
+     * only read on start.
+     */
+    void reloadConfig(ConfigFile& cfile) override;
+
     /**
      * Calls DataTransfer::stopThread(), but also runs code specific
      * to the DataSender.
@@ -49,13 +92,24 @@ public:
 
 protected:
     void readAndSetLogLevel(ConfigFile &cfile) override;
+    void restartWorkers() override;
 
     /**
      * Picks an interface uniformly at random.
      * More sophisticated strategies to be implemented at a later date.
-     * @return random interface
+     * @param count interfaces to pick from
+     * @return index of the random interface
+     */
+    int pickRandomIface(int count);
+
+    /**
+     * Picks the interface with the best throughput history at the current position,
+     * from the throughput cache. Falls back to pickRandomIface() when the cache has
+     * no throughput samples for the position.
+     * @param ifnames interfaces to pick from, by scheduler index
+     * @return index of the best interface
      */
-    std::string pickRandomIface();
+    int pickBestIface(const std::vector<std::string> &ifnames);
 
     void commThread() override;
 };
@@ -20,9 +20,11 @@
 #include <linux/wireless.h>
 
 #include "FeedbackReceiver.hpp"
+#include "../FeedbackCodec.hpp"
 
-FeedbackReceiver::FeedbackReceiver() : DataTransfer("FeedRx"), databaseManager(),
-            feedbackInterval(FEEDBACK_INTERVAL_DEF), dataSenderIfaces() {}
+FeedbackReceiver::FeedbackReceiver() : DataTransfer("FeedRx"),
+            feedbackInterval(FEEDBACK_INTERVAL_DEF), databaseWriter(), dataSenderIfaces(),
+            ratsPending(false), session(0), haveSession(false), lastBin(), badMessages(0) {}
 
 void FeedbackReceiver::readAndSetLogLevel(ConfigFile &cfile) {
     WiperfUtility::readAndSetLogLevel(cfile, std::string("feedback-receiver"));
@@ -42,11 +44,12 @@ void FeedbackReceiver::readConfig(const std::string& configFname) {
     WiperfUtility::readIfaces(cfile, "data-receiver", SERVER, this->dataSenderIfaces);
 
     this->dataSenderIfnames = WiperfUtility::readIfnames(cfile, "data-sender");
+    this->lastBin.assign(this->dataSenderIfnames.size(), IFACE_BIN_NONE);
 
     this->gpsShmPath = WiperfUtility::readGpsShmPath(cfile, GPS_SHM_PATH_DEF);
 
     // Instantiate database manager
-    this->databaseManager.configure(cfile);
+    this->databaseWriter = DatabaseWriter::get(cfile);
 
     // configure the feedback interval
     this->feedbackInterval = FEEDBACK_INTERVAL_DEF;
@@ -79,6 +82,20 @@ void FeedbackReceiver::readConfig(const std::string& configFname) {
     }
 }
 
+void FeedbackReceiver::reloadConfig(ConfigFile& cfile) {
+    this->readAndSetLogLevel(cfile);
+
+    std::vector<std::string> ifnames = WiperfUtility::readIfnames(cfile, "data-sender");
+
+    std::lock_guard<std::mutex> lock(this->reloadRatsMutex);
+    const std::vector<std::string> &current = this->ratsPending ? this->pendingIfnames : this->dataSenderIfnames;
+    if (ifnames == current) return;
+
+    LOG_STREAM(MSG, "Reload: feedback for " << ifnames.size() << " RATs")
+    this->pendingIfnames = ifnames;
+    this->ratsPending = true;
+}
+
 int FeedbackReceiver::initializeInterfaceSockets() {
     //Go over all interface addresses and create a socket for each of them
     int maxfd = wakefd_; // will hold largest fd value at the end of the loop
@@ -124,83 +141,104 @@ int FeedbackReceiver::initializeInterfaceSockets() {
 
         // update interface details
         ifaceInfo.sockfd = sockfd;
-        ifaceInfo.nbytesAcc = 0;
 
     } // iface sock creation loop end
 
     return maxfd;
 }
 
-std::vector<DatabaseInfo> FeedbackReceiver::readFeedbackMessage(uint8_t* buffer, GpsInfo* gpsInfo) {
-    GpsInfo currentInfo = WiperfUtility::getCurrentGps(gpsInfo);
-
-    double latitude = static_cast<double>(currentInfo.lat);
-    double longitude = static_cast<double>(currentInfo.lon);
-    double speed = static_cast<double>(currentInfo.speed);
-    double orientation = static_cast<double>(currentInfo.head);
-    //If vehicle is moving at less than 0.5 kmph, we consider that it stopped?
-    int moving = speed > 0.5;
-    //uint64_t timestamp = gpsInfo->systime;
-
-    uint32_t netNumberOfRats = 0;
-	std::memcpy(&netNumberOfRats, &buffer[0], 4);
+size_t FeedbackReceiver::readFeedbackMessage(const uint8_t* buffer, size_t len, GpsInfo* gpsInfo,
+                                             std::vector<DatabaseInfo>& feedbackInformation) {
+    FeedbackHeader header;
+    if (!FeedbackCodec::decodeHeader(buffer, len, header)) {
+        this->logBadMessage("not a feedback message of version " + std::to_string(FEEDBACK_VERSION));
+        return 0;
+    }
 
-    uint32_t numberOfRats = ntohl(netNumberOfRats);
+    // a restarted sender may repeat bins, forget what we've seen from the old one
+    if (!this->haveSession || header.session != this->session) {
+        if (this->haveSession) LOG_MSG("Feedback sender restarted, new session");
+        this->session = header.session;
+        this->haveSession = true;
+        std::fill(this->lastBin.begin(), this->lastBin.end(), IFACE_BIN_NONE);
+    }
 
-    std::vector<DatabaseInfo> feedbackInformation;
+    const size_t before = feedbackInformation.size();
+    const uint8_t *bins;
+    size_t pos = FEEDBACK_HEADER_LEN;
 
-    for (uint32_t i = 0; i < numberOfRats; i++) {
-        uint32_t offset = 4 + i * 40;
+    for (uint8_t r = 0; r < header.nrats; r++) {
+        uint8_t ratId;
+        if (!FeedbackCodec::decodeRat(buffer, len, pos, header.nbins, ratId, bins)) {
+            this->logBadMessage("truncated RAT record");
+            break;
+        }
+        if (ratId >= this->dataSenderIfnames.size()) {
+            this->logBadMessage("unknown RAT id " + std::to_string(ratId));
+            continue;
+        }
 
-        uint32_t netIfaceId;
-        std::memcpy(&netIfaceId, &buffer[offset], sizeof(uint32_t));
-        uint32_t ifaceId = ntohl(netIfaceId);
+        const std::string &ifaceName = this->dataSenderIfnames[ratId];
+        uint64_t &lastBin = this->lastBin[ratId];
 
-        std::string ifaceName = this->dataSenderIfnames.at(i);
-        IfaceInfo ifaceInfo = this->ifaceMap[ifaceName];
+        for (uint16_t j = 0; j < header.nbins; j++) {
+            const uint64_t bin = header.firstBin + j;
+            if (lastBin != IFACE_BIN_NONE && bin <= lastBin) continue; // already stored
+            lastBin = bin;
 
-        // iterate over the 3 entries (t, t-1, and t-2)
-        for (int j = 0; j < 3; j++) {
-            uint32_t entryOffset = offset + 4 + j * 12;
+            // the entry goes on the end of the bin, as the grid tick the bytes were counted up to
+            const uint64_t timestamp = (bin + 1) * header.binUs / 1000;
+            const uint64_t nbits = (uint64_t) FeedbackCodec::binBytes(bins, j) * 8;
 
-            uint64_t netTimestamp;
-            std::memcpy(&netTimestamp, &buffer[entryOffset], sizeof(uint64_t));
-            uint64_t timestamp = WiperfUtility::ntohll(netTimestamp);
+            DatabaseInfo databaseInfo;
 
-            if (timestamp > 0) { //t-2 and t-1 may not be present
-                uint32_t netThroughput;
-                std::memcpy(&netThroughput, &buffer[entryOffset + sizeof(uint64_t)], sizeof(uint32_t));
+            //Each entry gets the position where it was measured, not the current one
+            GpsFix fix{};
+            WiperfUtility::positionAt(gpsInfo, timestamp, fix);
 
-                DatabaseInfo databaseInfo;
+            databaseInfo.latitude = static_cast<double>(fix.lat);
+            databaseInfo.longitude = static_cast<double>(fix.lon);
+            databaseInfo.speed = static_cast<double>(fix.speed);
+            databaseInfo.orientation = static_cast<double>(fix.head);
+            //If vehicle is moving at less than 0.5 kmph, we consider that it stopped?
+            databaseInfo.moving = databaseInfo.speed > 0.5;
 
-                databaseInfo.latitude = latitude;
-                databaseInfo.longitude = longitude;
-                databaseInfo.speed = speed;
-                databaseInfo.orientation = orientation;
-                databaseInfo.moving = moving;
+            // bits per ms, in 64 bits as a 1 ms bin of a fast link is a lot of bits
+            const uint64_t throughput = nbits * 1000 / header.binUs;
+            databaseInfo.throughput = (uint32_t) std::min<uint64_t>(throughput, UINT32_MAX);
+            databaseInfo.numBits = (uint32_t) std::min<uint64_t>(nbits, UINT32_MAX);
+            databaseInfo.feedback = true;  // an outage is a bin of 0 bits, not a missing one
+            databaseInfo.rat = ifaceName;
+            databaseInfo.timestamp = timestamp;
 
-                databaseInfo.throughput = ntohl(netThroughput);
-                databaseInfo.numBits = databaseInfo.throughput * this->feedbackInterval;
-                databaseInfo.channelInfo;
-                databaseInfo.scanInfo;
-                databaseInfo.rat = ifaceName;
-                databaseInfo.timestamp = timestamp;
+            databaseInfo.tx_bitrate = 0;
+            databaseInfo.signal_strength = 0;
 
-                databaseInfo.tx_bitrate = 0;
-                databaseInfo.signal_strength = 0;
+            // loss, reordering and delay of the same bin, empty if the sender doesn't probe
+            FeedbackCodec::binProbes(bins, j, databaseInfo.probes);
 
-                feedbackInformation.push_back(databaseInfo);
-            }
+            feedbackInformation.push_back(databaseInfo);
         }
     }
 
-    return feedbackInformation;
+    return feedbackInformation.size() - before;
+}
+
+void FeedbackReceiver::logBadMessage(const std::string& reason) {
+    // at one message per feedback interval, once in a while is plenty
+    if (this->badMessages++ % 100 == 0) {
+        std::stringstream ss;
+        ss << "Dropping feedback: " << reason << " (" << this->badMessages << " so far)";
+        LOG_WARN(ss.str().c_str());
+    }
 }
 
 void FeedbackReceiver::commThread() {
     //int maxfd = this->initializeInterfaceSockets();
     GpsInfo *gpsInfo = WiperfUtility::getGpsInfo(this->gpsShmPath);
 
+    this->databaseWriter->start();
+
     //Go over all interface addresses and create a socket for each of them
     int maxfd = wakefd_; // will hold largest fd value at the end of the loop
 
@@ -244,7 +282,6 @@ void FeedbackReceiver::commThread() {
 
         // update interface details
         ifaceInfo.sockfd = sockfd;
-        ifaceInfo.nbytesAcc = 0;
 
     } // iface sock creation loop end
 
@@ -256,7 +293,6 @@ void FeedbackReceiver::commThread() {
     maxfd++; // maxfd (needed for select) must be one more than actual max
 
     while (!endProgram_) { // for ever, and ever, and ever
-        std::fill(std::begin(rcvBuf), std::end(rcvBuf), 0);
 
         // set all file descriptors of interest
         // iterate over map and call FD_SET on each socket fd
@@ -269,11 +305,10 @@ void FeedbackReceiver::commThread() {
         IfaceInfo ifaceInfo = itr->second;
 
         const int sockfd = ifaceInfo.sockfd;
+        FD_ZERO(&sockfdSet);
         FD_SET(sockfd, &sockfdSet);
         FD_SET(wakefd_, &sockfdSet);
 
-std::cout << "[DEBUG] sockfd :: " << sockfd << std::endl;
-
         // wait for there to be something for us to read
         // returns # of ready fds, but we don't need it
         if (select(maxfd, &sockfdSet /*readfds*/, NULL /*writefds*/, NULL /*exceptfds*/, NULL /*timeout*/) == -1) {
@@ -293,35 +328,21 @@ std::cout << "[DEBUG] sockfd :: " << sockfd << std::endl;
         //const uint64_t sockfd = ifaceInfo.sockfd;
         //const std::string ifaceName = this->feedbackIface;
 
-        if (FD_ISSET(sockfd, &sockfdSet)) {
-            int size = FEEDBACK_RCV_BUF_LEN;
-			
-            size_t total = 0; 
-			int nbytes = 0;
-            
-			while((nbytes = recv(sockfd, rcvBuf, size-total-1, 0)) > 0) {
-                total += nbytes;
+        {
+            // the ids change, so what was stored under the old ones doesn't count
+            std::lock_guard<std::mutex> lock(this->reloadRatsMutex);
+            if (this->ratsPending) {
+                this->dataSenderIfnames.swap(this->pendingIfnames);
+                this->lastBin.assign(this->dataSenderIfnames.size(), IFACE_BIN_NONE);
+                this->ratsPending = false;
             }
+        }
 
-            /*if (nbytes < 0) { 
-                this->closeIfaceSocks();
-                LOG_FATAL_PERROR_EXIT("rthread recv()");
-            }*/
-
-            rcvBuf[total] = 0;
-
-//std::cout << "[DEBUG] :: ";
-//for (int i = 0; i < total; ++i) {
-	//std::cout  << std::setfill('0') << std::setw(2) << std::hex << (int) rcvBuf[i];
-//}
-//std::cout << std::endl;
-
-			if (total > 0) { //If any message was received in this interface
-std::cout << "[DEBUG] feedback :: bytes received" << std::endl;
-                databaseInfoVector = this->readFeedbackMessage(rcvBuf, gpsInfo);
-            }
-            else {
-std::cout << "[DEBUG] feedback :: no bytes received" << std::endl;
+        if (FD_ISSET(sockfd, &sockfdSet)) {
+            // every datagram is a whole message, drain them all
+            ssize_t nbytes;
+            while ((nbytes = recv(sockfd, rcvBuf, sizeof(rcvBuf), 0)) > 0) {
+                this->readFeedbackMessage(rcvBuf, nbytes, gpsInfo, databaseInfoVector);
             }
         }
 
@@ -330,11 +351,12 @@ std::cout << "[DEBUG] feedback :: no bytes received" << std::endl;
             LOG_FATAL_PERROR_EXIT("rthread pthread_mutex_unlock()");
         }*/
 
-        //Send all data to the database
-        this->databaseManager.createAll(databaseInfoVector);
+        //Queue all data for the database, the writer thread does the rest
+        this->databaseWriter->enqueue(databaseInfoVector);
     } // while() end
 
     // clean up and be done
     this->closeIfaceSocks();
+    this->databaseWriter->stop();
 }
 
@@ -8,10 +8,11 @@
 #ifndef FEEDBACKRECEIVER_HPP
 #define FEEDBACKRECEIVER_HPP
 
+#include <mutex>    // std::mutex
 #include <string>   // std::string
 
 #include "../DataTransfer.hpp"
-#include "../database/DatabaseManager.hpp"
+#include "../database/DatabaseWriter.hpp"
 #include "../../mygpsd/gpsinfo.hpp"
 
 /**
@@ -22,11 +23,22 @@
 class FeedbackReceiver : public DataTransfer {
 private:
     int feedbackInterval;
-    DatabaseManager databaseManager;
+    std::shared_ptr<DatabaseWriter> databaseWriter; // shared by the components of the process
 
     IfaceInfoMap dataSenderIfaces;
     std::vector<std::string> dataSenderIfnames;
 
+    // RAT ids of a reload, for commThread() to apply before the next message
+    std::mutex reloadRatsMutex;
+    std::vector<std::string> pendingIfnames;
+    bool ratsPending;
+
+    // what was already stored, so the bins repeated in later messages are dropped
+    uint32_t session;
+    bool haveSession;
+    std::vector<uint64_t> lastBin; // per RAT id, IFACE_BIN_NONE if none yet
+    uint64_t badMessages;
+
     /**
      * Create and bind sockets for each interface in the IfaceInfoMap field.
      * Socket file descriptors are stored in IfaceInfoMap.
@@ -34,7 +46,14 @@ private:
      */
     int initializeInterfaceSockets();
 
-    std::vector<DatabaseInfo> readFeedbackMessage(uint8_t* buffer, GpsInfo* gpsInfo);
+    /**
+     * Decodes a feedback message and appends the bins that weren't stored yet, one
+     * entry per bin.
+     * @return number of entries appended
+     */
+    size_t readFeedbackMessage(const uint8_t* buffer, size_t len, GpsInfo* gpsInfo,
+                               std::vector<DatabaseInfo>& feedbackInformation);
+    void logBadMessage(const std::string& reason);
 
 protected:
     void readAndSetLogLevel(ConfigFile& cfile) override;
@@ -43,6 +62,13 @@ protected:
 public:
     FeedbackReceiver();
     void readConfig(const std::string& configFname) override;
+
+    /**
+     * Applies the RAT ids (data-sender interfaces) of the reloaded configuration, which
+     * the feedback sender must reload as well. The interfaces and the database are only
+     * read on start.
+     */
+    void reloadConfig(ConfigFile& cfile) override;
 };
 
 #endif //FEEDBACKRECEIVER_HPP
@@ -0,0 +1,172 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "RatScheduler.hpp"
+
+#include <sys/eventfd.h>  // eventfd()
+#include <unistd.h>       // close()
+#include <ctime>          // clock_gettime()
+#include <sstream>        // std::stringstream
+
+#include "../../util/logfile.hpp"    // class LogFile and LOG_* macros
+
+static uint64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+RatScheduler::RatScheduler(IfaceInfoMap &ifaceMap, uint32_t session) :
+        lanes(), switchfd(-1), active(0), requestedNs(0), stopFlag(false), stats(),
+        reactionMetric(Metrics::getInstance()->histogram(
+                "wiperf_rat_switch_reaction_us",
+                "Time from a switch request to the first datagram on the new interface, in us", "", 16, 16)),
+        gapMetric(Metrics::getInstance()->histogram(
+                "wiperf_rat_switch_gap_us", "Time without sending across an interface switch, in us", "", 16, 16)) {
+    if ((this->switchfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        LOG_FATAL_PERROR_EXIT("sthread eventfd()");
+    }
+
+    this->lanes.reserve(ifaceMap.size());
+    for (auto &entry : ifaceMap) {
+        IfaceInfo &iinfo = entry.second;
+
+        Lane lane;
+        lane.name = entry.first;
+        lane.iinfo = &iinfo;
+        lane.engine.reset(TxEngine::create(iinfo, this->switchfd, session));
+        lane.datagramLen = lane.engine->datagramLen();
+        lane.pacer.reset(new TxPacer(iinfo.pacing, iinfo.sockfd, lane.datagramLen, this->switchfd));
+
+        std::stringstream ss;
+        ss << "Interface " << lane.name << " ready with the "
+           << WiperfUtility::ioEngineToStr(iinfo.ioEngine) << " engine, "
+           << lane.datagramLen << " byte datagrams";
+        LOG_MSG(ss.str().c_str());
+
+        this->lanes.push_back(std::move(lane));
+    }
+}
+
+RatScheduler::~RatScheduler() {
+    // the engines may still refer to it
+    this->lanes.clear();
+    if (this->switchfd >= 0) close(this->switchfd);
+}
+
+int RatScheduler::size() const {
+    return (int) this->lanes.size();
+}
+
+int RatScheduler::indexOf(const std::string &name) const {
+    for (size_t i = 0; i < this->lanes.size(); i++) {
+        if (this->lanes[i].name == name) return (int) i;
+    }
+    return -1;
+}
+
+const std::string &RatScheduler::nameOf(int index) const {
+    return this->lanes[index].name;
+}
+
+void RatScheduler::activate(int index) {
+    if (index < 0 || index >= this->size()) return;
+    if (this->active.load(std::memory_order_relaxed) == index) return;
+
+    this->requestedNs.store(monotonicNs(), std::memory_order_relaxed);
+    this->active.store(index, std::memory_order_release);
+    eventfd_write(this->switchfd, 1);  // cuts waits on the old interface short
+}
+
+int RatScheduler::activeIndex() const {
+    return this->active.load(std::memory_order_acquire);
+}
+
+void RatScheduler::stop() {
+    this->stopFlag.store(true);
+    eventfd_write(this->switchfd, 1);
+}
+
+const RatSwitchStats &RatScheduler::switchStats() const {
+    return this->stats;
+}
+
+void RatScheduler::drainSwitchfd() {
+    eventfd_t value;
+    eventfd_read(this->switchfd, &value);  // non-blocking, fails if already drained
+}
+
+void RatScheduler::recordSwitch(int from, int to, uint64_t reactionNs, uint64_t gapNs) {
+    this->stats.count++;
+    this->stats.reactionSumNs += reactionNs;
+    this->stats.gapSumNs += gapNs;
+    if (reactionNs > this->stats.reactionMaxNs) this->stats.reactionMaxNs = reactionNs;
+    if (gapNs > this->stats.gapMaxNs) this->stats.gapMaxNs = gapNs;
+    this->reactionMetric.observe(reactionNs / 1000);
+    this->gapMetric.observe(gapNs / 1000);
+
+    LOG_STREAM(VERBOSE, "Switched from " << this->lanes[from].name << " to " << this->lanes[to].name
+               << ": " << reactionNs / 1000 << " us to the first datagram, "
+               << gapNs / 1000 << " us without sending")
+}
+
+void RatScheduler::run(IfaceCounters &counters) {
+    if (this->lanes.empty()) return;
+
+    int current = this->active.load(std::memory_order_acquire);
+    int switchedFrom = -1;        // switch in progress, until the first datagram goes out
+    uint64_t switchRequestedNs = 0;
+    uint64_t lastSentNs = monotonicNs();
+
+    while (!this->stopFlag.load(std::memory_order_relaxed)) {
+        const int next = this->active.load(std::memory_order_acquire);
+        if (next != current) {
+            // a switch while another is in progress still counts from the first interface
+            if (switchedFrom < 0) switchedFrom = current;
+            switchRequestedNs = this->requestedNs.load(std::memory_order_relaxed);
+            current = next;
+        }
+
+        Lane &lane = this->lanes[current];
+
+        int budget = lane.pacer->acquire(lane.engine->batchLen());
+        if (budget < 0) {  // switched, or time to end
+            this->drainSwitchfd();
+            continue;
+        }
+
+        int ndatagrams = lane.engine->transmit(budget);
+        if (ndatagrams < 0) {  // idem
+            this->drainSwitchfd();
+            continue;
+        }
+
+        lane.pacer->consume(ndatagrams);
+        counters.add(lane.iinfo->counterSlot, ndatagrams * lane.datagramLen, ndatagrams);
+
+        if (ndatagrams == 0) continue;
+
+        const uint64_t now = monotonicNs();
+        if (switchedFrom >= 0) {
+            if (switchedFrom != current) {
+                this->recordSwitch(switchedFrom, current, now - switchRequestedNs, now - lastSentNs);
+            }
+            switchedFrom = -1;
+        }
+        lastSentNs = now;
+    }
+
+    if (this->stats.count > 0) {
+        std::stringstream ss;
+        ss << this->stats.count << " interface switches, reaction "
+           << this->stats.reactionSumNs / this->stats.count / 1000 << " us mean, "
+           << this->stats.reactionMaxNs / 1000 << " us max, gap "
+           << this->stats.gapSumNs / this->stats.count / 1000 << " us mean, "
+           << this->stats.gapMaxNs / 1000 << " us max";
+        LOG_MSG(ss.str().c_str());
+    }
+}
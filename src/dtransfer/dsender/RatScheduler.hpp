@@ -0,0 +1,118 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the scheduler the Data Sender uses to send through one interface at a time
+ * and switch between them (802.11n/ac/ad) as the decision logic asks.
+ */
+
+#ifndef RATSCHEDULER_HPP
+#define RATSCHEDULER_HPP
+
+#include <atomic>   // std::atomic
+#include <cstdint>  // uint*_t
+#include <memory>   // std::unique_ptr
+#include <string>   // std::string
+#include <vector>   // std::vector
+
+#include "../../util/metrics.hpp"
+#include "../IfaceCounters.hpp"
+#include "../WiperfUtility.hpp"
+#include "TxEngine.hpp"
+#include "TxPacer.hpp"
+
+/**
+ * Switch latency totals, in ns. The reaction is the time from the call to activate()
+ * to the first datagram sent through the new interface, the gap the time between the
+ * last datagram sent through the old one and that same datagram.
+ */
+struct RatSwitchStats {
+    uint64_t count = 0;
+    uint64_t reactionSumNs = 0;
+    uint64_t reactionMaxNs = 0;
+    uint64_t gapSumNs = 0;
+    uint64_t gapMaxNs = 0;
+};
+
+/**
+ * Every interface gets its engine and pacer up front, on the socket that is already
+ * bound and connected, so all of them are ready to send at any time (make before
+ * break) and a switch is only a change of the array index the send loop reads.
+ *
+ * The active interface is an atomic index that any thread can set with activate().
+ * The send loop reads it before every batch. The engines and pacers wait on the
+ * scheduler's own event file descriptor, which activate() signals, so a send blocked
+ * on a full socket buffer, or a pacing sleep, of the old interface doesn't hold the
+ * switch back.
+ */
+class RatScheduler {
+private:
+    struct Lane {
+        std::string name;
+        IfaceInfo *iinfo;
+        std::unique_ptr<TxEngine> engine;
+        std::unique_ptr<TxPacer> pacer;
+        uint64_t datagramLen;
+    };
+
+    std::vector<Lane> lanes; // fixed once built, indexed by RAT
+    int switchfd;
+
+    std::atomic<int> active;
+    std::atomic<uint64_t> requestedNs; // when the last switch was asked, monotonic
+    std::atomic<bool> stopFlag;
+
+    RatSwitchStats stats; // only touched by the send loop
+    MetricHistogram &reactionMetric; // the same, in us
+    MetricHistogram &gapMetric;
+
+    void drainSwitchfd();
+    void recordSwitch(int from, int to, uint64_t reactionNs, uint64_t gapNs);
+
+public:
+    /**
+     * @param ifaceMap interfaces, with open sockets, outliving the scheduler
+     * @param session  written in the probe header of every datagram
+     */
+    RatScheduler(IfaceInfoMap &ifaceMap, uint32_t session);
+    ~RatScheduler();
+
+    RatScheduler(const RatScheduler &) = delete;
+    RatScheduler &operator=(const RatScheduler &) = delete;
+
+    int size() const;
+
+    /**
+     * @return the index of the interface, or -1 if it isn't scheduled
+     */
+    int indexOf(const std::string &name) const;
+
+    const std::string &nameOf(int index) const;
+
+    /**
+     * Makes the interface the one to send through, from the next batch on. Doesn't
+     * block, may be called from any thread.
+     */
+    void activate(int index);
+
+    int activeIndex() const;
+
+    /**
+     * Sends through the active interface until stop() is called. Only one thread may
+     * run it, which is the only writer of the counters of the interfaces.
+     */
+    void run(IfaceCounters &counters);
+
+    /**
+     * Makes run() return. Doesn't block, may be called from any thread.
+     */
+    void stop();
+
+    /**
+     * @return switch latency totals, only to be read once run() has returned
+     */
+    const RatSwitchStats &switchStats() const;
+};
+
+#endif //RATSCHEDULER_HPP
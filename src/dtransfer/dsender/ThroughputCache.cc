@@ -0,0 +1,232 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "ThroughputCache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+
+#include "../../util/logfile.hpp"
+#include "../WiperfUtility.hpp"
+
+static uint64_t steadyMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ThroughputCache::ThroughputCache() :
+        databaseManager(), maxCells(CACHE_CELLS_DEF), radius(CACHE_RADIUS_DEF),
+        refreshInterval(CACHE_REFRESH_INTERVAL_DEF), ttl(CACHE_TTL_DEF * 1000ULL),
+        mutex(), lru(), index(), stopMutex(), stopCond(), stopping(false), refreshThread() {
+}
+
+ThroughputCache::~ThroughputCache() {
+    this->stop();
+}
+
+void ThroughputCache::configure(ConfigFile &configFile, const std::string &secName) {
+    this->databaseManager.configure(configFile);
+
+    // optional cache parameters
+    try {
+        this->maxCells = std::stoul(configFile.Value(secName, "cache-cells"));
+    } catch (std::exception const&) {
+        this->maxCells = CACHE_CELLS_DEF;
+    }
+
+    try {
+        this->radius = std::stoi(configFile.Value(secName, "cache-radius"));
+    } catch (std::exception const&) {
+        this->radius = CACHE_RADIUS_DEF;
+    }
+
+    try {
+        this->refreshInterval = std::stoi(configFile.Value(secName, "cache-refresh-interval"));
+    } catch (std::exception const&) {
+        this->refreshInterval = CACHE_REFRESH_INTERVAL_DEF;
+    }
+
+    try {
+        this->ttl = std::stoull(configFile.Value(secName, "cache-ttl")) * 1000;
+    } catch (std::exception const&) {
+        this->ttl = CACHE_TTL_DEF * 1000ULL;
+    }
+
+    if (this->radius < 0) this->radius = 0;
+    if (this->refreshInterval < 1) this->refreshInterval = 1;
+
+    // the whole neighbourhood must fit, or it would evict itself on every refresh
+    size_t side = 2 * (size_t) this->radius + 1;
+    if (this->maxCells < side * side) this->maxCells = side * side;
+
+    std::stringstream ss;
+    ss << "Throughput cache: " << this->maxCells << " cells, radius " << this->radius
+       << " cells (" << DB_GRID_CELL_DEG << " deg), refresh every " << this->refreshInterval
+       << " ms, ttl " << this->ttl / 1000 << " s";
+    LOG_MSG(ss.str().c_str());
+}
+
+void ThroughputCache::start(GpsInfo *gpsInfo) {
+    if (this->refreshThread.joinable()) return;
+
+    this->stopping = false;
+    this->refreshThread = std::thread(&ThroughputCache::refreshLoop, this, gpsInfo);
+}
+
+void ThroughputCache::stop() {
+    if (!this->refreshThread.joinable()) return;
+
+    {
+        std::lock_guard<std::mutex> lock(this->stopMutex);
+        this->stopping = true;
+    }
+    this->stopCond.notify_one();
+    this->refreshThread.join();
+}
+
+void ThroughputCache::refreshLoop(GpsInfo *gpsInfo) {
+    std::unique_lock<std::mutex> lock(this->stopMutex);
+
+    while (!this->stopping) {
+        lock.unlock();
+
+        GpsInfo currentInfo = WiperfUtility::getCurrentGps(gpsInfo);
+        if (currentInfo.fix >= 2) {  // no point in loading around a stale position
+            this->refreshAround(currentInfo.lat, currentInfo.lon);
+        }
+
+        lock.lock();
+        this->stopCond.wait_for(lock, std::chrono::milliseconds(this->refreshInterval),
+                                [this] { return this->stopping; });
+    }
+}
+
+void ThroughputCache::refreshAround(double latitude, double longitude) {
+    const int64_t latCenter = DatabaseManager::latCellIndex(latitude);
+    const int64_t lonCenter = DatabaseManager::lonCellIndex(longitude);
+    const uint64_t now = steadyMillis();
+
+    // bounding box of the cells that need to be (re)loaded
+    int64_t latLo = INT64_MAX, latHi = INT64_MIN, lonLo = INT64_MAX, lonHi = INT64_MIN;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+
+        for (int64_t la = latCenter - this->radius; la <= latCenter + this->radius; la++) {
+            for (int64_t lo = lonCenter - this->radius; lo <= lonCenter + this->radius; lo++) {
+                auto itr = this->index.find(DatabaseManager::cellId(la, lo));
+                if (itr != this->index.end() && now - itr->second->loadedAt < this->ttl) continue;
+
+                latLo = std::min(latLo, la);
+                latHi = std::max(latHi, la);
+                lonLo = std::min(lonLo, lo);
+                lonHi = std::max(lonHi, lo);
+            }
+        }
+    }
+
+    if (latLo > latHi) return;  // all fresh, typical while the vehicle stays in the same cell
+
+    // outside the lock, lookups must never wait on the database
+    std::vector<CellStats> cellStatsList;
+    if (!this->databaseManager.retrieveStatsByCells(latLo, latHi, lonLo, lonHi, cellStatsList)) {
+        return;  // already logged, retry on the next refresh
+    }
+
+    std::unordered_map<int64_t, std::vector<RatStats>> loaded;
+    for (CellStats &cellStats : cellStatsList) {
+        loaded[cellStats.cellId].push_back(std::move(cellStats.stats));
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    // cells without samples are stored too, so they aren't queried again until they expire
+    for (int64_t la = latLo; la <= latHi; la++) {
+        for (int64_t lo = lonLo; lo <= lonHi; lo++) {
+            int64_t cellId = DatabaseManager::cellId(la, lo);
+            this->store(cellId, now, loaded[cellId]);
+        }
+    }
+}
+
+void ThroughputCache::store(int64_t cellId, uint64_t now, std::vector<RatStats> &stats) {
+    auto itr = this->index.find(cellId);
+    if (itr != this->index.end()) {
+        this->lru.erase(itr->second);
+        this->index.erase(itr);
+    }
+
+    this->lru.push_front(Entry{cellId, now, std::move(stats)});
+    this->index[cellId] = this->lru.begin();
+
+    while (this->lru.size() > this->maxCells) {
+        this->index.erase(this->lru.back().cellId);
+        this->lru.pop_back();
+    }
+}
+
+const ThroughputCache::Entry *ThroughputCache::findCell(double latitude, double longitude) {
+    int64_t cellId = DatabaseManager::cellId(DatabaseManager::latCellIndex(latitude),
+                                             DatabaseManager::lonCellIndex(longitude));
+
+    auto itr = this->index.find(cellId);
+    if (itr == this->index.end()) return nullptr;
+
+    this->lru.splice(this->lru.begin(), this->lru, itr->second);  // most recently used
+    return &*itr->second;
+}
+
+bool ThroughputCache::lookup(double latitude, double longitude, std::vector<RatStats> &stats) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    const Entry *entry = this->findCell(latitude, longitude);
+    if (entry == nullptr) return false;
+
+    stats = entry->stats;
+    return true;
+}
+
+int ThroughputCache::bestRat(double latitude, double longitude, const std::vector<std::string> &candidates) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    const Entry *entry = this->findCell(latitude, longitude);
+    if (entry == nullptr) return -1;
+
+    // the statistics count the bins of 0 bits, so a RAT that is often down has a low median
+    int best = -1;
+    double bestP50 = 0, bestMean = 0;
+    std::vector<bool> sampled(candidates.size(), false);
+    for (const RatStats &ratStats : entry->stats) {
+        if (ratStats.nthroughput == 0) continue;  // no feedback here, nothing known about it
+
+        auto candidate = std::find(candidates.begin(), candidates.end(), ratStats.rat);
+        if (candidate == candidates.end()) continue;
+
+        const int index = (int) (candidate - candidates.begin());
+        sampled[index] = true;
+
+        if (ratStats.p50Throughput > bestP50 ||
+            (ratStats.p50Throughput == bestP50 && ratStats.meanThroughput > bestMean)) {
+            best = index;
+            bestP50 = ratStats.p50Throughput;
+            bestMean = ratStats.meanThroughput;
+        }
+    }
+    if (best >= 0 || std::find(sampled.begin(), sampled.end(), true) == sampled.end()) return best;
+
+    // none carried any traffic here: one not tried yet beats the ones known to be down
+    for (size_t i = 0; i < candidates.size(); i++) {
+        if (!sampled[i]) return (int) i;
+    }
+    return -1;
+}
+
+size_t ThroughputCache::size() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->lru.size();
+}
@@ -0,0 +1,116 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the throughput cache, an in-memory copy of the per-RAT history statistics
+ * around the current position, so decisions don't have to wait on the database.
+ *
+ * The cache is keyed by the grid cells of the database location index. A refresh
+ * thread follows the GPS position and loads the cells around it that are missing or
+ * stale, with one query per refresh. The least recently used cells are evicted once
+ * the cache holds cache-cells cells.
+ */
+
+#ifndef WIPERF_IMPL_THROUGHPUTCACHE_HPP
+#define WIPERF_IMPL_THROUGHPUTCACHE_HPP
+
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../../util/configfile.hpp"
+#include "../../mygpsd/gpsinfo.hpp"
+#include "../database/DatabaseManager.hpp"
+
+#define CACHE_CELLS_DEF 4096             // max cells held in memory
+#define CACHE_RADIUS_DEF 4               // cells preloaded on each side of the current cell
+#define CACHE_REFRESH_INTERVAL_DEF 1000  // ms between refreshes
+#define CACHE_TTL_DEF 300                // s before a cell is loaded again
+
+class ThroughputCache {
+private:
+    struct Entry {
+        int64_t cellId;
+        uint64_t loadedAt; // ms
+        std::vector<RatStats> stats;
+    };
+
+    DatabaseManager databaseManager;
+
+    size_t maxCells;
+    int radius;          // cells
+    int refreshInterval; // ms
+    uint64_t ttl;        // ms
+
+    std::mutex mutex;
+    std::list<Entry> lru; // most recently used first
+    std::unordered_map<int64_t, std::list<Entry>::iterator> index;
+
+    std::mutex stopMutex;
+    std::condition_variable stopCond;
+    bool stopping;
+    std::thread refreshThread;
+
+    void refreshLoop(GpsInfo *gpsInfo);
+
+    /**
+     * Inserts (or replaces) a cell, evicting the least recently used ones if needed.
+     * Must be called with the mutex held.
+     */
+    void store(int64_t cellId, uint64_t now, std::vector<RatStats> &stats);
+
+    /**
+     * Finds the cell of a position, and makes it the most recently used.
+     * Must be called with the mutex held.
+     * @return the cell, or nullptr if it isn't cached
+     */
+    const Entry *findCell(double latitude, double longitude);
+
+public:
+    ThroughputCache();
+    ~ThroughputCache();
+
+    /**
+     * Configures the database and the optional cache parameters (cache-cells,
+     * cache-radius, cache-refresh-interval and cache-ttl) of the given section.
+     */
+    void configure(ConfigFile &configFile, const std::string &secName);
+
+    /**
+     * Starts the refresh thread, which follows the position in the GPS shared memory.
+     */
+    void start(GpsInfo *gpsInfo);
+    void stop();
+
+    /**
+     * Loads the missing or stale cells around a position. Called by the refresh
+     * thread, but can be used to preload a position.
+     */
+    void refreshAround(double latitude, double longitude);
+
+    /**
+     * Gets the statistics of the cell of a position, without touching the database.
+     * @return false if the cell isn't cached
+     */
+    bool lookup(double latitude, double longitude, std::vector<RatStats> &stats);
+
+    /**
+     * Picks the RAT with the highest median throughput in the cell of a position (then
+     * the highest mean), the bins of 0 bits included. If none of those with feedback
+     * samples carried any traffic, picks the first one without samples instead. The
+     * cell is scanned in place, without copying its statistics.
+     * @param candidates RATs that may be picked
+     * @return index of the best RAT in candidates, or -1 if the cell isn't cached, none
+     * of them has feedback samples, or all of them have samples of 0 bits only
+     */
+    int bestRat(double latitude, double longitude, const std::vector<std::string> &candidates);
+
+    size_t size();
+};
+
+#endif //WIPERF_IMPL_THROUGHPUTCACHE_HPP
@@ -0,0 +1,533 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "TxEngine.hpp"
+
+#include <arpa/inet.h>   // inet_ntop()
+#include <linux/if_ether.h>  // ETH_P_IP
+#include <net/if.h>      // if_nametoindex(), struct ifreq
+#include <netinet/in.h>  // IPPROTO_UDP
+#include <poll.h>        // poll()
+#include <sys/ioctl.h>   // ioctl()
+#include <sys/mman.h>    // mmap()
+#include <unistd.h>      // close(), getpagesize()
+#include <algorithm>     // std::min
+#include <cerrno>        // errno
+#include <cstdint>       // UINT32_MAX
+#include <cstdio>        // sscanf()
+#include <cstring>       // std::strerror, memset()
+#include <fstream>       // std::ifstream
+#include <random>        // std::minstd_rand
+#include <sstream>       // std::stringstream
+
+#include "../../util/logfile.hpp"    // class LogFile and LOG_* macros
+
+// older libc headers don't know about UDP GSO (kernel >= 4.18)
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+
+#define GSO_MAX_LEN 65507 // UDP payload of a super-datagram
+#define IP_UDP_HEADER_LEN 28 // IPv4 without options, then UDP
+
+TxEngine::TxEngine(IfaceInfo &iinfo, int wakefd, uint32_t session, size_t payloadLen) :
+        iinfo(iinfo), wakefd(wakefd),
+        batchSizes(Metrics::getInstance()->histogram("wiperf_tx_batch_datagrams", "Datagrams per send call",
+                                                     Metrics::label("iface", iinfo.name), 1, 8)),
+        sendFull(Metrics::getInstance()->counter("wiperf_tx_send_full_total",
+                                                 "Send calls that found the socket buffer full (EAGAIN, ENOBUFS)",
+                                                 Metrics::label("iface", iinfo.name))),
+        sendErrors(Metrics::getInstance()->counter("wiperf_tx_send_errors_total", "Failed send calls, other errors",
+                                                   Metrics::label("iface", iinfo.name))),
+        sendErrno(0), repeatedErrors(0), payload(payloadLen), probe() {
+    // pseudo-random data, generated once
+    std::minstd_rand randEngine(iinfo.ifaceId + 1);
+    for (char &c : this->payload) {
+        c = (char) randEngine();
+    }
+
+    this->probe.ratId = (uint8_t) iinfo.ifaceId;
+    this->probe.session = session;
+}
+
+bool TxEngine::setup() {
+    return true;
+}
+
+int TxEngine::batchLen() const {
+    return 1;
+}
+
+size_t TxEngine::datagramLen() const {
+    return this->payload.size();
+}
+
+void TxEngine::stamp(uint8_t *header, uint64_t sendUs) {
+    this->probe.sendUs = sendUs;
+    ProbeCodec::encode(header, this->probe);
+    this->probe.seq++;
+}
+
+void TxEngine::unstamp(int stamped, int sent) {
+    if (sent < stamped) this->probe.seq -= stamped - sent;
+}
+
+bool TxEngine::waitWritable() {
+    struct pollfd fds[2];
+    fds[0].fd = this->iinfo.sockfd;
+    fds[0].events = POLLOUT;
+    fds[1].fd = this->wakefd;
+    fds[1].events = POLLIN;
+
+    while (true) {
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+
+        if (poll(fds, 2, -1 /*no timeout*/) < 0) {
+            if (errno == EINTR) continue;
+            LOG_FATAL_PERROR_EXIT("sthread poll()");
+        }
+
+        if (fds[1].revents & POLLIN) return false;  // time to end
+        if (fds[0].revents & (POLLOUT | POLLERR)) return true;
+    }
+}
+
+bool TxEngine::handleSendError() {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+        this->sendFull.add();
+        return this->waitWritable();
+    }
+
+    if (errno == EINTR) return true;
+
+    this->sendErrors.add();
+    this->logSendError("sthread send error");
+
+    // don't spin on persistent errors (e.g., interface down), wait for the socket
+    return this->waitWritable();
+}
+
+void TxEngine::logSendError(const char *what) {
+    const int err = errno;
+    if (err == this->sendErrno) {
+        this->repeatedErrors++;
+        return;
+    }
+
+    this->sendErrno = err;
+    this->repeatedErrors = 0;
+    LOG_STREAM(ERROR, what << " on " << this->iinfo.name << ": " << err << " :: " << std::strerror(err))
+}
+
+void TxEngine::sendWorked() {
+    if (this->sendErrno == 0) return;
+
+    LOG_STREAM(MSG, "Sending through " << this->iinfo.name << " again, after "
+                    << this->repeatedErrors + 1 << " failed sends")
+    this->sendErrno = 0;
+    this->repeatedErrors = 0;
+}
+
+TxEngine* TxEngine::create(IfaceInfo &iinfo, int wakefd, uint32_t session) {
+    TxEngine *engine = nullptr;
+
+    if (iinfo.ioEngine == IoEngine::ring) {
+        engine = new RingTxEngine(iinfo, wakefd, session);
+        if (engine->setup()) return engine;
+
+        LOG_WARN("PACKET_MMAP transmit ring not available, falling back to the mmsg engine");
+        delete engine;
+        iinfo.ioEngine = IoEngine::mmsg;
+    }
+
+    if (iinfo.ioEngine == IoEngine::gso) {
+        engine = new GsoTxEngine(iinfo, wakefd, session);
+        if (engine->setup()) return engine;
+
+        LOG_WARN("UDP GSO not supported, falling back to the mmsg engine");
+        delete engine;
+        iinfo.ioEngine = IoEngine::mmsg;
+    }
+
+    if (iinfo.ioEngine == IoEngine::mmsg) {
+        engine = new MmsgTxEngine(iinfo, wakefd, session);
+    } else {
+        iinfo.ioEngine = IoEngine::basic;  // gro and other receive-only engines
+        engine = new BasicTxEngine(iinfo, wakefd, session);
+    }
+
+    engine->setup();
+    return engine;
+}
+
+// ------------- BASIC -------------
+
+BasicTxEngine::BasicTxEngine(IfaceInfo &iinfo, int wakefd, uint32_t session) :
+        TxEngine(iinfo, wakefd, session, iinfo.pacing.datagramLen ? iinfo.pacing.datagramLen : SND_BUF_LEN) {}
+
+int BasicTxEngine::transmit(int /*maxDatagrams*/) {
+    // the header goes straight into the payload, there is a single datagram in flight
+    this->stamp((uint8_t *) this->payload.data(), ProbeCodec::nowUs());
+
+    ssize_t ret = sendto(this->iinfo.sockfd, this->payload.data(), this->payload.size(),
+                         MSG_DONTWAIT | MSG_DONTROUTE,
+                         (const struct sockaddr *) &this->iinfo.sockaddrSrv, sizeof(this->iinfo.sockaddrSrv));
+
+    if (ret < 0) {
+        this->unstamp(1, 0);
+        return this->handleSendError() ? 0 : -1;
+    }
+
+    this->sendWorked();
+    this->batchSizes.observe(1);
+    return 1;
+}
+
+// ------------- MMSG -------------
+
+MmsgTxEngine::MmsgTxEngine(IfaceInfo &iinfo, int wakefd, uint32_t session) :
+        TxEngine(iinfo, wakefd, session, iinfo.pacing.datagramLen ? iinfo.pacing.datagramLen : SND_BUF_LEN) {
+    memset(this->msgs, 0, sizeof(this->msgs));
+
+    // every message has its own header, then the same payload and destination
+    for (int i = 0; i < SND_BATCH_LEN; i++) {
+        this->iovs[i][0].iov_base = this->headers[i];
+        this->iovs[i][0].iov_len = PROBE_HEADER_LEN;
+        this->iovs[i][1].iov_base = this->payload.data() + PROBE_HEADER_LEN;
+        this->iovs[i][1].iov_len = this->payload.size() - PROBE_HEADER_LEN;
+
+        this->msgs[i].msg_hdr.msg_iov = this->iovs[i];
+        this->msgs[i].msg_hdr.msg_iovlen = 2;
+        this->msgs[i].msg_hdr.msg_name = &this->iinfo.sockaddrSrv;
+        this->msgs[i].msg_hdr.msg_namelen = sizeof(this->iinfo.sockaddrSrv);
+    }
+}
+
+int MmsgTxEngine::transmit(int maxDatagrams) {
+    const int n = maxDatagrams < SND_BATCH_LEN ? maxDatagrams : SND_BATCH_LEN;
+
+    const uint64_t now = ProbeCodec::nowUs();
+    for (int i = 0; i < n; i++) {
+        this->stamp(this->headers[i], now);
+    }
+
+    int ret = sendmmsg(this->iinfo.sockfd, this->msgs, n, MSG_DONTWAIT | MSG_DONTROUTE);
+
+    if (ret < 0) {
+        this->unstamp(n, 0);
+        return this->handleSendError() ? 0 : -1;
+    }
+
+    this->sendWorked();
+    this->unstamp(n, ret);
+    this->batchSizes.observe(ret);
+    return ret;
+}
+
+int MmsgTxEngine::batchLen() const {
+    return SND_BATCH_LEN;
+}
+
+// ------------- GSO -------------
+
+GsoTxEngine::GsoTxEngine(IfaceInfo &iinfo, int wakefd, uint32_t session) :
+        TxEngine(iinfo, wakefd, session,
+                 iinfo.pacing.datagramLen ? iinfo.pacing.datagramLen : SND_GSO_SEGMENT_LEN) {
+    this->segments = (int) (GSO_MAX_LEN / this->payload.size());
+    if (this->segments > GSO_MAX_SEGMENTS) this->segments = GSO_MAX_SEGMENTS;
+
+    memset(this->msgs, 0, sizeof(this->msgs));
+
+    // a super-datagram alternates the header of each segment with the shared payload
+    for (int i = 0; i < SND_GSO_BATCH_LEN; i++) {
+        for (int j = 0; j < this->segments; j++) {
+            this->iovs[i][2 * j].iov_base = this->headers[i * this->segments + j];
+            this->iovs[i][2 * j].iov_len = PROBE_HEADER_LEN;
+            this->iovs[i][2 * j + 1].iov_base = this->payload.data() + PROBE_HEADER_LEN;
+            this->iovs[i][2 * j + 1].iov_len = this->payload.size() - PROBE_HEADER_LEN;
+        }
+
+        this->msgs[i].msg_hdr.msg_iov = this->iovs[i];
+        this->msgs[i].msg_hdr.msg_iovlen = 2 * this->segments;
+        this->msgs[i].msg_hdr.msg_name = &this->iinfo.sockaddrSrv;
+        this->msgs[i].msg_hdr.msg_namelen = sizeof(this->iinfo.sockaddrSrv);
+    }
+}
+
+bool GsoTxEngine::setup() {
+    // the segment size is set on the socket, so every send is segmented
+    int segmentLen = (int) this->payload.size();
+    return setsockopt(this->iinfo.sockfd, SOL_UDP, UDP_SEGMENT, &segmentLen, sizeof(segmentLen)) == 0;
+}
+
+int GsoTxEngine::transmit(int maxDatagrams) {
+    const int n = maxDatagrams < this->batchLen() ? maxDatagrams : this->batchLen();
+    const int nmsgs = (n + this->segments - 1) / this->segments;
+
+    // the last super-datagram may be short, when paced
+    const uint64_t now = ProbeCodec::nowUs();
+    for (int i = 0; i < nmsgs; i++) {
+        const int nsegments = n - i * this->segments < this->segments ? n - i * this->segments : this->segments;
+        this->msgs[i].msg_hdr.msg_iovlen = 2 * nsegments;
+
+        for (int j = 0; j < nsegments; j++) {
+            this->stamp(this->headers[i * this->segments + j], now);
+        }
+    }
+
+    int ret = sendmmsg(this->iinfo.sockfd, this->msgs, nmsgs, MSG_DONTWAIT | MSG_DONTROUTE);
+
+    if (ret < 0) {
+        this->unstamp(n, 0);
+        return this->handleSendError() ? 0 : -1;
+    }
+
+    this->sendWorked();
+    const int sent = ret * this->segments < n ? ret * this->segments : n;
+    this->unstamp(n, sent);
+    this->batchSizes.observe(sent);
+    return sent;
+}
+
+int GsoTxEngine::batchLen() const {
+    return SND_GSO_BATCH_LEN * this->segments;
+}
+
+// ------------- RING -------------
+
+RingTxEngine::RingTxEngine(IfaceInfo &iinfo, int wakefd, uint32_t session) :
+        TxEngine(iinfo, wakefd, session,
+                 iinfo.pacing.datagramLen ? iinfo.pacing.datagramLen : SND_GSO_SEGMENT_LEN),
+        ringfd(-1), ring(nullptr), ringLen(0), frameSize(0), frameLen(0), nframes(0), head(0), peer() {}
+
+RingTxEngine::~RingTxEngine() {
+    if (this->ring) munmap(this->ring, this->ringLen);
+    if (this->ringfd >= 0) close(this->ringfd);
+}
+
+static void putBe16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t) (v >> 8);
+    p[1] = (uint8_t) v;
+}
+
+bool RingTxEngine::setup() {
+    const int ifindex = (int) if_nametoindex(this->iinfo.name.c_str());
+    if (ifindex == 0) return false;
+
+    struct sockaddr_in local{};
+    socklen_t localLen = sizeof(local);
+    if (getsockname(this->iinfo.sockfd, (struct sockaddr *) &local, &localLen) < 0) return false;
+
+    // no IP fragmentation past the UDP stack
+    struct ifreq ifr{};
+    strncpy(ifr.ifr_name, this->iinfo.name.c_str(), IFNAMSIZ - 1);
+    this->frameLen = IP_UDP_HEADER_LEN + this->payload.size();
+    if (ioctl(this->iinfo.sockfd, SIOCGIFMTU, &ifr) < 0 || this->frameLen > (size_t) ifr.ifr_mtu) {
+        LOG_STREAM(WARN, "Datagrams of " << this->payload.size() << " bytes don't fit the MTU of "
+                   << this->iinfo.name << ", set a shorter one with pacing")
+        return false;
+    }
+
+    // protocol 0, so the socket only sends
+    if ((this->ringfd = socket(AF_PACKET, SOCK_DGRAM, 0)) < 0) return false;
+
+    int version = TPACKET_V2;
+    int loss = 1;  // a bad frame is skipped rather than stalling the ring
+    if (setsockopt(this->ringfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+        setsockopt(this->ringfd, SOL_PACKET, PACKET_LOSS, &loss, sizeof(loss)) < 0) {
+        return false;
+    }
+
+    const size_t dataOffset = TPACKET_ALIGN(sizeof(struct tpacket2_hdr));
+    this->frameSize = TPACKET_ALIGNMENT;
+    while (this->frameSize < dataOffset + this->frameLen) this->frameSize <<= 1;
+    const size_t blockSize = this->frameSize > (size_t) getpagesize() ? this->frameSize : (size_t) getpagesize();
+
+    struct tpacket_req req{};
+    req.tp_block_size = (unsigned) blockSize;
+    req.tp_block_nr = (unsigned) ((SND_RING_FRAMES * this->frameSize + blockSize - 1) / blockSize);
+    req.tp_frame_size = (unsigned) this->frameSize;
+    req.tp_frame_nr = (unsigned) (req.tp_block_nr * (blockSize / this->frameSize));
+    if (setsockopt(this->ringfd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) return false;
+
+    this->nframes = (int) req.tp_frame_nr;
+    this->ringLen = (size_t) req.tp_block_size * req.tp_block_nr;
+    void *ring = mmap(nullptr, this->ringLen, PROT_READ | PROT_WRITE, MAP_SHARED, this->ringfd, 0);
+    if (ring == MAP_FAILED) return false;
+    this->ring = (uint8_t *) ring;
+
+    struct sockaddr_ll sll{};
+    sll.sll_family = AF_PACKET;
+    sll.sll_ifindex = ifindex;
+    if (bind(this->ringfd, (struct sockaddr *) &sll, sizeof(sll)) < 0) return false;
+
+    // the qdisc (fq) paces packet sockets as well
+    if (this->iinfo.pacing.rate > 0) {
+        uint32_t maxRate = (uint32_t) std::min<uint64_t>(this->iinfo.pacing.rate / 8, UINT32_MAX);
+        setsockopt(this->ringfd, SOL_SOCKET, SO_MAX_PACING_RATE, &maxRate, sizeof(maxRate));
+    }
+
+    if (!this->resolvePeer(ifindex)) {
+        LOG_STREAM(WARN, "Link address of " << this->iinfo.addrSrv << " not resolved on " << this->iinfo.name)
+        return false;
+    }
+
+    this->buildFrames(local);
+    return true;
+}
+
+/**
+ * @return the link address of the IP address from the ARP table, false if there's none (yet)
+ */
+static bool arpLookup(const std::string &ip, const std::string &ifname, unsigned char *mac) {
+    std::ifstream arp("/proc/net/arp");
+    std::string line;
+    std::getline(arp, line);  // header
+
+    while (std::getline(arp, line)) {
+        char addr[64], hw[64], dev[64];
+        unsigned type, flags;
+        if (sscanf(line.c_str(), "%63s 0x%x 0x%x %63s %*s %63s", addr, &type, &flags, hw, dev) != 5) continue;
+        if (ip != addr || ifname != dev || !(flags & 0x2 /*ATF_COM*/)) continue;
+
+        unsigned b[6];
+        if (sscanf(hw, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6) return false;
+        for (int i = 0; i < 6; i++) mac[i] = (unsigned char) b[i];
+        return true;
+    }
+
+    return false;
+}
+
+bool RingTxEngine::resolvePeer(int ifindex) {
+    this->peer.sll_family = AF_PACKET;
+    this->peer.sll_protocol = htons(ETH_P_IP);
+    this->peer.sll_ifindex = ifindex;
+    this->peer.sll_halen = 6;
+
+    // the loopback and point to point links don't resolve addresses
+    struct ifreq ifr{};
+    strncpy(ifr.ifr_name, this->iinfo.name.c_str(), IFNAMSIZ - 1);
+    if (ioctl(this->iinfo.sockfd, SIOCGIFFLAGS, &ifr) == 0 && (ifr.ifr_flags & (IFF_LOOPBACK | IFF_NOARP))) {
+        return true;
+    }
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &this->iinfo.sockaddrSrv.sin_addr, ip, sizeof(ip));
+
+    for (int waited = 0; waited <= RING_ARP_WAIT_MS; waited += 50) {
+        if (arpLookup(ip, this->iinfo.name, this->peer.sll_addr)) return true;
+
+        // an empty datagram through the UDP stack makes the kernel resolve the address
+        if (waited == 0) {
+            sendto(this->iinfo.sockfd, "", 0, MSG_DONTWAIT | MSG_DONTROUTE,
+                   (const struct sockaddr *) &this->iinfo.sockaddrSrv, sizeof(this->iinfo.sockaddrSrv));
+        }
+        usleep(50000);
+    }
+
+    return false;
+}
+
+void RingTxEngine::buildFrames(const struct sockaddr_in &local) {
+    uint8_t header[IP_UDP_HEADER_LEN] = {};
+
+    // IPv4, don't fragment, no options
+    header[0] = 0x45;
+    putBe16(header + 2, (uint16_t) this->frameLen);
+    putBe16(header + 6, 0x4000);
+    header[8] = 64;  // TTL
+    header[9] = IPPROTO_UDP;
+    memcpy(header + 12, &local.sin_addr, 4);
+    memcpy(header + 16, &this->iinfo.sockaddrSrv.sin_addr, 4);
+
+    uint32_t sum = 0;
+    for (int i = 0; i < 20; i += 2) sum += (uint32_t) (header[i] << 8 | header[i + 1]);
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    putBe16(header + 10, (uint16_t) ~sum);
+
+    // UDP, without checksum (optional over IPv4), as the probe header changes every time
+    memcpy(header + 20, &local.sin_port, 2);
+    memcpy(header + 22, &this->iinfo.sockaddrSrv.sin_port, 2);
+    putBe16(header + 24, (uint16_t) (this->frameLen - 20));
+
+    const size_t dataOffset = TPACKET_ALIGN(sizeof(struct tpacket2_hdr));
+    for (int i = 0; i < this->nframes; i++) {
+        uint8_t *data = this->ring + i * this->frameSize + dataOffset;
+        memcpy(data, header, sizeof(header));
+        memcpy(data + IP_UDP_HEADER_LEN, this->payload.data(), this->payload.size());
+    }
+}
+
+void RingTxEngine::kick() {
+    if (sendto(this->ringfd, nullptr, 0, MSG_DONTWAIT, (const struct sockaddr *) &this->peer,
+               sizeof(this->peer)) >= 0) {
+        this->sendWorked();
+        return;
+    }
+
+    // with a full socket buffer the frames left stay handed over, and go with the next
+    // kick; the ring filling up is what counts as full
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS && errno != EINTR) {
+        this->sendErrors.add();
+        this->logSendError("sthread ring send error");
+    }
+}
+
+bool RingTxEngine::waitRoom() {
+    struct pollfd pfd = {this->wakefd, POLLIN, 0};
+    const struct timespec timeout = {0, RING_FULL_WAIT_US * 1000};
+
+    int ret = ppoll(&pfd, 1, &timeout, nullptr);
+    if (ret < 0 && errno != EINTR) LOG_FATAL_PERROR_EXIT("sthread ppoll()");
+
+    return !(ret > 0 && (pfd.revents & POLLIN));
+}
+
+int RingTxEngine::transmit(int maxDatagrams) {
+    const int n = maxDatagrams < SND_RING_BATCH_LEN ? maxDatagrams : SND_RING_BATCH_LEN;
+    const size_t dataOffset = TPACKET_ALIGN(sizeof(struct tpacket2_hdr));
+
+    const uint64_t now = ProbeCodec::nowUs();
+    int queued = 0;
+    while (queued < n) {
+        auto *hdr = (struct tpacket2_hdr *) (this->ring + this->head * this->frameSize);
+
+        // frames the kernel still has to send, or to release, mean the ring is full
+        const uint32_t status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+        if (status != TP_STATUS_AVAILABLE && status != TP_STATUS_WRONG_FORMAT) break;
+
+        this->stamp((uint8_t *) hdr + dataOffset + IP_UDP_HEADER_LEN, now);
+        hdr->tp_len = (uint32_t) this->frameLen;
+        __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+        this->head = (this->head + 1) % this->nframes;
+        queued++;
+    }
+
+    this->kick();
+
+    if (queued == 0) {
+        this->sendFull.add();
+        return this->waitRoom() ? 0 : -1;
+    }
+
+    this->batchSizes.observe(queued);
+    return queued;
+}
+
+int RingTxEngine::batchLen() const {
+    return SND_RING_BATCH_LEN;
+}
@@ -0,0 +1,225 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the transmit engines used by the Data Sender to push pseudo-random UDP data
+ * through an interface. Each engine trades syscall and fragmentation overhead differently,
+ * so that the link, and not the CPU, is what limits the measured throughput.
+ */
+
+#ifndef TXENGINE_HPP
+#define TXENGINE_HPP
+
+#include <linux/if_packet.h>  // struct sockaddr_ll
+#include <sys/socket.h>  // struct mmsghdr
+#include <sys/uio.h>     // struct iovec
+#include <vector>        // std::vector
+
+#include "../../util/metrics.hpp"
+#include "../WiperfUtility.hpp"
+#include "../ProbeCodec.hpp"
+
+#define GSO_MAX_SEGMENTS 64 // UDP_MAX_SEGMENTS in the kernel
+#define RING_ARP_WAIT_MS 1000 // to resolve the next hop of the ring engine
+#define RING_FULL_WAIT_US 200 // between checks of a full transmit ring
+
+/**
+ * Base class of the transmit engines. An engine owns the buffers it sends from and
+ * transmits one batch of datagrams per call to transmit(). When the socket send buffer
+ * is full, the engine blocks until the socket becomes writable (or the wake up file
+ * descriptor is signaled) instead of spinning on EAGAIN.
+ *
+ * Every datagram starts with a probe header (see ProbeCodec.hpp) with the next sequence
+ * number of the interface. The batched engines keep the headers apart from the payload
+ * and gather both with iovecs, so stamping a batch doesn't touch the payload.
+ */
+class TxEngine {
+protected:
+    IfaceInfo &iinfo;
+    int wakefd;
+
+    MetricHistogram &batchSizes; // datagrams per send call
+    MetricCounter &sendFull;     // send calls that found the socket buffer full
+    MetricCounter &sendErrors;   // other send errors
+
+    int sendErrno;           // of the error the sends fail with, 0 while they work
+    uint64_t repeatedErrors; // failed sends not logged since, as they failed the same way
+
+    /**
+     * Pseudo-random payload shared by every datagram sent by the engine.
+     */
+    std::vector<char> payload;
+
+    /**
+     * Header of the next datagram.
+     */
+    ProbeHeader probe;
+
+    TxEngine(IfaceInfo &iinfo, int wakefd, uint32_t session, size_t payloadLen);
+
+    /**
+     * Writes the probe header of the next datagram and advances the sequence number.
+     */
+    void stamp(uint8_t *header, uint64_t sendUs);
+
+    /**
+     * Takes back the sequence numbers stamped but not sent, so they stay consecutive.
+     */
+    void unstamp(int stamped, int sent);
+
+    /**
+     * Blocks until the interface socket can take more data.
+     * @return false if the wake up file descriptor was signaled (time to stop)
+     */
+    bool waitWritable();
+
+    /**
+     * Handles a failed send call.
+     * @return false if the engine must stop
+     */
+    bool handleSendError();
+
+    /**
+     * Logs a send error (errno), only when the sends start failing or fail another way,
+     * so an error that persists (e.g., the interface is down) doesn't flood the log.
+     */
+    void logSendError(const char *what);
+
+    /**
+     * Called after a send call that worked, logs the end of the errors, if any.
+     */
+    void sendWorked();
+
+public:
+    virtual ~TxEngine() = default;
+
+    /**
+     * Engine specific socket configuration.
+     * @return false if the engine is not supported by the socket/kernel
+     */
+    virtual bool setup();
+
+    /**
+     * Transmits one batch of at most maxDatagrams datagrams.
+     * @return number of datagrams sent, or -1 if the engine must stop
+     */
+    virtual int transmit(int maxDatagrams) = 0;
+
+    /**
+     * @return most datagrams a call to transmit() can send
+     */
+    virtual int batchLen() const;
+
+    /**
+     * @return UDP payload length of each datagram sent
+     */
+    size_t datagramLen() const;
+
+    /**
+     * Creates the engine configured for the interface, falling back to simpler
+     * engines when the preferred one isn't supported.
+     * @param iinfo   interface information (with an open socket)
+     * @param wakefd  file descriptor that is signaled when it's time to end
+     * @param session written in the probe header of every datagram
+     * @return engine, owned by the caller
+     */
+    static TxEngine* create(IfaceInfo &iinfo, int wakefd, uint32_t session);
+};
+
+/**
+ * One sendto() per datagram, SND_BUF_LEN bytes by default.
+ */
+class BasicTxEngine : public TxEngine {
+public:
+    BasicTxEngine(IfaceInfo &iinfo, int wakefd, uint32_t session);
+    int transmit(int maxDatagrams) override;
+};
+
+/**
+ * SND_BATCH_LEN datagrams per sendmmsg() call, SND_BUF_LEN bytes by default.
+ */
+class MmsgTxEngine : public TxEngine {
+private:
+    struct mmsghdr msgs[SND_BATCH_LEN];
+    struct iovec iovs[SND_BATCH_LEN][2];  // probe header, payload
+    uint8_t headers[SND_BATCH_LEN][PROBE_HEADER_LEN];
+
+public:
+    MmsgTxEngine(IfaceInfo &iinfo, int wakefd, uint32_t session);
+    int transmit(int maxDatagrams) override;
+    int batchLen() const override;
+};
+
+/**
+ * UDP GSO: each sendmmsg() slot carries a super-datagram that the kernel (or the NIC)
+ * splits into datagrams of SND_GSO_SEGMENT_LEN bytes by default, avoiding IP
+ * fragmentation. The segments must fit the MTU of the interface.
+ */
+class GsoTxEngine : public TxEngine {
+private:
+    int segments;  // per super-datagram
+
+    struct mmsghdr msgs[SND_GSO_BATCH_LEN];
+    struct iovec iovs[SND_GSO_BATCH_LEN][2 * GSO_MAX_SEGMENTS];  // probe header, payload, ...
+    uint8_t headers[SND_GSO_BATCH_LEN * GSO_MAX_SEGMENTS][PROBE_HEADER_LEN];
+
+public:
+    GsoTxEngine(IfaceInfo &iinfo, int wakefd, uint32_t session);
+    bool setup() override;
+    int transmit(int maxDatagrams) override;
+    int batchLen() const override;
+};
+
+/**
+ * PACKET_MMAP transmit ring (TPACKET_V2) on a packet socket of the interface. Every
+ * frame of the ring, shared with the kernel, holds a whole datagram, IP and UDP headers
+ * included, built once; a batch only stamps the probe headers, hands the frames over
+ * and kicks the kernel with one send(), which sends from the ring pages without
+ * copying them. The UDP stack is skipped: datagrams must fit the MTU
+ * (SND_GSO_SEGMENT_LEN bytes by default) and go to the next hop found in the ARP table,
+ * the peer being on the link (as with MSG_DONTROUTE). The interface socket stays open,
+ * it keeps the port and triggers address resolution.
+ */
+class RingTxEngine : public TxEngine {
+private:
+    int ringfd;
+    uint8_t *ring;
+    size_t ringLen;
+    size_t frameSize; // bytes per frame of the ring
+    size_t frameLen;  // bytes of the IP datagram in each frame
+    int nframes;
+    int head;         // next frame to fill
+    struct sockaddr_ll peer;
+
+    /**
+     * Finds the link address of the receiver, through the ARP table.
+     * @return false if it isn't resolved within RING_ARP_WAIT_MS
+     */
+    bool resolvePeer(int ifindex);
+
+    /**
+     * Writes the IP and UDP headers and the payload of every frame.
+     */
+    void buildFrames(const struct sockaddr_in &local);
+
+    /**
+     * Sends the frames handed over, without waiting for them.
+     */
+    void kick();
+
+    /**
+     * Waits RING_FULL_WAIT_US for the kernel to free frames.
+     * @return false if the wake up file descriptor was signaled (time to stop)
+     */
+    bool waitRoom();
+
+public:
+    RingTxEngine(IfaceInfo &iinfo, int wakefd, uint32_t session);
+    ~RingTxEngine() override;
+    bool setup() override;
+    int transmit(int maxDatagrams) override;
+    int batchLen() const override;
+};
+
+#endif //TXENGINE_HPP
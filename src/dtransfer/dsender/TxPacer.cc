@@ -0,0 +1,98 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "TxPacer.hpp"
+
+#include <poll.h>        // ppoll()
+#include <sys/socket.h>  // setsockopt()
+#include <cerrno>        // errno
+#include <ctime>         // clock_gettime()
+#include <sstream>       // std::stringstream
+
+#include "../../util/logfile.hpp"    // class LogFile and LOG_* macros
+
+// older libc headers don't know about it (kernel >= 3.13)
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_MS 1000000ULL
+
+static uint64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+TxPacer::TxPacer(const IfacePacing &pacing, int sockfd, size_t datagramLen, int wakefd) :
+        pacing(pacing), datagramLen(datagramLen), wakefd(wakefd), tokens(0), depth(0),
+        last(monotonicNs()), start(last) {
+    if (this->pacing.rate == 0) return;
+
+    this->depth = (double) this->pacing.rate / 8 * PACING_BURST_US / 1e6;
+    if (this->depth < 2.0 * datagramLen) this->depth = 2.0 * datagramLen;
+    this->tokens = datagramLen;
+
+    // bytes per second; the 32 bit form is understood by every kernel with the option
+    const uint64_t bytesPerSec = this->pacing.rate / 8;
+    unsigned int maxRate = bytesPerSec > UINT32_MAX ? UINT32_MAX : (unsigned int) bytesPerSec;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_MAX_PACING_RATE, &maxRate, sizeof(maxRate)) < 0) {
+        std::stringstream ss;
+        ss << "SO_MAX_PACING_RATE not supported, pacing in user space only: " << errno;
+        LOG_WARN(ss.str().c_str());
+    }
+}
+
+bool TxPacer::sleepFor(uint64_t ns) {
+    struct pollfd pfd = {this->wakefd, POLLIN, 0};
+    struct timespec ts = {(time_t) (ns / NS_PER_SEC), (long) (ns % NS_PER_SEC)};
+
+    int ret = ppoll(&pfd, 1, &ts, nullptr);
+    if (ret < 0 && errno != EINTR) LOG_FATAL_PERROR_EXIT("sthread ppoll()");
+
+    return !(ret > 0 && (pfd.revents & POLLIN));
+}
+
+int TxPacer::acquire(int maxDatagrams) {
+    // as fast as possible, don't even look at the clock
+    if (this->pacing.rate == 0 && this->pacing.offMs == 0) return maxDatagrams;
+
+    while (true) {
+        uint64_t now = monotonicNs();
+
+        if (this->pacing.offMs > 0) {
+            const uint64_t period = (uint64_t) (this->pacing.onMs + this->pacing.offMs) * NS_PER_MS;
+            const uint64_t phase = (now - this->start) % period;
+            if (phase >= this->pacing.onMs * NS_PER_MS) {
+                if (!this->sleepFor(period - phase)) return -1;
+                continue;
+            }
+        }
+
+        if (this->pacing.rate == 0) return maxDatagrams;
+
+        this->tokens += (double) (now - this->last) * this->pacing.rate / 8 / NS_PER_SEC;
+        if (this->tokens > this->depth) this->tokens = this->depth;
+        this->last = now;
+
+        const double ndatagrams = this->tokens / this->datagramLen;
+        if (ndatagrams >= 1) {
+            return ndatagrams >= maxDatagrams ? maxDatagrams : (int) ndatagrams;
+        }
+
+        // until there are tokens for one datagram
+        const double missing = this->datagramLen - this->tokens;
+        if (!this->sleepFor((uint64_t) (missing * 8 * NS_PER_SEC / this->pacing.rate) + 1)) return -1;
+    }
+}
+
+void TxPacer::consume(int ndatagrams) {
+    if (this->pacing.rate == 0 || ndatagrams <= 0) return;
+
+    this->tokens -= (double) ndatagrams * this->datagramLen;
+}
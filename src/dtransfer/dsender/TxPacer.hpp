@@ -0,0 +1,70 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the token bucket that holds the Data Sender to the target rate and on/off
+ * pattern of an interface, instead of saturating the link.
+ */
+
+#ifndef TXPACER_HPP
+#define TXPACER_HPP
+
+#include <cstddef>  // size_t
+#include <cstdint>  // uint*_t
+
+#include "../WiperfUtility.hpp"
+
+#define PACING_BURST_US 1000 // bucket depth, in us worth of the target rate
+
+/**
+ * Token bucket, in bytes, filled at the target rate and at most PACING_BURST_US deep,
+ * so a link that was slow for a while doesn't get a burst afterwards. The bucket
+ * hands out whole datagrams: the engine is given as many as there are tokens for,
+ * and the pacer sleeps until there are tokens for at least one.
+ *
+ * The rate is also set as SO_MAX_PACING_RATE on the socket. With the fq qdisc on the
+ * interface, the kernel then spaces the datagrams of a batch out too; without it the
+ * option has no effect on UDP and the bucket alone keeps the rate.
+ *
+ * During the off period of the pattern nothing is handed out. Sleeps are cut short
+ * when the wake up file descriptor is signaled.
+ */
+class TxPacer {
+private:
+    const IfacePacing pacing;
+    const size_t datagramLen;
+    const int wakefd;
+
+    double tokens;   // bytes
+    double depth;    // bytes
+    uint64_t last;   // last refill, monotonic ns
+    uint64_t start;  // start of the first on period, monotonic ns
+
+    /**
+     * Sleeps for ns nanoseconds.
+     * @return false if the wake up file descriptor was signaled (time to stop)
+     */
+    bool sleepFor(uint64_t ns);
+
+public:
+    /**
+     * @param sockfd      socket the engine sends through, to set SO_MAX_PACING_RATE
+     * @param datagramLen UDP payload of each datagram of the engine
+     */
+    TxPacer(const IfacePacing &pacing, int sockfd, size_t datagramLen, int wakefd);
+
+    /**
+     * Blocks until at least one datagram may be sent.
+     * @param maxDatagrams most datagrams the engine can take
+     * @return datagrams that may be sent now, or -1 if it's time to stop
+     */
+    int acquire(int maxDatagrams);
+
+    /**
+     * Takes the tokens of the datagrams actually sent.
+     */
+    void consume(int ndatagrams);
+};
+
+#endif //TXPACER_HPP
@@ -14,7 +14,9 @@
 
 #include "DataSender.hpp"
 #include "FeedbackReceiver.hpp"
+#include "../../util/configreloader.hpp"
 #include "../../util/logfile.hpp"
+#include "../../util/metrics.hpp"
 
 #define LOG_FNAME "/var/log/dsender.log"
 
@@ -41,13 +43,23 @@ int main(int argc, char* argv[]) {
     FeedbackReceiver freceiver;
     freceiver.readConfig(CONFIG_FNAME);
 
+    ConfigFile cfile(CONFIG_FNAME);
+    MetricsExporter metricsExporter;
+    metricsExporter.start(WiperfUtility::readMetricsEndpoint(cfile, "data-sender"));
+
     //To handle signals
     array[0] = &dsender;
     array[1] = &freceiver;
 
     signal(SIGINT, sigHandler);
     signal(SIGTERM, sigHandler);
-    signal(SIGHUP, sigHandler);
+
+    //SIGHUP reloads the configuration, in the order it was read on start
+    ConfigReloader *reloader = ConfigReloader::getInstance();
+    reloader->addListener([&dsender](ConfigFile &cfile) { dsender.reloadConfig(cfile); });
+    reloader->addListener([&freceiver](ConfigFile &cfile) { freceiver.reloadConfig(cfile); });
+    reloader->start(CONFIG_FNAME);
+    signal(SIGHUP, ConfigReloader::signalHandler);
 
     //This is needed because dsender and feedback receiver both
     // initiate two children threads and would block the other from running.
@@ -59,6 +71,9 @@ int main(int argc, char* argv[]) {
     freceiverThread.join();
     dsenderThread.join();
 
+    reloader->stop();
+    metricsExporter.stop();
+
     std::cout << "Threads finish running" << std::endl;
 
     LOG_CLOSE()
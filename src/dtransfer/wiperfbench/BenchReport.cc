@@ -0,0 +1,105 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "BenchReport.hpp"
+
+#include <sys/resource.h>  // getrusage()
+#include <algorithm>       // std::nth_element
+#include <ctime>           // clock_gettime()
+#include <iomanip>         // std::setprecision
+#include <utility>         // std::move
+
+BenchReport::BenchReport(std::string workload) :
+        workload(std::move(workload)), startNs(0), stopNs(0), startCpuNs(0), stopCpuNs(0),
+        bytes(0), rows(0), missed(0), ticksNs() {}
+
+uint64_t BenchReport::monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t BenchReport::cpuNs() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return ((uint64_t) usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL +
+           ((uint64_t) usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+void BenchReport::start() {
+    this->startNs = monotonicNs();
+    this->startCpuNs = cpuNs();
+}
+
+void BenchReport::stop() {
+    this->stopNs = monotonicNs();
+    this->stopCpuNs = cpuNs();
+}
+
+void BenchReport::addBytes(uint64_t nbytes) {
+    this->bytes += nbytes;
+}
+
+void BenchReport::addRows(uint64_t nrows) {
+    this->rows += nrows;
+}
+
+void BenchReport::addMissed(uint64_t nticks) {
+    this->missed += nticks;
+}
+
+void BenchReport::addTick(uint64_t latencyNs) {
+    this->ticksNs.push_back(latencyNs);
+}
+
+double BenchReport::seconds() const {
+    return (double) (this->stopNs - this->startNs) / 1e9;
+}
+
+uint64_t BenchReport::percentile(double p) const {
+    if (this->ticksNs.empty()) return 0;
+
+    std::vector<uint64_t> sorted(this->ticksNs);
+    size_t rank = (size_t) (p * (double) (sorted.size() - 1) + 0.5);
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    return sorted[rank];
+}
+
+void BenchReport::print(std::ostream &os) const {
+    const double secs = this->seconds();
+    const double cpuSecs = (double) (this->stopCpuNs - this->startCpuNs) / 1e9;
+    const double gbits = (double) this->bytes * 8 / 1e9;
+
+    os << std::fixed << std::setprecision(3)
+       << "workload=" << this->workload
+       << " seconds=" << secs
+       << " cpu_seconds=" << cpuSecs;
+
+    if (this->bytes > 0 && secs > 0) {
+        os << " bytes=" << this->bytes << " mbit_per_s=" << gbits * 1000 / secs
+           << " cpu_seconds_per_gbit=" << cpuSecs / gbits;
+    } else {
+        os << " bytes=- mbit_per_s=- cpu_seconds_per_gbit=-";
+    }
+
+    if (this->rows > 0 && secs > 0) {
+        os << " rows=" << this->rows << " rows_per_s=" << (double) this->rows / secs;
+    } else {
+        os << " rows=- rows_per_s=-";
+    }
+
+    if (!this->ticksNs.empty()) {
+        os << " ticks=" << this->ticksNs.size()
+           << " tick_p50_us=" << (double) this->percentile(0.50) / 1000
+           << " tick_p99_us=" << (double) this->percentile(0.99) / 1000
+           << " tick_max_us=" << (double) this->percentile(1.0) / 1000;
+    } else {
+        os << " ticks=- tick_p50_us=- tick_p99_us=- tick_max_us=-";
+    }
+
+    os << " missed=" << this->missed << std::endl;
+}
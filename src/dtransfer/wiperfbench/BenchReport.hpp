@@ -0,0 +1,69 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the report of a benchmark run: the wall clock and CPU time it took, the
+ * bytes and rows it went through, and the latency of each of its ticks (a GPS epoch,
+ * a sampling round, a database batch, ...).
+ */
+
+#ifndef BENCHREPORT_HPP
+#define BENCHREPORT_HPP
+
+#include <cstdint>  // uint*_t
+#include <ostream>  // std::ostream
+#include <string>   // std::string
+#include <vector>   // std::vector
+
+class BenchReport {
+private:
+    std::string workload;
+
+    uint64_t startNs;
+    uint64_t stopNs;
+    uint64_t startCpuNs;
+    uint64_t stopCpuNs;
+
+    uint64_t bytes;
+    uint64_t rows;
+    uint64_t missed;
+    std::vector<uint64_t> ticksNs;
+
+public:
+    explicit BenchReport(std::string workload);
+
+    /**
+     * Starts the clocks. The CPU time is the one of the whole process, every thread.
+     */
+    void start();
+    void stop();
+
+    void addBytes(uint64_t nbytes);
+    void addRows(uint64_t nrows);
+
+    /**
+     * Accounts a tick that didn't complete (e.g. an epoch mygpsd didn't publish).
+     */
+    void addMissed(uint64_t nticks = 1);
+
+    void addTick(uint64_t latencyNs);
+
+    double seconds() const;
+
+    /**
+     * @return the latency below which the fraction p of the ticks are, in ns (0 if none)
+     */
+    uint64_t percentile(double p) const;
+
+    /**
+     * Prints the report as one line of key=value pairs, so runs can be compared with
+     * the usual text tools. Values that don't apply to the workload are printed as "-".
+     */
+    void print(std::ostream &os) const;
+
+    static uint64_t monotonicNs();
+    static uint64_t cpuNs();
+};
+
+#endif //BENCHREPORT_HPP
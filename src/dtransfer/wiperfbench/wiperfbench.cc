@@ -0,0 +1,513 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * WiPerf benchmark: runs the pipeline off the vehicle, on recorded data or on a
+ * loopback/veth setup, and prints one report per workload (see BenchReport):
+ *
+ *  - nmea: replays a recorded NMEA stream into mygpsd through a pseudo terminal,
+ *    and times each epoch from its last sentence to its publication in the shared
+ *    memory segment
+ *  - wifiinfo: replays the channel info samples kept in a spill file through the
+ *    encode path of the Channel Monitor, one sampling round per tick
+ *  - transfer: runs the Data Sender and the Data Receiver of the configuration in
+ *    this process, e.g. over lo or a veth pair, at the rates of its pacing key
+ *  - db: inserts synthetic rows in the database of the configuration, in batches,
+ *    and queries the statistics of their positions
+ *
+ * The configuration file is /etc/wiperf.conf, or whatever -c says, so a bench
+ * setup (another database, other interfaces) doesn't have to touch the real one.
+ */
+
+#include <fcntl.h>     // O_RDWR, etc
+#include <poll.h>      // poll()
+#include <sys/mman.h>  // shm_open()
+#include <sys/stat.h>  // lstat()
+#include <unistd.h>    // write(), symlink()
+
+#include <algorithm>   // std::max, std::min
+#include <atomic>      // std::atomic
+#include <cerrno>      // errno
+#include <chrono>      // std::chrono::milliseconds
+#include <csignal>     // SIGTERM, etc
+#include <cstdlib>     // std::stoi
+#include <cstring>     // strerror()
+#include <ctime>       // clock_nanosleep()
+#include <fstream>     // std::ifstream
+#include <iostream>
+#include <random>      // std::mt19937
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BenchReport.hpp"
+#include "../dsender/DataSender.hpp"
+#include "../dreceiver/DataReceiver.hpp"
+#include "../channelMonitor/ChannelMonitor.hpp"
+#include "../channelMonitor/WifiInfoCodec.hpp"
+#include "../database/DatabaseManager.hpp"
+#include "../database/SpillFile.hpp"
+#include "../WiperfUtility.hpp"
+#include "../../mygpsd/gpsshm.hpp"
+#include "../../util/configfile.hpp"
+#include "../../util/logfile.hpp"
+
+#define CONFIG_FNAME "/etc/wiperf.conf"
+#define LOG_FNAME "/var/log/wiperfbench.log"
+
+#define NMEA_EPOCH_RATE_DEF 10     // epochs replayed per second
+#define NMEA_PUBLISH_TIMEOUT 1000  // ms to wait for mygpsd to publish an epoch
+#define TRANSFER_WARMUP_DEF 2      // s before the transfer counters are read
+#define DB_BATCH_LEN_DEF 256       // rows per transaction
+#define DB_QUERIES_DEF 200
+#define DB_QUERY_RADIUS 50         // m
+#define DB_ORIGIN_LAT 41.1780      // where the synthetic rows are (FEUP, Porto)
+#define DB_ORIGIN_LON -8.5980
+
+static std::atomic<bool> stopBench(false);
+static DataSender *dataSender = nullptr;
+static DataReceiver *dataReceiver = nullptr;
+
+/**
+ * Handle signals to terminate the program by stopping
+ * all threads.
+ */
+void sigHandler(int) {  // what a killer method!
+    stopBench = true;
+    if (dataSender) dataSender->stopThread();
+    if (dataReceiver) dataReceiver->stopThread();
+}
+
+static void sleepUntilNs(uint64_t ns) {
+    struct timespec ts;
+    ts.tv_sec = (time_t) (ns / 1000000000ULL);
+    ts.tv_nsec = (long) (ns % 1000000000ULL);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR && !stopBench) {}
+}
+
+// ------------- NMEA -------------
+
+/**
+ * Cuts the recording into epochs, each ending with its RMC sentence, as mygpsd
+ * folds them. Sentences after the last RMC are left out.
+ */
+static std::vector<std::string> readNmeaEpochs(const std::string &path) {
+    std::vector<std::string> epochs;
+    std::ifstream file(path);
+
+    std::string epoch;
+    for (std::string line; std::getline(file, line);) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.size() < 6 || line[0] != '$') continue;
+
+        epoch += line + "\r\n";
+        if (line.compare(3, 3, "RMC") == 0) {
+            epochs.push_back(epoch);
+            epoch.clear();
+        }
+    }
+
+    return epochs;
+}
+
+/**
+ * Opens a pseudo terminal and links its other end at linkPath, for mygpsd to open.
+ * @return the master side, -1 on error
+ */
+static int openReplayTerminal(const std::string &linkPath) {
+    int masterfd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (masterfd < 0 || grantpt(masterfd) < 0 || unlockpt(masterfd) < 0) {
+        std::cerr << "Can't open a pseudo terminal: " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    const char *slavePath = ptsname(masterfd);
+
+    // only a link left by an earlier run is replaced, never a real device
+    struct stat st;
+    if (lstat(linkPath.c_str(), &st) == 0) {
+        if (!S_ISLNK(st.st_mode)) {
+            std::cerr << linkPath << " exists and isn't a link" << std::endl;
+            close(masterfd);
+            return -1;
+        }
+        unlink(linkPath.c_str());
+    }
+
+    if (symlink(slavePath, linkPath.c_str()) < 0) {
+        std::cerr << "Can't link " << linkPath << " to " << slavePath << ": " << strerror(errno) << std::endl;
+        close(masterfd);
+        return -1;
+    }
+
+    std::cout << "Replaying through " << linkPath << " (" << slavePath << "), start mygpsd with "
+              << "serial-device = " << linkPath << std::endl;
+    return masterfd;
+}
+
+/**
+ * Waits for mygpsd to open the terminal and to be up on the shared memory segment.
+ */
+static GpsInfo *waitMygpsd(int masterfd, const std::string &shmPath) {
+    while (!stopBench) {
+        // the master hangs up while nobody has the other end open
+        struct pollfd pfd = {masterfd, POLLIN, 0};
+        poll(&pfd, 1, 0);
+
+        int shmfd = shm_open(shmPath.c_str(), O_RDONLY, 0);
+        if (shmfd >= 0) close(shmfd);
+
+        if (!(pfd.revents & POLLHUP) && shmfd >= 0) {
+            GpsInfo *gpsInfo = WiperfUtility::getGpsInfo(shmPath);
+            if (WiperfUtility::getCurrentGps(gpsInfo).daemonOn) return gpsInfo;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    return nullptr;
+}
+
+static int benchNmea(ConfigFile &cfile, const std::string &recording, const std::string &linkPath, int rate) {
+    std::vector<std::string> epochs = readNmeaEpochs(recording);
+    if (epochs.empty()) {
+        std::cerr << "No epochs (sentences up to an RMC) in " << recording << std::endl;
+        return 1;
+    }
+
+    int masterfd = openReplayTerminal(linkPath);
+    if (masterfd < 0) return 1;
+
+    GpsInfo *gpsInfo = waitMygpsd(masterfd, WiperfUtility::readGpsShmPath(cfile, GPS_SHM_PATH_DEF));
+
+    BenchReport report("nmea");
+    report.start();
+
+    const uint64_t startNs = BenchReport::monotonicNs();
+    const int timeout = rate > 0 ? std::max(1, 1000 / rate) : NMEA_PUBLISH_TIMEOUT;
+
+    for (size_t i = 0; gpsInfo && i < epochs.size() && !stopBench; i++) {
+        // on the epoch grid, or right after the previous one is published
+        if (rate > 0) sleepUntilNs(startNs + i * 1000000000ULL / rate);
+
+        const std::string &epoch = epochs[i];
+        uint32_t updates = gpsShmUpdates(gpsInfo);
+
+        if (write(masterfd, epoch.data(), epoch.size()) != (ssize_t) epoch.size()) {
+            std::cerr << "Can't write to the terminal: " << strerror(errno) << std::endl;
+            break;
+        }
+        const uint64_t writtenNs = BenchReport::monotonicNs();
+        report.addBytes(epoch.size());
+
+        if (WiperfUtility::waitGpsUpdate(gpsInfo, updates, timeout)) {
+            report.addTick(BenchReport::monotonicNs() - writtenNs);
+            report.addRows(1);
+        } else {
+            report.addMissed();
+        }
+    }
+
+    report.stop();
+    report.print(std::cout);
+
+    unlink(linkPath.c_str());
+    close(masterfd);
+    return 0;
+}
+
+// ------------- WIFIINFO -------------
+
+static int benchWifiInfo(ConfigFile &cfile, const std::string &spillPath, int repeat) {
+    bool csv = false;
+    try {
+        csv = cfile.Value("channel-monitor", "channel-info-csv") == "true";
+    } catch (std::exception const&) {
+        csv = false;
+    }
+
+    // decoded up front, so the file isn't part of the measurement
+    std::vector<DatabaseInfo> entries;
+    std::vector<WifiInfo> samples;
+    long nread = SpillFile::readAll(spillPath, [&](DatabaseInfo &databaseInfo) {
+        WifiInfo wifiInfo;
+        if (databaseInfo.channelInfoBin.empty() ||
+            !WifiInfoCodec::decode((const uint8_t *) databaseInfo.channelInfoBin.data(),
+                                   databaseInfo.channelInfoBin.size(), wifiInfo)) {
+            return;  // feedback entries
+        }
+
+        samples.push_back(wifiInfo);
+        entries.push_back(std::move(databaseInfo));
+    });
+
+    if (nread < 0) {
+        std::cerr << "Can't open " << spillPath << std::endl;
+        return 1;
+    }
+    if (samples.empty()) {
+        std::cerr << "No channel info samples in " << spillPath << std::endl;
+        return 1;
+    }
+
+    BenchReport report("wifiinfo");
+    report.start();
+
+    std::vector<DatabaseInfo> databaseInfoVector;
+    for (int r = 0; r < repeat && !stopBench; r++) {
+        // a tick is a sampling round, every radio with the same timestamp
+        for (size_t first = 0; first < samples.size();) {
+            const uint64_t tickNs = BenchReport::monotonicNs();
+
+            GpsFix fix{};
+            fix.lat = (float) entries[first].latitude;
+            fix.lon = (float) entries[first].longitude;
+            fix.speed = (float) entries[first].speed;
+            fix.head = (float) entries[first].orientation;
+
+            databaseInfoVector.clear();
+            size_t last = first;
+            for (; last < samples.size() && entries[last].timestamp == entries[first].timestamp; last++) {
+                databaseInfoVector.push_back(
+                        ChannelMonitor::toDatabaseInfo(samples[last], entries[last].timestamp, fix, csv));
+            }
+
+            report.addTick(BenchReport::monotonicNs() - tickNs);
+            report.addRows(last - first);
+            for (const DatabaseInfo &databaseInfo : databaseInfoVector) {
+                report.addBytes(databaseInfo.channelInfoBin.size() + databaseInfo.channelInfo.size());
+            }
+
+            first = last;
+        }
+    }
+
+    report.stop();
+    report.print(std::cout);
+    return 0;
+}
+
+// ------------- TRANSFER -------------
+
+static void sumCounters(IfaceCounters &counters, uint64_t &nbytes, uint64_t &npackets) {
+    nbytes = npackets = 0;
+    for (int slot = 0; slot < counters.size(); slot++) {
+        nbytes += counters.totalBytes(slot);
+        npackets += counters.totalPackets(slot);
+    }
+}
+
+static int benchTransfer(const std::string &configFname, int seconds, int warmup) {
+    DataReceiver receiver;
+    receiver.readConfig(configFname);
+    DataSender sender;
+    sender.readConfig(configFname);
+
+    dataReceiver = &receiver;
+    dataSender = &sender;
+
+    // the receiver first, so the first datagrams aren't refused
+    std::thread receiverThread(&DataReceiver::run, &receiver);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    std::thread senderThread(&DataSender::run, &sender);
+
+    for (int s = 0; s < warmup && !stopBench; s++) std::this_thread::sleep_for(std::chrono::seconds(1));
+
+    BenchReport txReport("transfer-tx"), rxReport("transfer-rx");
+    uint64_t txBytes0, txPackets0, rxBytes0, rxPackets0;
+    sumCounters(sender.getIfaceCounters(), txBytes0, txPackets0);
+    sumCounters(receiver.getIfaceCounters(), rxBytes0, rxPackets0);
+    txReport.start();
+    rxReport.start();
+
+    // a tick is a second, and its latency how late the counters were read
+    const uint64_t startNs = BenchReport::monotonicNs();
+    for (int s = 1; s <= seconds && !stopBench; s++) {
+        const uint64_t dueNs = startNs + (uint64_t) s * 1000000000ULL;
+        sleepUntilNs(dueNs);
+        const uint64_t lateNs = BenchReport::monotonicNs() - dueNs;
+        txReport.addTick(lateNs);
+        rxReport.addTick(lateNs);
+    }
+
+    uint64_t txBytes, txPackets, rxBytes, rxPackets;
+    sumCounters(sender.getIfaceCounters(), txBytes, txPackets);
+    sumCounters(receiver.getIfaceCounters(), rxBytes, rxPackets);
+    txReport.stop();
+    rxReport.stop();
+
+    sender.stopThread();
+    receiver.stopThread();
+    senderThread.join();
+    receiverThread.join();
+    dataSender = nullptr;
+    dataReceiver = nullptr;
+
+    // rows are datagrams, the ones sent and not received are missed
+    txReport.addBytes(txBytes - txBytes0);
+    txReport.addRows(txPackets - txPackets0);
+    rxReport.addBytes(rxBytes - rxBytes0);
+    rxReport.addRows(rxPackets - rxPackets0);
+    if (txPackets - txPackets0 > rxPackets - rxPackets0) {
+        rxReport.addMissed((txPackets - txPackets0) - (rxPackets - rxPackets0));
+    }
+
+    txReport.print(std::cout);
+    rxReport.print(std::cout);
+    return 0;
+}
+
+// ------------- DB -------------
+
+static int benchDb(ConfigFile &cfile, long nrows, int batchLen, int nqueries) {
+    if (nrows < 1 || batchLen < 1) {
+        std::cerr << "The rows and the rows per batch must be positive" << std::endl;
+        return 1;
+    }
+
+    DatabaseManager databaseManager;
+    databaseManager.configure(cfile);
+
+    // a sample of a radio, as the Channel Monitor stores it
+    WifiInfo wifiInfo{};
+    uint8_t codedWifiInfo[WIFI_INFO_BIN_LEN];
+    wifiInfo.ifname = "bench";
+    wifiInfo.signal = 256 - 60;
+    wifiInfo.tx_bitrate = 8667;
+    size_t codedLen = WifiInfoCodec::encode(wifiInfo, codedWifiInfo, sizeof(codedWifiInfo));
+
+    // a drive at about 50 km/h, three radios every 100 ms, at a time no real data has
+    std::mt19937 random(1);
+    std::uniform_int_distribution<uint32_t> throughput(0, 2000000000);
+    const char *rats[] = {"bench0", "bench1", "bench2"};
+    const uint64_t startMs = 4000000000000ULL;
+
+    std::vector<DatabaseInfo> rows((size_t) nrows);
+    for (long i = 0; i < nrows; i++) {
+        DatabaseInfo &row = rows[i];
+        const long step = i / 3;
+        row.timestamp = startMs + (uint64_t) step * 100;
+        row.rat = rats[i % 3];
+        row.latitude = DB_ORIGIN_LAT + DatabaseManager::metersToDecimalDegrees(1.4 * (double) step);
+        row.longitude = DB_ORIGIN_LON;
+        row.speed = 50;
+        row.orientation = 0;
+        row.moving = 1;
+        row.throughput = throughput(random);
+        row.numBits = row.throughput / 10;
+        row.feedback = true;
+        row.channelInfoBin.assign((const char *) codedWifiInfo, codedLen);
+        row.tx_bitrate = wifiInfo.tx_bitrate;
+        row.signal_strength = wifiInfo.signal - 256;
+    }
+
+    BenchReport insertReport("db-insert");
+    insertReport.start();
+
+    std::vector<DatabaseInfo> batch;
+    batch.reserve((size_t) batchLen);
+    for (size_t first = 0; first < rows.size() && !stopBench; first += batchLen) {
+        batch.assign(rows.begin() + first, rows.begin() + std::min(rows.size(), first + batchLen));
+
+        const uint64_t tickNs = BenchReport::monotonicNs();
+        if (databaseManager.createAll(batch)) {
+            insertReport.addTick(BenchReport::monotonicNs() - tickNs);
+            insertReport.addRows(batch.size());
+        } else {
+            insertReport.addMissed();
+        }
+    }
+
+    insertReport.stop();
+    insertReport.print(std::cout);
+
+    // the index is built on the first query otherwise
+    databaseManager.setupSpatialIndex();
+
+    BenchReport queryReport("db-query");
+    queryReport.start();
+
+    std::uniform_int_distribution<size_t> pick(0, rows.size() - 1);
+    for (int q = 0; q < nqueries && !rows.empty() && !stopBench; q++) {
+        const DatabaseInfo &row = rows[pick(random)];
+
+        const uint64_t tickNs = BenchReport::monotonicNs();
+        std::vector<RatStats> stats = databaseManager.retrieveStatsByPosition(
+                row.latitude, row.longitude, DB_QUERY_RADIUS);
+        queryReport.addTick(BenchReport::monotonicNs() - tickNs);
+
+        // rows are the history entries the statistics were made of
+        for (const RatStats &ratStats : stats) queryReport.addRows(ratStats.nsamples);
+        if (stats.empty()) queryReport.addMissed();
+    }
+
+    queryReport.stop();
+    queryReport.print(std::cout);
+    return 0;
+}
+
+static void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [-c <config-file>] <workload> ...\n"
+              << "  nmea <recording> <device-link> [<epochs-per-s> (0 for as fast as published)]\n"
+              << "  wifiinfo <spill-file> [<repeat>]\n"
+              << "  transfer <seconds> [<warmup-seconds>]\n"
+              << "  db <rows> [<rows-per-batch> [<queries>]]" << std::endl;
+}
+
+/**
+ * Runs the workload named in the arguments and prints its report.
+ */
+int main(int argc, char *argv[]) {
+    std::string configFname = CONFIG_FNAME;
+
+    std::vector<std::string> args(argv + 1, argv + argc);
+    if (args.size() >= 2 && args[0] == "-c") {
+        configFname = args[1];
+        args.erase(args.begin(), args.begin() + 2);
+    }
+
+    if (args.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    LOG_INIT(LOG_FNAME)
+
+    ConfigFile cfile(configFname);
+    WiperfUtility::readAndSetLogLevel(cfile, "wiperfbench");
+
+    signal(SIGINT, sigHandler);
+    signal(SIGTERM, sigHandler);
+    signal(SIGHUP, sigHandler);
+
+    int ret = 1;
+    try {
+        const std::string &workload = args[0];
+        if (workload == "nmea" && args.size() >= 3) {
+            ret = benchNmea(cfile, args[1], args[2], args.size() > 3 ? std::stoi(args[3]) : NMEA_EPOCH_RATE_DEF);
+        }
+        else if (workload == "wifiinfo" && args.size() >= 2) {
+            ret = benchWifiInfo(cfile, args[1], args.size() > 2 ? std::stoi(args[2]) : 1);
+        }
+        else if (workload == "transfer" && args.size() >= 2) {
+            ret = benchTransfer(configFname, std::stoi(args[1]),
+                                args.size() > 2 ? std::stoi(args[2]) : TRANSFER_WARMUP_DEF);
+        }
+        else if (workload == "db" && args.size() >= 2) {
+            ret = benchDb(cfile, std::stol(args[1]), args.size() > 2 ? std::stoi(args[2]) : DB_BATCH_LEN_DEF,
+                          args.size() > 3 ? std::stoi(args[3]) : DB_QUERIES_DEF);
+        }
+        else {
+            usage(argv[0]);
+        }
+    } catch (std::logic_error const&) {  // std::stoi()
+        usage(argv[0]);
+    } catch (std::exception const& e) {  // a required key missing from the configuration
+        std::cerr << "Config exception: " << e.what() << std::endl;
+    }
+
+    LOG_CLOSE()
+
+    return ret;
+}
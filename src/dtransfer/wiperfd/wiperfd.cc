@@ -0,0 +1,161 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * WiPerf daemon: runs the modules of dsender, dreceiver and channel_monitor in a
+ * single process. They share the GPS shared memory mapping, the database writer (and
+ * its connections and spill file), the log and the metrics exporter, instead of each
+ * process having its own.
+ */
+
+#include <csignal>   // SIGTERM, etc
+#include <iostream>
+#include <memory>    // std::unique_ptr
+#include <sstream>   // std::stringstream
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../dsender/DataSender.hpp"
+#include "../dsender/FeedbackReceiver.hpp"
+#include "../dreceiver/DataReceiver.hpp"
+#include "../dreceiver/FeedbackSender.hpp"
+#include "../channelMonitor/ChannelMonitor.hpp"
+#include "../../util/configfile.hpp"
+#include "../../util/configreloader.hpp"
+#include "../../util/logfile.hpp"
+#include "../../util/metrics.hpp"
+
+#define LOG_FNAME "/var/log/wiperfd.log"
+#define COMPONENTS_STR_DEF "data-sender, channel-monitor" // the mobile client
+
+static std::unique_ptr<DataSender> dataSender;
+static std::unique_ptr<FeedbackReceiver> feedbackReceiver;
+static std::unique_ptr<DataReceiver> dataReceiver;
+static std::unique_ptr<FeedbackSender> feedbackSender;
+static std::unique_ptr<ChannelMonitor> channelMonitor;
+
+/**
+ * Handle signals to terminate the program by stopping
+ * all threads.
+ */
+void sigHandler(int) {  // what a killer method!
+    if (dataSender) dataSender->stopThread();
+    if (feedbackReceiver) feedbackReceiver->stopThread();
+    if (dataReceiver) dataReceiver->stopThread();
+    if (feedbackSender) feedbackSender->stopThread();
+    if (channelMonitor) channelMonitor->stopThread();
+}
+
+/**
+ * @return the components to run: data-sender (with the feedback receiver),
+ * data-receiver (with the feedback sender) and channel-monitor
+ */
+static std::vector<std::string> readComponents(ConfigFile &cfile) {
+    std::string componentsStr = COMPONENTS_STR_DEF;
+    try {
+        componentsStr = cfile.Value("wiperfd", "components");
+    } catch (std::exception const&) {
+        componentsStr = COMPONENTS_STR_DEF;
+    }
+
+    std::vector<std::string> components;
+
+    // note: ">> std::ws" is used to remove whitespace
+    std::stringstream sstream(componentsStr);
+    for (std::string entry; std::getline(sstream >> std::ws, entry, ',');) {
+        entry.erase(entry.find_last_not_of(" \t") + 1);
+
+        if (entry != "data-sender" && entry != "data-receiver" && entry != "channel-monitor") {
+            std::stringstream ss;
+            ss << "Config exception: section=wiperfd, value=components. "
+               << "Unknown component " << entry << ". Ignoring.";
+            LOG_ERR(ss.str().c_str());
+            continue;
+        }
+
+        components.push_back(entry);
+    }
+
+    if (components.empty()) {
+        LOG_FATAL_EXIT("Config exception: section=wiperfd, value=components. No valid component provided");
+    }
+
+    return components;
+}
+
+/**
+ * Sets up the components named in the configuration and runs them until a signal
+ * ends the program.
+ */
+int main(int argc, char* argv[]) {
+    LOG_INIT(LOG_FNAME)
+
+    ConfigFile cfile(CONFIG_FNAME);
+
+    for (const std::string &component : readComponents(cfile)) {
+        if (component == "data-sender") {
+            dataSender.reset(new DataSender());
+            dataSender->readConfig(CONFIG_FNAME);
+            feedbackReceiver.reset(new FeedbackReceiver());
+            feedbackReceiver->readConfig(CONFIG_FNAME);
+        }
+        else if (component == "data-receiver") {
+            dataReceiver.reset(new DataReceiver());
+            dataReceiver->readConfig(CONFIG_FNAME);
+            feedbackSender.reset(new FeedbackSender(dataReceiver.get()));
+            feedbackSender->readConfig(CONFIG_FNAME);
+        }
+        else if (component == "channel-monitor") {
+            channelMonitor.reset(new ChannelMonitor(CONFIG_FNAME));
+        }
+    }
+
+    // every module set the level of its own section, the daemon has the last word
+    WiperfUtility::readAndSetLogLevel(cfile, "wiperfd");
+
+    MetricsExporter metricsExporter;
+    metricsExporter.start(WiperfUtility::readMetricsEndpoint(cfile, "wiperfd"));
+
+    signal(SIGINT, sigHandler);
+    signal(SIGTERM, sigHandler);
+
+    //SIGHUP reloads the configuration, in the order it was read on start
+    ConfigReloader *reloader = ConfigReloader::getInstance();
+    if (dataSender) reloader->addListener([](ConfigFile &cfile) { dataSender->reloadConfig(cfile); });
+    if (feedbackReceiver) reloader->addListener([](ConfigFile &cfile) { feedbackReceiver->reloadConfig(cfile); });
+    if (dataReceiver) reloader->addListener([](ConfigFile &cfile) { dataReceiver->reloadConfig(cfile); });
+    if (feedbackSender) reloader->addListener([](ConfigFile &cfile) { feedbackSender->reloadConfig(cfile); });
+    if (channelMonitor) reloader->addListener([](ConfigFile &cfile) { channelMonitor->reloadConfig(cfile); });
+    reloader->addListener([](ConfigFile &cfile) { WiperfUtility::readAndSetLogLevel(cfile, "wiperfd"); });
+    reloader->start(CONFIG_FNAME);
+    signal(SIGHUP, ConfigReloader::signalHandler);
+
+    std::vector<std::thread> threads;
+    if (dataSender) threads.emplace_back(&DataSender::run, dataSender.get());
+    if (feedbackReceiver) threads.emplace_back(&FeedbackReceiver::run, feedbackReceiver.get());
+    if (dataReceiver) threads.emplace_back(&DataReceiver::run, dataReceiver.get());
+    if (feedbackSender) threads.emplace_back(&FeedbackSender::run, feedbackSender.get());
+    if (channelMonitor) threads.emplace_back(&ChannelMonitor::run, channelMonitor.get());
+
+    std::cout << "[INFO] Threads start running" << std::endl;
+
+    for (std::thread &thread : threads) thread.join();
+
+    reloader->stop();
+    metricsExporter.stop();
+
+    std::cout << "[INFO] Threads finish running" << std::endl;
+
+    // the feedback sender reads the data receiver, and the writer outlives its users
+    feedbackSender.reset();
+    dataReceiver.reset();
+    feedbackReceiver.reset();
+    dataSender.reset();
+    channelMonitor.reset();
+
+    LOG_CLOSE()
+
+    return 0;
+}
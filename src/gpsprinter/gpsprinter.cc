@@ -17,11 +17,12 @@
 #include <sstream>    // std::stringstream
 #include <string>     // std::string, std::stoi
 #include <iostream>   // std::cout
-#include <pthread.h>  // pthread_mutex_lock, etc
+#include <pthread.h>  // pthread_create()
 
 #include "../util/configfile.hpp" // class ConfigFile
 #include "../util/logfile.hpp"    // class LogFile and LOG_* macros
 #include "../mygpsd/gpsinfo.hpp"  // struct GpsInfo
+#include "../mygpsd/gpsshm.hpp"   // gpsShmRead(), etc
 
 #define LOG_FNAME "/var/log/gpsprinter.log"
 #define CONFIG_FNAME "/etc/wiperf.conf"
@@ -106,6 +107,9 @@ void *printerThread(void *arg) {
                                        gpsShmfd, 0)) == MAP_FAILED)
         LOG_FATAL_PERROR_EXIT("gpsInfo nmap()");
 
+    if (!gpsShmCompatible(gpsInfoShm))
+        LOG_FATAL_EXIT("gpsInfo shared memory has a different layout, restart mygpsd");
+
     LOG_MSG("gpsprinter up and running");
 
     // print header line with format
@@ -114,39 +118,42 @@ void *printerThread(void *arg) {
 
     // main loop
     unsigned long long niters = 0;
+    uint32_t updates = gpsShmUpdates(gpsInfoShm);
+    GpsInfo gpsInfo;
     while (!endProgram_) {
 
         // check limit. recall we want nprints == -1 to mean limitless printing
         if (niters == config->nprints) break; // stop if limit hit, but not if over
         else niters++;
 
-        if (pthread_mutex_lock(&gpsInfoShm->mutex)) // try to access region
-            LOG_FATAL_PERROR_EXIT("printerThread pthread_mutex_lock()");
-
-        /* note on behavior: call to cond_wait unlocks mutex then blocks
-           on condition. when condition is signaled, mutex is auto-locked. */
-        if (pthread_cond_wait(&gpsInfoShm->updateCond, &gpsInfoShm->mutex))
-            LOG_FATAL_PERROR_EXIT("printerThread pthread_cond_wait()");
-
-        if (gpsInfoShm->daemonOn) { // daemon is live, print the info
-            std::cout << gpsInfoShm->gpstime << ", " <<
-                      gpsInfoShm->systime << ", " <<
-                      gpsInfoShm->lat << ", " <<
-                      gpsInfoShm->lon << ", " <<
-                      gpsInfoShm->alt << ", " <<
-                      gpsInfoShm->speed << ", " <<
-                      gpsInfoShm->head << ", " <<
-                      gpsInfoShm->head_mag << ", " <<
-                      (unsigned) gpsInfoShm->fix << ", " <<
-                      (unsigned) gpsInfoShm->nsats << ", " <<
-                      (unsigned) gpsInfoShm->qual << ", " <<
-                      gpsInfoShm->hdop << ", " <<
-                      gpsInfoShm->vdop << ", " <<
-                      gpsInfoShm->pdop << std::endl;
-        } else endProgram_ = true; // daemon is gone, we'd better leave too
+        /* block until mygpsd announces new info; the timeout only serves to
+           notice the signals */
+        if (!gpsShmWaitUpdate(gpsInfoShm, &updates, 1000)) {
+            niters--;
+            continue;
+        }
 
-        if (pthread_mutex_unlock(&gpsInfoShm->mutex)) // let others go
-            LOG_FATAL_PERROR_EXIT("printerThread pthread_mutex_unlock()");
+        if (!gpsShmRead(gpsInfoShm, &gpsInfo)) {
+            LOG_WARN("gpsInfo shared memory stuck mid-update");
+            continue;
+        }
+
+        if (gpsInfo.daemonOn) { // daemon is live, print the info
+            std::cout << gpsInfo.gpstime << ", " <<
+                      gpsInfo.systime << ", " <<
+                      gpsInfo.lat << ", " <<
+                      gpsInfo.lon << ", " <<
+                      gpsInfo.alt << ", " <<
+                      gpsInfo.speed << ", " <<
+                      gpsInfo.head << ", " <<
+                      gpsInfo.head_mag << ", " <<
+                      (unsigned) gpsInfo.fix << ", " <<
+                      (unsigned) gpsInfo.nsats << ", " <<
+                      (unsigned) gpsInfo.qual << ", " <<
+                      gpsInfo.hdop << ", " <<
+                      gpsInfo.vdop << ", " <<
+                      gpsInfo.pdop << std::endl;
+        } else endProgram_ = true; // daemon is gone, we'd better leave too
     }
 
     // no cleanup needed
@@ -14,10 +14,19 @@
 #define GPS_INFO_H__
 
 #include <stdint.h> // uint*_t typedefs
-#include <pthread.h> // pthread_cond_t
+
+#define GPS_SHM_LAYOUT_VERSION 3 // bumped whenever the layout of the segment changes
+#define GPS_HISTORY_LEN 128      // recent fixes kept in the segment, 12.8 s at 10 Hz
 
 // store gps information
 struct GpsInfo {
+    /* shared memory header, see gpsshm.hpp. Only meaningful in the segment itself,
+       a copy read by a consumer carries whatever values they had at the time */
+    uint32_t layoutVersion; // GPS_SHM_LAYOUT_VERSION, set by mygpsd once the segment is ready
+    uint32_t seq;           // seqlock sequence, odd while mygpsd is updating the fields below
+    uint32_t updates;       // futex word, incremented after every update
+    uint32_t waiters;       // consumers blocked waiting for an update
+
     uint64_t systime; // in millis
     uint32_t gpstime; // in seconds
 
@@ -39,10 +48,36 @@ struct GpsInfo {
 
     // extra info for inter-process communication
     bool daemonOn;
-    pthread_mutex_t mutex; // exclusive access
-    pthread_cond_t updateCond; // supports update notification
 };
 
 typedef struct GpsInfo GpsInfo;
 
+// a timestamped position, as kept in the history
+struct GpsFix {
+    uint32_t seq;     // per-slot seqlock sequence, see gpsshm.hpp
+    uint32_t index;   // position in the sequence of fixes, to tell overwritten slots apart
+
+    uint64_t systime; // in millis
+    uint32_t gpstime; // in seconds
+    uint8_t fix;      // as in GpsInfo
+
+    float lat;   // decimal degrees
+    float lon;   // decimal degrees
+    float alt;   // meters
+    float speed; // km/h
+    float head;  // degrees from true north
+};
+
+typedef struct GpsFix GpsFix;
+
+// ring of the recent fixes, right after the GpsInfo in the shared memory segment
+struct GpsHistory {
+    uint32_t count; // fixes published so far, fix i is in slot i % GPS_HISTORY_LEN
+    GpsFix fixes[GPS_HISTORY_LEN];
+};
+
+typedef struct GpsHistory GpsHistory;
+
+#define GPS_SHM_SIZE (sizeof(GpsInfo) + sizeof(GpsHistory))
+
 #endif
@@ -0,0 +1,297 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "gpsparse.hpp"
+
+#define KNOTS_TO_KMH 1.852f
+#define MMS_TO_KMH 0.0036f
+
+// a field of a sentence, in place (not NUL terminated)
+struct NmeaField {
+    const char *p;
+    size_t len;
+};
+typedef struct NmeaField NmeaField;
+
+// relevant NMEA sentences
+enum NmeaType {
+    Rmc, Gga, Gsa, Vtg, Other
+};
+typedef enum NmeaType NmeaType;
+
+/* field parsing start */
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+/**
+ * Parses n digits starting at pos of the field, e.g., the minutes in hhmmss.
+ */
+static bool fieldDigits(const NmeaField &f, size_t pos, size_t n, int *out) {
+    if (pos + n > f.len) return false;
+
+    int value = 0;
+    for (size_t i = pos; i < pos + n; i++) {
+        if (f.p[i] < '0' || f.p[i] > '9') return false;
+        value = value * 10 + (f.p[i] - '0');
+    }
+
+    *out = value;
+    return true;
+}
+
+static bool fieldInt(const NmeaField &f, int *out) {
+    return f.len > 0 && f.len < 10 && fieldDigits(f, 0, f.len, out);
+}
+
+/**
+ * Parses [-+]digits[.digits], the only number format in NMEA.
+ */
+static bool fieldDouble(const NmeaField &f, double *out) {
+    size_t i = 0;
+    bool negative = false;
+    if (i < f.len && (f.p[i] == '-' || f.p[i] == '+')) negative = f.p[i++] == '-';
+
+    uint64_t mantissa = 0;
+    uint64_t scale = 1;
+    int ndigits = 0;
+    bool fraction = false;
+    for (; i < f.len; i++) {
+        const char c = f.p[i];
+        if (c == '.' && !fraction) {
+            fraction = true;
+        } else if (c >= '0' && c <= '9') {
+            if (++ndigits > 18) return false; // would overflow, no sane NMEA field gets here
+            mantissa = mantissa * 10 + (c - '0');
+            if (fraction) scale *= 10;
+        } else return false;
+    }
+    if (ndigits == 0) return false;
+
+    const double value = (double) mantissa / (double) scale;
+    *out = negative ? -value : value;
+    return true;
+}
+
+static bool fieldFloat(const NmeaField &f, float *out) {
+    double value;
+    if (!fieldDouble(f, &value)) return false;
+    *out = (float) value;
+    return true;
+}
+
+/**
+ * Parses a (d)ddmm.mmmm coordinate and its hemisphere into decimal degrees.
+ */
+static bool fieldCoord(const NmeaField &f, const NmeaField &hemi, char positive, char negative, float *out) {
+    double value;
+    if (hemi.len != 1 || !fieldDouble(f, &value) || value < 0) return false;
+
+    const int degrees = (int) (value / 100);
+    const double decimal = degrees + (value - degrees * 100) / 60.0;
+
+    if (hemi.p[0] == positive) *out = (float) decimal;
+    else if (hemi.p[0] == negative) *out = (float) -decimal;
+    else return false;
+
+    return true;
+}
+
+/**
+ * Validates the checksum and splits the sentence into fields, in a single pass.
+ * Field 0 is the address (e.g., GPRMC); the fields that don't exist are left empty.
+ * @return false if the checksum is missing or wrong
+ */
+static bool nmeaSplit(const char *s, size_t len, NmeaField fields[NMEA_MAX_FIELDS]) {
+    if (len < 4 || s[0] != '$') return false;
+
+    uint8_t sum = 0;
+    int nfields = 0;
+    const char *fieldStart = s + 1;
+    size_t i = 1;
+    for (; i < len && s[i] != '*'; i++) {
+        sum ^= (uint8_t) s[i];
+        if (s[i] == ',') {
+            if (nfields < NMEA_MAX_FIELDS) fields[nfields++] = {fieldStart, (size_t) (s + i - fieldStart)};
+            fieldStart = s + i + 1;
+        }
+    }
+    if (nfields < NMEA_MAX_FIELDS) fields[nfields++] = {fieldStart, (size_t) (s + i - fieldStart)};
+
+    // '*' and two hex digits must end the sentence
+    if (i + 3 != len) return false;
+    const int hi = hexValue(s[i + 1]), lo = hexValue(s[i + 2]);
+    if (hi < 0 || lo < 0 || ((hi << 4) | lo) != sum) return false;
+
+    for (; nfields < NMEA_MAX_FIELDS; nfields++) fields[nfields] = {s, 0};
+    return true;
+}
+
+/**
+ * The type from the address, whatever the talker (GP -> GPS, GN -> GNSS, GL -> GLONASS, etc).
+ */
+static NmeaType nmeaType(const NmeaField &address) {
+    if (address.len != 5) return Other;
+
+    const char *type = address.p + 2;
+    if (type[0] == 'R' && type[1] == 'M' && type[2] == 'C') return Rmc;
+    if (type[0] == 'G' && type[1] == 'G' && type[2] == 'A') return Gga;
+    if (type[0] == 'G' && type[1] == 'S' && type[2] == 'A') return Gsa;
+    if (type[0] == 'V' && type[1] == 'T' && type[2] == 'G') return Vtg;
+    return Other;
+}
+
+/* field parsing end */
+
+uint32_t utcSeconds(int year, int month, int day, int hour, int min, int sec) {
+    if (year < 1970 || month < 1 || month > 12 || day < 1 || day > 31
+        || hour > 23 || min > 59 || sec > 60)
+        return 0;
+
+    // days since 1970-01-01 in the proleptic Gregorian calendar, with years starting in March
+    const int y = year - (month <= 2);
+    const int era = y / 400;
+    const int yoe = y - era * 400;
+    const int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    const int64_t days = (int64_t) era * 146097 + doe - 719468;
+
+    return (uint32_t) (days * 86400 + hour * 3600 + min * 60 + sec);
+}
+
+GpsParse nmeaParse(const char *sentence, size_t len, GpsInfo *info) {
+    NmeaField fields[NMEA_MAX_FIELDS];
+    if (!nmeaSplit(sentence, len, fields)) return GpsParseBad;
+
+    int value;
+    switch (nmeaType(fields[0])) {
+
+        case Rmc: {
+            // time hhmmss.ss in position 1 and date ddmmyy in position 9, both UTC
+            int hh, mm, ss, dd, mo, yy;
+            if (fieldDigits(fields[1], 0, 2, &hh) && fieldDigits(fields[1], 2, 2, &mm)
+                && fieldDigits(fields[1], 4, 2, &ss) && fieldDigits(fields[9], 0, 2, &dd)
+                && fieldDigits(fields[9], 2, 2, &mo) && fieldDigits(fields[9], 4, 2, &yy))
+                info->gpstime = utcSeconds(2000 + yy, mo, dd, hh, mm, ss);
+            else info->gpstime = 0;
+
+            // A stands for Active and V stands for Void
+            if (fields[2].len == 1 && fields[2].p[0] == 'A') {
+                fieldCoord(fields[3], fields[4], 'N', 'S', &info->lat);
+                fieldCoord(fields[5], fields[6], 'E', 'W', &info->lon);
+
+                if (fieldFloat(fields[7], &info->speed)) info->speed *= KNOTS_TO_KMH;
+                fieldFloat(fields[8], &info->head);
+            }
+
+            /* we assume the RMC tag is always the last one (from experiments and
+               online doc, this is usually the case) */
+            return GpsParseEpoch;
+        }
+
+        case Gga:
+            fieldCoord(fields[2], fields[3], 'N', 'S', &info->lat);
+            fieldCoord(fields[4], fields[5], 'E', 'W', &info->lon);
+
+            if (fieldInt(fields[6], &value)) info->qual = (uint8_t) value;
+            if (fieldInt(fields[7], &value)) info->nsats = (uint8_t) value;
+            fieldFloat(fields[8], &info->hdop);
+            fieldFloat(fields[9], &info->alt);
+            return GpsParseUpdated;
+
+        case Vtg:
+            // course true in 1, magnetic in 3, speed in knots in 5 and in km/h in 7
+            fieldFloat(fields[1], &info->head);
+            fieldFloat(fields[3], &info->head_mag);
+            if (!fieldFloat(fields[7], &info->speed) && fieldFloat(fields[5], &info->speed))
+                info->speed *= KNOTS_TO_KMH;
+            return GpsParseUpdated;
+
+        case Gsa:
+            if (fieldInt(fields[2], &value)) info->fix = (uint8_t) value; // 1=nofix, 2=2D, 3=3D
+
+            // the 12 satellite ids come before the dilutions
+            fieldFloat(fields[15], &info->pdop);
+            fieldFloat(fields[16], &info->hdop);
+            fieldFloat(fields[17], &info->vdop);
+            return GpsParseUpdated;
+
+        default:
+            return GpsParseIgnored;
+    }
+}
+
+/* UBX start, all fields are little endian and possibly unaligned */
+
+static uint16_t ubxU2(const uint8_t *p) {
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static uint32_t ubxU4(const uint8_t *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static int32_t ubxI4(const uint8_t *p) {
+    return (int32_t) ubxU4(p);
+}
+
+#define UBX_NAV_DOP_LEN 18
+#define UBX_NAV_PVT_LEN_MIN 84 // u-blox 7, later versions append fields
+#define UBX_NAV_PVT_LEN_MAG 92 // with the magnetic declination
+
+GpsParse ubxParse(uint8_t ubxClass, uint8_t ubxId, const uint8_t *p, size_t len, GpsInfo *info) {
+    if (ubxClass != UBX_CLASS_NAV) return GpsParseIgnored;
+
+    if (ubxId == UBX_ID_NAV_DOP) {
+        if (len < UBX_NAV_DOP_LEN) return GpsParseBad;
+
+        info->pdop = ubxU2(p + 6) * 0.01f;
+        info->vdop = ubxU2(p + 10) * 0.01f;
+        info->hdop = ubxU2(p + 12) * 0.01f;
+        return GpsParseUpdated;
+    }
+
+    if (ubxId != UBX_ID_NAV_PVT) return GpsParseIgnored;
+    if (len < UBX_NAV_PVT_LEN_MIN) return GpsParseBad;
+
+    const uint8_t valid = p[11];
+    if ((valid & 0x03) == 0x03) // validDate and validTime
+        info->gpstime = utcSeconds(ubxU2(p + 4), p[6], p[7], p[8], p[9], p[10]);
+    else info->gpstime = 0;
+
+    // fixType 2=2D, 3=3D, 4=GNSS+dead reckoning; the rest isn't a position fix
+    const uint8_t fixType = p[20];
+    const bool fixOk = p[21] & 0x01;
+    const uint8_t carrier = (p[21] >> 6) & 0x03; // RTK solution, 1=float, 2=fixed
+    info->fix = !fixOk ? 1 : fixType == 2 ? 2 : (fixType == 3 || fixType == 4) ? 3 : 1;
+    info->qual = !fixOk ? 0 : carrier == 2 ? 4 : carrier == 1 ? 5 : 1;
+    info->nsats = p[23];
+    info->pdop = ubxU2(p + 76) * 0.01f;
+
+    if (fixOk) {
+        info->lon = ubxI4(p + 24) * 1e-7f;
+        info->lat = ubxI4(p + 28) * 1e-7f;
+        info->alt = ubxI4(p + 36) * 0.001f; // above mean sea level, as in GGA
+        info->speed = ubxI4(p + 60) * MMS_TO_KMH;
+        info->head = ubxI4(p + 64) * 1e-5f;
+
+        if (len >= UBX_NAV_PVT_LEN_MAG && (valid & 0x08)) { // validMag
+            float headMag = info->head - (int16_t) ubxU2(p + 88) * 0.01f;
+            if (headMag < 0) headMag += 360;
+            else if (headMag >= 360) headMag -= 360;
+            info->head_mag = headMag;
+        }
+    }
+
+    return GpsParseEpoch;
+}
+
+/* UBX end */
@@ -0,0 +1,57 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Parsers for the frames cut by GpsReader.
+ *
+ * NMEA sentences are validated and split into fields in a single pass, without copies
+ * nor allocations, and the numbers are parsed straight from the fields. A fix spans
+ * several sentences of the same epoch, which are folded into one GpsInfo until the
+ * RMC, the last sentence of the epoch, completes it.
+ *
+ * The UBX NAV-PVT message of u-blox receivers carries a whole fix on its own, and can
+ * be enabled instead of (or on top of) NMEA for higher rates. NAV-DOP, if enabled too,
+ * fills in the dilutions of precision that NAV-PVT lacks.
+ */
+
+#ifndef GPS_PARSE_H__
+#define GPS_PARSE_H__
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint*_t typedefs
+
+#include "gpsinfo.hpp" // GpsInfo struct
+
+#define NMEA_MAX_FIELDS 30
+
+#define UBX_CLASS_NAV 0x01
+#define UBX_ID_NAV_DOP 0x04
+#define UBX_ID_NAV_PVT 0x07
+
+enum GpsParse {
+    GpsParseBad,     // checksum failed or malformed
+    GpsParseIgnored, // valid, but nothing we use
+    GpsParseUpdated, // some fields were updated
+    GpsParseEpoch    // the fix is complete and can be published
+};
+typedef enum GpsParse GpsParse;
+
+/**
+ * Folds an NMEA sentence (RMC, GGA, GSA or VTG, from any talker) into the fix.
+ * @param sentence from '$' to the checksum, without CR/LF
+ */
+GpsParse nmeaParse(const char *sentence, size_t len, GpsInfo *info);
+
+/**
+ * Folds a UBX message (NAV-PVT or NAV-DOP) into the fix.
+ * @param payload the payload of a frame whose checksum was already verified
+ */
+GpsParse ubxParse(uint8_t ubxClass, uint8_t ubxId, const uint8_t *payload, size_t len, GpsInfo *info);
+
+/**
+ * @return the UTC date and time as seconds since the epoch, 0 if out of range
+ */
+uint32_t utcSeconds(int year, int month, int day, int hour, int min, int sec);
+
+#endif
@@ -0,0 +1,144 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ */
+
+#include "gpsreader.hpp"
+
+#include <errno.h>
+#include <fcntl.h>   // open(), O_RDONLY, etc
+#include <poll.h>    // poll()
+#include <string.h>  // memchr(), memmove()
+#include <termios.h> // tcgetattr(), cfmakeraw(), etc
+#include <unistd.h>  // read(), close()
+
+#include "../util/logfile.hpp" // LOG_* macros
+
+#define UBX_SYNC1 0xB5
+#define UBX_SYNC2 0x62
+#define UBX_HEADER_LEN 6 // sync, class, id, length
+#define UBX_FRAME_LEN(payload) (UBX_HEADER_LEN + (payload) + 2)
+
+GpsReader::GpsReader() : fd(-1), buf(), start(0), end(0) {
+}
+
+GpsReader::~GpsReader() {
+    if (this->fd >= 0) ::close(this->fd);
+}
+
+bool GpsReader::open(const std::string &device) {
+    if ((this->fd = ::open(device.c_str(), O_RDONLY | O_NOCTTY | O_NONBLOCK)) < 0) return false;
+
+    // not a terminal (e.g., a recorded log in a fifo), nothing to set up
+    struct termios tio;
+    if (tcgetattr(this->fd, &tio) < 0) return true;
+
+    /* raw mode: no line editing nor CR/LF translation, which would mangle UBX frames.
+       read() returns what is there right away, the waiting is done by poll() */
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    if (tcsetattr(this->fd, TCSANOW, &tio) < 0) return false;
+
+    tcflush(this->fd, TCIFLUSH); // whatever queued up before we came is stale
+    return true;
+}
+
+bool GpsReader::cutFrame(GpsFrame &frame) {
+    while (this->start < this->end) {
+        const char *p = this->buf + this->start;
+        const size_t avail = this->end - this->start;
+
+        if (*p == '$') {
+            const size_t maxLine = NMEA_MAX_LEN + 2; // CR LF
+            const char *nl = (const char *) memchr(p, '\n', avail < maxLine ? avail : maxLine);
+            if (!nl) {
+                if (avail < maxLine) return false; // wait for the rest of the line
+                this->start++; // too long, resync
+                continue;
+            }
+
+            size_t len = nl - p;
+            if (len > 0 && p[len - 1] == '\r') len--;
+
+            frame.type = FrameNmea;
+            frame.data = p;
+            frame.len = len;
+            this->start += nl - p + 1;
+            return true;
+        }
+
+        if ((uint8_t) *p == UBX_SYNC1) {
+            if (avail < 2) return false;
+            if ((uint8_t) p[1] != UBX_SYNC2) {
+                this->start++;
+                continue;
+            }
+            if (avail < UBX_HEADER_LEN) return false;
+
+            const size_t len = (uint8_t) p[4] | ((size_t) (uint8_t) p[5] << 8);
+            if (len > UBX_MAX_PAYLOAD) {
+                this->start++;
+                continue;
+            }
+            if (avail < UBX_FRAME_LEN(len)) return false;
+
+            // 8-bit Fletcher checksum over class, id, length and payload
+            uint8_t cka = 0, ckb = 0;
+            for (size_t i = 2; i < UBX_HEADER_LEN + len; i++) {
+                cka += (uint8_t) p[i];
+                ckb += cka;
+            }
+            if (cka != (uint8_t) p[UBX_HEADER_LEN + len] || ckb != (uint8_t) p[UBX_HEADER_LEN + len + 1]) {
+                LOG_WARN("read ubx checksum failed");
+                this->start++;
+                continue;
+            }
+
+            frame.type = FrameUbx;
+            frame.data = p + UBX_HEADER_LEN;
+            frame.len = len;
+            frame.ubxClass = (uint8_t) p[2];
+            frame.ubxId = (uint8_t) p[3];
+            this->start += UBX_FRAME_LEN(len);
+            return true;
+        }
+
+        this->start++; // between frames
+    }
+
+    return false;
+}
+
+int GpsReader::fill(int timeout) {
+    // keep the partial frame at the front, so frames are always contiguous
+    if (this->start > 0) {
+        memmove(this->buf, this->buf + this->start, this->end - this->start);
+        this->end -= this->start;
+        this->start = 0;
+    }
+
+    struct pollfd pfd = {this->fd, POLLIN, 0};
+    int ret = poll(&pfd, 1, timeout);
+    if (ret == 0 || (ret < 0 && errno == EINTR)) return 0;
+    if (ret < 0) return -1;
+
+    ssize_t nread = read(this->fd, this->buf + this->end, GPS_READ_BUFLEN - this->end);
+    if (nread < 0) return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+    if (nread == 0) return -1; // device gone
+
+    this->end += nread;
+    return 1;
+}
+
+int GpsReader::next(GpsFrame &frame, int timeout) {
+    while (!this->cutFrame(frame)) {
+        int ret = this->fill(timeout);
+        if (ret <= 0) return ret;
+    }
+
+    return 1;
+}
@@ -0,0 +1,80 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Buffered reader for the serial GPS device.
+ *
+ * The device is read in bulk, whatever the driver has queued, into a buffer from which
+ * complete frames are cut in place: NMEA sentences ('$' up to the end of line) and
+ * UBX binary messages (0xB5 0x62 sync, checksum verified). Frames point into the
+ * buffer, so nothing is copied, and stay valid until the next call to next().
+ */
+
+#ifndef GPS_READER_H__
+#define GPS_READER_H__
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint*_t typedefs
+
+#include <string> // std::string
+
+#define GPS_READ_BUFLEN 4096    // must fit the longest frame
+#define NMEA_MAX_LEN 100        // longer lines are garbage (the standard says 82)
+#define UBX_MAX_PAYLOAD 1024    // longer payloads are garbage
+
+enum GpsFrameType {
+    FrameNmea, FrameUbx
+};
+typedef enum GpsFrameType GpsFrameType;
+
+struct GpsFrame {
+    GpsFrameType type;
+    const char *data; // NMEA: the sentence from '$', without CR/LF; UBX: the payload
+    size_t len;
+    uint8_t ubxClass; // UBX only
+    uint8_t ubxId;    // UBX only
+};
+typedef struct GpsFrame GpsFrame;
+
+class GpsReader {
+private:
+    int fd;
+    char buf[GPS_READ_BUFLEN];
+    size_t start; // first byte not consumed yet
+    size_t end;   // one past the last byte read
+
+    /**
+     * Cuts the next complete frame out of the buffer, skipping garbage.
+     * @return false if more bytes are needed
+     */
+    bool cutFrame(GpsFrame &frame);
+
+    /**
+     * Waits for the device and appends whatever it has to the buffer.
+     * @return 1 if bytes were read, 0 on timeout or signal, -1 on error or end of file
+     */
+    int fill(int timeout);
+
+public:
+    GpsReader();
+    ~GpsReader();
+
+    GpsReader(const GpsReader &) = delete;
+    GpsReader &operator=(const GpsReader &) = delete;
+
+    /**
+     * Opens the device. Terminals are put in raw mode, so binary frames go through.
+     * @return false on error, with errno set
+     */
+    bool open(const std::string &device);
+
+    /**
+     * Returns the next frame, reading from the device when the buffer runs out.
+     * @param timeout ms to wait for the device
+     * @return 1 if a frame was returned, 0 on timeout or signal, -1 on error or end of file
+     */
+    int next(GpsFrame &frame, int timeout);
+};
+
+#endif
@@ -0,0 +1,201 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Lock-free access to the GpsInfo shared memory segment.
+ *
+ * The segment is a seqlock: mygpsd (the only writer) makes the sequence odd, updates
+ * the fields and makes it even again, without ever waiting on a consumer. Consumers
+ * copy the fields and retry if the sequence changed or was odd meanwhile, so they
+ * never write to the segment and one dying can't block anybody else.
+ *
+ * New fixes are announced through a futex on the updates counter, which consumers
+ * can wait on instead of polling. mygpsd only issues the wake-up syscall when some
+ * consumer is actually waiting.
+ *
+ * The history ring that follows GpsInfo has a seqlock per slot, so a reader looking
+ * up an old fix only ever retries when it races the writer on that very slot.
+ */
+
+#ifndef GPS_SHM_H__
+#define GPS_SHM_H__
+
+#include <stddef.h>        // offsetof
+#include <string.h>        // memcpy
+#include <time.h>          // struct timespec
+#include <sched.h>         // sched_yield()
+#include <unistd.h>        // syscall()
+#include <sys/syscall.h>   // SYS_futex
+#include <linux/futex.h>   // FUTEX_WAIT, FUTEX_WAKE
+#include <limits.h>        // INT_MAX
+
+#include "gpsinfo.hpp" // GpsInfo struct
+
+#define GPS_SHM_READ_SPINS 1000 // retries before a reader gives up on a stuck writer
+
+// the fields protected by the seqlock, from systime to the end of the struct
+#define GPS_INFO_DATA_OFFSET offsetof(GpsInfo, systime)
+#define GPS_INFO_DATA_LEN (sizeof(GpsInfo) - GPS_INFO_DATA_OFFSET)
+
+/**
+ * Initializes a freshly mapped segment. Must be called by mygpsd before any update.
+ */
+inline void gpsShmInit(GpsInfo *shm) {
+    memset(shm, 0, GPS_SHM_SIZE);
+    __atomic_store_n(&shm->layoutVersion, (uint32_t) GPS_SHM_LAYOUT_VERSION, __ATOMIC_RELEASE);
+}
+
+/**
+ * @return true if the segment was initialized with the layout this program was built with
+ */
+inline bool gpsShmCompatible(const GpsInfo *shm) {
+    return __atomic_load_n(&shm->layoutVersion, __ATOMIC_ACQUIRE) == GPS_SHM_LAYOUT_VERSION;
+}
+
+/**
+ * Publishes new data (everything from systime on) and wakes up the waiting consumers.
+ * Wait-free, must only be called by the single writer.
+ */
+inline void gpsShmWrite(GpsInfo *shm, const GpsInfo *info) {
+    uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);  // odd, update in progress
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy((char *) shm + GPS_INFO_DATA_OFFSET, (const char *) info + GPS_INFO_DATA_OFFSET, GPS_INFO_DATA_LEN);
+
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);  // even, consistent again
+
+    __atomic_add_fetch(&shm->updates, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shm->waiters, __ATOMIC_SEQ_CST) > 0) {
+        syscall(SYS_futex, &shm->updates, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/**
+ * Copies a consistent snapshot of the segment.
+ * @return false if the writer seems stuck in the middle of an update (e.g., it died)
+ */
+inline bool gpsShmRead(const GpsInfo *shm, GpsInfo *info) {
+    for (int spins = 0; spins < GPS_SHM_READ_SPINS; spins++) {
+        uint32_t seq1 = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (seq1 & 1) {  // writer busy, a handful of stores, let it finish
+            sched_yield();
+            continue;
+        }
+
+        memcpy(info, shm, sizeof(GpsInfo));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint32_t seq2 = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+        if (seq1 == seq2) return true;
+    }
+
+    return false;
+}
+
+/**
+ * @return the update counter, to be passed to gpsShmWaitUpdate()
+ */
+inline uint32_t gpsShmUpdates(const GpsInfo *shm) {
+    return __atomic_load_n(&shm->updates, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Blocks until the segment is updated again.
+ * @param lastUpdates the update counter the caller has already seen, updated on return
+ * @param timeout ms to wait, or a negative value to wait forever
+ * @return false if the timeout expired (or a signal interrupted the wait) without updates
+ */
+inline bool gpsShmWaitUpdate(GpsInfo *shm, uint32_t *lastUpdates, int timeout) {
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (long) (timeout % 1000) * 1000000L;
+
+    __atomic_add_fetch(&shm->waiters, 1, __ATOMIC_SEQ_CST);
+
+    // the kernel only sleeps if the counter still holds the value we've seen
+    uint32_t updates = __atomic_load_n(&shm->updates, __ATOMIC_SEQ_CST);
+    if (updates == *lastUpdates) {
+        syscall(SYS_futex, &shm->updates, FUTEX_WAIT, *lastUpdates, timeout < 0 ? NULL : &ts, NULL, 0);
+        updates = __atomic_load_n(&shm->updates, __ATOMIC_SEQ_CST);
+    }
+
+    __atomic_sub_fetch(&shm->waiters, 1, __ATOMIC_SEQ_CST);
+
+    bool updated = updates != *lastUpdates;
+    *lastUpdates = updates;
+    return updated;
+}
+
+inline GpsHistory *gpsShmHistory(GpsInfo *shm) {
+    return (GpsHistory *) (shm + 1);
+}
+
+inline const GpsHistory *gpsShmHistory(const GpsInfo *shm) {
+    return (const GpsHistory *) (shm + 1);
+}
+
+/**
+ * Appends a fix to the history, overwriting the oldest one. Wait-free, single writer.
+ */
+inline void gpsShmPushFix(GpsInfo *shm, const GpsInfo *info) {
+    GpsHistory *history = gpsShmHistory(shm);
+    const uint32_t index = __atomic_load_n(&history->count, __ATOMIC_RELAXED);
+    GpsFix *slot = &history->fixes[index % GPS_HISTORY_LEN];
+
+    GpsFix fix;
+    fix.index = index;
+    fix.systime = info->systime;
+    fix.gpstime = info->gpstime;
+    fix.fix = info->fix;
+    fix.lat = info->lat;
+    fix.lon = info->lon;
+    fix.alt = info->alt;
+    fix.speed = info->speed;
+    fix.head = info->head;
+
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy((char *) slot + offsetof(GpsFix, index), (const char *) &fix + offsetof(GpsFix, index),
+           sizeof(GpsFix) - offsetof(GpsFix, index));
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&history->count, index + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @return the number of fixes published so far
+ */
+inline uint32_t gpsShmFixCount(const GpsInfo *shm) {
+    return __atomic_load_n(&gpsShmHistory(shm)->count, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Copies fix number index from the history.
+ * @return false if the fix was already overwritten, or the writer seems stuck
+ */
+inline bool gpsShmReadFix(const GpsInfo *shm, uint32_t index, GpsFix *fix) {
+    const GpsFix *slot = &gpsShmHistory(shm)->fixes[index % GPS_HISTORY_LEN];
+
+    for (int spins = 0; spins < GPS_SHM_READ_SPINS; spins++) {
+        uint32_t seq1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq1 & 1) {
+            sched_yield();
+            continue;
+        }
+
+        memcpy(fix, slot, sizeof(GpsFix));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint32_t seq2 = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        if (seq1 == seq2) return fix->index == index;
+    }
+
+    return false;
+}
+
+#endif
@@ -0,0 +1,133 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Implementation of the configuration reloader.
+ *
+ */
+
+#include "configreloader.hpp"
+
+#include <poll.h>         // poll()
+#include <sys/eventfd.h>  // eventfd()
+#include <cerrno>         // errno
+#include <cstring>        // strerror()
+#include <sstream>        // std::stringstream
+#include <stdexcept>      // std::exception
+#include <system_error>   // std::system_error
+
+#include "logfile.hpp"
+
+// the signal handler can't take the singleton (nor a lock), it only writes here
+static int reloadfd = -1;
+
+ConfigReloader::ConfigReloader() : mutex(), listeners(), nextListener(0), configFname(),
+                                   wakefd(-1), stopping(false), reloads(0), thread() {
+    if ((this->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        LOG_FATAL_PERROR("ConfigReloader() eventfd()")
+    }
+    reloadfd = this->wakefd;
+}
+
+ConfigReloader *ConfigReloader::getInstance() {
+    // never destroyed, like the metrics, a signal may still come while the statics go away
+    static ConfigReloader *single = new ConfigReloader();
+    return single;
+}
+
+int ConfigReloader::addListener(ConfigListener listener) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    const int id = this->nextListener++;
+    this->listeners[id] = std::move(listener);
+    return id;
+}
+
+void ConfigReloader::removeListener(int id) {
+    // a reload in progress holds the mutex, so once this returns the listener isn't running
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->listeners.erase(id);
+}
+
+void ConfigReloader::signalHandler(int) {
+    if (reloadfd >= 0) eventfd_write(reloadfd, 1);  // async-signal-safe
+}
+
+uint64_t ConfigReloader::getReloads() const {
+    return this->reloads;
+}
+
+bool ConfigReloader::start(const std::string &configFname) {
+    if (this->wakefd < 0 || this->thread.joinable()) return false;
+
+    this->configFname = configFname;
+    this->stopping = false;
+
+    try {
+        this->thread = std::thread(&ConfigReloader::reloadLoop, this);
+    } catch (const std::system_error &e) {
+        std::stringstream ss;
+        ss << "Configuration reloader can't start: " << e.what();
+        LOG_ERR(ss.str().c_str());
+        return false;
+    }
+
+    std::stringstream ss;
+    ss << "Reloading " << configFname << " on SIGHUP";
+    LOG_MSG(ss.str().c_str());
+    return true;
+}
+
+void ConfigReloader::stop() {
+    if (!this->thread.joinable()) return;
+
+    this->stopping = true;
+    eventfd_write(this->wakefd, 1);
+    this->thread.join();
+}
+
+void ConfigReloader::reload() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    std::stringstream ss;
+    ss << "Reloading " << this->configFname;
+    LOG_MSG(ss.str().c_str());
+
+    // a missing file is logged (and gives the defaults), like on start
+    ConfigFile cfile(this->configFname);
+
+    // a listener that fails doesn't keep the others from applying their part
+    for (auto &itr : this->listeners) {
+        try {
+            itr.second(cfile);
+        } catch (std::exception const &e) {
+            std::stringstream ess;
+            ess << "Reload of " << this->configFname << " failed in part: " << e.what();
+            LOG_ERR(ess.str().c_str());
+        }
+    }
+
+    this->reloads++;
+    LOG_MSG("Configuration reloaded");
+}
+
+void ConfigReloader::reloadLoop() {
+    struct pollfd pfd = {this->wakefd, POLLIN, 0};
+
+    while (!this->stopping) {
+        pfd.revents = 0;
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            LOG_STREAM(ERROR, "ConfigReloader poll(): " << strerror(errno))
+            break;
+        }
+
+        // signals that came while reloading are folded into the next reload
+        eventfd_t count;
+        if (eventfd_read(this->wakefd, &count) < 0) continue;
+        if (this->stopping) break;
+
+        this->reload();
+    }
+}
@@ -0,0 +1,84 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the configuration reloader: on SIGHUP, the configuration file is read again,
+ * in a thread of its own, and handed to the modules of the process, which apply what
+ * changed without being restarted (e.g., interfaces added or removed, a new sampling
+ * interval, log levels). What a module can't change while it runs is logged as taking
+ * effect on the next start.
+ */
+
+#ifndef CONFIG_RELOADER_H__
+#define CONFIG_RELOADER_H__
+
+#include <atomic>     // std::atomic
+#include <cstdint>    // uint*_t
+#include <functional> // std::function
+#include <map>        // std::map
+#include <mutex>      // std::mutex
+#include <string>     // std::string
+#include <thread>     // std::thread
+
+#include "configfile.hpp"
+
+typedef std::function<void(ConfigFile &)> ConfigListener;
+
+/**
+ * Process-wide, like the metrics registry, since a process has a single SIGHUP.
+ */
+class ConfigReloader {
+public:
+    static ConfigReloader *getInstance();
+
+    /**
+     * Adds a function called with the new configuration on every reload, from the
+     * reloader thread, in the order they were added. It must be removed before what it
+     * changes goes away.
+     * @return id for removeListener()
+     */
+    int addListener(ConfigListener listener);
+    void removeListener(int id);
+
+    /**
+     * Starts waiting for reloads, in a thread of its own.
+     * @param configFname configuration file read on every reload
+     * @return false if the thread can't be started
+     */
+    bool start(const std::string &configFname);
+
+    void stop();
+
+    /**
+     * Reads the configuration and calls the listeners, from the calling thread.
+     */
+    void reload();
+
+    /**
+     * To install as the SIGHUP handler, only wakes up the reloader thread.
+     */
+    static void signalHandler(int);
+
+    uint64_t getReloads() const;
+
+    ConfigReloader(const ConfigReloader &) = delete;
+    ConfigReloader &operator=(const ConfigReloader &) = delete;
+
+private:
+    std::mutex mutex; // listeners, and one reload at a time
+    std::map<int, ConfigListener> listeners;
+    int nextListener;
+
+    std::string configFname;
+    int wakefd; // written by the signal handler
+    std::atomic<bool> stopping;
+    std::atomic<uint64_t> reloads;
+    std::thread thread;
+
+    ConfigReloader();
+
+    void reloadLoop();
+};
+
+#endif
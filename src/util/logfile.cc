@@ -9,23 +9,42 @@
 
 #include "logfile.hpp"
 
+#include <algorithm> // std::stable_sort
+#include <chrono> // std::chrono::milliseconds
+#include <cstdio> // snprintf()
 #include <cstring> // std::strerror
 #include <cerrno> // errno
-#include <sstream> // stringstream
+#include <ctime> // clock_gettime(), gmtime_r()
 #include <sys/stat.h> // stat()
 
+/**
+ * Owns the ring of a thread, which outlives it until the flusher has emptied it.
+ */
+struct LogRingHolder {
+    LogFile::Ring *ring = nullptr;
+
+    ~LogRingHolder() {
+        if (this->ring != nullptr) this->ring->abandoned.store(true, std::memory_order_release);
+    }
+};
+
+static thread_local LogRingHolder ringHolder;
 
-LogFile* LogFile::single_ = nullptr; // initialize the singleton
+static void closeLogAtExit() {
+    LogFile::getInstance()->closeLog();
+}
 
 /**
  * A trivial  but necessary constructor.
  */
-LogFile::LogFile() : logfp_(nullptr), level_(LOG_LEVEL_DEF) { }
+LogFile::LogFile() : logfp_(nullptr), level_(LOG_LEVEL_DEF), open_(false), rings_(),
+                     batch_(), out_(), flusher_(), stop_(false) { }
 
 
 LogFile* LogFile::getInstance(){
-    if (LogFile::single_ == nullptr) LogFile::single_ = new LogFile();
-    return LogFile::single_;
+    // never destroyed, threads may still log while the statics go away
+    static LogFile *single = new LogFile();
+    return single;
 }
 
 /**
@@ -41,10 +60,13 @@ void LogFile::initLog(const char* fname){
  * Uses caller-specified max log length.
  */
 void LogFile::initLog(const char* fname, std::size_t maxlen){
+    this->closeLog();
 
+    std::lock_guard<std::mutex> lifeLock(this->lifeMutex_);
     if (fname != nullptr) {
         /* check the size */
         struct stat fstat;
+        fstat.st_size = 0;
         stat(fname, &fstat);
 
         /* reset log if it's larger than limit */
@@ -52,45 +74,183 @@ void LogFile::initLog(const char* fname, std::size_t maxlen){
             this->logfp_ = fopen(fname, "w");
         else this->logfp_ = fopen(fname, "a+");
 
-        if (this->logfp_ != nullptr)
+        if (this->logfp_ != nullptr) {
             fseek(this->logfp_, 0, SEEK_END); /* scan to the end */
+
+            this->stop_ = false;
+            this->flusher_ = std::thread(&LogFile::flusherLoop, this);
+            this->open_.store(true);
+
+            /* what's still in the rings when the program exits */
+            static bool atExitSet = false;
+            if (!atExitSet) atExitSet = atexit(closeLogAtExit) == 0;
+        }
     }
 }
 
 void LogFile::setLevel(const LogLevel level){
-    this->level_ = level;
+    this->level_.store(level, std::memory_order_relaxed);
+}
+
+LogFile::Ring *LogFile::threadRing() {
+    if (ringHolder.ring == nullptr) {
+        ringHolder.ring = new Ring();
+
+        std::lock_guard<std::mutex> lock(this->ringsMutex_);
+        this->rings_.push_back(ringHolder.ring);
+    }
+    return ringHolder.ring;
 }
 
 void LogFile::writeLog(LogLevel level, const char* pMsg, const char* pFname,
         int lineNo){
 
-    if (this->logfp_ != nullptr && level <= this->level_) {
-        static const char* levelNames[] = {"fatal", "error", "warn", "msg",
-            "verbose"};
-        const char*  pType = levelNames[level];
+    if (!this->enabled(level)) return;
 
-        time_t rawtime;
-        struct tm *ptm;
-
-        time(&rawtime);
-        ptm = gmtime(&rawtime);
+    // a fatal message is written right away, make room for it first
+    std::unique_lock<std::mutex> fatalLock(this->flushMutex_, std::defer_lock);
+    if (level == FATAL) {
+        fatalLock.lock();
+        this->flushLocked();
+    }
 
-        fprintf(logfp_, "%s\t%4d-%02d-%02d\t%02d:%02d:%02d\t%s\t%d\t%s\n", pType,
-                1900 + ptm->tm_year, 1 + ptm->tm_mon, ptm->tm_mday,
-                ptm->tm_hour, ptm->tm_min, ptm->tm_sec, pFname, lineNo,
-                pMsg);
-        fflush(logfp_);
+    Ring *ring = this->threadRing();
+    const uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= LOG_RING_LEN) {
+        ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
     }
+
+    Record &record = ring->records[head % LOG_RING_LEN];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record.timeUs = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    record.pFname = pFname;
+    record.lineNo = lineNo;
+    record.level = level;
+
+    const size_t len = strnlen(pMsg, sizeof(record.msg) - 1);
+    memcpy(record.msg, pMsg, len);
+    record.msg[len] = '\0';
+
+    ring->head.store(head + 1, std::memory_order_release);
+
+    if (level == FATAL) this->flushLocked();
 }
 
 void LogFile::writeLogPerror(LogLevel level, const char* pMsg,
         const char* pFname, int lineNo){
+    if (!this->enabled(level)) return;
+
+    const char *error = std::strerror(errno);
     std::stringstream ss;
-    ss << pMsg << ": " << std::strerror(errno);
+    ss << pMsg << ": " << error;
     this->writeLog(level, ss.str().c_str(), pFname, lineNo);
 }
 
+void LogFile::flush() {
+    std::lock_guard<std::mutex> lock(this->flushMutex_);
+    this->flushLocked();
+}
+
+void LogFile::flushLocked() {
+    static const char* levelNames[] = {"fatal", "error", "warn", "msg",
+        "verbose"};
+    uint64_t dropped = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(this->ringsMutex_);
+        for (auto itr = this->rings_.begin(); itr != this->rings_.end();) {
+            Ring *ring = *itr;
+            const bool abandoned = ring->abandoned.load(std::memory_order_acquire);
+
+            const uint64_t head = ring->head.load(std::memory_order_acquire);
+            for (uint64_t i = ring->tail.load(std::memory_order_relaxed); i < head; i++) {
+                this->batch_.push_back(ring->records[i % LOG_RING_LEN]);
+            }
+            ring->tail.store(head, std::memory_order_release);
+            dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+
+            if (abandoned) {
+                delete ring;
+                itr = this->rings_.erase(itr);
+            } else {
+                ++itr;
+            }
+        }
+    }
+
+    if (this->logfp_ == nullptr || (this->batch_.empty() && dropped == 0)) {
+        this->batch_.clear();
+        return;
+    }
+
+    // each thread's records are in order already, interleave them
+    std::stable_sort(this->batch_.begin(), this->batch_.end(),
+                     [](const Record &a, const Record &b) { return a.timeUs < b.timeUs; });
+
+    char line[LOG_RECORD_LEN + 256];
+    for (const Record &record : this->batch_) {
+        const time_t rawtime = (time_t) (record.timeUs / 1000000);
+        struct tm tm;
+        gmtime_r(&rawtime, &tm);
+
+        int len = snprintf(line, sizeof(line), "%s\t%4d-%02d-%02d\t%02d:%02d:%02d\t%s\t%d\t%s\n",
+                           levelNames[record.level], 1900 + tm.tm_year, 1 + tm.tm_mon, tm.tm_mday,
+                           tm.tm_hour, tm.tm_min, tm.tm_sec, record.pFname, record.lineNo,
+                           record.msg);
+        if (len < 0) continue;
+        if ((size_t) len >= sizeof(line)) len = sizeof(line) - 1;
+        this->out_.insert(this->out_.end(), line, line + len);
+    }
+
+    if (dropped > 0) {
+        const time_t rawtime = time(nullptr);
+        struct tm tm;
+        gmtime_r(&rawtime, &tm);
+
+        int len = snprintf(line, sizeof(line), "%s\t%4d-%02d-%02d\t%02d:%02d:%02d\t%s\t%d\t%llu %s\n",
+                           levelNames[WARN], 1900 + tm.tm_year, 1 + tm.tm_mon, tm.tm_mday,
+                           tm.tm_hour, tm.tm_min, tm.tm_sec, __FILE__, __LINE__,
+                           (unsigned long long) dropped, "log messages dropped, ring full");
+        if (len > 0) this->out_.insert(this->out_.end(), line, line + std::min((size_t) len, sizeof(line) - 1));
+    }
+
+    fwrite(this->out_.data(), 1, this->out_.size(), this->logfp_);
+    fflush(this->logfp_);
+
+    this->batch_.clear();
+    this->out_.clear();
+}
+
+void LogFile::flusherLoop() {
+    std::unique_lock<std::mutex> lock(this->stopMutex_);
+    while (!this->stop_) {
+        this->stopCond_.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+
+        lock.unlock();
+        this->flush();
+        lock.lock();
+    }
+}
+
 void LogFile::closeLog() {
+    std::lock_guard<std::mutex> lifeLock(this->lifeMutex_);
+
+    this->open_.store(false);
+
+    if (this->flusher_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(this->stopMutex_);
+            this->stop_ = true;
+        }
+        this->stopCond_.notify_one();
+        this->flusher_.join();
+    }
+
+    std::lock_guard<std::mutex> lock(this->flushMutex_);
+    this->flushLocked();
+
     if (this->logfp_ != nullptr){
         fclose(this->logfp_);
         this->logfp_ = nullptr;
@@ -5,45 +5,116 @@
  *
  * Utility class to log program errors and definition of useful macros.
  *
+ * Logging never blocks the caller on the file: every thread copies its messages into
+ * a ring buffer of its own, and a background thread formats and writes what the rings
+ * hold every LOG_FLUSH_INTERVAL_MS. A full ring drops the message (the drops are
+ * logged later) instead of stalling the thread. Fatal messages are the exception:
+ * they are written, along with everything still pending, before the call returns,
+ * since the program is about to exit.
  */
 
 #ifndef LOGGING_H__
 #define LOGGING_H__
 
+#include <atomic> // std::atomic
+#include <condition_variable> // std::condition_variable
+#include <cstdint> // uint*_t
+#include <cstdio> // FILE
 #include <iostream> // std::cerr
 #include <cstddef> // std::size_t
 #include <cstdlib> // exit()
+#include <mutex> // std::mutex
+#include <sstream> // std::stringstream, for LOG_STREAM
+#include <thread> // std::thread
+#include <vector> // std::vector
 
 // some default constants
 #define LOG_LEVEL_DEF ERROR
 #define LOG_LEN_MAX_DEF 1048576 // 1 MiB
+#define LOG_RING_LEN 128 // records per thread
+#define LOG_RECORD_LEN 512 // bytes of a record, longer messages are cut
+#define LOG_FLUSH_INTERVAL_MS 100
 
 // some useful macros
 #define LOG_INIT(fname) do{if(fname!= NULL)LogFile::getInstance()->initLog(fname); else std::cerr << "error init log file " << fname << std::endl;}while(0);
 #define LOG_LEVEL_SET(level) LogFile::getInstance()->setLevel(level);
-#define LOG_VERBOSE(msg) LogFile::getInstance()->writeLog(VERBOSE, msg, __FILE__, __LINE__);
-#define LOG_MSG(msg) LogFile::getInstance()->writeLog(MSG, msg, __FILE__, __LINE__);
-#define LOG_WARN(msg) LogFile::getInstance()->writeLog(WARN, msg, __FILE__, __LINE__);
-#define LOG_ERR(msg) LogFile::getInstance()->writeLog(ERROR, msg, __FILE__, __LINE__);
+#define LOG_ENABLED(level) (LogFile::getInstance()->enabled(level))
+#define LOG_AT(level, msg) do{if(LOG_ENABLED(level))LogFile::getInstance()->writeLog(level, msg, __FILE__, __LINE__);}while(0);
+#define LOG_VERBOSE(msg) LOG_AT(VERBOSE, msg)
+#define LOG_MSG(msg) LOG_AT(MSG, msg)
+#define LOG_WARN(msg) LOG_AT(WARN, msg)
+#define LOG_ERR(msg) LOG_AT(ERROR, msg)
 #define LOG_FATAL(msg) LogFile::getInstance()->writeLog(FATAL, msg, __FILE__, __LINE__);
 #define LOG_FATAL_EXIT(msg) do{LOG_FATAL(msg) exit(1);}while(0);
 #define LOG_FATAL_PERROR(msg) LogFile::getInstance()->writeLogPerror(FATAL, msg, __FILE__, __LINE__);
 #define LOG_FATAL_PERROR_EXIT(msg) do{LOG_FATAL_PERROR(msg) exit(1);}while(0);
 #define LOG_CLOSE() LogFile::getInstance()->closeLog();
 
+/**
+ * Builds the message with operator<< only if the level is enabled, e.g.
+ * LOG_STREAM(VERBOSE, "sent " << n << " datagrams")
+ */
+#define LOG_STREAM(level, expr) do{if(LOG_ENABLED(level)){std::stringstream logss_; logss_ << expr; LogFile::getInstance()->writeLog(level, logss_.str().c_str(), __FILE__, __LINE__);}}while(0);
+
 enum LogLevel {FATAL, ERROR, WARN, MSG, VERBOSE, NLOG_LEVELS};
 typedef enum LogLevel LogLevel;
 
 class LogFile {
 
 protected:
-  static LogFile* single_; // singleton instance
+  /**
+   * A message as written by the caller, formatted by the flusher.
+   */
+  struct Record {
+    uint64_t timeUs;       // wall clock
+    const char *pFname;    // __FILE__, a literal
+    int lineNo;
+    LogLevel level;
+    char msg[LOG_RECORD_LEN - 24];
+  };
+
+  /**
+   * Single producer (its thread), single consumer (whoever holds flushMutex_).
+   */
+  struct Ring {
+    alignas(64) std::atomic<uint64_t> head; // records written, by the producer
+    alignas(64) std::atomic<uint64_t> tail; // records taken, by the consumer
+    std::atomic<uint64_t> dropped;
+    std::atomic<bool> abandoned;            // the thread is gone, free once empty
+    Record records[LOG_RING_LEN];
+
+    Ring() : head(0), tail(0), dropped(0), abandoned(false) {}
+  };
+
+  friend struct LogRingHolder;
 
   FILE *logfp_;
-  LogLevel level_;
+  std::atomic<int> level_;
+  std::atomic<bool> open_;
+
+  std::mutex ringsMutex_;     // guards rings_
+  std::vector<Ring*> rings_;
+  std::mutex flushMutex_;     // one consumer at a time, and logfp_
+  std::vector<Record> batch_; // records being written, under flushMutex_
+  std::vector<char> out_;     // formatted batch, under flushMutex_
+
+  std::mutex lifeMutex_;      // initLog() and closeLog()
+  std::thread flusher_;
+  std::mutex stopMutex_;
+  std::condition_variable stopCond_;
+  bool stop_;
 
   LogFile();
 
+  Ring *threadRing();
+  void flusherLoop();
+
+  /**
+   * Takes the records out of every ring and writes them in time order.
+   * Must be called with flushMutex_ held.
+   */
+  void flushLocked();
+
 public:
   static LogFile* getInstance();
 
@@ -53,12 +124,26 @@ public:
 
   void setLevel(const LogLevel level);
 
+  /**
+   * @return whether messages of the level are logged; cheap enough to guard the
+   * construction of a message
+   */
+  bool enabled(LogLevel level) const {
+    return level <= this->level_.load(std::memory_order_relaxed) &&
+           this->open_.load(std::memory_order_relaxed);
+  }
+
   void writeLog(LogLevel level, const char* pmsg, const char* pFname,
                 int lineNo);
 
   void writeLogPerror(LogLevel level, const char* pMsg, const char* pFname,
                       int lineNo);
 
+  /**
+   * Writes what is pending now, from the calling thread.
+   */
+  void flush();
+
   void closeLog();
 
   /**
@@ -72,4 +157,4 @@ public:
   void operator=(const LogFile&) = delete;
 };
 
-#endif 
+#endif
@@ -0,0 +1,368 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Implementation of the metrics registry and exporter.
+ *
+ */
+
+#include "metrics.hpp"
+
+#include <arpa/inet.h>    // inet_pton()
+#include <netinet/in.h>   // struct sockaddr_in
+#include <poll.h>         // poll()
+#include <sys/eventfd.h>  // eventfd()
+#include <sys/socket.h>   // socket(), accept()
+#include <sys/time.h>     // struct timeval
+#include <sys/un.h>       // struct sockaddr_un
+#include <unistd.h>       // close(), unlink()
+#include <cerrno>         // errno
+#include <cstring>        // strncpy(), memmem()
+#include <sstream>        // std::stringstream
+#include <stdexcept>      // std::exception
+
+#include "logfile.hpp"
+
+MetricHistogram::MetricHistogram(uint64_t base, int nbuckets) :
+        base(base > 0 ? base : 1),
+        nbuckets(nbuckets < 2 ? 2 : nbuckets > METRICS_HIST_BUCKETS_MAX ? METRICS_HIST_BUCKETS_MAX : nbuckets),
+        sum(0) {
+    for (auto &b : this->buckets) b.store(0, std::memory_order_relaxed);
+}
+
+uint64_t MetricHistogram::getBase() const {
+    return this->base;
+}
+
+int MetricHistogram::getBuckets() const {
+    return this->nbuckets;
+}
+
+uint64_t MetricHistogram::bucket(int i) const {
+    return this->buckets[i].load(std::memory_order_relaxed);
+}
+
+uint64_t MetricHistogram::getSum() const {
+    return this->sum.load(std::memory_order_relaxed);
+}
+
+MetricsText::Family &MetricsText::family(const std::string &name, const char *type, const std::string &help) {
+    Family &family = this->families[name];
+    if (family.type.empty()) {
+        family.type = type;
+        family.help = help;
+    }
+    return family;
+}
+
+static std::string sampleName(const std::string &name, const std::string &labels) {
+    return labels.empty() ? name : name + "{" + labels + "}";
+}
+
+void MetricsText::counter(const std::string &name, const std::string &help, const std::string &labels,
+                          uint64_t value) {
+    this->family(name, "counter", help).samples += sampleName(name, labels) + " " + std::to_string(value) + "\n";
+}
+
+void MetricsText::gauge(const std::string &name, const std::string &help, const std::string &labels,
+                        int64_t value) {
+    this->family(name, "gauge", help).samples += sampleName(name, labels) + " " + std::to_string(value) + "\n";
+}
+
+void MetricsText::histogram(const std::string &name, const std::string &help, const std::string &labels,
+                            const MetricHistogram &histogram) {
+    std::string &samples = this->family(name, "histogram", help).samples;
+    const std::string prefix = labels.empty() ? "" : labels + ",";
+
+    // read the buckets once, the count is their sum so the output is consistent
+    uint64_t cumulative = 0;
+    for (int i = 0; i < histogram.getBuckets(); i++) {
+        cumulative += histogram.bucket(i);
+
+        std::string le = i < histogram.getBuckets() - 1 ? std::to_string(histogram.getBase() << i) : "+Inf";
+        samples += name + "_bucket{" + prefix + "le=\"" + le + "\"} " + std::to_string(cumulative) + "\n";
+    }
+    samples += sampleName(name + "_sum", labels) + " " + std::to_string(histogram.getSum()) + "\n";
+    samples += sampleName(name + "_count", labels) + " " + std::to_string(cumulative) + "\n";
+}
+
+std::string MetricsText::str() const {
+    std::string out;
+    for (auto &itr : this->families) {
+        out += "# HELP " + itr.first + " " + itr.second.help + "\n";
+        out += "# TYPE " + itr.first + " " + itr.second.type + "\n";
+        out += itr.second.samples;
+    }
+    return out;
+}
+
+Metrics::Metrics() : mutex(), entries(), collectors(), nextCollector(0) {}
+
+Metrics *Metrics::getInstance() {
+    // never destroyed, like the log, threads may still count while the statics go away
+    static Metrics *single = new Metrics();
+    return single;
+}
+
+std::string Metrics::label(const std::string &key, const std::string &value) {
+    std::string escaped;
+    for (char c : value) {
+        if (c == '\\' || c == '"') escaped += '\\';
+        if (c == '\n') {
+            escaped += "\\n";
+            continue;
+        }
+        escaped += c;
+    }
+    return key + "=\"" + escaped + "\"";
+}
+
+Metrics::Entry &Metrics::entry(Type type, const std::string &name, const std::string &help,
+                               const std::string &labels) {
+    Entry &entry = this->entries[name + "{" + labels + "}"];
+    if (entry.name.empty()) {
+        entry.type = type;
+        entry.name = name;
+        entry.help = help;
+        entry.labels = labels;
+    }
+    else if (entry.type != type) {
+        std::stringstream ss;
+        ss << "Metric " << name << " registered again with another type";
+        LOG_FATAL_EXIT(ss.str().c_str());
+    }
+    return entry;
+}
+
+MetricCounter &Metrics::counter(const std::string &name, const std::string &help, const std::string &labels) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    Entry &entry = this->entry(Type::counter, name, help, labels);
+    if (!entry.counter) entry.counter.reset(new MetricCounter());
+    return *entry.counter;
+}
+
+MetricGauge &Metrics::gauge(const std::string &name, const std::string &help, const std::string &labels) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    Entry &entry = this->entry(Type::gauge, name, help, labels);
+    if (!entry.gauge) entry.gauge.reset(new MetricGauge());
+    return *entry.gauge;
+}
+
+MetricHistogram &Metrics::histogram(const std::string &name, const std::string &help, const std::string &labels,
+                                    uint64_t base, int nbuckets) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    Entry &entry = this->entry(Type::histogram, name, help, labels);
+    if (!entry.histogram) entry.histogram.reset(new MetricHistogram(base, nbuckets));
+    return *entry.histogram;
+}
+
+int Metrics::addCollector(MetricsCollector collector) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    const int id = this->nextCollector++;
+    this->collectors[id] = std::move(collector);
+    return id;
+}
+
+void Metrics::removeCollector(int id) {
+    // a scrape in progress holds the mutex, so once this returns the collector isn't running
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->collectors.erase(id);
+}
+
+std::string Metrics::render() {
+    MetricsText text;
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    for (auto &itr : this->entries) {
+        const Entry &entry = itr.second;
+        switch (entry.type) {
+            case Type::counter:
+                text.counter(entry.name, entry.help, entry.labels, entry.counter->get());
+                break;
+            case Type::gauge:
+                text.gauge(entry.name, entry.help, entry.labels, entry.gauge->get());
+                break;
+            case Type::histogram:
+                text.histogram(entry.name, entry.help, entry.labels, *entry.histogram);
+                break;
+        }
+    }
+
+    for (auto &itr : this->collectors) itr.second(text);
+
+    return text.str();
+}
+
+MetricsExporter::MetricsExporter() : listenfd(-1), stopfd(-1), unixPath(), thread() {}
+
+MetricsExporter::~MetricsExporter() {
+    this->stop();
+}
+
+bool MetricsExporter::listenTcp(const std::string &address) {
+    std::string host = "0.0.0.0", port = address;
+    const size_t colon = address.rfind(':');
+    if (colon != std::string::npos) {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+
+    struct sockaddr_in sockaddr{};
+    sockaddr.sin_family = AF_INET;
+    try {
+        sockaddr.sin_port = htons((uint16_t) std::stoi(port));
+    } catch (std::exception const &) {
+        return false;
+    }
+    if (inet_pton(AF_INET, host.c_str(), &sockaddr.sin_addr) != 1) return false;
+
+    if ((this->listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) return false;
+
+    int enable = 1;
+    setsockopt(this->listenfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    return bind(this->listenfd, (struct sockaddr *) &sockaddr, sizeof(sockaddr)) == 0;
+}
+
+bool MetricsExporter::listenUnix(const std::string &path) {
+    struct sockaddr_un sockaddr{};
+    sockaddr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(sockaddr.sun_path)) return false;
+    strncpy(sockaddr.sun_path, path.c_str(), sizeof(sockaddr.sun_path) - 1);
+
+    if ((this->listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) return false;
+
+    unlink(path.c_str());  // left over by a previous run
+    if (bind(this->listenfd, (struct sockaddr *) &sockaddr, sizeof(sockaddr)) < 0) return false;
+
+    this->unixPath = path;
+    return true;
+}
+
+bool MetricsExporter::start(const std::string &endpoint) {
+    if (endpoint.empty() || this->thread.joinable()) return false;
+
+    bool ok;
+    if (endpoint.compare(0, 5, "unix:") == 0) {
+        ok = this->listenUnix(endpoint.substr(5));
+    } else if (endpoint.compare(0, 4, "tcp:") == 0) {
+        ok = this->listenTcp(endpoint.substr(4));
+    } else {
+        ok = false;
+        errno = EINVAL;
+    }
+
+    if (ok) ok = listen(this->listenfd, 4) == 0;
+    if (ok) ok = (this->stopfd = eventfd(0, EFD_CLOEXEC)) >= 0;
+
+    if (!ok) {
+        std::stringstream ss;
+        ss << "Metrics exporter can't listen on " << endpoint << ": " << std::strerror(errno);
+        LOG_ERR(ss.str().c_str());
+        this->stop();
+        return false;
+    }
+
+    std::stringstream ss;
+    ss << "Metrics exported on " << endpoint;
+    LOG_MSG(ss.str().c_str());
+
+    this->thread = std::thread(&MetricsExporter::serveLoop, this);
+    return true;
+}
+
+void MetricsExporter::stop() {
+    if (this->thread.joinable()) {
+        eventfd_write(this->stopfd, 1);
+        this->thread.join();
+    }
+
+    if (this->listenfd >= 0) close(this->listenfd);
+    if (this->stopfd >= 0) close(this->stopfd);
+    if (!this->unixPath.empty()) unlink(this->unixPath.c_str());
+
+    this->listenfd = -1;
+    this->stopfd = -1;
+    this->unixPath.clear();
+}
+
+void MetricsExporter::serveLoop() {
+    struct pollfd fds[2];
+    fds[0].fd = this->listenfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = this->stopfd;
+    fds[1].events = POLLIN;
+
+    while (true) {
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+
+        if (poll(fds, 2, -1 /*no timeout*/) < 0) {
+            if (errno == EINTR) continue;
+            LOG_FATAL_PERROR_EXIT("metrics poll()");
+        }
+
+        if (fds[1].revents & POLLIN) break;  // time to end
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        int fd = accept4(this->listenfd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+
+        // clients are served one at a time, one that stops reading mustn't hold the others
+        const struct timeval sndTimeout = {METRICS_CLIENT_TIMEOUT_MS / 1000,
+                                           (METRICS_CLIENT_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sndTimeout, sizeof(sndTimeout));
+
+        this->serve(fd);
+        close(fd);
+    }
+}
+
+static void sendAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;  // client gone, or not reading (SO_SNDTIMEO)
+        data += n;
+        len -= n;
+    }
+}
+
+void MetricsExporter::serve(int fd) {
+    // the request, up to the end of its headers; a client that sends nothing gets the text alone
+    char request[METRICS_REQUEST_LEN_MAX];
+    size_t len = 0;
+
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while (len < sizeof(request) && poll(&pfd, 1, METRICS_CLIENT_TIMEOUT_MS) > 0) {
+        ssize_t n = recv(fd, request + len, sizeof(request) - len, 0);
+        if (n <= 0) break;
+        len += n;
+        if (memmem(request, len, "\r\n\r\n", 4) || memmem(request, len, "\n\n", 2)) break;
+    }
+
+    const std::string body = Metrics::getInstance()->render();
+    if (len == 0) {
+        sendAll(fd, body.data(), body.size());
+        return;
+    }
+
+    const std::string line(request, strnlen(request, len));
+    const bool found = line.compare(0, 13, "GET /metrics ") == 0 || line.compare(0, 6, "GET / ") == 0;
+
+    std::stringstream ss;
+    if (found) {
+        ss << "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+           << "Content-Length: " << body.size() << "\r\nConnection: close\r\n\r\n" << body;
+    } else {
+        ss << "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+
+    const std::string response = ss.str();
+    sendAll(fd, response.data(), response.size());
+}
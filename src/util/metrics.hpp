@@ -0,0 +1,219 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the metrics registry shared by the daemons (counters, gauges and histograms)
+ * and the exporter that serves them, in the Prometheus text format, over TCP or a Unix
+ * socket.
+ *
+ * Metrics are registered once, off the hot path, and the hot path only holds a
+ * reference and does relaxed atomic adds (once per syscall batch, not per datagram).
+ * Values that are already counted elsewhere (interface counters, writer backlog) are
+ * not duplicated: a collector reads them when the metrics are scraped.
+ */
+
+#ifndef METRICS_H__
+#define METRICS_H__
+
+#include <atomic>     // std::atomic
+#include <cstdint>    // uint*_t
+#include <functional> // std::function
+#include <map>        // std::map
+#include <memory>     // std::unique_ptr
+#include <mutex>      // std::mutex
+#include <string>     // std::string
+#include <thread>     // std::thread
+#include <vector>     // std::vector
+
+#define METRICS_HIST_BUCKETS_MAX 24
+#define METRICS_CLIENT_TIMEOUT_MS 1000 // to read a scrape request, and for each send of the response
+#define METRICS_REQUEST_LEN_MAX 4096
+
+class MetricCounter {
+public:
+    MetricCounter() : value(0) {}
+
+    inline void add(uint64_t n = 1) {
+        this->value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const {
+        return this->value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> value;
+};
+
+class MetricGauge {
+public:
+    MetricGauge() : value(0) {}
+
+    inline void set(int64_t v) {
+        this->value.store(v, std::memory_order_relaxed);
+    }
+
+    inline void add(int64_t d) {
+        this->value.fetch_add(d, std::memory_order_relaxed);
+    }
+
+    int64_t get() const {
+        return this->value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<int64_t> value;
+};
+
+/**
+ * Histogram with power of two buckets: bucket i counts the values below base << i,
+ * the last one the rest.
+ */
+class MetricHistogram {
+public:
+    MetricHistogram(uint64_t base, int nbuckets);
+
+    inline void observe(uint64_t v) {
+        const uint64_t q = v / this->base;
+        int i = q == 0 ? 0 : 64 - __builtin_clzll(q);
+        if (i >= this->nbuckets) i = this->nbuckets - 1;
+
+        this->buckets[i].fetch_add(1, std::memory_order_relaxed);
+        this->sum.fetch_add(v, std::memory_order_relaxed);
+    }
+
+    uint64_t getBase() const;
+    int getBuckets() const;
+    uint64_t bucket(int i) const;
+    uint64_t getSum() const;
+
+private:
+    const uint64_t base;
+    const int nbuckets;
+    std::atomic<uint64_t> buckets[METRICS_HIST_BUCKETS_MAX];
+    std::atomic<uint64_t> sum;
+};
+
+/**
+ * What a scrape is made of, filled by the registry and the collectors.
+ */
+class MetricsText {
+public:
+    void counter(const std::string &name, const std::string &help, const std::string &labels, uint64_t value);
+    void gauge(const std::string &name, const std::string &help, const std::string &labels, int64_t value);
+    void histogram(const std::string &name, const std::string &help, const std::string &labels,
+                   const MetricHistogram &histogram);
+
+    /**
+     * @return the Prometheus text exposition of everything added
+     */
+    std::string str() const;
+
+private:
+    struct Family {
+        std::string type;
+        std::string help;
+        std::string samples;
+    };
+
+    std::map<std::string, Family> families; // by name, so the output is stable
+
+    Family &family(const std::string &name, const char *type, const std::string &help);
+};
+
+typedef std::function<void(MetricsText &)> MetricsCollector;
+
+/**
+ * Process-wide registry. A metric is identified by its name and labels: asking for
+ * one that already exists returns it, so a module that is set up again keeps counting
+ * on the same series. Metrics are never freed.
+ */
+class Metrics {
+public:
+    static Metrics *getInstance();
+
+    /**
+     * @return key="value", escaped, to build the labels of a metric
+     */
+    static std::string label(const std::string &key, const std::string &value);
+
+    MetricCounter &counter(const std::string &name, const std::string &help, const std::string &labels = "");
+    MetricGauge &gauge(const std::string &name, const std::string &help, const std::string &labels = "");
+    MetricHistogram &histogram(const std::string &name, const std::string &help, const std::string &labels,
+                               uint64_t base, int nbuckets);
+
+    /**
+     * Adds a function called on every scrape, from the exporter thread, to add values
+     * kept elsewhere. It must be removed before what it reads goes away.
+     * @return id for removeCollector()
+     */
+    int addCollector(MetricsCollector collector);
+    void removeCollector(int id);
+
+    /**
+     * @return every metric, in the Prometheus text format
+     */
+    std::string render();
+
+    Metrics(const Metrics &) = delete;
+    Metrics &operator=(const Metrics &) = delete;
+
+private:
+    enum class Type { counter, gauge, histogram };
+
+    struct Entry {
+        Type type;
+        std::string name;
+        std::string help;
+        std::string labels;
+        std::unique_ptr<MetricCounter> counter;
+        std::unique_ptr<MetricGauge> gauge;
+        std::unique_ptr<MetricHistogram> histogram;
+    };
+
+    std::mutex mutex;
+    std::map<std::string, Entry> entries; // by name and labels
+    std::map<int, MetricsCollector> collectors;
+    int nextCollector;
+
+    Metrics();
+
+    Entry &entry(Type type, const std::string &name, const std::string &help, const std::string &labels);
+};
+
+/**
+ * Serves the registry, one client at a time, on "tcp:[address:]port" or
+ * "unix:path". A request is answered over HTTP (GET /metrics, as Prometheus
+ * scrapes it); a client that sends nothing gets the bare text, e.g. with nc -U.
+ */
+class MetricsExporter {
+public:
+    MetricsExporter();
+    ~MetricsExporter();
+
+    MetricsExporter(const MetricsExporter &) = delete;
+    MetricsExporter &operator=(const MetricsExporter &) = delete;
+
+    /**
+     * Starts listening, in a thread of its own.
+     * @param endpoint where to listen, nothing is done if empty
+     * @return false if it can't listen on the endpoint (or it's empty)
+     */
+    bool start(const std::string &endpoint);
+
+    void stop();
+
+private:
+    int listenfd;
+    int stopfd;
+    std::string unixPath; // to unlink on stop
+    std::thread thread;
+
+    bool listenTcp(const std::string &address);
+    bool listenUnix(const std::string &path);
+    void serveLoop();
+    void serve(int fd);
+};
+
+#endif
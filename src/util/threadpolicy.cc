@@ -0,0 +1,215 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Implementation of the thread policy.
+ *
+ */
+
+#include "threadpolicy.hpp"
+
+#include <dirent.h>   // opendir()
+#include <pthread.h>  // pthread_setschedparam()
+#include <sched.h>    // sched_setaffinity(), SCHED_FIFO
+#include <unistd.h>   // sysconf()
+#include <algorithm>  // std::sort, std::unique
+#include <cctype>     // isdigit()
+#include <cerrno>     // errno
+#include <cstring>    // strerror()
+#include <fstream>    // std::ifstream
+#include <sstream>    // std::stringstream
+#include <stdexcept>  // std::exception
+
+#include "logfile.hpp"
+
+ThreadPolicy::ThreadPolicy() : secName(), roles() {}
+
+static std::string cpuListToStr(const std::vector<int> &cpus) {
+    std::stringstream ss;
+    for (size_t i = 0; i < cpus.size(); i++) ss << (i ? "+" : "") << cpus[i];
+    return ss.str();
+}
+
+bool ThreadPolicy::parseCpuList(const std::string &str, std::vector<int> &cpus) {
+    std::vector<int> parsed;
+
+    std::stringstream sstream(str);
+    for (std::string item; std::getline(sstream, item, '+');) {
+        std::stringstream isstream(item);
+        for (std::string range; std::getline(isstream, range, ',');) {
+            range.erase(0, range.find_first_not_of(" \t\n"));
+            range.erase(range.find_last_not_of(" \t\n") + 1);
+            if (range.empty()) continue;
+
+            int first, last;
+            char dash;
+            std::stringstream rsstream(range);
+            if (!(rsstream >> first) || first < 0) return false;
+            last = first;
+            if (rsstream >> dash && (dash != '-' || !(rsstream >> last) || last < first)) return false;
+
+            for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) parsed.push_back(cpu);
+        }
+    }
+
+    if (parsed.empty()) return false;
+
+    std::sort(parsed.begin(), parsed.end());
+    parsed.erase(std::unique(parsed.begin(), parsed.end()), parsed.end());
+    cpus = parsed;
+    return true;
+}
+
+void ThreadPolicy::configure(ConfigFile &cfile, const std::string &secName) {
+    this->secName = secName;
+    this->roles.clear();
+
+    std::string threadsStr;
+    try {
+        threadsStr = cfile.Value(secName, "threads");
+    } catch (std::exception const&) {
+        return;  // default scheduling for all
+    }
+
+    // note: ">> std::ws" is used to remove whitespace
+    std::stringstream sstream(threadsStr);
+    for (std::string entry; std::getline(sstream >> std::ws, entry, ',');) {
+        std::stringstream esstream(entry);
+        std::string role, cpusStr;
+        int priority = 0;
+
+        ThreadRolePolicy policy{};
+        bool valid = static_cast<bool>(esstream >> role >> cpusStr);
+        if (valid && !(esstream >> std::ws).eof()) {
+            valid = static_cast<bool>(esstream >> priority) && priority >= 0 &&
+                    priority <= THREAD_POLICY_PRIORITY_MAX;
+        }
+
+        if (valid) {
+            if (cpusStr == "irq") policy.irqAware = true;
+            else if (cpusStr != "any") valid = parseCpuList(cpusStr, policy.cpus);
+        }
+
+        if (!valid) {
+            std::stringstream ss;
+            ss << "Config exception: section=" << secName << ", value=threads. "
+               << "Invalid entry " << entry << ". Ignoring.";
+            LOG_ERR(ss.str().c_str());
+            continue;
+        }
+
+        policy.priority = priority;
+        this->roles[role] = policy;
+    }
+}
+
+std::vector<int> ThreadPolicy::irqCpus(const std::string &ifname) {
+    const std::string devPath = "/sys/class/net/" + ifname + "/device";
+
+    // MSI vectors (PCIe radios), or else the legacy line
+    std::vector<int> irqs;
+    if (DIR *dir = opendir((devPath + "/msi_irqs").c_str())) {
+        while (struct dirent *dent = readdir(dir)) {
+            if (isdigit((unsigned char) dent->d_name[0])) irqs.push_back(std::stoi(dent->d_name));
+        }
+        closedir(dir);
+    }
+
+    if (irqs.empty()) {
+        std::ifstream irqFile(devPath + "/irq");
+        int irq;
+        if (irqFile >> irq && irq > 0) irqs.push_back(irq);
+    }
+
+    std::vector<int> cpus;
+    for (int irq : irqs) {
+        const std::string irqPath = "/proc/irq/" + std::to_string(irq);
+
+        // where the interrupt actually goes, if the kernel tells, else where it may go
+        std::string listStr;
+        std::ifstream effective(irqPath + "/effective_affinity_list");
+        if (!std::getline(effective, listStr) || listStr.empty()) {
+            std::ifstream affinity(irqPath + "/smp_affinity_list");
+            std::getline(affinity, listStr);
+        }
+
+        std::vector<int> irqCpus;
+        if (parseCpuList(listStr, irqCpus)) cpus.insert(cpus.end(), irqCpus.begin(), irqCpus.end());
+    }
+
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return cpus;
+}
+
+bool ThreadPolicy::apply(const std::string &role, const std::vector<std::string> &ifnames) const {
+    auto itr = this->roles.find(role);
+    if (itr == this->roles.end()) return true;  // default scheduling
+
+    const ThreadRolePolicy &policy = itr->second;
+
+    std::stringstream what;
+    what << "Thread " << this->secName << "/" << role;
+    for (const std::string &ifname : ifnames) what << " " << ifname;
+
+    bool ok = true;
+    std::vector<int> cpus = policy.cpus;
+    if (cpus.empty() && policy.irqAware) {
+        const long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int cpu = 0; cpu < ncpus && cpu < CPU_SETSIZE; cpu++) cpus.push_back(cpu);
+
+        std::vector<int> busy;
+        for (const std::string &ifname : ifnames) {
+            std::vector<int> ifaceCpus = irqCpus(ifname);
+            busy.insert(busy.end(), ifaceCpus.begin(), ifaceCpus.end());
+        }
+
+        std::vector<int> idle;
+        for (int cpu : cpus) {
+            if (std::find(busy.begin(), busy.end(), cpu) == busy.end()) idle.push_back(cpu);
+        }
+
+        if (busy.empty()) {
+            LOG_STREAM(WARN, what.str() << ": interrupts of the interfaces not found, any CPU")
+        }
+        else if (idle.empty()) {
+            LOG_STREAM(WARN, what.str() << ": every CPU handles interrupts of the interfaces, any CPU")
+        }
+        else {
+            cpus = idle;
+        }
+    }
+
+    if (!policy.cpus.empty() || policy.irqAware) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) CPU_SET(cpu, &set);
+
+        // 0 is the calling thread
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            LOG_STREAM(WARN, what.str() << ": CPUs " << cpuListToStr(cpus) << " not set, " << strerror(errno))
+            ok = false;
+        }
+        else {
+            what << ", CPUs " << cpuListToStr(cpus);
+        }
+    }
+
+    if (policy.priority > 0) {
+        struct sched_param param{};
+        param.sched_priority = policy.priority;
+
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0) {
+            LOG_STREAM(WARN, what.str() << ": SCHED_FIFO " << policy.priority << " not set, " << strerror(err))
+            ok = false;
+        }
+        else {
+            what << ", SCHED_FIFO " << policy.priority;
+        }
+    }
+
+    LOG_MSG(what.str().c_str());
+    return ok;
+}
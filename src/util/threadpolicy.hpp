@@ -0,0 +1,69 @@
+/**
+ *
+ * Copyright (c) 2022 Instituto de Telecomunicações, Porto, Portugal, and Contributors.
+ * Distributed under the GNU GPL v2. For full terms see the file LICENSE.
+ *
+ * Defines the thread policy: where the threads of each role run (CPU affinity) and
+ * with what scheduling (SCHED_FIFO priority), as read from the "threads" key of a
+ * section of the configuration file, e.g.
+ *
+ *     threads = send irq 50, decision 0
+ *
+ * Each entry is a role, the CPUs (a list such as 0-1+3, "any", or "irq" for the CPUs
+ * that don't handle the interrupts of the interfaces the thread serves, so it doesn't
+ * compete with their softirqs) and, optionally, a SCHED_FIFO priority from 1 to 99.
+ * Roles without an entry keep the default scheduling.
+ */
+
+#ifndef THREAD_POLICY_H__
+#define THREAD_POLICY_H__
+
+#include <map>    // std::map
+#include <string> // std::string
+#include <vector> // std::vector
+
+#include "configfile.hpp"
+
+#define THREAD_POLICY_PRIORITY_MAX 99
+
+struct ThreadRolePolicy {
+    std::vector<int> cpus; // empty for any
+    bool irqAware;         // keep off the CPUs that handle the interrupts of the interfaces
+    int priority;          // SCHED_FIFO priority, 0 for the default scheduling
+};
+
+class ThreadPolicy {
+public:
+    ThreadPolicy();
+
+    /**
+     * Reads the optional "threads" key of the section. Bad entries are logged and ignored.
+     */
+    void configure(ConfigFile &cfile, const std::string &secName);
+
+    /**
+     * Applies the policy of the role to the calling thread, and logs what was applied.
+     * @param role    role of the thread, as in the configuration (e.g. send)
+     * @param ifnames interfaces the thread serves, for the irq placement
+     * @return false if the role has a policy and it couldn't be applied (e.g. no
+     * CAP_SYS_NICE for SCHED_FIFO), the thread then runs as before
+     */
+    bool apply(const std::string &role, const std::vector<std::string> &ifnames = {}) const;
+
+    /**
+     * @return the CPUs the interrupts of the interface are delivered to (empty if unknown)
+     */
+    static std::vector<int> irqCpus(const std::string &ifname);
+
+    /**
+     * Parses a CPU list, with '+' or ',' between the items, e.g. 0-1+3.
+     * @return false if it isn't one
+     */
+    static bool parseCpuList(const std::string &str, std::vector<int> &cpus);
+
+private:
+    std::string secName;
+    std::map<std::string, ThreadRolePolicy> roles;
+};
+
+#endif